@@ -130,6 +130,16 @@ static inline void blkio_update_group_bps(struct blkio_group *blkg, u64 bps,
 		    && blkiop->ops.blkio_update_group_write_bps_fn)
 			blkiop->ops.blkio_update_group_write_bps_fn(blkg->key,
 								blkg, bps);
+
+		if (fileid == BLKIO_THROTL_read_bps_low_device
+		    && blkiop->ops.blkio_update_group_read_bps_low_fn)
+			blkiop->ops.blkio_update_group_read_bps_low_fn(
+							blkg->key, blkg, bps);
+
+		if (fileid == BLKIO_THROTL_write_bps_low_device
+		    && blkiop->ops.blkio_update_group_write_bps_low_fn)
+			blkiop->ops.blkio_update_group_write_bps_low_fn(
+							blkg->key, blkg, bps);
 	}
 }
 
@@ -153,6 +163,31 @@ static inline void blkio_update_group_iops(struct blkio_group *blkg,
 		    && blkiop->ops.blkio_update_group_write_iops_fn)
 			blkiop->ops.blkio_update_group_write_iops_fn(blkg->key,
 								blkg,iops);
+
+		if (fileid == BLKIO_THROTL_read_iops_low_device
+		    && blkiop->ops.blkio_update_group_read_iops_low_fn)
+			blkiop->ops.blkio_update_group_read_iops_low_fn(
+							blkg->key, blkg, iops);
+
+		if (fileid == BLKIO_THROTL_write_iops_low_device
+		    && blkiop->ops.blkio_update_group_write_iops_low_fn)
+			blkiop->ops.blkio_update_group_write_iops_low_fn(
+							blkg->key, blkg, iops);
+	}
+}
+
+static inline void
+blkio_update_group_latency(struct blkio_group *blkg, u64 latency)
+{
+	struct blkio_policy_type *blkiop;
+
+	list_for_each_entry(blkiop, &blkio_list, list) {
+		/* If this policy does not own the blkg, do not send updates */
+		if (blkiop->plid != blkg->plid)
+			continue;
+		if (blkiop->ops.blkio_update_group_latency_fn)
+			blkiop->ops.blkio_update_group_latency_fn(blkg->key,
+							blkg, latency);
 	}
 }
 
@@ -448,6 +483,20 @@ void blkiocg_update_io_merged_stats(struct blkio_group *blkg, bool direction,
 }
 EXPORT_SYMBOL_GPL(blkiocg_update_io_merged_stats);
 
+void blkiocg_update_lat_hist(struct blkio_group *blkg, struct request *rq,
+				uint64_t now)
+{
+	unsigned long flags;
+
+	if (!blkg->lat_hist)
+		return;
+
+	spin_lock_irqsave(&blkg->stats_lock, flags);
+	blk_lat_hist_add(blkg->lat_hist, rq, now);
+	spin_unlock_irqrestore(&blkg->stats_lock, flags);
+}
+EXPORT_SYMBOL_GPL(blkiocg_update_lat_hist);
+
 /*
  * This function allocates the per cpu stats for blkio_group. Should be called
  * from sleepable context as alloc_per_cpu() requires that.
@@ -590,6 +639,8 @@ blkiocg_reset_stats(struct cgroup *cgroup, struct cftype *cftype, u64 val)
 			stats->stat_arr[BLKIO_STAT_QUEUED][i] = queued[i];
 		for (i = 0; i < BLKIO_STAT_TOTAL; i++)
 			stats->stat_arr[BLKIO_STAT_THROTTLED][i] = throttled[i];
+		if (blkg->lat_hist)
+			memset(blkg->lat_hist, 0, sizeof(*blkg->lat_hist));
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 		if (idling) {
 			blkio_mark_blkg_idling(stats);
@@ -775,7 +826,7 @@ static int blkio_policy_parse_and_set(char *buf,
 	unsigned long major, minor, temp;
 	int i = 0;
 	dev_t dev;
-	u64 bps, iops;
+	u64 bps, iops, temp64;
 
 	memset(s, 0, sizeof(s));
 
@@ -837,6 +888,8 @@ static int blkio_policy_parse_and_set(char *buf,
 		switch(fileid) {
 		case BLKIO_THROTL_read_bps_device:
 		case BLKIO_THROTL_write_bps_device:
+		case BLKIO_THROTL_read_bps_low_device:
+		case BLKIO_THROTL_write_bps_low_device:
 			ret = strict_strtoull(s[1], 10, &bps);
 			if (ret)
 				return -EINVAL;
@@ -847,6 +900,8 @@ static int blkio_policy_parse_and_set(char *buf,
 			break;
 		case BLKIO_THROTL_read_iops_device:
 		case BLKIO_THROTL_write_iops_device:
+		case BLKIO_THROTL_read_iops_low_device:
+		case BLKIO_THROTL_write_iops_low_device:
 			ret = strict_strtoull(s[1], 10, &iops);
 			if (ret)
 				return -EINVAL;
@@ -860,6 +915,15 @@ static int blkio_policy_parse_and_set(char *buf,
 			break;
 		}
 		break;
+	case BLKIO_POLICY_LATENCY:
+		ret = strict_strtoull(s[1], 10, &temp64);
+		if (ret)
+			return -EINVAL;
+
+		newpn->plid = plid;
+		newpn->fileid = fileid;
+		newpn->val.latency = temp64;
+		break;
 	default:
 		BUG();
 	}
@@ -927,6 +991,66 @@ unsigned int blkcg_get_write_iops(struct blkio_cgroup *blkcg, dev_t dev)
 		return -1;
 }
 
+uint64_t blkcg_get_read_bps_low(struct blkio_cgroup *blkcg, dev_t dev)
+{
+	struct blkio_policy_node *pn;
+
+	pn = blkio_policy_search_node(blkcg, dev, BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_read_bps_low_device);
+	if (pn)
+		return pn->val.bps;
+	else
+		return -1;
+}
+
+uint64_t blkcg_get_write_bps_low(struct blkio_cgroup *blkcg, dev_t dev)
+{
+	struct blkio_policy_node *pn;
+
+	pn = blkio_policy_search_node(blkcg, dev, BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_write_bps_low_device);
+	if (pn)
+		return pn->val.bps;
+	else
+		return -1;
+}
+
+unsigned int blkcg_get_read_iops_low(struct blkio_cgroup *blkcg, dev_t dev)
+{
+	struct blkio_policy_node *pn;
+
+	pn = blkio_policy_search_node(blkcg, dev, BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_read_iops_low_device);
+	if (pn)
+		return pn->val.iops;
+	else
+		return -1;
+}
+
+unsigned int blkcg_get_write_iops_low(struct blkio_cgroup *blkcg, dev_t dev)
+{
+	struct blkio_policy_node *pn;
+
+	pn = blkio_policy_search_node(blkcg, dev, BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_write_iops_low_device);
+	if (pn)
+		return pn->val.iops;
+	else
+		return -1;
+}
+
+u64 blkcg_get_latency_target(struct blkio_cgroup *blkcg, dev_t dev)
+{
+	struct blkio_policy_node *pn;
+
+	pn = blkio_policy_search_node(blkcg, dev, BLKIO_POLICY_LATENCY,
+				BLKIO_LAT_target_device);
+	if (pn)
+		return pn->val.latency;
+	else
+		return 0;
+}
+
 /* Checks whether user asked for deleting a policy rule */
 static bool blkio_delete_rule_command(struct blkio_policy_node *pn)
 {
@@ -939,15 +1063,23 @@ static bool blkio_delete_rule_command(struct blkio_policy_node *pn)
 		switch(pn->fileid) {
 		case BLKIO_THROTL_read_bps_device:
 		case BLKIO_THROTL_write_bps_device:
+		case BLKIO_THROTL_read_bps_low_device:
+		case BLKIO_THROTL_write_bps_low_device:
 			if (pn->val.bps == 0)
 				return 1;
 			break;
 		case BLKIO_THROTL_read_iops_device:
 		case BLKIO_THROTL_write_iops_device:
+		case BLKIO_THROTL_read_iops_low_device:
+		case BLKIO_THROTL_write_iops_low_device:
 			if (pn->val.iops == 0)
 				return 1;
 		}
 		break;
+	case BLKIO_POLICY_LATENCY:
+		if (pn->val.latency == 0)
+			return 1;
+		break;
 	default:
 		BUG();
 	}
@@ -966,13 +1098,20 @@ static void blkio_update_policy_rule(struct blkio_policy_node *oldpn,
 		switch(newpn->fileid) {
 		case BLKIO_THROTL_read_bps_device:
 		case BLKIO_THROTL_write_bps_device:
+		case BLKIO_THROTL_read_bps_low_device:
+		case BLKIO_THROTL_write_bps_low_device:
 			oldpn->val.bps = newpn->val.bps;
 			break;
 		case BLKIO_THROTL_read_iops_device:
 		case BLKIO_THROTL_write_iops_device:
+		case BLKIO_THROTL_read_iops_low_device:
+		case BLKIO_THROTL_write_iops_low_device:
 			oldpn->val.iops = newpn->val.iops;
 		}
 		break;
+	case BLKIO_POLICY_LATENCY:
+		oldpn->val.latency = newpn->val.latency;
+		break;
 	default:
 		BUG();
 	}
@@ -998,16 +1137,23 @@ static void blkio_update_blkg_policy(struct blkio_cgroup *blkcg,
 		switch(pn->fileid) {
 		case BLKIO_THROTL_read_bps_device:
 		case BLKIO_THROTL_write_bps_device:
+		case BLKIO_THROTL_read_bps_low_device:
+		case BLKIO_THROTL_write_bps_low_device:
 			bps = pn->val.bps ? pn->val.bps : (-1);
 			blkio_update_group_bps(blkg, bps, pn->fileid);
 			break;
 		case BLKIO_THROTL_read_iops_device:
 		case BLKIO_THROTL_write_iops_device:
+		case BLKIO_THROTL_read_iops_low_device:
+		case BLKIO_THROTL_write_iops_low_device:
 			iops = pn->val.iops ? pn->val.iops : (-1);
 			blkio_update_group_iops(blkg, iops, pn->fileid);
 			break;
 		}
 		break;
+	case BLKIO_POLICY_LATENCY:
+		blkio_update_group_latency(blkg, pn->val.latency);
+		break;
 	default:
 		BUG();
 	}
@@ -1108,16 +1254,25 @@ blkio_print_policy_node(struct seq_file *m, struct blkio_policy_node *pn)
 			switch(pn->fileid) {
 			case BLKIO_THROTL_read_bps_device:
 			case BLKIO_THROTL_write_bps_device:
+			case BLKIO_THROTL_read_bps_low_device:
+			case BLKIO_THROTL_write_bps_low_device:
 				seq_printf(m, "%u:%u\t%llu\n", MAJOR(pn->dev),
 					MINOR(pn->dev), pn->val.bps);
 				break;
 			case BLKIO_THROTL_read_iops_device:
 			case BLKIO_THROTL_write_iops_device:
+			case BLKIO_THROTL_read_iops_low_device:
+			case BLKIO_THROTL_write_iops_low_device:
 				seq_printf(m, "%u:%u\t%u\n", MAJOR(pn->dev),
 					MINOR(pn->dev), pn->val.iops);
 				break;
 			}
 			break;
+		case BLKIO_POLICY_LATENCY:
+			if (pn->fileid == BLKIO_LAT_target_device)
+				seq_printf(m, "%u:%u\t%llu\n", MAJOR(pn->dev),
+					MINOR(pn->dev), pn->val.latency);
+			break;
 		default:
 			BUG();
 	}
@@ -1140,6 +1295,37 @@ static void blkio_read_policy_node_files(struct cftype *cft,
 	}
 }
 
+/* Prints the latency histograms of the groups of one policy per device */
+static int blkio_read_lat_hist(struct cftype *cft, struct blkio_cgroup *blkcg,
+			       struct seq_file *m)
+{
+	struct blkio_group *blkg;
+	struct hlist_node *n;
+	char prefix[16];
+	char *buf;
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(blkg, n, &blkcg->blkg_list, blkcg_node) {
+		if (!blkg->dev || !blkg->lat_hist ||
+		    !cftype_blkg_same_policy(cft, blkg))
+			continue;
+		snprintf(prefix, sizeof(prefix), "%u:%u ", MAJOR(blkg->dev),
+			 MINOR(blkg->dev));
+		spin_lock_irq(&blkg->stats_lock);
+		blk_lat_hist_print(blkg->lat_hist, prefix, buf, PAGE_SIZE);
+		spin_unlock_irq(&blkg->stats_lock);
+		seq_puts(m, buf);
+	}
+	rcu_read_unlock();
+
+	free_page((unsigned long)buf);
+	return 0;
+}
+
 static int blkiocg_file_read(struct cgroup *cgrp, struct cftype *cft,
 				struct seq_file *m)
 {
@@ -1163,14 +1349,29 @@ static int blkiocg_file_read(struct cgroup *cgrp, struct cftype *cft,
 		switch(name){
 		case BLKIO_THROTL_read_bps_device:
 		case BLKIO_THROTL_write_bps_device:
+		case BLKIO_THROTL_read_bps_low_device:
+		case BLKIO_THROTL_write_bps_low_device:
 		case BLKIO_THROTL_read_iops_device:
 		case BLKIO_THROTL_write_iops_device:
+		case BLKIO_THROTL_read_iops_low_device:
+		case BLKIO_THROTL_write_iops_low_device:
 			blkio_read_policy_node_files(cft, blkcg, m);
 			return 0;
 		default:
 			BUG();
 		}
 		break;
+	case BLKIO_POLICY_LATENCY:
+		switch(name){
+		case BLKIO_LAT_target_device:
+			blkio_read_policy_node_files(cft, blkcg, m);
+			return 0;
+		case BLKIO_LAT_histogram:
+			return blkio_read_lat_hist(cft, blkcg, m);
+		default:
+			BUG();
+		}
+		break;
 	default:
 		BUG();
 	}
@@ -1461,6 +1662,38 @@ struct cftype blkio_files[] = {
 		.write_string = blkiocg_file_write,
 		.max_write_len = 256,
 	},
+	{
+		.name = "throttle.low_read_bps_device",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_read_bps_low_device),
+		.read_seq_string = blkiocg_file_read,
+		.write_string = blkiocg_file_write,
+		.max_write_len = 256,
+	},
+	{
+		.name = "throttle.low_write_bps_device",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_write_bps_low_device),
+		.read_seq_string = blkiocg_file_read,
+		.write_string = blkiocg_file_write,
+		.max_write_len = 256,
+	},
+	{
+		.name = "throttle.low_read_iops_device",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_read_iops_low_device),
+		.read_seq_string = blkiocg_file_read,
+		.write_string = blkiocg_file_write,
+		.max_write_len = 256,
+	},
+	{
+		.name = "throttle.low_write_iops_device",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_THROTL,
+				BLKIO_THROTL_write_iops_low_device),
+		.read_seq_string = blkiocg_file_read,
+		.write_string = blkiocg_file_write,
+		.max_write_len = 256,
+	},
 	{
 		.name = "throttle.io_service_bytes",
 		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_THROTL,
@@ -1481,6 +1714,23 @@ struct cftype blkio_files[] = {
 	},
 #endif /* CONFIG_BLK_DEV_THROTTLING */
 
+#ifdef CONFIG_BLK_DEV_IOLATENCY
+	{
+		.name = "latency.target_device",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_LATENCY,
+				BLKIO_LAT_target_device),
+		.read_seq_string = blkiocg_file_read,
+		.write_string = blkiocg_file_write,
+		.max_write_len = 256,
+	},
+	{
+		.name = "latency.histogram",
+		.private = BLKIOFILE_PRIVATE(BLKIO_POLICY_LATENCY,
+				BLKIO_LAT_histogram),
+		.read_seq_string = blkiocg_file_read,
+	},
+#endif /* CONFIG_BLK_DEV_IOLATENCY */
+
 #ifdef CONFIG_DEBUG_BLK_CGROUP
 	{
 		.name = "avg_queue_size",
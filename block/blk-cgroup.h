@@ -19,6 +19,7 @@
 enum blkio_policy_id {
 	BLKIO_POLICY_PROP = 0,		/* Proportional Bandwidth division */
 	BLKIO_POLICY_THROTL,		/* Throttling */
+	BLKIO_POLICY_LATENCY,		/* Latency targets */
 };
 
 /* Max limits for throttle policy */
@@ -100,11 +101,21 @@ enum blkcg_file_name_throtl {
 	BLKIO_THROTL_write_bps_device,
 	BLKIO_THROTL_read_iops_device,
 	BLKIO_THROTL_write_iops_device,
+	BLKIO_THROTL_read_bps_low_device,
+	BLKIO_THROTL_write_bps_low_device,
+	BLKIO_THROTL_read_iops_low_device,
+	BLKIO_THROTL_write_iops_low_device,
 	BLKIO_THROTL_io_service_bytes,
 	BLKIO_THROTL_io_serviced,
 	BLKIO_THROTL_io_queued,
 };
 
+/* cgroup files owned by latency target policy */
+enum blkcg_file_name_lat {
+	BLKIO_LAT_target_device,
+	BLKIO_LAT_histogram,
+};
+
 struct blkio_cgroup {
 	struct cgroup_subsys_state css;
 	unsigned int weight;
@@ -166,6 +177,8 @@ struct blkio_group {
 	struct blkio_group_stats stats;
 	/* Per cpu stats pointer */
 	struct blkio_group_stats_cpu __percpu *stats_cpu;
+	/* Latency histogram, only kept by policies which allocate it */
+	struct blk_lat_hist *lat_hist;
 };
 
 struct blkio_policy_node {
@@ -185,6 +198,8 @@ struct blkio_policy_node {
 		 */
 		u64 bps;
 		unsigned int iops;
+		/* Target completion latency in usecs */
+		u64 latency;
 	} val;
 };
 
@@ -198,6 +213,15 @@ extern unsigned int blkcg_get_read_iops(struct blkio_cgroup *blkcg,
 				     dev_t dev);
 extern unsigned int blkcg_get_write_iops(struct blkio_cgroup *blkcg,
 				     dev_t dev);
+extern uint64_t blkcg_get_read_bps_low(struct blkio_cgroup *blkcg,
+				     dev_t dev);
+extern uint64_t blkcg_get_write_bps_low(struct blkio_cgroup *blkcg,
+				     dev_t dev);
+extern unsigned int blkcg_get_read_iops_low(struct blkio_cgroup *blkcg,
+				     dev_t dev);
+extern unsigned int blkcg_get_write_iops_low(struct blkio_cgroup *blkcg,
+				     dev_t dev);
+extern u64 blkcg_get_latency_target(struct blkio_cgroup *blkcg, dev_t dev);
 
 typedef void (blkio_unlink_group_fn) (void *key, struct blkio_group *blkg);
 
@@ -211,6 +235,8 @@ typedef void (blkio_update_group_read_iops_fn) (void *key,
 			struct blkio_group *blkg, unsigned int read_iops);
 typedef void (blkio_update_group_write_iops_fn) (void *key,
 			struct blkio_group *blkg, unsigned int write_iops);
+typedef void (blkio_update_group_latency_fn) (void *key,
+			struct blkio_group *blkg, u64 latency);
 
 struct blkio_policy_ops {
 	blkio_unlink_group_fn *blkio_unlink_group_fn;
@@ -219,6 +245,12 @@ struct blkio_policy_ops {
 	blkio_update_group_write_bps_fn *blkio_update_group_write_bps_fn;
 	blkio_update_group_read_iops_fn *blkio_update_group_read_iops_fn;
 	blkio_update_group_write_iops_fn *blkio_update_group_write_iops_fn;
+	/* low limits share the signatures of the max limit updates */
+	blkio_update_group_read_bps_fn *blkio_update_group_read_bps_low_fn;
+	blkio_update_group_write_bps_fn *blkio_update_group_write_bps_low_fn;
+	blkio_update_group_read_iops_fn *blkio_update_group_read_iops_low_fn;
+	blkio_update_group_write_iops_fn *blkio_update_group_write_iops_low_fn;
+	blkio_update_group_latency_fn *blkio_update_group_latency_fn;
 };
 
 struct blkio_policy_type {
@@ -313,6 +345,8 @@ void blkiocg_update_completion_stats(struct blkio_group *blkg,
 	uint64_t start_time, uint64_t io_start_time, bool direction, bool sync);
 void blkiocg_update_io_merged_stats(struct blkio_group *blkg, bool direction,
 					bool sync);
+void blkiocg_update_lat_hist(struct blkio_group *blkg, struct request *rq,
+				uint64_t now);
 void blkiocg_update_io_add_stats(struct blkio_group *blkg,
 		struct blkio_group *curr_blkg, bool direction, bool sync);
 void blkiocg_update_io_remove_stats(struct blkio_group *blkg,
@@ -349,6 +383,8 @@ static inline void blkiocg_update_completion_stats(struct blkio_group *blkg,
 		bool sync) {}
 static inline void blkiocg_update_io_merged_stats(struct blkio_group *blkg,
 						bool direction, bool sync) {}
+static inline void blkiocg_update_lat_hist(struct blkio_group *blkg,
+				struct request *rq, uint64_t now) {}
 static inline void blkiocg_update_io_add_stats(struct blkio_group *blkg,
 		struct blkio_group *curr_blkg, bool direction, bool sync) {}
 static inline void blkiocg_update_io_remove_stats(struct blkio_group *blkg,
@@ -28,11 +28,13 @@
 #include <linux/task_io_accounting_ops.h>
 #include <linux/fault-inject.h>
 #include <linux/ratelimit.h>
+#include <linux/list_sort.h>
 
 #define CREATE_TRACE_POINTS
 #include <trace/events/block.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 
 EXPORT_TRACEPOINT_SYMBOL_GPL(block_remap);
 EXPORT_TRACEPOINT_SYMBOL_GPL(block_rq_remap);
@@ -55,7 +57,7 @@ struct kmem_cache *blk_requestq_cachep;
  */
 static struct workqueue_struct *kblockd_workqueue;
 
-static void drive_stat_acct(struct request *rq, int new_io)
+void drive_stat_acct(struct request *rq, int new_io)
 {
 	struct hd_struct *part;
 	int rw = rq_data_dir(rq);
@@ -388,6 +390,9 @@ void blk_sync_queue(struct request_queue *q)
 	del_timer_sync(&q->timeout);
 	cancel_work_sync(&q->unplug_work);
 	cancel_delayed_work_sync(&q->delay_work);
+
+	if (q->mq_ops)
+		blk_mq_sync_queue(q);
 }
 EXPORT_SYMBOL(blk_sync_queue);
 
@@ -477,6 +482,7 @@ void blk_cleanup_queue(struct request_queue *q)
 		elevator_exit(q->elevator);
 
 	blk_throtl_exit(q);
+	blk_iolatency_exit(q);
 
 	blk_put_queue(q);
 }
@@ -564,6 +570,12 @@ struct request_queue *blk_alloc_queue_node(gfp_t gfp_mask, int node_id)
 	 */
 	q->queue_lock = &q->__queue_lock;
 
+	if (blk_iolatency_init(q)) {
+		blk_throtl_exit(q);
+		kmem_cache_free(blk_requestq_cachep, q);
+		return NULL;
+	}
+
 	return q;
 }
 EXPORT_SYMBOL(blk_alloc_queue_node);
@@ -955,6 +967,10 @@ struct request *blk_get_request(struct request_queue *q, int rw, gfp_t gfp_mask)
 
 	BUG_ON(rw != READ && rw != WRITE);
 
+	/* multi-queue devices have no request_list to allocate from */
+	if (q->mq_ops)
+		return NULL;
+
 	spin_lock_irq(q->queue_lock);
 	if (gfp_mask & __GFP_WAIT) {
 		rq = get_request_wait(q, rw, NULL);
@@ -1098,18 +1114,25 @@ void blk_insert_request(struct request_queue *q, struct request *rq,
 }
 EXPORT_SYMBOL(blk_insert_request);
 
+/*
+ * blk-mq gets here without the queue lock: whoever moves the stamp on
+ * accounts for the time since, nobody else does.
+ */
 static void part_round_stats_single(int cpu, struct hd_struct *part,
 				    unsigned long now)
 {
-	if (now == part->stamp)
+	unsigned long stamp = ACCESS_ONCE(part->stamp);
+	int inflight;
+
+	if (now == stamp || cmpxchg(&part->stamp, stamp, now) != stamp)
 		return;
 
-	if (part_in_flight(part)) {
+	inflight = part_in_flight(part);
+	if (inflight) {
 		__part_stat_add(cpu, part, time_in_queue,
-				part_in_flight(part) * (now - part->stamp));
-		__part_stat_add(cpu, part, io_ticks, (now - part->stamp));
+				inflight * (now - stamp));
+		__part_stat_add(cpu, part, io_ticks, (now - stamp));
 	}
-	part->stamp = now;
 }
 
 /**
@@ -1149,6 +1172,7 @@ void __blk_put_request(struct request_queue *q, struct request *req)
 		return;
 
 	elv_completed_request(q, req);
+	blk_iolatency_done(req);
 
 	/* this is a bio leak */
 	WARN_ON(req->bio != NULL);
@@ -1269,26 +1293,123 @@ static void blk_account_io_front_merge(struct request *req, sector_t newsector)
 				  &oldpart, &newpart)) {
 			if (oldpart) {
 				part_round_stats(cpu, oldpart);
-				oldpart->in_flight[rq_data_dir(req)]--;
+				atomic_dec(&oldpart->in_flight[rq_data_dir(req)]);
 			}
 			if (newpart) {
 				part_round_stats(cpu, newpart);
-				newpart->in_flight[rq_data_dir(req)]++;
+				atomic_inc(&newpart->in_flight[rq_data_dir(req)]);
 			}
 		}
 		part_stat_unlock();
 	}
 }
 
+static bool bio_attempt_back_merge(struct request_queue *q,
+				   struct request *req, struct bio *bio)
+{
+	const unsigned int ff = bio->bi_rw & REQ_FAILFAST_MASK;
+
+	if (!ll_back_merge_fn(q, req, bio))
+		return false;
+
+	trace_block_bio_backmerge(q, bio);
+
+	if ((req->cmd_flags & REQ_FAILFAST_MASK) != ff)
+		blk_rq_set_mixed_merge(req);
+
+	req->biotail->bi_next = bio;
+	req->biotail = bio;
+	req->__data_len += bio->bi_size;
+	req->ioprio = ioprio_best(req->ioprio, bio_prio(bio));
+	if (!blk_rq_cpu_valid(req))
+		req->cpu = bio->bi_comp_cpu;
+	drive_stat_acct(req, 0);
+	return true;
+}
+
+/*
+ * @queued is false for requests still on a plug list, those are not
+ * accounted in flight yet.
+ */
+static bool bio_attempt_front_merge(struct request_queue *q,
+				    struct request *req, struct bio *bio,
+				    bool queued)
+{
+	const unsigned int ff = bio->bi_rw & REQ_FAILFAST_MASK;
+
+	if (!ll_front_merge_fn(q, req, bio))
+		return false;
+
+	trace_block_bio_frontmerge(q, bio);
+
+	if ((req->cmd_flags & REQ_FAILFAST_MASK) != ff) {
+		blk_rq_set_mixed_merge(req);
+		req->cmd_flags &= ~REQ_FAILFAST_MASK;
+		req->cmd_flags |= ff;
+	}
+
+	bio->bi_next = req->bio;
+	req->bio = bio;
+
+	/*
+	 * may not be valid. if the low level driver said
+	 * it didn't need a bounce buffer then it better
+	 * not touch req->buffer either...
+	 */
+	req->buffer = bio_data(bio);
+	/*
+	 * The merge may happen accross partitions
+	 * We must update in_flight value accordingly
+	 */
+	if (queued)
+		blk_account_io_front_merge(req, bio->bi_sector);
+	req->__sector = bio->bi_sector;
+	req->__data_len += bio->bi_size;
+	req->ioprio = ioprio_best(req->ioprio, bio_prio(bio));
+	if (!blk_rq_cpu_valid(req))
+		req->cpu = bio->bi_comp_cpu;
+	drive_stat_acct(req, 0);
+	return true;
+}
+
+/*
+ * Try to merge @bio into a request the current task holds on its plug
+ * list. Nobody else can see those requests, so no lock is needed.
+ */
+static bool attempt_plug_merge(struct task_struct *tsk,
+			       struct request_queue *q, struct bio *bio)
+{
+	struct blk_plug *plug = tsk->plug;
+	struct request *rq;
+	int el_ret;
+
+	if (!plug)
+		return false;
+
+	list_for_each_entry_reverse(rq, &plug->list, queuelist) {
+		if (rq->q != q)
+			continue;
+
+		el_ret = elv_try_merge(rq, bio);
+		if (el_ret == ELEVATOR_BACK_MERGE) {
+			if (bio_attempt_back_merge(q, rq, bio))
+				return true;
+		} else if (el_ret == ELEVATOR_FRONT_MERGE) {
+			if (bio_attempt_front_merge(q, rq, bio, false))
+				return true;
+		}
+	}
+	return false;
+}
+
 static int __make_request(struct request_queue *q, struct bio *bio)
 {
 	struct request *req;
+	struct blk_plug *plug;
+	struct iolat_grp *iolat;
 	int el_ret;
-	unsigned int bytes = bio->bi_size;
-	const unsigned short prio = bio_prio(bio);
 	const bool sync = bio_rw_flagged(bio, BIO_RW_SYNCIO);
 	const bool unplug = bio_rw_flagged(bio, BIO_RW_UNPLUG);
-	const unsigned int ff = bio->bi_rw & REQ_FAILFAST_MASK;
 	int where = ELEVATOR_INSERT_SORT;
 	int rw_flags;
 
@@ -1306,13 +1427,21 @@ static int __make_request(struct request_queue *q, struct bio *bio)
 	 */
 	blk_queue_bounce(q, &bio);
 
-	spin_lock_irq(q->queue_lock);
-
 	if (bio->bi_rw & (BIO_FLUSH | BIO_FUA)) {
+		spin_lock_irq(q->queue_lock);
 		where = ELEVATOR_INSERT_FLUSH;
 		goto get_rq;
 	}
 
+	/*
+	 * Check if we can merge with the plugged list before grabbing
+	 * any locks.
+	 */
+	if (attempt_plug_merge(current, q, bio))
+		return 0;
+
+	spin_lock_irq(q->queue_lock);
+
 	if (elv_queue_empty(q))
 		goto get_rq;
 
@@ -1321,21 +1450,9 @@ static int __make_request(struct request_queue *q, struct bio *bio)
 	case ELEVATOR_BACK_MERGE:
 		BUG_ON(!rq_mergeable(req));
 
-		if (!ll_back_merge_fn(q, req, bio))
+		if (!bio_attempt_back_merge(q, req, bio))
 			break;
 
-		trace_block_bio_backmerge(q, bio);
-
-		if ((req->cmd_flags & REQ_FAILFAST_MASK) != ff)
-			blk_rq_set_mixed_merge(req);
-
-		req->biotail->bi_next = bio;
-		req->biotail = bio;
-		req->__data_len += bytes;
-		req->ioprio = ioprio_best(req->ioprio, prio);
-		if (!blk_rq_cpu_valid(req))
-			req->cpu = bio->bi_comp_cpu;
-		drive_stat_acct(req, 0);
 		elv_bio_merged(q, req, bio);
 		if (!attempt_back_merge(q, req))
 			elv_merged_request(q, req, el_ret);
@@ -1344,37 +1461,9 @@ static int __make_request(struct request_queue *q, struct bio *bio)
 	case ELEVATOR_FRONT_MERGE:
 		BUG_ON(!rq_mergeable(req));
 
-		if (!ll_front_merge_fn(q, req, bio))
+		if (!bio_attempt_front_merge(q, req, bio, true))
 			break;
 
-		trace_block_bio_frontmerge(q, bio);
-
-		if ((req->cmd_flags & REQ_FAILFAST_MASK) != ff) {
-			blk_rq_set_mixed_merge(req);
-			req->cmd_flags &= ~REQ_FAILFAST_MASK;
-			req->cmd_flags |= ff;
-		}
-
-		bio->bi_next = req->bio;
-		req->bio = bio;
-
-		/*
-		 * may not be valid. if the low level driver said
-		 * it didn't need a bounce buffer then it better
-		 * not touch req->buffer either...
-		 */
-		req->buffer = bio_data(bio);
-		/*
-		 * The merge may happen accross partitions
-		 * We must update in_flight value accordingly
-		 */
-		blk_account_io_front_merge(req, bio->bi_sector);
-		req->__sector = bio->bi_sector;
-		req->__data_len += bytes;
-		req->ioprio = ioprio_best(req->ioprio, prio);
-		if (!blk_rq_cpu_valid(req))
-			req->cpu = bio->bi_comp_cpu;
-		drive_stat_acct(req, 0);
 		elv_bio_merged(q, req, bio);
 		if (!attempt_front_merge(q, req))
 			elv_merged_request(q, req, el_ret);
@@ -1395,11 +1484,18 @@ get_rq:
 	if (sync)
 		rw_flags |= REQ_SYNC;
 
+	/*
+	 * Wait until the cgroup is within its latency controller depth.
+	 * Might sleep, returns with the queue still locked.
+	 */
+	iolat = blk_iolatency_throttle(q);
+
 	/*
 	 * Grab a free request. This is might sleep but can not fail.
 	 * Returns with the queue unlocked.
 	 */
 	req = get_request_wait(q, rw_flags, bio);
+	blk_rq_set_iolat(req, iolat);
 
 	/*
 	 * After dropping the lock and possibly sleeping here, our request
@@ -1409,10 +1505,29 @@ get_rq:
 	 */
 	init_request_from_bio(req, bio);
 
-	spin_lock_irq(q->queue_lock);
 	if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags) ||
 	    bio_flagged(bio, BIO_CPU_AFFINE))
-		req->cpu = smp_processor_id();
+		req->cpu = raw_smp_processor_id();
+
+	/*
+	 * A plugged task keeps the request to itself until blk_finish_plug()
+	 * or until it sleeps, then the whole batch goes in under one lock.
+	 */
+	plug = current->plug;
+	if (plug && where != ELEVATOR_INSERT_FLUSH) {
+		if (!plug->should_sort && !list_empty(&plug->list)) {
+			struct request *__rq = list_entry_rq(plug->list.prev);
+
+			if (__rq->q != q || blk_rq_pos(__rq) > blk_rq_pos(req))
+				plug->should_sort = 1;
+		}
+		list_add_tail(&req->queuelist, &plug->list);
+		if (unplug || ++plug->count >= BLK_MAX_REQUEST_COUNT)
+			blk_flush_plug_list(plug, false);
+		return 0;
+	}
+
+	spin_lock_irq(q->queue_lock);
 	if (queue_should_plug(q) && elv_queue_empty(q))
 		blk_plug_device(q);
 
@@ -1426,6 +1541,112 @@ out:
 	return 0;
 }
 
+/**
+ * blk_start_plug - initialize blk_plug and track it inside the task_struct
+ * @plug:	The &struct blk_plug that needs to be initialized
+ *
+ * Description:
+ *   Requests submitted by the task until blk_finish_plug() are kept on
+ *   @plug, merged there without any lock, and then inserted into their
+ *   queues in one batch per queue. If the task blocks in between, the
+ *   pending requests are flushed from schedule() so nothing waits on I/O
+ *   that was never issued.
+ *
+ *   Nested plugs are allowed, only the outermost one collects requests.
+ */
+void blk_start_plug(struct blk_plug *plug)
+{
+	struct task_struct *tsk = current;
+
+	plug->magic = PLUG_MAGIC;
+	INIT_LIST_HEAD(&plug->list);
+	plug->should_sort = 0;
+	plug->count = 0;
+
+	if (!tsk->plug)
+		tsk->plug = plug;
+}
+EXPORT_SYMBOL(blk_start_plug);
+
+static int plug_rq_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct request *rqa = container_of(a, struct request, queuelist);
+	struct request *rqb = container_of(b, struct request, queuelist);
+
+	if (rqa->q != rqb->q)
+		return rqa->q < rqb->q ? -1 : 1;
+	return blk_rq_pos(rqa) > blk_rq_pos(rqb);
+}
+
+static void queue_unplugged(struct request_queue *q, bool from_schedule)
+	__releases(q->queue_lock)
+{
+	trace_block_unplug_io(q);
+
+	/* don't run the driver on the stack of whoever is going to sleep */
+	if (from_schedule)
+		blk_run_queue_async(q);
+	else
+		__blk_run_queue(q);
+	spin_unlock(q->queue_lock);
+}
+
+void blk_flush_plug_list(struct blk_plug *plug, bool from_schedule)
+{
+	struct request_queue *q;
+	unsigned long flags;
+	struct request *rq;
+	LIST_HEAD(list);
+
+	BUG_ON(plug->magic != PLUG_MAGIC);
+
+	if (list_empty(&plug->list))
+		return;
+
+	list_splice_init(&plug->list, &list);
+	plug->count = 0;
+
+	if (plug->should_sort) {
+		list_sort(NULL, &list, plug_rq_cmp);
+		plug->should_sort = 0;
+	}
+
+	q = NULL;
+
+	/*
+	 * Save and disable interrupts here, to avoid doing it for every
+	 * queue lock we have to take.
+	 */
+	local_irq_save(flags);
+	while (!list_empty(&list)) {
+		rq = list_entry_rq(list.next);
+		list_del_init(&rq->queuelist);
+		if (rq->q != q) {
+			if (q)
+				queue_unplugged(q, from_schedule);
+			q = rq->q;
+			spin_lock(q->queue_lock);
+		}
+		drive_stat_acct(rq, 1);
+		__elv_add_request(q, rq, ELEVATOR_INSERT_SORT, 0);
+	}
+
+	if (q)
+		queue_unplugged(q, from_schedule);
+
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL(blk_flush_plug_list);
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+	blk_flush_plug_list(plug, false);
+
+	if (plug == current->plug)
+		current->plug = NULL;
+}
+EXPORT_SYMBOL(blk_finish_plug);
+
 /*
  * If bio->bi_dev is a partition, remap the location
  */
@@ -1893,7 +2114,44 @@ static void blk_account_io_completion(struct request *req, unsigned int bytes)
 	}
 }
 
-static void blk_account_io_done(struct request *req)
+static inline int blk_lat_hist_bucket(u64 ns)
+{
+	return min_t(int, fls64(div_u64(ns, NSEC_PER_USEC)),
+		     BLK_LAT_HIST_BUCKETS - 1);
+}
+
+/**
+ * blk_lat_hist_add - account a completed request in a latency histogram
+ * @hist: histogram to update, the caller serializes updates
+ * @rq: the request
+ * @now: completion time from sched_clock()
+ *
+ * Queue and service time are only known for requests which went through
+ * blk_dequeue_request().
+ */
+void blk_lat_hist_add(struct blk_lat_hist *hist, struct request *rq, u64 now)
+{
+	u64 start = rq_start_time_ns(rq);
+	u64 io_start = rq_io_start_time_ns(rq);
+	const int rw = rq_data_dir(rq);
+	const int sync = rq_is_sync(rq);
+
+	/* sched_clock() is not synchronized across CPUs */
+	if (unlikely(!start || now < start))
+		return;
+	hist->count[BLK_LAT_TOTAL][rw][sync]
+		[blk_lat_hist_bucket(now - start)]++;
+
+	if (!io_start || io_start < start || now < io_start)
+		return;
+	hist->count[BLK_LAT_QUEUE][rw][sync]
+		[blk_lat_hist_bucket(io_start - start)]++;
+	hist->count[BLK_LAT_SERVICE][rw][sync]
+		[blk_lat_hist_bucket(now - io_start)]++;
+}
+EXPORT_SYMBOL_GPL(blk_lat_hist_add);
+
+void blk_account_io_done(struct request *req)
 {
 	/*
 	 * Account IO completion.  flush_rq isn't accounted as a
@@ -1904,6 +2162,7 @@ static void blk_account_io_done(struct request *req)
 		unsigned long duration = jiffies - req->start_time;
 		const int rw = rq_data_dir(req);
 		struct hd_struct *part;
+		unsigned long flags;
 		int cpu;
 
 		cpu = part_stat_lock();
@@ -1914,6 +2173,12 @@ static void blk_account_io_done(struct request *req)
 		part_round_stats(cpu, part);
 		part_dec_in_flight(part, rw);
 
+		/* completions also run from softirq, e.g. for blk-mq */
+		local_irq_save(flags);
+		blk_lat_hist_add(per_cpu_ptr(req->rq_disk->lat_hist, cpu),
+				 req, sched_clock());
+		local_irq_restore(flags);
+
 		part_stat_unlock();
 	}
 }
@@ -2330,8 +2595,9 @@ static void blk_finish_request(struct request *req, int error)
 	if (req->cmd_flags & REQ_DONTPREP)
 		blk_unprep_request(req);
 
-
 	blk_account_io_done(req);
+	blk_throtl_rq_done(req);
+	blk_iolatency_done(req);
 
 	if (req->end_io)
 		req->end_io(req, error);
@@ -2710,6 +2976,13 @@ int kblockd_schedule_work(struct request_queue *q, struct work_struct *work)
 }
 EXPORT_SYMBOL(kblockd_schedule_work);
 
+int kblockd_schedule_delayed_work(struct request_queue *q,
+				  struct delayed_work *dwork, unsigned long delay)
+{
+	return queue_delayed_work(kblockd_workqueue, dwork, delay);
+}
+EXPORT_SYMBOL(kblockd_schedule_delayed_work);
+
 int __init blk_dev_init(void)
 {
 	BUILD_BUG_ON(__REQ_NR_BITS > 8 *
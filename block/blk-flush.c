@@ -459,3 +459,134 @@ int blkdev_issue_flush(struct block_device *bdev, sector_t *error_sector)
 	return __blkdev_issue_flush(bdev, GFP_KERNEL, error_sector);
 }
 EXPORT_SYMBOL(blkdev_issue_flush);
+
+/*
+ * FLUSH/FUA sequencing for queues that bypass the request layer (blk-mq
+ * and bio based drivers).  There is no flush queue to merge into, so a
+ * bio carrying data is simply walked through its PREFLUSH, DATA and
+ * POSTFLUSH steps one at a time, each step being issued from kblockd
+ * once the previous one has completed.
+ */
+struct bio_flush_seq {
+	struct work_struct	work;
+	struct request_queue	*q;
+	struct bio		*bio;
+	bio_end_io_t		*end_io;
+	void			*private;
+	unsigned int		seq;
+	int			error;
+};
+
+static void bio_flush_seq_end_io(struct bio *bio, int err)
+{
+	struct bio_flush_seq *fs = bio->bi_private;
+
+	if (err && !fs->error)
+		fs->error = err;
+	if (bio != fs->bio)
+		bio_put(bio);
+
+	/* completions may come from irq context, issue the next step later */
+	kblockd_schedule_work(fs->q, &fs->work);
+}
+
+static void bio_flush_seq_step(struct bio_flush_seq *fs)
+{
+	struct bio *bio = fs->bio;
+	struct bio *flush_bio;
+
+	if (fs->error || !(fs->seq & REQ_FSEQ_ACTIONS)) {
+		bio->bi_end_io = fs->end_io;
+		bio->bi_private = fs->private;
+		bio_endio(bio, fs->error);
+		kfree(fs);
+		return;
+	}
+
+	if (fs->seq & REQ_FSEQ_PREFLUSH) {
+		fs->seq &= ~REQ_FSEQ_PREFLUSH;
+	} else if (fs->seq & REQ_FSEQ_DATA) {
+		fs->seq &= ~REQ_FSEQ_DATA;
+		generic_make_request(bio);
+		return;
+	} else {
+		fs->seq &= ~REQ_FSEQ_POSTFLUSH;
+	}
+
+	flush_bio = bio_alloc(GFP_NOIO, 0);
+	flush_bio->bi_bdev = bio->bi_bdev;
+	flush_bio->bi_end_io = bio_flush_seq_end_io;
+	flush_bio->bi_private = fs;
+	flush_bio->bi_rw = WRITE_FLUSH;
+	generic_make_request(flush_bio);
+}
+
+static void bio_flush_seq_work(struct work_struct *work)
+{
+	bio_flush_seq_step(container_of(work, struct bio_flush_seq, work));
+}
+
+/**
+ * blk_flush_bio_seq - sequence a FLUSH/FUA bio without a request_fn
+ * @q:		queue the bio was submitted to
+ * @bio:	bio to examine
+ *
+ * Description:
+ *    To be called from a make_request_fn before the bio is mapped.  Strips
+ *    FLUSH/FUA if @q has no volatile cache and takes over bios whose
+ *    FLUSH/FUA can't be handed to the driver as is.  Empty flushes and
+ *    FUA on queues advertising REQ_FUA are left to the driver.  Returns
+ *    %true if @bio has been taken over and the caller must not touch it.
+ */
+bool blk_flush_bio_seq(struct request_queue *q, struct bio *bio)
+{
+	unsigned int fflags = q->flush_flags;
+	struct bio_flush_seq *fs;
+	unsigned int seq = 0;
+
+	if (!(bio->bi_rw & (BIO_FLUSH | BIO_FUA)))
+		return false;
+
+	if (!(fflags & REQ_FLUSH)) {
+		bio->bi_rw &= ~(BIO_FLUSH | BIO_FUA);
+		if (!bio_has_data(bio)) {
+			bio_endio(bio, 0);
+			return true;
+		}
+		return false;
+	}
+
+	if (!bio_has_data(bio))
+		return false;
+
+	if (bio->bi_rw & BIO_FLUSH)
+		seq |= REQ_FSEQ_PREFLUSH;
+	if ((bio->bi_rw & BIO_FUA) && !(fflags & REQ_FUA))
+		seq |= REQ_FSEQ_POSTFLUSH;
+	if (!seq)
+		return false;
+
+	fs = kmalloc(sizeof(*fs), GFP_NOIO);
+	if (!fs) {
+		bio_endio(bio, -ENOMEM);
+		return true;
+	}
+
+	INIT_WORK(&fs->work, bio_flush_seq_work);
+	fs->q = q;
+	fs->bio = bio;
+	fs->end_io = bio->bi_end_io;
+	fs->private = bio->bi_private;
+	fs->seq = seq | REQ_FSEQ_DATA;
+	fs->error = 0;
+
+	bio->bi_rw &= ~BIO_FLUSH;
+	if (seq & REQ_FSEQ_POSTFLUSH)
+		bio->bi_rw &= ~BIO_FUA;
+	bio->bi_end_io = bio_flush_seq_end_io;
+	bio->bi_private = fs;
+
+	bio_flush_seq_step(fs);
+	return true;
+}
+EXPORT_SYMBOL(blk_flush_bio_seq);
@@ -0,0 +1,489 @@
+/*
+ * Latency target IO controller
+ *
+ * Every blkio cgroup may ask for a target completion latency per device.
+ * The controller counts the requests each group has allocated and not yet
+ * completed. When a group misses its target over a window, all groups
+ * with a looser target or none at all get their allowed number of requests
+ * in flight halved. While every target is met, the limits grow back again
+ * step by step. Nothing is limited as long as no group has a target.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/blktrace_api.h>
+#include "blk-cgroup.h"
+#include "blk.h"
+
+/* Targets are checked and depths adjusted once per window */
+static unsigned long iolat_window = HZ/10;	/* 100 ms */
+
+/* A group needs this many completions in a window to be judged */
+#define IOLAT_MIN_SAMPLES	4
+
+/* Depth is unlimited */
+#define IOLAT_DEPTH_MAX		UINT_MAX
+
+struct iolat_grp {
+	/* List of groups on the request queue */
+	struct hlist_node grp_node;
+
+	struct blkio_group blkg;
+	atomic_t ref;
+
+	/* Target completion latency in ns, 0 if the group has none */
+	u64 target;
+
+	/* Requests allocated and not yet completed, and the limit on those */
+	unsigned int inflight;
+	unsigned int depth;
+	wait_queue_head_t wait;
+
+	/* Completions in the current window */
+	u64 lat_sum;
+	unsigned int lat_nr;
+
+	struct rcu_head rcu_head;
+};
+
+struct iolat_data {
+	/* List of groups */
+	struct hlist_head grp_list;
+
+	struct iolat_grp *root_grp;
+	struct request_queue *queue;
+
+	/* Groups with a target, recounted when targets_changed is set */
+	unsigned int nr_targets;
+	int targets_changed;
+
+	unsigned long window_end;
+
+	/* number of total undestroyed groups */
+	unsigned int nr_undestroyed_grps;
+};
+
+#define iolat_log_grp(iold, grp, fmt, args...)				\
+	blk_add_trace_msg((iold)->queue, "iolat %s " fmt,		\
+				blkg_path(&(grp)->blkg), ##args)
+
+static inline struct iolat_grp *grp_of_blkg(struct blkio_group *blkg)
+{
+	if (blkg)
+		return container_of(blkg, struct iolat_grp, blkg);
+
+	return NULL;
+}
+
+static void __iolat_free_grp(struct iolat_grp *grp)
+{
+	kfree(grp->blkg.lat_hist);
+	free_percpu(grp->blkg.stats_cpu);
+	kfree(grp);
+}
+
+static void iolat_free_grp(struct rcu_head *head)
+{
+	__iolat_free_grp(container_of(head, struct iolat_grp, rcu_head));
+}
+
+static void iolat_put_grp(struct iolat_grp *grp)
+{
+	BUG_ON(atomic_read(&grp->ref) <= 0);
+	if (!atomic_dec_and_test(&grp->ref))
+		return;
+
+	/* Group lookups are rcu protected, see throtl_put_tg() */
+	call_rcu(&grp->rcu_head, iolat_free_grp);
+}
+
+/* Should be called without queue lock and outside of rcu period */
+static struct iolat_grp *iolat_alloc_grp(struct iolat_data *iold)
+{
+	struct iolat_grp *grp;
+
+	grp = kzalloc_node(sizeof(*grp), GFP_ATOMIC, iold->queue->node);
+	if (!grp)
+		return NULL;
+
+	if (blkio_alloc_blkg_stats(&grp->blkg)) {
+		kfree(grp);
+		return NULL;
+	}
+
+	grp->blkg.lat_hist = kzalloc_node(sizeof(struct blk_lat_hist),
+					  GFP_ATOMIC, iold->queue->node);
+	if (!grp->blkg.lat_hist) {
+		__iolat_free_grp(grp);
+		return NULL;
+	}
+
+	INIT_HLIST_NODE(&grp->grp_node);
+	init_waitqueue_head(&grp->wait);
+	grp->depth = IOLAT_DEPTH_MAX;
+
+	/* Initial reference, dropped by queue exit or cgroup deletion */
+	atomic_set(&grp->ref, 1);
+	return grp;
+}
+
+static void iolat_fill_dev_details(struct iolat_data *iold,
+				   struct iolat_grp *grp)
+{
+	struct backing_dev_info *bdi = &iold->queue->backing_dev_info;
+	unsigned int major, minor;
+
+	if (!grp || grp->blkg.dev)
+		return;
+
+	/* Device might not have been attached at group creation time */
+	if (bdi->dev && dev_name(bdi->dev)) {
+		sscanf(dev_name(bdi->dev), "%u:%u", &major, &minor);
+		grp->blkg.dev = MKDEV(major, minor);
+	}
+}
+
+/* Should be called with rcu read lock and queue lock held */
+static void iolat_init_add_grp(struct iolat_data *iold, struct iolat_grp *grp,
+			       struct blkio_cgroup *blkcg)
+{
+	iolat_fill_dev_details(iold, grp);
+
+	blkiocg_add_blkio_group(blkcg, &grp->blkg, (void *)iold,
+				grp->blkg.dev, BLKIO_POLICY_LATENCY);
+
+	grp->target = blkcg_get_latency_target(blkcg, grp->blkg.dev) *
+			NSEC_PER_USEC;
+	if (grp->target)
+		iold->targets_changed = true;
+
+	hlist_add_head(&grp->grp_node, &iold->grp_list);
+	iold->nr_undestroyed_grps++;
+}
+
+static struct iolat_grp *
+iolat_find_grp(struct iolat_data *iold, struct blkio_cgroup *blkcg)
+{
+	struct iolat_grp *grp;
+
+	if (blkcg == &blkio_root_cgroup)
+		grp = iold->root_grp;
+	else
+		grp = grp_of_blkg(blkiocg_lookup_group(blkcg, iold));
+
+	iolat_fill_dev_details(iold, grp);
+	return grp;
+}
+
+/*
+ * Returns the group of the current task, allocating it if need be. Called
+ * and returns with queue lock held, but drops it for the allocation.
+ */
+static struct iolat_grp *iolat_get_grp(struct iolat_data *iold)
+{
+	struct request_queue *q = iold->queue;
+	struct iolat_grp *grp, *__grp;
+	struct blkio_cgroup *blkcg;
+
+	rcu_read_lock();
+	blkcg = task_blkio_cgroup(current);
+	grp = iolat_find_grp(iold, blkcg);
+	rcu_read_unlock();
+	if (grp)
+		return grp;
+
+	blk_get_queue(q);
+	spin_unlock_irq(q->queue_lock);
+
+	grp = iolat_alloc_grp(iold);
+
+	blk_put_queue(q);
+	spin_lock_irq(q->queue_lock);
+
+	/* Queue is going away, just use the root group */
+	if (unlikely(test_bit(QUEUE_FLAG_DEAD, &q->queue_flags))) {
+		if (grp)
+			__iolat_free_grp(grp);
+		return iold->root_grp;
+	}
+
+	/* After sleeping, read the blkcg again */
+	rcu_read_lock();
+	blkcg = task_blkio_cgroup(current);
+	__grp = iolat_find_grp(iold, blkcg);
+	if (__grp) {
+		if (grp)
+			__iolat_free_grp(grp);
+		grp = __grp;
+	} else if (!grp) {
+		/* Group allocation failed. Account the IO to root group */
+		grp = iold->root_grp;
+	} else
+		iolat_init_add_grp(iold, grp, blkcg);
+	rcu_read_unlock();
+
+	return grp;
+}
+
+/* Should be called with queue lock held */
+static void iolat_update_targets(struct iolat_data *iold)
+{
+	struct iolat_grp *grp;
+	struct hlist_node *pos;
+	unsigned int nr_targets = 0;
+
+	if (!xchg(&iold->targets_changed, false))
+		return;
+
+	hlist_for_each_entry(grp, pos, &iold->grp_list, grp_node)
+		if (grp->target)
+			nr_targets++;
+
+	/* Nobody to protect any more, let everybody go */
+	if (!nr_targets) {
+		hlist_for_each_entry(grp, pos, &iold->grp_list, grp_node) {
+			grp->depth = IOLAT_DEPTH_MAX;
+			wake_up_all(&grp->wait);
+		}
+	}
+	iold->nr_targets = nr_targets;
+}
+
+static void iolat_scale_down(struct iolat_data *iold, struct iolat_grp *grp)
+{
+	unsigned int depth = grp->depth;
+	unsigned int max_depth = iold->queue->nr_requests;
+
+	/* First cut starts from what the group has in flight right now */
+	if (depth == IOLAT_DEPTH_MAX)
+		depth = min(grp->inflight, max_depth);
+	depth = max(depth / 2, 1U);
+
+	if (depth != grp->depth) {
+		grp->depth = depth;
+		iolat_log_grp(iold, grp, "depth down to %u", depth);
+	}
+}
+
+static void iolat_scale_up(struct iolat_data *iold, struct iolat_grp *grp)
+{
+	unsigned int max_depth = iold->queue->nr_requests;
+
+	if (grp->depth == IOLAT_DEPTH_MAX)
+		return;
+
+	grp->depth += max(max_depth / 16, 1U);
+	if (grp->depth >= max_depth)
+		grp->depth = IOLAT_DEPTH_MAX;
+	iolat_log_grp(iold, grp, "depth up to %u", grp->depth);
+	wake_up_all(&grp->wait);
+}
+
+/*
+ * Called with queue lock held at the end of every window. Finds the
+ * tightest target that was missed and cuts the depth of all groups which
+ * matter less. Depths only grow back after a window without any miss.
+ */
+static void iolat_window_end(struct iolat_data *iold)
+{
+	struct iolat_grp *grp;
+	struct hlist_node *pos;
+	u64 missed = 0;
+
+	hlist_for_each_entry(grp, pos, &iold->grp_list, grp_node) {
+		if (grp->target && grp->lat_nr >= IOLAT_MIN_SAMPLES &&
+		    div64_u64(grp->lat_sum, grp->lat_nr) > grp->target &&
+		    (!missed || grp->target < missed))
+			missed = grp->target;
+		grp->lat_sum = 0;
+		grp->lat_nr = 0;
+	}
+
+	hlist_for_each_entry(grp, pos, &iold->grp_list, grp_node) {
+		if (!missed)
+			iolat_scale_up(iold, grp);
+		else if (!grp->target || grp->target > missed)
+			iolat_scale_down(iold, grp);
+	}
+
+	iold->window_end = jiffies + iolat_window;
+}
+
+/**
+ * blk_iolatency_throttle - wait for a request slot of the current cgroup
+ * @q: request queue the request is going to be allocated from
+ *
+ * Called with queue lock held before a new request is allocated. Might
+ * drop the lock and sleep until the group is below its depth limit. Returns
+ * with queue lock held and the group charged for one request, which has to
+ * be attached to the request with blk_rq_set_iolat().
+ */
+struct iolat_grp *blk_iolatency_throttle(struct request_queue *q)
+{
+	struct iolat_data *iold = q->iolat;
+	struct iolat_grp *grp;
+	DEFINE_WAIT(wait);
+
+	iolat_update_targets(iold);
+	grp = iolat_get_grp(iold);
+	atomic_inc(&grp->ref);
+
+	while (iold->nr_targets && grp->inflight >= grp->depth) {
+		prepare_to_wait_exclusive(&grp->wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		__generic_unplug_device(q);
+		spin_unlock_irq(q->queue_lock);
+		io_schedule();
+		spin_lock_irq(q->queue_lock);
+		finish_wait(&grp->wait, &wait);
+	}
+
+	grp->inflight++;
+	return grp;
+}
+
+/**
+ * blk_iolatency_done - uncharge a request
+ * @rq: request that completed or is being freed
+ *
+ * Called with queue lock held. Requests which made it to the driver also
+ * feed their latency into the group's window and histogram.
+ */
+void blk_iolatency_done(struct request *rq)
+{
+	struct iolat_grp *grp = rq->iolat;
+	struct iolat_data *iold = rq->q->iolat;
+	u64 now;
+
+	if (!grp)
+		return;
+	rq->iolat = NULL;
+
+	if (rq_io_start_time_ns(rq)) {
+		now = sched_clock();
+		if (now > rq_start_time_ns(rq)) {
+			grp->lat_sum += now - rq_start_time_ns(rq);
+			grp->lat_nr++;
+			blkiocg_update_lat_hist(&grp->blkg, rq, now);
+		}
+	}
+
+	grp->inflight--;
+	if (waitqueue_active(&grp->wait))
+		wake_up(&grp->wait);
+	iolat_put_grp(grp);
+
+	if (time_after_eq(jiffies, iold->window_end))
+		iolat_window_end(iold);
+}
+
+static void iolat_destroy_grp(struct iolat_data *iold, struct iolat_grp *grp)
+{
+	BUG_ON(hlist_unhashed(&grp->grp_node));
+
+	hlist_del_init(&grp->grp_node);
+	if (grp->target)
+		iold->targets_changed = true;
+	iolat_put_grp(grp);
+	iold->nr_undestroyed_grps--;
+}
+
+/*
+ * The cgroup of the group is going away. Called under rcu_read_lock(), key
+ * is a valid iolat_data pointer as long as we are in the rcu read section.
+ */
+static void iolat_unlink_blkio_group(void *key, struct blkio_group *blkg)
+{
+	struct iolat_data *iold = key;
+	unsigned long flags;
+
+	spin_lock_irqsave(iold->queue->queue_lock, flags);
+	iolat_destroy_grp(iold, grp_of_blkg(blkg));
+	spin_unlock_irqrestore(iold->queue->queue_lock, flags);
+}
+
+/*
+ * Called under blkcg_lock, which must not nest inside the queue lock.
+ * The new target is picked up from the submission path.
+ */
+static void iolat_update_blkio_group_latency(void *key,
+				struct blkio_group *blkg, u64 latency)
+{
+	struct iolat_data *iold = key;
+	struct iolat_grp *grp = grp_of_blkg(blkg);
+	int ret;
+
+	grp->target = latency * NSEC_PER_USEC;
+	ret = xchg(&iold->targets_changed, true);
+}
+
+static struct blkio_policy_type blkio_policy_iolat = {
+	.ops = {
+		.blkio_unlink_group_fn = iolat_unlink_blkio_group,
+		.blkio_update_group_latency_fn =
+					iolat_update_blkio_group_latency,
+	},
+	.plid = BLKIO_POLICY_LATENCY,
+};
+
+int blk_iolatency_init(struct request_queue *q)
+{
+	struct iolat_data *iold;
+	struct iolat_grp *grp;
+
+	iold = kzalloc_node(sizeof(*iold), GFP_KERNEL, q->node);
+	if (!iold)
+		return -ENOMEM;
+
+	INIT_HLIST_HEAD(&iold->grp_list);
+	iold->queue = q;
+
+	grp = iolat_alloc_grp(iold);
+	if (!grp) {
+		kfree(iold);
+		return -ENOMEM;
+	}
+	iold->root_grp = grp;
+
+	rcu_read_lock();
+	iolat_init_add_grp(iold, grp, &blkio_root_cgroup);
+	rcu_read_unlock();
+
+	q->iolat = iold;
+	return 0;
+}
+
+void blk_iolatency_exit(struct request_queue *q)
+{
+	struct iolat_data *iold = q->iolat;
+	struct hlist_node *pos, *n;
+	struct iolat_grp *grp;
+	bool wait = false;
+
+	BUG_ON(!iold);
+
+	spin_lock_irq(q->queue_lock);
+	hlist_for_each_entry_safe(grp, pos, n, &iold->grp_list, grp_node) {
+		/* cgroup removal path might have got to the group first */
+		if (!blkiocg_del_blkio_group(&grp->blkg))
+			iolat_destroy_grp(iold, grp);
+	}
+	if (iold->nr_undestroyed_grps > 0)
+		wait = true;
+	spin_unlock_irq(q->queue_lock);
+
+	/* Wait for the unlink path to stop looking at the key */
+	if (wait)
+		synchronize_rcu();
+
+	kfree(iold);
+}
+
+static int __init iolat_init(void)
+{
+	blkio_policy_register(&blkio_policy_iolat);
+	return 0;
+}
+
+module_init(iolat_init);
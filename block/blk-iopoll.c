@@ -11,6 +11,7 @@
 #include <linux/cpu.h>
 #include <linux/blk-iopoll.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
 
 #include "blk.h"
 
@@ -19,6 +20,12 @@ EXPORT_SYMBOL(blk_iopoll_enabled);
 
 static unsigned int blk_iopoll_budget __read_mostly = 256;
 
+/* never give up on a completion before spinning this long */
+#define BLK_POLL_MIN_SPIN_NS	(10 * NSEC_PER_USEC)
+
+/* cap on the mean, polling is pointless for anything slower */
+#define BLK_POLL_MAX_NS		NSEC_PER_MSEC
+
 static DEFINE_PER_CPU(struct list_head, blk_cpu_iopoll);
 
 /**
@@ -77,6 +84,143 @@ void blk_iopoll_complete(struct blk_iopoll *iopoll)
 }
 EXPORT_SYMBOL(blk_iopoll_complete);
 
+/**
+ * blk_iopoll_poll - Run the iopoll handler from the calling task
+ * @iop:      The parent iopoll structure
+ *
+ * Description:
+ *     Meant for a driver's blk_poll_fn, see blk_poll(). Runs @iop->poll()
+ *     directly unless the softirq already owns @iop, in which case there
+ *     is nothing to do. If the handler uses up its weight, @iop is handed
+ *     to the softirq just as an interrupt would have. Must be called with
+ *     bottom halves disabled. Returns the number of completions reaped or
+ *     -1 if @iop can't be polled.
+ **/
+int blk_iopoll_poll(struct blk_iopoll *iop)
+{
+	int work;
+
+	if (!blk_iopoll_enabled || blk_iopoll_disable_pending(iop))
+		return -1;
+	if (test_and_set_bit(IOPOLL_F_SCHED, &iop->state))
+		return 0;
+
+	/* not on any list, ->poll() may still blk_iopoll_complete() it */
+	INIT_LIST_HEAD(&iop->list);
+	work = iop->poll(iop, iop->weight);
+
+	if (work >= iop->weight) {
+		if (blk_iopoll_disable_pending(iop))
+			blk_iopoll_complete(iop);
+		else
+			blk_iopoll_sched(iop);
+	}
+	return work;
+}
+EXPORT_SYMBOL(blk_iopoll_poll);
+
+static inline u64 blk_poll_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static void blk_poll_account(struct request_queue *q, u64 nsec)
+{
+	u64 mean = q->poll_nsec;
+
+	nsec = min_t(u64, nsec, BLK_POLL_MAX_NS);
+	q->poll_nsec = mean ? mean - (mean >> 3) + (nsec >> 3) : nsec;
+}
+
+/*
+ * Hybrid polling: sleep through most of the expected completion time and
+ * only spin for the tail. The sleep ends at @wait_start plus half the mean
+ * (or the fixed io_poll_delay), so rechecking the wait condition and
+ * calling back in after it does not sleep again.
+ */
+static bool blk_poll_sleep(struct request_queue *q, u64 wait_start)
+{
+	struct hrtimer_sleeper hs;
+	u64 nsec;
+
+	if (q->poll_delay < 0)
+		return false;
+	if (q->poll_delay > 0)
+		nsec = (u64)q->poll_delay * NSEC_PER_USEC;
+	else
+		nsec = q->poll_nsec / 2;
+	if (!nsec || blk_poll_now() >= wait_start + nsec)
+		return false;
+
+	hrtimer_init_on_stack(&hs.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	hrtimer_set_expires(&hs.timer, ns_to_ktime(wait_start + nsec));
+	hrtimer_init_sleeper(&hs, current);
+
+	/* woken by either the timer or the completion */
+	hrtimer_start_expires(&hs.timer, HRTIMER_MODE_ABS);
+	if (hs.task)
+		io_schedule();
+	hrtimer_cancel(&hs.timer);
+	destroy_hrtimer_on_stack(&hs.timer);
+
+	q->poll_stat.sleeps++;
+	return true;
+}
+
+/**
+ * blk_poll - Spin for a completion instead of waiting for its interrupt
+ * @q:          The queue the I/O was submitted to
+ * @wait_start: ktime_get() in nanoseconds when the caller began waiting
+ *
+ * Description:
+ *     The caller has set itself TASK_UNINTERRUPTIBLE and will be woken by
+ *     wake_up_process() from the completion it waits for, exactly as it
+ *     would before io_schedule(). Returns true once the task is runnable
+ *     again, the caller must then recheck its wait condition. Returns
+ *     false if the queue does not poll or polling gave up, the caller
+ *     has to io_schedule() after all.
+ **/
+bool blk_poll(struct request_queue *q, u64 wait_start)
+{
+	u64 deadline;
+
+	if (!q->poll_fn || !blk_queue_poll(q))
+		return false;
+
+	q->poll_stat.invoked++;
+
+	/* we don't go through schedule(), nobody else would unplug */
+	blk_flush_plug(current);
+
+	if (blk_poll_sleep(q, wait_start))
+		return true;
+
+	deadline = wait_start + max_t(u64, 2 * q->poll_nsec,
+				      BLK_POLL_MIN_SPIN_NS);
+	while (!need_resched()) {
+		int ret;
+
+		local_bh_disable();
+		ret = q->poll_fn(q);
+		local_bh_enable();
+
+		if (current->state == TASK_RUNNING) {
+			q->poll_stat.hits++;
+			blk_poll_account(q, blk_poll_now() - wait_start);
+			return true;
+		}
+		if (ret < 0 || blk_poll_now() > deadline)
+			break;
+		cpu_relax();
+	}
+
+	/* a lower bound, but it lets the mean catch up with slow devices */
+	q->poll_stat.misses++;
+	blk_poll_account(q, blk_poll_now() - wait_start);
+	return false;
+}
+EXPORT_SYMBOL(blk_poll);
+
 static void blk_iopoll_softirq(struct softirq_action *h)
 {
 	struct list_head *list = &__get_cpu_var(blk_cpu_iopoll);
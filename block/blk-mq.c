@@ -0,0 +1,527 @@
+/*
+ * Multi-queue block submission: per-cpu software queues feeding one or
+ * more hardware dispatch queues, with per hardware queue tag sets.
+ *
+ * Requests are never merged or sorted and the submission path does not
+ * touch q->queue_lock, so a fast device scales with the submitting cpus
+ * instead of with the queue lock.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include <trace/events/block.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+
+/* hctx->state bit, ->init_hctx() succeeded and ->exit_hctx() is owed */
+#define BLK_MQ_S_DRIVER_INIT	1
+
+static void blk_mq_free_tags(struct blk_mq_tags *tags)
+{
+	unsigned int i;
+
+	if (tags->rqs) {
+		for (i = 0; i < tags->nr_tags; i++)
+			kfree(tags->rqs[i]);
+		kfree(tags->rqs);
+	}
+	if (tags->hint)
+		free_percpu(tags->hint);
+	kfree(tags->bitmap);
+	kfree(tags);
+}
+
+static struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags,
+					    unsigned int cmd_size, int node)
+{
+	struct blk_mq_tags *tags;
+	unsigned int i, cpu;
+
+	tags = kzalloc_node(sizeof(*tags), GFP_KERNEL, node);
+	if (!tags)
+		return NULL;
+
+	tags->nr_tags = nr_tags;
+	init_waitqueue_head(&tags->wait);
+
+	tags->bitmap = kzalloc_node(BITS_TO_LONGS(nr_tags) * sizeof(long),
+				    GFP_KERNEL, node);
+	tags->rqs = kzalloc_node(nr_tags * sizeof(struct request *),
+				 GFP_KERNEL, node);
+	tags->hint = alloc_percpu(unsigned int);
+	if (!tags->bitmap || !tags->rqs || !tags->hint)
+		goto fail;
+
+	/* spread the cpus over the tag space */
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(tags->hint, cpu) = cpu * nr_tags / nr_cpu_ids;
+
+	for (i = 0; i < nr_tags; i++) {
+		tags->rqs[i] = kzalloc_node(sizeof(struct request) + cmd_size,
+					    GFP_KERNEL, node);
+		if (!tags->rqs[i])
+			goto fail;
+	}
+	return tags;
+fail:
+	blk_mq_free_tags(tags);
+	return NULL;
+}
+
+static int blk_mq_get_tag(struct blk_mq_tags *tags)
+{
+	unsigned int *hint, start, tag;
+	bool wrapped = false;
+
+	hint = per_cpu_ptr(tags->hint, get_cpu());
+	start = *hint;
+	for (;;) {
+		tag = find_next_zero_bit(tags->bitmap, tags->nr_tags, start);
+		if (tag >= tags->nr_tags) {
+			if (wrapped || !start) {
+				put_cpu();
+				return -1;
+			}
+			wrapped = true;
+			start = 0;
+			continue;
+		}
+		if (!test_and_set_bit_lock(tag, tags->bitmap))
+			break;
+		start = tag + 1;
+	}
+	*hint = tag + 1 < tags->nr_tags ? tag + 1 : 0;
+	put_cpu();
+	return tag;
+}
+
+static void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag)
+{
+	clear_bit_unlock(tag, tags->bitmap);
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(&tags->wait))
+		wake_up(&tags->wait);
+}
+
+/*
+ * Grab a tag and its request, sleeping until one frees up. Can not fail.
+ */
+static struct request *blk_mq_alloc_request(struct blk_mq_hw_ctx *hctx,
+					    struct blk_mq_ctx *ctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct blk_mq_tags *tags = hctx->tags;
+	struct request *rq;
+	DEFINE_WAIT(wait);
+	int tag;
+
+	tag = blk_mq_get_tag(tags);
+	while (tag < 0) {
+		/* make sure what we already queued is on its way */
+		blk_mq_run_hw_queue(hctx, false);
+
+		prepare_to_wait_exclusive(&tags->wait, &wait,
+					  TASK_UNINTERRUPTIBLE);
+		tag = blk_mq_get_tag(tags);
+		if (tag < 0)
+			io_schedule();
+		finish_wait(&tags->wait, &wait);
+	}
+
+	rq = tags->rqs[tag];
+	blk_rq_init(q, rq);
+	rq->tag = tag;
+	rq->mq_ctx = ctx;
+	if (blk_queue_io_stat(q))
+		rq->cmd_flags |= REQ_IO_STAT;
+	return rq;
+}
+
+static void blk_mq_free_request(struct request *rq)
+{
+	blk_mq_put_tag(rq->mq_ctx->hctx->tags, rq->tag);
+}
+
+/**
+ * blk_mq_end_io - end I/O on a multi-queue request
+ * @rq:		the request being completed
+ * @error:	%0 for success, < %0 for error
+ *
+ * Description:
+ *     Completes all bios of @rq and gives its tag back. May be called
+ *     from any context, usually from the ->complete() softirq handler
+ *     after blk_complete_request().
+ */
+void blk_mq_end_io(struct request *rq, int error)
+{
+	if (blk_update_request(rq, error, blk_rq_bytes(rq)))
+		BUG();
+
+	blk_account_io_done(rq);
+	blk_mq_free_request(rq);
+}
+EXPORT_SYMBOL(blk_mq_end_io);
+
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q, const int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+EXPORT_SYMBOL(blk_mq_map_queue);
+
+static void blk_mq_start_request(struct request *rq)
+{
+	trace_block_rq_issue(rq->q, rq);
+	set_io_start_time_ns(rq);
+}
+
+/*
+ * Pull everything the software queues have pending and hand it to the
+ * driver. Anything the driver could not take is parked on ->dispatch and
+ * goes first on the next run.
+ */
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	LIST_HEAD(rq_list);
+	int bit, ret;
+
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	for_each_bit(bit, hctx->ctx_map, hctx->nr_ctx) {
+		ctx = hctx->ctxs[bit];
+		clear_bit(bit, hctx->ctx_map);
+
+		spin_lock(&ctx->lock);
+		list_splice_tail_init(&ctx->rq_list, &rq_list);
+		spin_unlock(&ctx->lock);
+	}
+
+	if (!list_empty_careful(&hctx->dispatch)) {
+		spin_lock(&hctx->lock);
+		list_splice_init(&hctx->dispatch, &rq_list);
+		spin_unlock(&hctx->lock);
+	}
+
+	while (!list_empty(&rq_list)) {
+		rq = list_first_entry(&rq_list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+
+		blk_mq_start_request(rq);
+		ret = q->mq_ops->queue_rq(hctx, rq);
+		if (ret == BLK_MQ_RQ_QUEUE_OK)
+			continue;
+		if (ret == BLK_MQ_RQ_QUEUE_BUSY) {
+			list_add(&rq->queuelist, &rq_list);
+			break;
+		}
+
+		WARN_ON(ret != BLK_MQ_RQ_QUEUE_ERROR);
+		rq->errors = -EIO;
+		blk_mq_end_io(rq, -EIO);
+	}
+
+	if (!list_empty(&rq_list)) {
+		spin_lock(&hctx->lock);
+		list_splice(&rq_list, &hctx->dispatch);
+		spin_unlock(&hctx->lock);
+
+		/*
+		 * The driver may have restarted the queue already, and run it
+		 * while the dispatch list was still empty. Nobody would run it
+		 * again for these, so do it ourselves.
+		 */
+		smp_mb();
+		if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			blk_mq_run_hw_queue(hctx, true);
+	}
+}
+
+static void blk_mq_run_work_fn(struct work_struct *work)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = container_of(work, struct blk_mq_hw_ctx, run_work.work);
+	__blk_mq_run_hw_queue(hctx);
+}
+
+/**
+ * blk_mq_run_hw_queue - dispatch pending requests of a hardware queue
+ * @hctx:	the hardware queue
+ * @async:	leave the dispatch to kblockd
+ *
+ * Description:
+ *     From interrupt context, or with interrupts disabled, the dispatch is
+ *     always deferred to kblockd.
+ */
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async)
+{
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	if (async || in_interrupt() || irqs_disabled())
+		kblockd_schedule_delayed_work(hctx->queue, &hctx->run_work, 0);
+	else
+		__blk_mq_run_hw_queue(hctx);
+}
+EXPORT_SYMBOL(blk_mq_run_hw_queue);
+
+static bool blk_mq_hctx_has_pending(struct blk_mq_hw_ctx *hctx)
+{
+	return !bitmap_empty(hctx->ctx_map, hctx->nr_ctx) ||
+		!list_empty_careful(&hctx->dispatch);
+}
+
+void blk_mq_run_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (blk_mq_hctx_has_pending(hctx))
+			blk_mq_run_hw_queue(hctx, async);
+	}
+}
+EXPORT_SYMBOL(blk_mq_run_queues);
+
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queue);
+
+void blk_mq_start_stopped_hw_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (test_and_clear_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			blk_mq_run_hw_queue(hctx, async);
+	}
+}
+EXPORT_SYMBOL(blk_mq_start_stopped_hw_queues);
+
+/*
+ * There is no plug, but page cache waiters still kick the queue through
+ * the unplug hooks, let them push out whatever was queued asynchronously.
+ */
+static void blk_mq_unplug(struct request_queue *q)
+{
+	blk_mq_run_queues(q, false);
+}
+
+static int blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	const bool sync = bio_rw_flagged(bio, BIO_RW_SYNCIO) ||
+			  bio_rw_flagged(bio, BIO_RW_UNPLUG);
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+
+	/* BIO_RW_BARRIER is deprecated */
+	if (WARN_ONCE(bio_rw_flagged(bio, BIO_RW_BARRIER),
+		"block: BARRIER is deprecated, use FLUSH/FUA instead\n")) {
+		bio_endio(bio, -EOPNOTSUPP);
+		return 0;
+	}
+
+	/*
+	 * There is no flush queue on this path, FLUSH/FUA writes carrying
+	 * data are broken up into separate steps. The driver only ever sees
+	 * empty REQ_FLUSH requests, and REQ_FUA if it advertised it.
+	 */
+	if (blk_flush_bio_seq(q, bio))
+		return 0;
+
+	blk_queue_bounce(q, &bio);
+
+	/* the ctx stays valid if we migrate, its lock covers the list */
+	ctx = per_cpu_ptr(q->queue_ctx, get_cpu());
+	put_cpu();
+	hctx = ctx->hctx;
+
+	rq = blk_mq_alloc_request(hctx, ctx);
+	init_request_from_bio(rq, bio);
+	if (test_bit(QUEUE_FLAG_SAME_COMP, &q->queue_flags) ||
+	    bio_flagged(bio, BIO_CPU_AFFINE))
+		rq->cpu = raw_smp_processor_id();
+	drive_stat_acct(rq, 1);
+	trace_block_rq_insert(q, rq);
+
+	spin_lock(&ctx->lock);
+	list_add_tail(&rq->queuelist, &ctx->rq_list);
+	spin_unlock(&ctx->lock);
+	set_bit(ctx->index_hw, hctx->ctx_map);
+
+	/* async IO is batched by kblockd, sync IO goes out right away */
+	blk_mq_run_hw_queue(hctx, !sync);
+	return 0;
+}
+
+void blk_mq_sync_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	for (i = 0; q->queue_hw_ctx && i < q->nr_hw_queues; i++) {
+		hctx = q->queue_hw_ctx[i];
+		if (hctx)
+			cancel_delayed_work_sync(&hctx->run_work);
+	}
+}
+
+void blk_mq_free_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	for (i = 0; q->queue_hw_ctx && i < q->nr_hw_queues; i++) {
+		hctx = q->queue_hw_ctx[i];
+		if (!hctx)
+			continue;
+		if (test_bit(BLK_MQ_S_DRIVER_INIT, &hctx->state))
+			q->mq_ops->exit_hctx(hctx, i);
+		if (hctx->tags)
+			blk_mq_free_tags(hctx->tags);
+		kfree(hctx->ctxs);
+		kfree(hctx->ctx_map);
+		kfree(hctx);
+	}
+	kfree(q->queue_hw_ctx);
+	kfree(q->mq_map);
+	if (q->queue_ctx)
+		free_percpu(q->queue_ctx);
+
+	q->queue_hw_ctx = NULL;
+	q->mq_map = NULL;
+	q->queue_ctx = NULL;
+}
+
+static int blk_mq_init_hw_queues(struct request_queue *q,
+				 struct blk_mq_reg *reg, void *driver_data)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	unsigned int i, cpu;
+
+	for (i = 0; i < reg->nr_hw_queues; i++) {
+		hctx = kzalloc_node(sizeof(*hctx), GFP_KERNEL, reg->numa_node);
+		if (!hctx)
+			return -ENOMEM;
+		q->queue_hw_ctx[i] = hctx;
+
+		spin_lock_init(&hctx->lock);
+		INIT_LIST_HEAD(&hctx->dispatch);
+		INIT_DELAYED_WORK(&hctx->run_work, blk_mq_run_work_fn);
+		hctx->queue = q;
+		hctx->queue_num = i;
+		hctx->numa_node = reg->numa_node;
+		hctx->driver_data = driver_data;
+
+		hctx->ctxs = kzalloc_node(nr_cpu_ids * sizeof(void *),
+					  GFP_KERNEL, reg->numa_node);
+		hctx->ctx_map = kzalloc_node(BITS_TO_LONGS(nr_cpu_ids) *
+					     sizeof(long), GFP_KERNEL,
+					     reg->numa_node);
+		hctx->tags = blk_mq_init_tags(reg->queue_depth, reg->cmd_size,
+					      reg->numa_node);
+		if (!hctx->ctxs || !hctx->ctx_map || !hctx->tags)
+			return -ENOMEM;
+	}
+
+	/* contiguous cpus share a hardware queue */
+	for_each_possible_cpu(cpu) {
+		q->mq_map[cpu] = cpu * reg->nr_hw_queues / nr_cpu_ids;
+		hctx = q->queue_hw_ctx[q->mq_map[cpu]];
+
+		ctx = per_cpu_ptr(q->queue_ctx, cpu);
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->rq_list);
+		ctx->cpu = cpu;
+		ctx->queue = q;
+		ctx->hctx = hctx;
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+
+	if (!reg->ops->init_hctx)
+		return 0;
+
+	for (i = 0; i < reg->nr_hw_queues; i++) {
+		hctx = q->queue_hw_ctx[i];
+		if (reg->ops->init_hctx(hctx, driver_data, i))
+			return -ENODEV;
+		if (reg->ops->exit_hctx)
+			set_bit(BLK_MQ_S_DRIVER_INIT, &hctx->state);
+	}
+	return 0;
+}
+
+/**
+ * blk_mq_init_queue - set up a multi-queue request queue
+ * @reg:	hardware queue count, depth and driver operations
+ * @driver_data: passed to ->init_hctx() and stored in each hctx
+ *
+ * Description:
+ *     The multi-queue counterpart of blk_init_queue(). Requests come out
+ *     of ->queue_rq() with a tag unique within their hardware queue and
+ *     @reg->cmd_size bytes of driver data behind them, see
+ *     blk_mq_rq_to_pdu(). They are completed with blk_mq_end_io().
+ *     The queue is torn down with blk_cleanup_queue() as usual.
+ *
+ *     Returns %NULL on failure.
+ */
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data)
+{
+	struct request_queue *q;
+
+	if (!reg->nr_hw_queues || !reg->ops->queue_rq ||
+	    !reg->queue_depth || reg->queue_depth > BLK_MQ_MAX_DEPTH)
+		return NULL;
+
+	q = blk_alloc_queue_node(GFP_KERNEL, reg->numa_node);
+	if (!q)
+		return NULL;
+
+	q->mq_ops = reg->ops;
+	q->nr_hw_queues = reg->nr_hw_queues;
+	/* blk_alloc_queue_node() leaves out the defaults blk_init_queue() sets */
+	queue_flag_set_unlocked(QUEUE_FLAG_IO_STAT, q);
+	/* rq->cpu gets stamped, blk_complete_request() goes back to it */
+	queue_flag_set_unlocked(QUEUE_FLAG_SAME_COMP, q);
+
+	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
+	q->queue_hw_ctx = kzalloc_node(reg->nr_hw_queues * sizeof(void *),
+				       GFP_KERNEL, reg->numa_node);
+	q->mq_map = kzalloc_node(nr_cpu_ids * sizeof(unsigned int),
+				 GFP_KERNEL, reg->numa_node);
+	if (!q->queue_ctx || !q->queue_hw_ctx || !q->mq_map)
+		goto fail;
+
+	if (blk_mq_init_hw_queues(q, reg, driver_data))
+		goto fail;
+
+	blk_queue_make_request(q, blk_mq_make_request);
+	q->unplug_fn = blk_mq_unplug;
+	q->nr_requests = reg->queue_depth * reg->nr_hw_queues;
+	if (reg->ops->complete)
+		blk_queue_softirq_done(q, reg->ops->complete);
+
+	return q;
+fail:
+	blk_cleanup_queue(q);
+	return NULL;
+}
+EXPORT_SYMBOL(blk_mq_init_queue);
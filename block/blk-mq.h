@@ -0,0 +1,36 @@
+#ifndef BLK_MQ_INTERNAL_H
+#define BLK_MQ_INTERNAL_H
+
+#include <linux/blk-mq.h>
+
+/*
+ * Per-cpu software submission queue. Only the submitting cpu and the
+ * dispatcher of the hardware queue it maps to ever take ->lock.
+ */
+struct blk_mq_ctx {
+	spinlock_t		lock;
+	struct list_head	rq_list;
+
+	unsigned int		cpu;
+	unsigned int		index_hw;	/* bit in hctx->ctx_map */
+	struct blk_mq_hw_ctx	*hctx;
+	struct request_queue	*queue;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Tag space of one hardware queue, each tag owns a preallocated request.
+ * Every cpu starts its search at its own hint so that submitters do not
+ * all fight over the first word of the bitmap.
+ */
+struct blk_mq_tags {
+	unsigned int		nr_tags;
+	unsigned long		*bitmap;
+	unsigned int __percpu	*hint;
+	wait_queue_head_t	wait;
+	struct request		**rqs;
+};
+
+void blk_mq_sync_queue(struct request_queue *q);
+void blk_mq_free_queue(struct request_queue *q);
+
+#endif
@@ -80,6 +80,24 @@ void blk_queue_softirq_done(struct request_queue *q, softirq_done_fn *fn)
 }
 EXPORT_SYMBOL(blk_queue_softirq_done);
 
+/**
+ * blk_queue_poll_fn - set the completion poll hook for a queue
+ * @q:   the request queue for the device
+ * @fn:  reaps finished commands, returns how many or < 0 if it can't poll
+ *
+ * Description:
+ *    Lets tasks waiting synchronously on I/O spin on @fn rather than
+ *    sleeping until the completion interrupt, see blk_poll(). @fn is
+ *    called from process context with bottom halves disabled. Polling
+ *    still has to be switched on through the queue's io_poll attribute.
+ */
+void blk_queue_poll_fn(struct request_queue *q, blk_poll_fn *fn)
+{
+	q->poll_fn = fn;
+	q->poll_delay = -1;
+}
+EXPORT_SYMBOL(blk_queue_poll_fn);
+
 void blk_queue_rq_timeout(struct request_queue *q, unsigned int timeout)
 {
 	q->rq_timeout = timeout;
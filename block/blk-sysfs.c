@@ -9,6 +9,7 @@
 #include <linux/pagecache_api.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 
 struct queue_sysfs_entry {
 	struct attribute attr;
@@ -253,6 +254,62 @@ queue_rq_affinity_store(struct request_queue *q, const char *page, size_t count)
 	return ret;
 }
 
+static ssize_t queue_poll_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(blk_queue_poll(q), page);
+}
+
+static ssize_t queue_poll_store(struct request_queue *q, const char *page,
+				size_t count)
+{
+	unsigned long poll_on;
+	ssize_t ret;
+
+	if (!q->poll_fn)
+		return -EINVAL;
+
+	ret = queue_var_store(&poll_on, page, count);
+
+	spin_lock_irq(q->queue_lock);
+	if (poll_on)
+		queue_flag_set(QUEUE_FLAG_POLL, q);
+	else
+		queue_flag_clear(QUEUE_FLAG_POLL, q);
+	spin_unlock_irq(q->queue_lock);
+
+	return ret;
+}
+
+static ssize_t queue_poll_delay_show(struct request_queue *q, char *page)
+{
+	return sprintf(page, "%d\n", q->poll_delay);
+}
+
+static ssize_t queue_poll_delay_store(struct request_queue *q,
+				      const char *page, size_t count)
+{
+	long val;
+
+	if (!q->poll_fn)
+		return -EINVAL;
+
+	/* -1 spins right away, 0 sleeps half the mean, else usecs */
+	if (strict_strtol(page, 10, &val) || val < -1 || val > USEC_PER_SEC)
+		return -EINVAL;
+
+	q->poll_delay = val;
+	return count;
+}
+
+static ssize_t queue_poll_stat_show(struct request_queue *q, char *page)
+{
+	return sprintf(page, "invoked %lu\nhits %lu\nmisses %lu\n"
+		       "sleeps %lu\nmean_nsec %llu\n",
+		       q->poll_stat.invoked, q->poll_stat.hits,
+		       q->poll_stat.misses, q->poll_stat.sleeps,
+		       (unsigned long long)q->poll_nsec);
+}
+
 static ssize_t queue_random_show(struct request_queue *q, char *page)
 {
 	return queue_var_show(blk_queue_add_random(q), page);
@@ -398,6 +455,23 @@ static struct queue_sysfs_entry queue_iostats_entry = {
 	.store = queue_iostats_store,
 };
 
+static struct queue_sysfs_entry queue_poll_entry = {
+	.attr = {.name = "io_poll", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_show,
+	.store = queue_poll_store,
+};
+
+static struct queue_sysfs_entry queue_poll_delay_entry = {
+	.attr = {.name = "io_poll_delay", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_delay_show,
+	.store = queue_poll_delay_store,
+};
+
+static struct queue_sysfs_entry queue_poll_stat_entry = {
+	.attr = {.name = "io_poll_stat", .mode = S_IRUGO },
+	.show = queue_poll_stat_show,
+};
+
 static struct queue_sysfs_entry queue_random_entry = {
 	.attr = {.name = "add_random", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_random_show,
@@ -425,6 +499,9 @@ static struct attribute *default_attrs[] = {
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
+	&queue_poll_entry.attr,
+	&queue_poll_delay_entry.attr,
+	&queue_poll_stat_entry.attr,
 	NULL,
 };
 
@@ -495,6 +572,9 @@ static void blk_release_queue(struct kobject *kobj)
 
 	blk_sync_queue(q);
 
+	if (q->mq_ops)
+		blk_mq_free_queue(q);
+
 	if (rl->rq_pool)
 		mempool_destroy(rl->rq_pool);
 
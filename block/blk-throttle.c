@@ -20,6 +20,25 @@ static int throtl_quantum = 32;
 /* Throttling is performed over 100ms slice and after that slice is renewed */
 static unsigned long throtl_slice = HZ/10;	/* 100 ms */
 
+/* A cpu may take 1/8th of a slice's allowance in advance */
+#define THROTL_CPU_BATCH_SHIFT	3
+
+/*
+ * Low limits are enforced only while the device is contended. Completion
+ * latency is averaged over one slice; a window needs this many samples to
+ * count, and an average above THROTL_LAT_FACTOR times the idle baseline
+ * means contention. Low limits are lifted again only after
+ * THROTL_UPGRADE_WINDOWS calm windows in a row.
+ */
+#define THROTL_LAT_MIN_SAMPLES	8
+#define THROTL_LAT_FACTOR	2
+#define THROTL_UPGRADE_WINDOWS	4
+
+enum {
+	THROTL_LIMIT_LOW,
+	THROTL_LIMIT_MAX,
+};
+
 /* A workqueue to queue throttle related work */
 static struct workqueue_struct *kthrotld_workqueue;
 static void throtl_schedule_delayed_work(struct throtl_data *td,
@@ -37,6 +56,22 @@ struct throtl_rb_root {
 
 #define rb_entry_tg(node)	rb_entry((node), struct throtl_grp, rb_node)
 
+/*
+ * Per cpu token bucket of a group. When the locked path lets a bio through
+ * it also charges the group for a batch of bytes and ios and parks them
+ * with the submitting cpu. Further bios from that cpu pass against these
+ * tokens without taking the queue lock. Tokens expire one slice after they
+ * are handed out, or as soon as the group's limits change. Whatever the cpu
+ * has left is credited back to the group once it falls back to the locked
+ * path.
+ */
+struct throtl_grp_cpu {
+	uint64_t bytes[2];
+	unsigned int ios[2];
+	unsigned long expires[2];
+	int gen[2];
+};
+
 struct throtl_grp {
 	/* List of throtl groups on the request queue*/
 	struct hlist_node tg_node;
@@ -67,6 +102,16 @@ struct throtl_grp {
 	/* IOPS limits */
 	unsigned int iops[2];
 
+	/* Limits groups fall back to while the device is busy, -1 if none */
+	uint64_t bps_low[2];
+	unsigned int iops_low[2];
+
+	/*
+	 * Group of the parent cgroup on the same queue, NULL for the root.
+	 * A bio has to be within the limits of all ancestors as well.
+	 */
+	struct throtl_grp *parent;
+
 	/* Number of bytes disptached in current slice */
 	uint64_t bytes_disp[2];
 	/* Number of bio's dispatched in current slice */
@@ -79,6 +124,10 @@ struct throtl_grp {
 	/* Some throttle limits got updated for the group */
 	int limits_changed;
 
+	/* Per cpu tokens, only valid while their gen matches tokens_gen */
+	struct throtl_grp_cpu __percpu *cpu_tokens;
+	atomic_t tokens_gen;
+
 	struct rcu_head rcu_head;
 };
 
@@ -105,10 +154,22 @@ struct throtl_data
 	struct delayed_work throtl_work;
 
 	int limits_changed;
+
+	/* THROTL_LIMIT_LOW or THROTL_LIMIT_MAX, see throtl_lat_window() */
+	int limit_index;
+	unsigned int nr_low_grps;
+
+	/* Request completion latency of the current window, in ns */
+	unsigned long lat_window_end;
+	u64 lat_sum;
+	unsigned int lat_nr;
+	u64 lat_baseline;
+	unsigned int lat_good_windows;
 };
 
 enum tg_state_flags {
 	THROTL_TG_FLAG_on_rr = 0,	/* on round-robin busy list */
+	THROTL_TG_FLAG_linked,		/* parent pointer is set up */
 };
 
 #define THROTL_TG_FNS(name)						\
@@ -126,6 +187,7 @@ static inline int throtl_tg_##name(const struct throtl_grp *tg)		\
 }
 
 THROTL_TG_FNS(on_rr);
+THROTL_TG_FNS(linked);
 
 #define throtl_log_tg(td, tg, fmt, args...)				\
 	blk_add_trace_msg((td)->queue, "throtl %s " fmt,		\
@@ -147,27 +209,56 @@ static inline int total_nr_queued(struct throtl_data *td)
 	return (td->nr_queued[0] + td->nr_queued[1]);
 }
 
+/* Limits in effect right now, low limits never exceed max ones */
+static inline uint64_t
+tg_bps(struct throtl_data *td, struct throtl_grp *tg, bool rw)
+{
+	if (td->limit_index == THROTL_LIMIT_LOW)
+		return min(tg->bps_low[rw], tg->bps[rw]);
+	return tg->bps[rw];
+}
+
+static inline unsigned int
+tg_iops(struct throtl_data *td, struct throtl_grp *tg, bool rw)
+{
+	if (td->limit_index == THROTL_LIMIT_LOW)
+		return min(tg->iops_low[rw], tg->iops[rw]);
+	return tg->iops[rw];
+}
+
+static inline bool tg_has_low(struct throtl_grp *tg)
+{
+	return tg->bps_low[READ] != -1 || tg->bps_low[WRITE] != -1 ||
+		tg->iops_low[READ] != -1 || tg->iops_low[WRITE] != -1;
+}
+
 static inline struct throtl_grp *throtl_ref_get_tg(struct throtl_grp *tg)
 {
 	atomic_inc(&tg->ref);
 	return tg;
 }
 
-static void throtl_free_tg(struct rcu_head *head)
+static void __throtl_free_tg(struct throtl_grp *tg)
 {
-	struct throtl_grp *tg;
-
-	tg = container_of(head, struct throtl_grp, rcu_head);
+	free_percpu(tg->cpu_tokens);
 	free_percpu(tg->blkg.stats_cpu);
 	kfree(tg);
 }
 
+static void throtl_free_tg(struct rcu_head *head)
+{
+	__throtl_free_tg(container_of(head, struct throtl_grp, rcu_head));
+}
+
 static void throtl_put_tg(struct throtl_grp *tg)
 {
 	BUG_ON(atomic_read(&tg->ref) <= 0);
 	if (!atomic_dec_and_test(&tg->ref))
 		return;
 
+	if (tg->parent)
+		throtl_put_tg(tg->parent);
+
 	/*
 	 * A group is freed in rcu manner. But having an rcu lock does not
 	 * mean that one can access all the fields of blkg and assume these
@@ -191,6 +282,8 @@ static void throtl_init_group(struct throtl_grp *tg)
 	/* Practically unlimited BW */
 	tg->bps[0] = tg->bps[1] = -1;
 	tg->iops[0] = tg->iops[1] = -1;
+	tg->bps_low[0] = tg->bps_low[1] = -1;
+	tg->iops_low[0] = tg->iops_low[1] = -1;
 
 	/*
 	 * Take the initial reference that will be released on destroy
@@ -245,6 +338,69 @@ throtl_tg_fill_dev_details(struct throtl_data *td, struct throtl_grp *tg)
 	spin_unlock_irq(td->queue->queue_lock);
 }
 
+static struct
+throtl_grp *throtl_find_tg(struct throtl_data *td, struct blkio_cgroup *blkcg)
+{
+	struct throtl_grp *tg = NULL;
+	void *key = td;
+
+	/*
+	 * This is the common case when there are no blkio cgroups.
+ 	 * Avoid lookup in this case
+ 	 */
+	if (blkcg == &blkio_root_cgroup)
+		tg = td->root_tg;
+	else
+		tg = tg_of_blkg(blkiocg_lookup_group(blkcg, key));
+
+	__throtl_tg_fill_dev_details(td, tg);
+	return tg;
+}
+
+static inline struct blkio_cgroup *blkcg_parent(struct blkio_cgroup *blkcg)
+{
+	struct cgroup *parent;
+
+	if (blkcg == &blkio_root_cgroup)
+		return NULL;
+
+	parent = blkcg->css.cgroup->parent;
+	return parent ? cgroup_to_blkio_cgroup(parent) : NULL;
+}
+
+/*
+ * Returns the cgroup closest to the root on the path from @blkcg which has
+ * no group on @td yet, NULL if all of them have one. Groups are created top
+ * down so that a parent group exists whenever its children do.
+ */
+static struct blkio_cgroup *
+throtl_missing_ancestor(struct throtl_data *td, struct blkio_cgroup *blkcg)
+{
+	struct blkio_cgroup *missing = NULL;
+
+	for (; blkcg; blkcg = blkcg_parent(blkcg))
+		if (!throtl_find_tg(td, blkcg))
+			missing = blkcg;
+
+	return missing;
+}
+
+/* Should be called with rcu read lock and queue lock held */
+static void throtl_tg_link(struct throtl_data *td, struct throtl_grp *tg,
+			struct blkio_cgroup *blkcg)
+{
+	struct blkio_cgroup *parent = blkcg_parent(blkcg);
+	struct throtl_grp *ptg;
+
+	if (parent) {
+		ptg = throtl_find_tg(td, parent);
+		if (WARN_ON_ONCE(!ptg))
+			ptg = td->root_tg;
+		tg->parent = throtl_ref_get_tg(ptg);
+	}
+	throtl_mark_tg_linked(tg);
+}
+
 static void throtl_init_add_tg_lists(struct throtl_data *td,
 			struct throtl_grp *tg, struct blkio_cgroup *blkcg)
 {
@@ -258,7 +414,20 @@ static void throtl_init_add_tg_lists(struct throtl_data *td,
 	tg->bps[WRITE] = blkcg_get_write_bps(blkcg, tg->blkg.dev);
 	tg->iops[READ] = blkcg_get_read_iops(blkcg, tg->blkg.dev);
 	tg->iops[WRITE] = blkcg_get_write_iops(blkcg, tg->blkg.dev);
+	tg->bps_low[READ] = blkcg_get_read_bps_low(blkcg, tg->blkg.dev);
+	tg->bps_low[WRITE] = blkcg_get_write_bps_low(blkcg, tg->blkg.dev);
+	tg->iops_low[READ] = blkcg_get_read_iops_low(blkcg, tg->blkg.dev);
+	tg->iops_low[WRITE] = blkcg_get_write_iops_low(blkcg, tg->blkg.dev);
+
+	/*
+	 * Count the group right away: throtl_process_limit_change() only
+	 * recounts from the dispatch work, which a group that never queues
+	 * a bio does not run.  Queue lock is held, or td is not visible yet.
+	 */
+	if (tg_has_low(tg))
+		td->nr_low_grps++;
 
+	throtl_tg_link(td, tg, blkcg);
 	throtl_add_group_to_td_list(td, tg);
 }
 
@@ -279,26 +448,13 @@ static struct throtl_grp *throtl_alloc_tg(struct throtl_data *td)
 		return NULL;
 	}
 
-	throtl_init_group(tg);
-	return tg;
-}
-
-static struct
-throtl_grp *throtl_find_tg(struct throtl_data *td, struct blkio_cgroup *blkcg)
-{
-	struct throtl_grp *tg = NULL;
-	void *key = td;
-
-	/*
-	 * This is the common case when there are no blkio cgroups.
- 	 * Avoid lookup in this case
- 	 */
-	if (blkcg == &blkio_root_cgroup)
-		tg = td->root_tg;
-	else
-		tg = tg_of_blkg(blkiocg_lookup_group(blkcg, key));
+	tg->cpu_tokens = alloc_percpu(struct throtl_grp_cpu);
+	if (!tg->cpu_tokens) {
+		__throtl_free_tg(tg);
+		return NULL;
+	}
 
-	__throtl_tg_fill_dev_details(td, tg);
+	throtl_init_group(tg);
 	return tg;
 }
 
@@ -308,18 +464,33 @@ throtl_grp *throtl_find_tg(struct throtl_data *td, struct blkio_cgroup *blkcg)
  */
 static struct throtl_grp * throtl_get_tg(struct throtl_data *td)
 {
-	struct throtl_grp *tg = NULL, *__tg = NULL;
-	struct blkio_cgroup *blkcg;
+	struct throtl_grp *tg = NULL;
+	struct blkio_cgroup *blkcg, *missing;
 	struct request_queue *q = td->queue;
 
 	rcu_read_lock();
+retry:
 	blkcg = task_blkio_cgroup(current);
-	tg = throtl_find_tg(td, blkcg);
-	if (tg) {
+	missing = throtl_missing_ancestor(td, blkcg);
+	if (!missing) {
+		/*
+		 * Some other thread allocated the groups while we were not
+		 * holding queue lock, free up the spare one.
+		 */
+		if (tg)
+			__throtl_free_tg(tg);
+		tg = throtl_find_tg(td, blkcg);
 		rcu_read_unlock();
 		return tg;
 	}
 
+	/* Fill in the topmost missing group and look again */
+	if (tg) {
+		throtl_init_add_tg_lists(td, tg, missing);
+		tg = NULL;
+		goto retry;
+	}
+
 	/*
 	 * Need to allocate a group. Allocation of group also needs allocation
 	 * of per cpu stats which in-turn takes a mutex() and can block. Hence
@@ -340,7 +511,7 @@ static struct throtl_grp * throtl_get_tg(struct throtl_data *td)
 	if (unlikely(test_bit(QUEUE_FLAG_DEAD, &q->queue_flags))) {
 		blk_put_queue(q);
 		if (tg)
-			kfree(tg);
+			__throtl_free_tg(tg);
 
 		return ERR_PTR(-ENODEV);
 	}
@@ -349,33 +520,13 @@ static struct throtl_grp * throtl_get_tg(struct throtl_data *td)
 	/* Group allocated and queue is still alive. take the lock */
 	spin_lock_irq(q->queue_lock);
 
-	/*
-	 * Initialize the new group. After sleeping, read the blkcg again.
-	 */
-	rcu_read_lock();
-	blkcg = task_blkio_cgroup(current);
-
-	/*
-	 * If some other thread already allocated the group while we were
-	 * not holding queue lock, free up the group
-	 */
-	__tg = throtl_find_tg(td, blkcg);
-
-	if (__tg) {
-		kfree(tg);
-		rcu_read_unlock();
-		return __tg;
-	}
-
 	/* Group allocation failed. Account the IO to root group */
-	if (!tg) {
-		tg = td->root_tg;
-		return tg;
-	}
+	if (!tg)
+		return td->root_tg;
 
-	throtl_init_add_tg_lists(td, tg, blkcg);
-	rcu_read_unlock();
-	return tg;
+	/* After sleeping, read the blkcg again. */
+	rcu_read_lock();
+	goto retry;
 }
 
 static struct throtl_grp *throtl_rb_first(struct throtl_rb_root *root)
@@ -563,11 +714,11 @@ throtl_trim_slice(struct throtl_data *td, struct throtl_grp *tg, bool rw)
 
 	if (!nr_slices)
 		return;
-	tmp = tg->bps[rw] * throtl_slice * nr_slices;
+	tmp = tg_bps(td, tg, rw) * throtl_slice * nr_slices;
 	do_div(tmp, HZ);
 	bytes_trim = tmp;
 
-	io_trim = (tg->iops[rw] * throtl_slice * nr_slices)/HZ;
+	io_trim = (tg_iops(td, tg, rw) * throtl_slice * nr_slices)/HZ;
 
 	if (!bytes_trim && !io_trim)
 		return;
@@ -613,7 +764,7 @@ static bool tg_with_in_iops_limit(struct throtl_data *td, struct throtl_grp *tg,
 	 * have been trimmed.
 	 */
 
-	tmp = (u64)tg->iops[rw] * jiffy_elapsed_rnd;
+	tmp = (u64)tg_iops(td, tg, rw) * jiffy_elapsed_rnd;
 	do_div(tmp, HZ);
 
 	if (tmp > UINT_MAX)
@@ -628,7 +779,7 @@ static bool tg_with_in_iops_limit(struct throtl_data *td, struct throtl_grp *tg,
 	}
 
 	/* Calc approx time to dispatch */
-	jiffy_wait = ((tg->io_disp[rw] + 1) * HZ)/tg->iops[rw] + 1;
+	jiffy_wait = ((tg->io_disp[rw] + 1) * HZ)/tg_iops(td, tg, rw) + 1;
 
 	if (jiffy_wait > jiffy_elapsed)
 		jiffy_wait = jiffy_wait - jiffy_elapsed;
@@ -655,7 +806,7 @@ static bool tg_with_in_bps_limit(struct throtl_data *td, struct throtl_grp *tg,
 
 	jiffy_elapsed_rnd = roundup(jiffy_elapsed_rnd, throtl_slice);
 
-	tmp = tg->bps[rw] * jiffy_elapsed_rnd;
+	tmp = tg_bps(td, tg, rw) * jiffy_elapsed_rnd;
 	do_div(tmp, HZ);
 	bytes_allowed = tmp;
 
@@ -667,7 +818,7 @@ static bool tg_with_in_bps_limit(struct throtl_data *td, struct throtl_grp *tg,
 
 	/* Calc approx time to dispatch */
 	extra_bytes = tg->bytes_disp[rw] + bio->bi_size - bytes_allowed;
-	jiffy_wait = div64_u64(extra_bytes * HZ, tg->bps[rw]);
+	jiffy_wait = div64_u64(extra_bytes * HZ, tg_bps(td, tg, rw));
 
 	if (!jiffy_wait)
 		jiffy_wait = 1;
@@ -682,32 +833,28 @@ static bool tg_with_in_bps_limit(struct throtl_data *td, struct throtl_grp *tg,
 	return 0;
 }
 
-static bool tg_no_rule_group(struct throtl_grp *tg, bool rw) {
-	if (tg->bps[rw] == -1 && tg->iops[rw] == -1)
-		return 1;
-	return 0;
+static bool tg_no_rule_group(struct throtl_data *td, struct throtl_grp *tg,
+			bool rw)
+{
+	/* Parent is not known yet, let the locked path sort it out */
+	if (!throtl_tg_linked(tg))
+		return 0;
+
+	for (; tg; tg = tg->parent)
+		if (tg_bps(td, tg, rw) != -1 || tg_iops(td, tg, rw) != -1)
+			return 0;
+	return 1;
 }
 
-/*
- * Returns whether one can dispatch a bio or not. Also returns approx number
- * of jiffies to wait before this bio is with-in IO rate and can be dispatched
- */
-static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
+/* Checks the bio against the limits of @tg alone */
+static bool __tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
 				struct bio *bio, unsigned long *wait)
 {
 	bool rw = bio_data_dir(bio);
 	unsigned long bps_wait = 0, iops_wait = 0, max_wait = 0;
 
-	/*
- 	 * Currently whole state machine of group depends on first bio
-	 * queued in the group bio list. So one should not be calling
-	 * this function with a different bio if there are other bios
-	 * queued.
-	 */
-	BUG_ON(tg->nr_queued[rw] && bio != bio_list_peek(&tg->bio_lists[rw]));
-
 	/* If tg->bps = -1, then BW is unlimited */
-	if (tg->bps[rw] == -1 && tg->iops[rw] == -1) {
+	if (tg_bps(td, tg, rw) == -1 && tg_iops(td, tg, rw) == -1) {
 		if (wait)
 			*wait = 0;
 		return 1;
@@ -743,16 +890,198 @@ static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
 	return 0;
 }
 
+/*
+ * Returns whether one can dispatch a bio or not. Also returns approx number
+ * of jiffies to wait before this bio is with-in IO rate of the group and
+ * all its ancestors and can be dispatched
+ */
+static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
+				struct bio *bio, unsigned long *wait)
+{
+	bool rw = bio_data_dir(bio);
+	unsigned long tg_wait, max_wait = 0;
+	bool ret = 1;
+
+	/*
+ 	 * Currently whole state machine of group depends on first bio
+	 * queued in the group bio list. So one should not be calling
+	 * this function with a different bio if there are other bios
+	 * queued.
+	 */
+	BUG_ON(tg->nr_queued[rw] && bio != bio_list_peek(&tg->bio_lists[rw]));
+
+	for (; tg; tg = tg->parent) {
+		if (__tg_may_dispatch(td, tg, bio, &tg_wait))
+			continue;
+		ret = 0;
+		max_wait = max(max_wait, tg_wait);
+	}
+
+	if (wait)
+		*wait = max_wait;
+	return ret;
+}
+
 static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
 {
 	bool rw = bio_data_dir(bio);
 	bool sync = bio->bi_rw & REQ_SYNC;
 
-	/* Charge the bio to the group */
-	tg->bytes_disp[rw] += bio->bi_size;
-	tg->io_disp[rw]++;
-
 	blkiocg_update_dispatch_stats(&tg->blkg, bio->bi_size, rw, sync);
+
+	/* Charge the bio to the group and everything above it */
+	for (; tg; tg = tg->parent) {
+		tg->bytes_disp[rw] += bio->bi_size;
+		tg->io_disp[rw]++;
+	}
+}
+
+static void
+throtl_trim_slices(struct throtl_data *td, struct throtl_grp *tg, bool rw)
+{
+	for (; tg; tg = tg->parent)
+		throtl_trim_slice(td, tg, rw);
+}
+
+/*
+ * Lockless fast path: let the bio through against this cpu's tokens.
+ * Bios never overtake ones already queued in the same direction.
+ */
+static bool throtl_tg_use_cpu_tokens(struct throtl_grp *tg, struct bio *bio)
+{
+	bool rw = bio_data_dir(bio);
+	struct throtl_grp_cpu *tc;
+	unsigned long flags;
+	bool ret = false;
+
+	if (tg->nr_queued[rw])
+		return false;
+
+	local_irq_save(flags);
+	tc = per_cpu_ptr(tg->cpu_tokens, smp_processor_id());
+	if (tc->ios[rw] && tc->bytes[rw] >= bio->bi_size &&
+	    tc->gen[rw] == atomic_read(&tg->tokens_gen) &&
+	    time_before(jiffies, tc->expires[rw])) {
+		tc->ios[rw]--;
+		tc->bytes[rw] -= bio->bi_size;
+		ret = true;
+	}
+	local_irq_restore(flags);
+
+	return ret;
+}
+
+/*
+ * Clamp @bytes and @ios to a batch out of what @tg may still dispatch in
+ * its current slice. Returns false if nothing is left.
+ */
+static bool throtl_tg_batch(struct throtl_data *td, struct throtl_grp *tg,
+			bool rw, uint64_t *bytes, unsigned int *ios)
+{
+	unsigned long jiffy_elapsed_rnd = jiffies - tg->slice_start[rw];
+	uint64_t bps = tg_bps(td, tg, rw), allowed, tmp;
+	unsigned int iops = tg_iops(td, tg, rw);
+
+	if (!jiffy_elapsed_rnd)
+		jiffy_elapsed_rnd = throtl_slice;
+	jiffy_elapsed_rnd = roundup(jiffy_elapsed_rnd, throtl_slice);
+
+	if (bps != -1) {
+		tmp = bps * jiffy_elapsed_rnd;
+		do_div(tmp, HZ);
+		allowed = tmp;
+		if (allowed <= tg->bytes_disp[rw])
+			return false;
+
+		tmp = bps * throtl_slice;
+		do_div(tmp, HZ);
+		*bytes = min3(*bytes, allowed - tg->bytes_disp[rw],
+			      tmp >> THROTL_CPU_BATCH_SHIFT);
+		if (!*bytes)
+			return false;
+	}
+
+	if (iops != -1) {
+		tmp = (u64)iops * jiffy_elapsed_rnd;
+		do_div(tmp, HZ);
+		allowed = min_t(u64, tmp, UINT_MAX);
+		if (allowed <= tg->io_disp[rw])
+			return false;
+
+		tmp = (u64)iops * throtl_slice;
+		do_div(tmp, HZ);
+		*ios = min_t(u64, *ios, min(allowed - tg->io_disp[rw],
+					       tmp >> THROTL_CPU_BATCH_SHIFT));
+		if (!*ios)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Give back whatever is left of this cpu's batch. The batch was charged up
+ * front, so unused tokens would otherwise count as dispatched for the rest
+ * of the slice. Stale tokens belong to a slice that has moved on already
+ * and are just dropped. Called with the queue lock held.
+ */
+static void
+throtl_tg_return_cpu_tokens(struct throtl_data *td, struct throtl_grp *tg,
+			    bool rw)
+{
+	struct throtl_grp_cpu *tc;
+	struct throtl_grp *t;
+
+	/* irqs are off under the queue lock, so the fast path can't race */
+	tc = per_cpu_ptr(tg->cpu_tokens, smp_processor_id());
+
+	if (tc->gen[rw] == atomic_read(&tg->tokens_gen) &&
+	    time_before(jiffies, tc->expires[rw])) {
+		/* the slice may have been trimmed meanwhile, don't underflow */
+		for (t = tg; t; t = t->parent) {
+			if (tg_bps(td, t, rw) != -1)
+				t->bytes_disp[rw] -= min(t->bytes_disp[rw],
+							 tc->bytes[rw]);
+			if (tg_iops(td, t, rw) != -1)
+				t->io_disp[rw] -= min(t->io_disp[rw],
+						      tc->ios[rw]);
+		}
+	}
+
+	tc->bytes[rw] = 0;
+	tc->ios[rw] = 0;
+}
+
+/*
+ * Hand this cpu a batch of tokens out of what the group and its ancestors
+ * may still dispatch in the current slice, charging them up front.
+ * Called with the queue lock held and the bio already charged.
+ */
+static void
+throtl_tg_refill_cpu_tokens(struct throtl_data *td, struct throtl_grp *tg,
+			    bool rw)
+{
+	uint64_t bytes = -1;
+	unsigned int ios = -1;
+	struct throtl_grp_cpu *tc;
+	struct throtl_grp *t;
+
+	for (t = tg; t; t = t->parent)
+		if (!throtl_tg_batch(td, t, rw, &bytes, &ios))
+			return;
+
+	for (t = tg; t; t = t->parent) {
+		if (tg_bps(td, t, rw) != -1)
+			t->bytes_disp[rw] += bytes;
+		if (tg_iops(td, t, rw) != -1)
+			t->io_disp[rw] += ios;
+	}
+
+	tc = per_cpu_ptr(tg->cpu_tokens, smp_processor_id());
+	tc->bytes[rw] = bytes;
+	tc->ios[rw] = ios;
+	tc->expires[rw] = jiffies + throtl_slice;
+	tc->gen[rw] = atomic_read(&tg->tokens_gen);
 }
 
 static void throtl_add_bio_tg(struct throtl_data *td, struct throtl_grp *tg,
@@ -810,7 +1139,7 @@ static void tg_dispatch_one_bio(struct throtl_data *td, struct throtl_grp *tg,
 	bio_list_add(bl, bio);
 	bio->bi_rw |= (1 << BIO_RW_THROTTLED);
 
-	throtl_trim_slice(td, tg, rw);
+	throtl_trim_slices(td, tg, rw);
 }
 
 static int throtl_dispatch_tg(struct throtl_data *td, struct throtl_grp *tg,
@@ -877,10 +1206,71 @@ static int throtl_select_dispatch(struct throtl_data *td, struct bio_list *bl)
 	return nr_disp;
 }
 
+/* Should be called with queue lock held */
+static void throtl_set_limit_index(struct throtl_data *td, int index)
+{
+	struct throtl_grp *tg;
+	struct hlist_node *pos;
+
+	td->lat_good_windows = 0;
+	if (td->limit_index == index)
+		return;
+
+	throtl_log(td, "%s limits lat_baseline=%llu",
+			index == THROTL_LIMIT_LOW ? "low" : "max",
+			td->lat_baseline);
+
+	/* Restart all slices at the new rates */
+	td->limit_index = index;
+	hlist_for_each_entry(tg, pos, &td->tg_list, tg_node) {
+		atomic_inc(&tg->tokens_gen);
+		tg->limits_changed = true;
+	}
+	td->limits_changed = true;
+	throtl_schedule_delayed_work(td, 0);
+}
+
+/*
+ * Called once per window with queue lock held. As long as requests
+ * complete close to the idle latency of the device, groups may run up to
+ * their max limits. Once latency climbs, the device is contended and the
+ * groups which have a low limit are pushed back to it. They are let go
+ * again after the device has been calm for a few windows.
+ */
+static void throtl_lat_window(struct throtl_data *td)
+{
+	u64 lat = 0;
+
+	if (td->lat_nr >= THROTL_LAT_MIN_SAMPLES) {
+		lat = div_u64(td->lat_sum, td->lat_nr);
+
+		/* Idle baseline, old minima are forgotten slowly */
+		if (!td->lat_baseline || lat < td->lat_baseline)
+			td->lat_baseline = lat;
+		else
+			td->lat_baseline += (lat - td->lat_baseline) >> 8;
+	}
+
+	if (td->limit_index == THROTL_LIMIT_MAX) {
+		if (td->nr_low_grps &&
+		    lat > td->lat_baseline * THROTL_LAT_FACTOR)
+			throtl_set_limit_index(td, THROTL_LIMIT_LOW);
+	} else if (lat <= td->lat_baseline * THROTL_LAT_FACTOR) {
+		if (++td->lat_good_windows >= THROTL_UPGRADE_WINDOWS)
+			throtl_set_limit_index(td, THROTL_LIMIT_MAX);
+	} else
+		td->lat_good_windows = 0;
+
+	td->lat_sum = 0;
+	td->lat_nr = 0;
+	td->lat_window_end = jiffies + throtl_slice;
+}
+
 static void throtl_process_limit_change(struct throtl_data *td)
 {
 	struct throtl_grp *tg;
 	struct hlist_node *pos, *n;
+	unsigned int nr_low_grps = 0;
 	int ret;
 
 	if (!td->limits_changed)
@@ -891,6 +1281,9 @@ static void throtl_process_limit_change(struct throtl_data *td)
 	throtl_log(td, "limits changed");
 
 	hlist_for_each_entry_safe(tg, pos, n, &td->tg_list, tg_node) {
+		if (tg_has_low(tg))
+			nr_low_grps++;
+
 		if (!tg->limits_changed)
 			continue;
 
@@ -909,7 +1302,18 @@ static void throtl_process_limit_change(struct throtl_data *td)
 		 */
 		throtl_start_new_slice(td, tg, 0);
 		throtl_start_new_slice(td, tg, 1);
+	}
+
+	td->nr_low_grps = nr_low_grps;
+	if (!nr_low_grps)
+		throtl_set_limit_index(td, THROTL_LIMIT_MAX);
 
+	/*
+	 * Limits of a group also bind its descendants, so void everybody's
+	 * tokens and recompute every dispatch time.
+	 */
+	hlist_for_each_entry_safe(tg, pos, n, &td->tg_list, tg_node) {
+		atomic_inc(&tg->tokens_gen);
 		if (throtl_tg_on_rr(tg))
 			tg_update_disptime(td, tg);
 	}
@@ -994,6 +1398,16 @@ throtl_destroy_tg(struct throtl_data *td, struct throtl_grp *tg)
 
 	hlist_del_init(&tg->tg_node);
 
+	/*
+	 * Uncount the group right away as well, and have the next limit
+	 * change recount them exactly.
+	 */
+	if (tg_has_low(tg)) {
+		if (td->nr_low_grps && !--td->nr_low_grps)
+			throtl_set_limit_index(td, THROTL_LIMIT_MAX);
+		td->limits_changed = true;
+	}
+
 	/*
 	 * Put the reference taken at the time of creation so that when all
 	 * queues are gone, group can be destroyed.
@@ -1052,6 +1466,8 @@ static void throtl_update_blkio_group_common(struct throtl_data *td,
 {
 	int ret;
 
+	/* tokens handed out under the old limits are void */
+	atomic_inc(&tg->tokens_gen);
 	ret = xchg(&tg->limits_changed, true);
 	ret = xchg(&td->limits_changed, true);
 	/* Schedule a work now to process the limit change */
@@ -1107,6 +1523,46 @@ static void throtl_update_blkio_group_write_iops(void *key,
 	throtl_update_blkio_group_common(td, tg);
 }
 
+static void throtl_update_blkio_group_read_bps_low(void *key,
+				struct blkio_group *blkg, u64 read_bps)
+{
+	struct throtl_data *td = key;
+	struct throtl_grp *tg = tg_of_blkg(blkg);
+
+	tg->bps_low[READ] = read_bps;
+	throtl_update_blkio_group_common(td, tg);
+}
+
+static void throtl_update_blkio_group_write_bps_low(void *key,
+				struct blkio_group *blkg, u64 write_bps)
+{
+	struct throtl_data *td = key;
+	struct throtl_grp *tg = tg_of_blkg(blkg);
+
+	tg->bps_low[WRITE] = write_bps;
+	throtl_update_blkio_group_common(td, tg);
+}
+
+static void throtl_update_blkio_group_read_iops_low(void *key,
+			struct blkio_group *blkg, unsigned int read_iops)
+{
+	struct throtl_data *td = key;
+	struct throtl_grp *tg = tg_of_blkg(blkg);
+
+	tg->iops_low[READ] = read_iops;
+	throtl_update_blkio_group_common(td, tg);
+}
+
+static void throtl_update_blkio_group_write_iops_low(void *key,
+			struct blkio_group *blkg, unsigned int write_iops)
+{
+	struct throtl_data *td = key;
+	struct throtl_grp *tg = tg_of_blkg(blkg);
+
+	tg->iops_low[WRITE] = write_iops;
+	throtl_update_blkio_group_common(td, tg);
+}
+
 static void throtl_shutdown_wq(struct request_queue *q)
 {
 	struct throtl_data *td = q->td;
@@ -1125,6 +1581,14 @@ static struct blkio_policy_type blkio_policy_throtl = {
 					throtl_update_blkio_group_read_iops,
 		.blkio_update_group_write_iops_fn =
 					throtl_update_blkio_group_write_iops,
+		.blkio_update_group_read_bps_low_fn =
+					throtl_update_blkio_group_read_bps_low,
+		.blkio_update_group_write_bps_low_fn =
+					throtl_update_blkio_group_write_bps_low,
+		.blkio_update_group_read_iops_low_fn =
+					throtl_update_blkio_group_read_iops_low,
+		.blkio_update_group_write_iops_low_fn =
+					throtl_update_blkio_group_write_iops_low,
 	},
 	.plid = BLKIO_POLICY_THROTL,
 };
@@ -1154,7 +1618,8 @@ int blk_throtl_bio(struct request_queue *q, struct bio **biop)
 	if (tg) {
 		throtl_tg_fill_dev_details(td, tg);
 
-		if (tg_no_rule_group(tg, rw)) {
+		if (tg_no_rule_group(td, tg, rw) ||
+		    throtl_tg_use_cpu_tokens(tg, bio)) {
 			blkiocg_update_dispatch_stats(&tg->blkg, bio->bi_size,
 					rw, bio->bi_rw & REQ_SYNC);
 			rcu_read_unlock();
@@ -1164,8 +1629,8 @@ int blk_throtl_bio(struct request_queue *q, struct bio **biop)
 	rcu_read_unlock();
 
 	/*
-	 * Either group has not been allocated yet or it is not an unlimited
-	 * IO group
+	 * Either group has not been allocated yet, or it is not an unlimited
+	 * IO group and this cpu has run out of tokens
 	 */
 
 	spin_lock_irq(q->queue_lock);
@@ -1190,6 +1655,9 @@ int blk_throtl_bio(struct request_queue *q, struct bio **biop)
 
 	}
 
+	/* This cpu's leftovers didn't cover the bio, let it use them here */
+	throtl_tg_return_cpu_tokens(td, tg, rw);
+
 	/* Bio is with-in rate limit of group */
 	if (tg_may_dispatch(td, tg, bio, NULL)) {
 		throtl_charge_bio(tg, bio);
@@ -1205,7 +1673,8 @@ int blk_throtl_bio(struct request_queue *q, struct bio **biop)
 		 *
 		 * So keep on trimming slice even if bio is not queued.
 		 */
-		throtl_trim_slice(td, tg, rw);
+		throtl_trim_slices(td, tg, rw);
+		throtl_tg_refill_cpu_tokens(td, tg, rw);
 		goto out;
 	}
 
@@ -1213,8 +1682,8 @@ queue_bio:
 	throtl_log_tg(td, tg, "[%c] bio. bdisp=%u sz=%u bps=%llu"
 			" iodisp=%u iops=%u queued=%d/%d",
 			rw == READ ? 'R' : 'W',
-			tg->bytes_disp[rw], bio->bi_size, tg->bps[rw],
-			tg->io_disp[rw], tg->iops[rw],
+			tg->bytes_disp[rw], bio->bi_size, tg_bps(td, tg, rw),
+			tg->io_disp[rw], tg_iops(td, tg, rw),
 			tg->nr_queued[READ], tg->nr_queued[WRITE]);
 
 	throtl_add_bio_tg(q->td, tg, bio);
@@ -1230,6 +1699,28 @@ out:
 	return 0;
 }
 
+/*
+ * Feed the completion latency of a request into the current window.
+ * Called with queue lock held.
+ */
+void blk_throtl_rq_done(struct request *rq)
+{
+	struct throtl_data *td = rq->q->td;
+	u64 start = rq_io_start_time_ns(rq), now;
+
+	if (!td || !td->nr_low_grps || rq->cmd_type != REQ_TYPE_FS || !start)
+		return;
+
+	now = sched_clock();
+	if (now > start) {
+		td->lat_sum += now - start;
+		td->lat_nr++;
+	}
+
+	if (time_after_eq(jiffies, td->lat_window_end))
+		throtl_lat_window(td);
+}
+
 int blk_throtl_init(struct request_queue *q)
 {
 	struct throtl_data *td;
@@ -1242,6 +1733,7 @@ int blk_throtl_init(struct request_queue *q)
 	INIT_HLIST_HEAD(&td->tg_list);
 	td->tg_service_tree = THROTL_RB_ROOT;
 	td->limits_changed = false;
+	td->limit_index = THROTL_LIMIT_MAX;
 	INIT_DELAYED_WORK(&td->throtl_work, blk_throtl_work);
 
 	/* alloc and Init root group. */
@@ -22,6 +22,8 @@ static const int write_expire = 5 * HZ; /* ditto for writes, these limits are SO
 static const int writes_starved = 2;    /* max times reads can starve a write */
 static const int fifo_batch = 16;       /* # of sequential requests treated as one
 				     by the above parameters. For throughput. */
+static const int ssd_depth = 32;	/* batch size if the tag depth is unknown */
+static const int ssd_max_depth = 4096;
 
 struct deadline_data {
 	/*
@@ -41,6 +43,7 @@ struct deadline_data {
 	unsigned int batching;		/* number of sequential requests made */
 	sector_t last_sector;		/* head position */
 	unsigned int starved;		/* times reads have starved writes */
+	int tokens[2];			/* ssd batch budget left per direction */
 
 	/*
 	 * settings that change how the i/o scheduler behaves
@@ -49,8 +52,20 @@ struct deadline_data {
 	int fifo_batch;
 	int writes_starved;
 	int front_merges;
+	int ssd_batch;
+	int batch_depth;
 };
 
+/*
+ * On non-rotational devices sector order does not matter. Requests are
+ * dispatched oldest first in batches which fill the device queue.
+ */
+static inline int deadline_ssd_mode(struct request_queue *q,
+				    struct deadline_data *dd)
+{
+	return dd->ssd_batch && blk_queue_nonrot(q);
+}
+
 static void deadline_move_request(struct deadline_data *, struct request *);
 
 static inline struct rb_root *
@@ -129,9 +144,9 @@ deadline_merge(struct request_queue *q, struct request **req, struct bio *bio)
 	int ret;
 
 	/*
-	 * check for front merge
+	 * check for front merge, not worth the lookup on ssds
 	 */
-	if (dd->front_merges) {
+	if (dd->front_merges && !deadline_ssd_mode(q, dd)) {
 		sector_t sector = bio->bi_sector + bio_sectors(bio);
 
 		__rq = elv_rb_find(&dd->sort_list[bio_data_dir(bio)], sector);
@@ -236,6 +251,78 @@ static inline int deadline_check_fifo(struct deadline_data *dd, int ddir)
 	return 0;
 }
 
+/*
+ * Number of requests the device takes, from its tag map if the block layer
+ * does the tagging.
+ */
+static int deadline_batch_depth(struct request_queue *q,
+				struct deadline_data *dd)
+{
+	if (dd->batch_depth)
+		return dd->batch_depth;
+	if (blk_queue_tagged(q) && q->queue_tags)
+		return q->queue_tags->max_depth;
+	return ssd_depth;
+}
+
+/*
+ * Pick the direction of the next request of an ssd batch. Reads get
+ * writes_starved times the write budget, a new round starts when every
+ * direction with requests has used up its budget.
+ */
+static int deadline_ssd_dir(struct request_queue *q, struct deadline_data *dd)
+{
+	const int reads = !list_empty(&dd->fifo_list[READ]);
+	const int writes = !list_empty(&dd->fifo_list[WRITE]);
+	int depth;
+
+	if (!reads && !writes)
+		return -1;
+
+	if (reads && dd->tokens[READ] > 0)
+		return READ;
+	if (writes && dd->tokens[WRITE] > 0)
+		return WRITE;
+
+	depth = deadline_batch_depth(q, dd);
+	dd->tokens[READ] = min_t(long long, (long long)depth *
+				 max(dd->writes_starved, 1), INT_MAX);
+	dd->tokens[WRITE] = depth;
+	return reads ? READ : WRITE;
+}
+
+/*
+ * Fill the room left in the device queue with requests in fifo order, no
+ * sort order to follow and no expiry to check.
+ */
+static int deadline_dispatch_batch(struct request_queue *q,
+				   struct deadline_data *dd)
+{
+	int room = deadline_batch_depth(q, dd) - queue_in_flight(q);
+	int dispatched = 0;
+	int data_dir;
+
+	/*
+	 * We are only asked once the dispatch queue has run dry, and a forced
+	 * drain keeps asking until we return 0: always hand out at least one
+	 * request, even with the device full, or the rest would be stranded.
+	 */
+	room = max(room, 1);
+
+	while (dispatched < room) {
+		data_dir = deadline_ssd_dir(q, dd);
+		if (data_dir < 0)
+			break;
+
+		dd->tokens[data_dir]--;
+		deadline_move_request(dd,
+			rq_entry_fifo(dd->fifo_list[data_dir].next));
+		dispatched++;
+	}
+
+	return dispatched;
+}
+
 /*
  * deadline_dispatch_requests selects the best request according to
  * read/write expire, fifo_batch, etc
@@ -248,6 +335,9 @@ static int deadline_dispatch_requests(struct request_queue *q, int force)
 	struct request *rq;
 	int data_dir;
 
+	if (deadline_ssd_mode(q, dd))
+		return deadline_dispatch_batch(q, dd);
+
 	/*
 	 * batches are currently reads XOR writes
 	 */
@@ -362,6 +452,7 @@ static void *deadline_init_queue(struct request_queue *q)
 	dd->writes_starved = writes_starved;
 	dd->front_merges = 1;
 	dd->fifo_batch = fifo_batch;
+	dd->ssd_batch = 1;
 	return dd;
 }
 
@@ -398,6 +489,8 @@ SHOW_FUNCTION(deadline_write_expire_show, dd->fifo_expire[WRITE], 1);
 SHOW_FUNCTION(deadline_writes_starved_show, dd->writes_starved, 0);
 SHOW_FUNCTION(deadline_front_merges_show, dd->front_merges, 0);
 SHOW_FUNCTION(deadline_fifo_batch_show, dd->fifo_batch, 0);
+SHOW_FUNCTION(deadline_ssd_batch_show, dd->ssd_batch, 0);
+SHOW_FUNCTION(deadline_batch_depth_show, dd->batch_depth, 0);
 #undef SHOW_FUNCTION
 
 #define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
@@ -421,6 +514,8 @@ STORE_FUNCTION(deadline_write_expire_store, &dd->fifo_expire[WRITE], 0, INT_MAX,
 STORE_FUNCTION(deadline_writes_starved_store, &dd->writes_starved, INT_MIN, INT_MAX, 0);
 STORE_FUNCTION(deadline_front_merges_store, &dd->front_merges, 0, 1, 0);
 STORE_FUNCTION(deadline_fifo_batch_store, &dd->fifo_batch, 0, INT_MAX, 0);
+STORE_FUNCTION(deadline_ssd_batch_store, &dd->ssd_batch, 0, 1, 0);
+STORE_FUNCTION(deadline_batch_depth_store, &dd->batch_depth, 0, ssd_max_depth, 0);
 #undef STORE_FUNCTION
 
 #define DD_ATTR(name) \
@@ -433,6 +528,8 @@ static struct elv_fs_entry deadline_attrs[] = {
 	DD_ATTR(writes_starved),
 	DD_ATTR(front_merges),
 	DD_ATTR(fifo_batch),
+	DD_ATTR(ssd_batch),
+	DD_ATTR(batch_depth),
 	__ATTR_NULL
 };
 
@@ -903,6 +903,73 @@ static ssize_t disk_discard_alignment_show(struct device *dev,
 	return sprintf(buf, "%d\n", queue_discard_alignment(disk->queue));
 }
 
+/**
+ * blk_lat_hist_print - format a latency histogram
+ * @hist: histogram to print
+ * @prefix: put in front of every line
+ * @buf: buffer to print into
+ * @size: size of @buf
+ *
+ * Prints one line each for queue, service and total time of read, write
+ * and sync requests.  Returns the number of characters written.
+ */
+int blk_lat_hist_print(struct blk_lat_hist *hist, const char *prefix,
+		       char *buf, int size)
+{
+	static const char * const type_name[BLK_LAT_NR_TYPES] = {
+		"queue", "service", "total" };
+	static const char * const row_name[] = { "read", "write", "sync" };
+	int type, row, i, len = 0;
+
+	for (type = 0; type < BLK_LAT_NR_TYPES; type++) {
+		unsigned long (*c)[2][BLK_LAT_HIST_BUCKETS] = hist->count[type];
+
+		for (row = 0; row < ARRAY_SIZE(row_name); row++) {
+			len += scnprintf(buf + len, size - len, "%s%s_%s",
+					 prefix, type_name[type],
+					 row_name[row]);
+			for (i = 0; i < BLK_LAT_HIST_BUCKETS; i++) {
+				unsigned long val;
+
+				if (row == 2)
+					val = c[READ][1][i] + c[WRITE][1][i];
+				else
+					val = c[row][0][i] + c[row][1][i];
+				len += scnprintf(buf + len, size - len,
+						 " %lu", val);
+			}
+			len += scnprintf(buf + len, size - len, "\n");
+		}
+	}
+	return len;
+}
+EXPORT_SYMBOL_GPL(blk_lat_hist_print);
+
+static ssize_t disk_lat_hist_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct gendisk *disk = dev_to_disk(dev);
+	struct blk_lat_hist *hist;
+	unsigned long *sum, *count;
+	int cpu, i;
+	ssize_t ret;
+
+	hist = kzalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+
+	sum = &hist->count[0][0][0][0];
+	for_each_possible_cpu(cpu) {
+		count = &per_cpu_ptr(disk->lat_hist, cpu)->count[0][0][0][0];
+		for (i = 0; i < sizeof(*hist) / sizeof(*sum); i++)
+			sum[i] += count[i];
+	}
+
+	ret = blk_lat_hist_print(hist, "", buf, PAGE_SIZE);
+	kfree(hist);
+	return ret;
+}
+
 static ssize_t eio_show(struct device *dev,
 			struct device_attribute *attr,
 			char *buf);
@@ -921,6 +988,7 @@ static DEVICE_ATTR(discard_alignment, S_IRUGO, disk_discard_alignment_show,
 static DEVICE_ATTR(capability, S_IRUGO, disk_capability_show, NULL);
 static DEVICE_ATTR(stat, S_IRUGO, part_stat_show, NULL);
 static DEVICE_ATTR(inflight, S_IRUGO, part_inflight_show, NULL);
+static DEVICE_ATTR(latency_histogram, S_IRUGO, disk_lat_hist_show, NULL);
 #ifdef CONFIG_FAIL_MAKE_REQUEST
 static struct device_attribute dev_attr_fail =
 	__ATTR(make-it-fail, S_IRUGO|S_IWUSR, part_fail_show, part_fail_store);
@@ -946,6 +1014,7 @@ static struct attribute *disk_attrs[] = {
 	&dev_attr_capability.attr,
 	&dev_attr_stat.attr,
 	&dev_attr_inflight.attr,
+	&dev_attr_latency_histogram.attr,
 #ifdef CONFIG_FAIL_MAKE_REQUEST
 	&dev_attr_fail.attr,
 #endif
@@ -1099,6 +1168,7 @@ static void disk_release(struct device *dev)
 	kfree(disk->random);
 	disk_replace_part_tbl(disk, NULL);
 	free_part_stats(&disk->part0);
+	free_percpu(disk->lat_hist);
 	kfree(disk);
 }
 struct class block_class = {
@@ -1275,8 +1345,15 @@ struct gendisk *alloc_disk_node(int minors, int node_id)
 			kfree(disk);
 			return NULL;
 		}
+		disk->lat_hist = alloc_percpu(struct blk_lat_hist);
+		if (!disk->lat_hist) {
+			free_part_stats(&disk->part0);
+			kfree(disk);
+			return NULL;
+		}
 		disk->node_id = node_id;
 		if (disk_expand_part_tbl(disk, 0)) {
+			free_percpu(disk->lat_hist);
 			free_part_stats(&disk->part0);
 			kfree(disk);
 			return NULL;
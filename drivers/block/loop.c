@@ -43,6 +43,9 @@
  * operations write_begin is not available on the backing filesystem.
  * Anton Altaparmakov, 16 Feb 2005
  *
+ * Multiple worker threads per device, and direct I/O remapping bios onto the
+ * blocks backing the file instead of copying through its page cache.
+ *
  * Still To Fix:
  * - Advisory locking is ignored here.
  * - Should use an own CAP_* category instead of CAP_SYS_ADMIN
@@ -74,6 +77,9 @@
 #include <linux/gfp.h>
 #include <linux/kthread.h>
 #include <linux/splice.h>
+#include <linux/mempool.h>
+#include <linux/vmalloc.h>
+#include <linux/fiemap.h>
 
 #include <asm/uaccess.h>
 
@@ -82,6 +88,7 @@ static DEFINE_MUTEX(loop_devices_mutex);
 
 static int max_part;
 static int part_shift;
+static int nr_workers = 4;
 
 /*
  * Transfer functions
@@ -505,6 +512,452 @@ out:
 	return ret;
 }
 
+/*
+ * Direct I/O
+ *
+ * With LO_FLAGS_DIRECT_IO the blocks backing the file are looked up once
+ * with bmap, the way swapon does it, and bios are remapped onto the block
+ * device underneath straight from loop_make_request.  Nothing is copied
+ * through the page cache of the backing file, and as many bios can be in
+ * flight as the underlying device accepts.
+ *
+ * Only files on filesystems flagged FS_STABLE_BMAP qualify, and only if
+ * every block is allocated and written: reads of preallocated, unwritten
+ * extents would return stale disk contents and writes to them would stay
+ * invisible to the filesystem.  Like a swapfile, the backing file is
+ * marked S_SWAPFILE while direct I/O is on, so that it can be neither
+ * truncated nor have its blocks moved underneath us.
+ */
+struct loop_dio {
+	struct bio		*orig;
+	struct loop_device	*lo;
+	atomic_t		remaining;
+	int			error;
+};
+
+#define LOOP_DIO_POOL_SIZE	64
+/*
+ * Clones of one bio are all held on current->bio_list until our
+ * make_request returns, so bios that need more than a few go to a worker,
+ * where each clone is sent down as soon as it is built.
+ */
+#define LOOP_DIO_MAX_CLONES	8
+
+static struct bio_set *loop_bio_set;
+static mempool_t *loop_dio_pool;
+
+static void loop_dio_put(struct loop_dio *dio)
+{
+	struct loop_device *lo = dio->lo;
+
+	if (!atomic_dec_and_test(&dio->remaining))
+		return;
+
+	bio_endio(dio->orig, dio->error);
+	mempool_free(dio, loop_dio_pool);
+
+	if (atomic_dec_and_test(&lo->lo_dio_pending))
+		wake_up_all(&lo->lo_dio_wait);
+}
+
+static void loop_dio_end_io(struct bio *bio, int error)
+{
+	struct loop_dio *dio = bio->bi_private;
+
+	if (error)
+		dio->error = error;
+	bio_put(bio);
+	loop_dio_put(dio);
+}
+
+static void loop_bio_destructor(struct bio *bio)
+{
+	bio_free(bio, loop_bio_set);
+}
+
+static struct loop_extent *
+loop_find_extent(struct loop_device *lo, sector_t sector)
+{
+	struct loop_extent *map = lo->lo_dio_map;
+	unsigned int first = 0, last = lo->lo_dio_nr_extents;
+
+	while (first < last) {
+		unsigned int mid = (first + last) / 2;
+
+		if (sector < map[mid].lstart)
+			last = mid;
+		else if (sector >= map[mid].lstart + map[mid].nr_sects)
+			first = mid + 1;
+		else
+			return &map[mid];
+	}
+	return NULL;
+}
+
+static struct bio *loop_dio_clone(struct loop_device *lo,
+		struct loop_dio *dio, sector_t sector, int nr_vecs)
+{
+	struct bio *clone;
+
+	clone = bio_alloc_bioset(GFP_NOIO, nr_vecs, loop_bio_set);
+	clone->bi_destructor = loop_bio_destructor;
+	clone->bi_sector = sector;
+	clone->bi_bdev = lo->lo_dio_bdev;
+	clone->bi_rw = dio->orig->bi_rw;
+	clone->bi_end_io = loop_dio_end_io;
+	clone->bi_private = dio;
+	atomic_inc(&dio->remaining);
+	return clone;
+}
+
+/*
+ * Whether the bio can be remapped from make_request: a rough upper bound
+ * of its clones, one per extent it spans plus one per piece the underlying
+ * queue may cut it into, has to stay within LOOP_DIO_MAX_CLONES.
+ */
+static int loop_dio_inline(struct loop_device *lo, struct bio *bio)
+{
+	struct request_queue *q = bdev_get_queue(lo->lo_dio_bdev);
+	sector_t sector = bio->bi_sector + (lo->lo_offset >> 9);
+	struct loop_extent *first, *last;
+	unsigned int nr;
+
+	if (!bio->bi_size)
+		return 1;
+	first = loop_find_extent(lo, sector);
+	last = loop_find_extent(lo, sector + bio_sectors(bio) - 1);
+	if (!first || !last)
+		return 1;	/* fails right away */
+
+	nr = last - first + 1;
+	nr += bio_sectors(bio) / queue_max_sectors(q);
+	nr += bio->bi_vcnt / queue_max_segments(q);
+	return nr <= LOOP_DIO_MAX_CLONES;
+}
+
+/*
+ * Split the bio at extent boundaries and whatever the underlying queue
+ * does not take in one piece, and send the pieces down.  Flush and FUA
+ * are passed on with every piece.
+ */
+static void loop_submit_direct(struct loop_device *lo, struct bio *bio)
+{
+	struct loop_extent *ext;
+	struct loop_dio *dio;
+	struct bio *clone = NULL;
+	struct bio_vec *bvec;
+	sector_t sector, left = 0;
+	int i;
+
+	dio = mempool_alloc(loop_dio_pool, GFP_NOIO);
+	dio->orig = bio;
+	dio->lo = lo;
+	dio->error = 0;
+	atomic_set(&dio->remaining, 1);
+
+	/* BIO_RW_BARRIER is deprecated */
+	if (bio_rw_flagged(bio, BIO_RW_BARRIER)) {
+		dio->error = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if (!bio->bi_size) {
+		generic_make_request(loop_dio_clone(lo, dio, 0, 0));
+		goto out;
+	}
+
+	sector = bio->bi_sector + (lo->lo_offset >> 9);
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned int offset = bvec->bv_offset;
+		unsigned int len = bvec->bv_len;
+
+		while (len) {
+			unsigned int size = len;
+
+			if (!clone) {
+				ext = loop_find_extent(lo, sector);
+				if (unlikely(!ext)) {
+					dio->error = -EIO;
+					goto out;
+				}
+				left = ext->lstart + ext->nr_sects - sector;
+				clone = loop_dio_clone(lo, dio,
+						ext->pstart + sector - ext->lstart,
+						bio->bi_vcnt - i);
+			}
+			if (size > left << 9)
+				size = left << 9;
+
+			if (bio_add_page(clone, bvec->bv_page, size,
+					 offset) < size) {
+				if (unlikely(!clone->bi_size)) {
+					loop_dio_end_io(clone, -EIO);
+					goto out;
+				}
+				generic_make_request(clone);
+				clone = NULL;
+				continue;
+			}
+
+			offset += size;
+			len -= size;
+			sector += size >> 9;
+			left -= size >> 9;
+			if (!left) {
+				generic_make_request(clone);
+				clone = NULL;
+			}
+		}
+	}
+	if (clone)
+		generic_make_request(clone);
+out:
+	loop_dio_put(dio);
+}
+
+static int loop_dio_map_bdev(struct loop_device *lo, struct inode *inode)
+{
+	struct loop_extent *map;
+
+	map = vmalloc(sizeof(*map));
+	if (!map)
+		return -ENOMEM;
+
+	map->lstart = 0;
+	map->pstart = 0;
+	map->nr_sects = i_size_read(inode) >> 9;
+	lo->lo_dio_map = map;
+	lo->lo_dio_nr_extents = 1;
+	return 0;
+}
+
+static int loop_dio_map_file(struct loop_device *lo, struct inode *inode)
+{
+	unsigned int blkbits = inode->i_blkbits;
+	unsigned int sects = 1 << (blkbits - 9);
+	sector_t block, nr_blocks;
+	struct loop_extent *map = NULL, *ext = NULL;
+	unsigned int nr = 0, max = 0;
+
+	nr_blocks = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+	for (block = 0; block < nr_blocks; block++) {
+		sector_t pblock;
+
+		cond_resched();
+
+		pblock = bmap(inode, block);
+		if (!pblock)
+			goto fail;	/* hole, or bmap not really supported */
+
+		if (ext && ext->pstart + ext->nr_sects == pblock * sects) {
+			ext->nr_sects += sects;
+			continue;
+		}
+
+		if (nr == max) {
+			struct loop_extent *new;
+
+			max = max ? max * 2 : 64;
+			new = vmalloc(max * sizeof(*new));
+			if (!new) {
+				vfree(map);
+				return -ENOMEM;
+			}
+			if (map)
+				memcpy(new, map, nr * sizeof(*new));
+			vfree(map);
+			map = new;
+		}
+		ext = &map[nr++];
+		ext->lstart = block * sects;
+		ext->pstart = pblock * sects;
+		ext->nr_sects = sects;
+	}
+	if (!nr)
+		goto fail;
+
+	lo->lo_dio_map = map;
+	lo->lo_dio_nr_extents = nr;
+	return 0;
+
+fail:
+	vfree(map);
+	return -EINVAL;
+}
+
+#define LOOP_FIEMAP_EXTENTS	32
+
+/*
+ * Refuse files with holes or with extents that are anything but plain,
+ * written blocks, as reported by ->fiemap.
+ */
+static int loop_dio_check_extents(struct inode *inode)
+{
+	struct fiemap_extent_info fieinfo;
+	struct fiemap_extent *extents;
+	u64 start = 0, len = i_size_read(inode);
+	mm_segment_t old_fs;
+	int error = 0;
+
+	if (!inode->i_op->fiemap)
+		return -EINVAL;
+
+	extents = kmalloc(LOOP_FIEMAP_EXTENTS * sizeof(*extents), GFP_KERNEL);
+	if (!extents)
+		return -ENOMEM;
+
+	while (start < len) {
+		unsigned int i;
+
+		memset(&fieinfo, 0, sizeof(fieinfo));
+		fieinfo.fi_extents_max = LOOP_FIEMAP_EXTENTS;
+		fieinfo.fi_extents_start = (struct fiemap_extent __user *)extents;
+
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		error = inode->i_op->fiemap(inode, &fieinfo, start, len - start);
+		set_fs(old_fs);
+		if (error)
+			break;
+
+		error = -EINVAL;
+		if (!fieinfo.fi_extents_mapped)
+			break;		/* hole up to the end */
+		for (i = 0; i < fieinfo.fi_extents_mapped; i++) {
+			struct fiemap_extent *fe = &extents[i];
+
+			if (fe->fe_logical > start)
+				goto out;	/* hole */
+			if (fe->fe_flags &
+			    ~(FIEMAP_EXTENT_LAST | FIEMAP_EXTENT_MERGED))
+				goto out;	/* unwritten, delalloc, ... */
+			start = fe->fe_logical + fe->fe_length;
+			if ((fe->fe_flags & FIEMAP_EXTENT_LAST) && start < len)
+				goto out;
+		}
+		error = 0;
+	}
+out:
+	kfree(extents);
+	return error;
+}
+
+/* Pin the blocks of a backing file the way swapon does */
+static int loop_dio_pin_file(struct inode *inode)
+{
+	int error = 0;
+
+	mutex_lock(&inode->i_mutex);
+	if (IS_SWAPFILE(inode))
+		error = -EBUSY;
+	else
+		inode->i_flags |= S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+	return error;
+}
+
+static void loop_dio_unpin_file(struct inode *inode)
+{
+	mutex_lock(&inode->i_mutex);
+	inode->i_flags &= ~S_SWAPFILE;
+	mutex_unlock(&inode->i_mutex);
+}
+
+/* Called with lo_ctl_mutex held */
+static void loop_dio_stop(struct loop_device *lo)
+{
+	struct inode *inode = lo->lo_backing_file->f_mapping->host;
+
+	spin_lock_irq(&lo->lo_lock);
+	lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+	spin_unlock_irq(&lo->lo_lock);
+
+	wait_event(lo->lo_dio_wait, !atomic_read(&lo->lo_dio_pending));
+
+	if (!S_ISBLK(inode->i_mode))
+		loop_dio_unpin_file(inode);
+	vfree(lo->lo_dio_map);
+	lo->lo_dio_map = NULL;
+	lo->lo_dio_nr_extents = 0;
+	lo->lo_dio_bdev = NULL;
+	blk_queue_logical_block_size(lo->lo_queue, 512);
+}
+
+static int loop_switch_dio(struct loop_device *lo);
+
+static int loop_set_dio(struct loop_device *lo, unsigned long arg)
+{
+	struct file *file = lo->lo_backing_file;
+	struct address_space *mapping;
+	struct block_device *bdev;
+	struct inode *inode;
+	int error;
+
+	if (lo->lo_state != Lo_bound)
+		return -ENXIO;
+	if (!arg == !(lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		return 0;
+	if (!arg) {
+		loop_dio_stop(lo);
+		return 0;
+	}
+
+	/* Data goes to the disk untransformed */
+	if (lo->transfer != transfer_none)
+		return -EINVAL;
+
+	mapping = file->f_mapping;
+	inode = mapping->host;
+	if (S_ISBLK(inode->i_mode))
+		bdev = inode->i_bdev;
+	else if (mapping->a_ops->bmap && inode->i_sb->s_bdev &&
+		 (inode->i_sb->s_type->fs_flags & FS_STABLE_BMAP))
+		bdev = inode->i_sb->s_bdev;
+	else
+		return -EINVAL;
+
+	if (lo->lo_offset & (bdev_logical_block_size(bdev) - 1))
+		return -EINVAL;
+
+	if (S_ISBLK(inode->i_mode)) {
+		error = loop_dio_map_bdev(lo, inode);
+		if (error)
+			return error;
+	} else {
+		error = loop_dio_pin_file(inode);
+		if (error)
+			return error;
+
+		/* Have delayed allocations done before asking for the blocks */
+		error = filemap_write_and_wait(mapping);
+		if (!error)
+			error = loop_dio_check_extents(inode);
+		if (!error)
+			error = loop_dio_map_file(lo, inode);
+		if (error) {
+			loop_dio_unpin_file(inode);
+			return error;
+		}
+	}
+
+	lo->lo_dio_bdev = bdev;
+	blk_queue_logical_block_size(lo->lo_queue,
+				     bdev_logical_block_size(bdev));
+
+	/* Buffered bios drain and the cache is dropped before we flip */
+	error = loop_switch_dio(lo);
+	if (error) {
+		if (!S_ISBLK(inode->i_mode))
+			loop_dio_unpin_file(inode);
+		vfree(lo->lo_dio_map);
+		lo->lo_dio_map = NULL;
+		lo->lo_dio_nr_extents = 0;
+		lo->lo_dio_bdev = NULL;
+		blk_queue_logical_block_size(lo->lo_queue, 512);
+	}
+	return error;
+}
+
 /*
  * Add bio to back of pending list
  */
@@ -536,6 +989,13 @@ static int loop_make_request(struct request_queue *q, struct bio *old_bio)
 		goto out;
 	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
 		goto out;
+	if ((lo->lo_flags & LO_FLAGS_DIRECT_IO) && old_bio->bi_bdev &&
+	    loop_dio_inline(lo, old_bio)) {
+		atomic_inc(&lo->lo_dio_pending);
+		spin_unlock_irq(&lo->lo_lock);
+		loop_submit_direct(lo, old_bio);
+		return 0;
+	}
 	loop_add_bio(lo, old_bio);
 	wake_up(&lo->lo_event);
 	spin_unlock_irq(&lo->lo_lock);
@@ -553,13 +1013,18 @@ out:
 static void loop_unplug(struct request_queue *q)
 {
 	struct loop_device *lo = q->queuedata;
+	struct block_device *bdev = ACCESS_ONCE(lo->lo_dio_bdev);
 
 	queue_flag_clear_unlocked(QUEUE_FLAG_PLUGGED, q);
+	if (bdev)
+		blk_unplug(bdev_get_queue(bdev));
 	blk_run_address_space(lo->lo_backing_file->f_mapping);
 }
 
 struct switch_request {
 	struct file *file;
+	int dio;		/* turn direct I/O on instead */
+	int error;
 	struct completion wait;
 };
 
@@ -568,6 +1033,8 @@ static void do_loop_switch(struct loop_device *, struct switch_request *);
 static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 {
 	if (unlikely(!bio->bi_bdev)) {
+		/* bios queued before were all handed out, wait for them */
+		wait_event(lo->lo_event, lo->lo_active == 1);
 		do_loop_switch(lo, bio->bi_private);
 		bio_put(bio);
 	} else {
@@ -577,7 +1044,16 @@ static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 }
 
 /*
- * worker thread that handles reads/writes to file backed loop devices,
+ * No bio is handed out while a switch request waits for the bios in front
+ * of it to complete.
+ */
+static inline int loop_bio_ready(struct loop_device *lo)
+{
+	return !bio_list_empty(&lo->lo_bio_list) && !lo->lo_barrier;
+}
+
+/*
+ * worker threads that handle reads/writes to file backed loop devices,
  * to avoid blocking in our make_request_fn. it also does loop decrypting
  * on reads for block backed loop, as that is too heavy to do from
  * b_end_io context where irqs may be disabled.
@@ -592,25 +1068,84 @@ static int loop_thread(void *data)
 {
 	struct loop_device *lo = data;
 	struct bio *bio;
+	int switch_req, direct, wake;
 
 	set_user_nice(current, -20);
 
 	while (!kthread_should_stop() || !bio_list_empty(&lo->lo_bio_list)) {
 
-		wait_event_interruptible(lo->lo_event,
-				!bio_list_empty(&lo->lo_bio_list) ||
-				kthread_should_stop());
+		wait_event_interruptible_exclusive(lo->lo_event,
+				loop_bio_ready(lo) || kthread_should_stop());
 
-		if (bio_list_empty(&lo->lo_bio_list))
-			continue;
 		spin_lock_irq(&lo->lo_lock);
+		if (!loop_bio_ready(lo)) {
+			spin_unlock_irq(&lo->lo_lock);
+			continue;
+		}
 		bio = loop_get_bio(lo);
+		switch_req = !bio->bi_bdev;
+		if (switch_req)
+			lo->lo_barrier = 1;
+		/*
+		 * Bios too big to remap from make_request, and those queued
+		 * while direct I/O was being turned on, go direct from here.
+		 */
+		direct = !switch_req && (lo->lo_flags & LO_FLAGS_DIRECT_IO);
+		if (direct)
+			atomic_inc(&lo->lo_dio_pending);
+		lo->lo_active++;
+		spin_unlock_irq(&lo->lo_lock);
+
+		if (direct)
+			loop_submit_direct(lo, bio);
+		else
+			loop_handle_bio(lo, bio);
+
+		spin_lock_irq(&lo->lo_lock);
+		lo->lo_active--;
+		wake = lo->lo_barrier;
+		if (switch_req)
+			lo->lo_barrier = 0;
 		spin_unlock_irq(&lo->lo_lock);
 
-		BUG_ON(!bio);
-		loop_handle_bio(lo, bio);
+		if (wake)
+			wake_up_all(&lo->lo_event);
+	}
+
+	return 0;
+}
+
+static void loop_stop_workers(struct loop_device *lo)
+{
+	int i;
+
+	for (i = 0; i < lo->lo_nr_threads; i++) {
+		kthread_stop(lo->lo_threads[i]);
+		lo->lo_threads[i] = NULL;
 	}
+	lo->lo_nr_threads = 0;
+	lo->lo_thread = NULL;
+}
 
+static int loop_start_workers(struct loop_device *lo)
+{
+	int i, nr = clamp(nr_workers, 1, LOOP_MAX_WORKERS);
+	struct task_struct *t;
+
+	for (i = 0; i < nr; i++) {
+		if (!i)
+			t = kthread_create(loop_thread, lo, "loop%d",
+					   lo->lo_number);
+		else
+			t = kthread_create(loop_thread, lo, "loop%d.%d",
+					   lo->lo_number, i);
+		if (IS_ERR(t)) {
+			loop_stop_workers(lo);
+			return PTR_ERR(t);
+		}
+		lo->lo_threads[lo->lo_nr_threads++] = t;
+	}
+	lo->lo_thread = lo->lo_threads[0];
 	return 0;
 }
 
@@ -619,7 +1154,7 @@ static int loop_thread(void *data)
  * First it needs to flush existing IO, it does this by sending a magic
  * BIO down the pipe. The completion of this BIO does the actual switch.
  */
-static int loop_switch(struct loop_device *lo, struct file *file)
+static int __loop_switch(struct loop_device *lo, struct file *file, int dio)
 {
 	struct switch_request w;
 	struct bio *bio = bio_alloc(GFP_KERNEL, 0);
@@ -627,11 +1162,27 @@ static int loop_switch(struct loop_device *lo, struct file *file)
 		return -ENOMEM;
 	init_completion(&w.wait);
 	w.file = file;
+	w.dio = dio;
+	w.error = 0;
 	bio->bi_private = &w;
 	bio->bi_bdev = NULL;
 	loop_make_request(lo->lo_queue, bio);
 	wait_for_completion(&w.wait);
-	return 0;
+	return w.error;
+}
+
+static int loop_switch(struct loop_device *lo, struct file *file)
+{
+	return __loop_switch(lo, file, 0);
+}
+
+/*
+ * Turn direct I/O on from the worker: the bios queued before have all
+ * completed and the ones behind are held back until it is done.
+ */
+static int loop_switch_dio(struct loop_device *lo)
+{
+	return __loop_switch(lo, NULL, 1);
 }
 
 /*
@@ -654,6 +1205,26 @@ static void do_loop_switch(struct loop_device *lo, struct switch_request *p)
 	struct file *file = p->file;
 	struct file *old_file = lo->lo_backing_file;
 	struct address_space *mapping;
+	int error;
+
+	if (p->dio) {
+		/*
+		 * Nothing goes through the page cache of the backing file
+		 * now: write it back and drop it, so that direct reads don't
+		 * miss newer data and no dirty page overwrites direct writes.
+		 */
+		mapping = old_file->f_mapping;
+		error = filemap_write_and_wait(mapping);
+		if (!error)
+			error = invalidate_inode_pages2(mapping);
+		if (!error) {
+			spin_lock_irq(&lo->lo_lock);
+			lo->lo_flags |= LO_FLAGS_DIRECT_IO;
+			spin_unlock_irq(&lo->lo_lock);
+		}
+		p->error = error;
+		goto out;
+	}
 
 	/* if no new file, only flush of queued bios requested */
 	if (!file)
@@ -695,6 +1266,11 @@ static int loop_change_fd(struct loop_device *lo, struct block_device *bdev,
 	if (!(lo->lo_flags & LO_FLAGS_READ_ONLY))
 		goto out;
 
+	/* the block map belongs to the old file */
+	error = -EBUSY;
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		goto out;
+
 	error = -EBADF;
 	file = fget(arg);
 	if (!file)
@@ -743,7 +1319,7 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 	struct address_space *mapping;
 	unsigned lo_blocksize;
 	int		lo_flags = 0;
-	int		error;
+	int		error, i;
 	loff_t		size;
 
 	/* This is safe, since we have a reference from open(). */
@@ -837,20 +1413,17 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 
 	set_blocksize(bdev, lo_blocksize);
 
-	lo->lo_thread = kthread_create(loop_thread, lo, "loop%d",
-						lo->lo_number);
-	if (IS_ERR(lo->lo_thread)) {
-		error = PTR_ERR(lo->lo_thread);
+	error = loop_start_workers(lo);
+	if (error)
 		goto out_clr;
-	}
 	lo->lo_state = Lo_bound;
-	wake_up_process(lo->lo_thread);
+	for (i = 0; i < lo->lo_nr_threads; i++)
+		wake_up_process(lo->lo_threads[i]);
 	if (max_part > 0)
 		ioctl_by_bdev(bdev, BLKRRPART, 0);
 	return 0;
 
 out_clr:
-	lo->lo_thread = NULL;
 	lo->lo_device = NULL;
 	lo->lo_backing_file = NULL;
 	lo->lo_flags = 0;
@@ -922,7 +1495,9 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 	lo->lo_state = Lo_rundown;
 	spin_unlock_irq(&lo->lo_lock);
 
-	kthread_stop(lo->lo_thread);
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		loop_dio_stop(lo);
+	loop_stop_workers(lo);
 
 	lo->lo_queue->unplug_fn = NULL;
 	lo->lo_backing_file = NULL;
@@ -936,7 +1511,6 @@ static int loop_clr_fd(struct loop_device *lo, struct block_device *bdev)
 	lo->lo_sizelimit = 0;
 	lo->lo_encrypt_key_size = 0;
 	lo->lo_flags = 0;
-	lo->lo_thread = NULL;
 	memset(lo->lo_encrypt_key, 0, LO_KEY_SIZE);
 	memset(lo->lo_crypt_name, 0, LO_NAME_SIZE);
 	memset(lo->lo_file_name, 0, LO_NAME_SIZE);
@@ -977,6 +1551,10 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 		return -ENXIO;
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
+	if ((lo->lo_flags & LO_FLAGS_DIRECT_IO) &&
+	    (info->lo_encrypt_type || info->lo_offset &
+	     (bdev_logical_block_size(lo->lo_dio_bdev) - 1)))
+		return -EINVAL;
 
 	err = loop_release_xfer(lo);
 	if (err)
@@ -1179,6 +1757,10 @@ static int loop_set_capacity(struct loop_device *lo, struct block_device *bdev)
 	err = -ENXIO;
 	if (unlikely(lo->lo_state != Lo_bound))
 		goto out;
+	/* growth would not be in the block map */
+	err = -EBUSY;
+	if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		goto out;
 	err = figure_loop_size(lo);
 	if (unlikely(err))
 		goto out;
@@ -1231,6 +1813,12 @@ static int lo_ioctl(struct block_device *bdev, fmode_t mode,
 		if ((mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN))
 			err = loop_set_capacity(lo, bdev);
 		break;
+	case LOOP_SET_DIRECT_IO:
+		/* reads whatever the file system left in the blocks */
+		err = -EPERM;
+		if (capable(CAP_SYS_ADMIN))
+			err = loop_set_dio(lo, arg);
+		break;
 	default:
 		err = lo->ioctl ? lo->ioctl(lo, cmd, arg) : -EINVAL;
 	}
@@ -1385,6 +1973,7 @@ static int lo_compat_ioctl(struct block_device *bdev, fmode_t mode,
 		arg = (unsigned long) compat_ptr(arg);
 	case LOOP_SET_FD:
 	case LOOP_CHANGE_FD:
+	case LOOP_SET_DIRECT_IO:
 		err = lo_ioctl(bdev, mode, cmd, arg);
 		break;
 	default:
@@ -1456,6 +2045,8 @@ module_param(max_loop, int, 0);
 MODULE_PARM_DESC(max_loop, "Maximum number of loop devices");
 module_param(max_part, int, 0);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per loop device");
+module_param(nr_workers, int, 0644);
+MODULE_PARM_DESC(nr_workers, "Number of worker threads per loop device");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(LOOP_MAJOR);
 
@@ -1516,6 +2107,8 @@ static struct loop_device *loop_alloc(int i)
 	lo->lo_number		= i;
 	lo->lo_thread		= NULL;
 	init_waitqueue_head(&lo->lo_event);
+	init_waitqueue_head(&lo->lo_dio_wait);
+	atomic_set(&lo->lo_dio_pending, 0);
 	spin_lock_init(&lo->lo_lock);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
@@ -1614,8 +2207,19 @@ static int __init loop_init(void)
 		range = 1UL << (MINORBITS - part_shift);
 	}
 
-	if (register_blkdev(LOOP_MAJOR, "loop"))
+	loop_bio_set = bioset_create(LOOP_DIO_POOL_SIZE, 0);
+	if (!loop_bio_set)
+		return -ENOMEM;
+	loop_dio_pool = mempool_create_kmalloc_pool(LOOP_DIO_POOL_SIZE,
+						    sizeof(struct loop_dio));
+	if (!loop_dio_pool)
+		goto out_free_bioset;
+
+	if (register_blkdev(LOOP_MAJOR, "loop")) {
+		mempool_destroy(loop_dio_pool);
+		bioset_free(loop_bio_set);
 		return -EIO;
+	}
 
 	for (i = 0; i < nr; i++) {
 		lo = loop_alloc(i);
@@ -1642,6 +2246,9 @@ Enomem:
 		loop_free(lo);
 
 	unregister_blkdev(LOOP_MAJOR, "loop");
+	mempool_destroy(loop_dio_pool);
+out_free_bioset:
+	bioset_free(loop_bio_set);
 	return -ENOMEM;
 }
 
@@ -1657,6 +2264,8 @@ static void __exit loop_exit(void)
 
 	blk_unregister_region(MKDEV(LOOP_MAJOR, 0), range);
 	unregister_blkdev(LOOP_MAJOR, "loop");
+	mempool_destroy(loop_dio_pool);
+	bioset_free(loop_bio_set);
 }
 
 module_init(loop_init);
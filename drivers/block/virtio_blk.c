@@ -8,6 +8,8 @@
 #include <linux/string_helpers.h>
 #include <scsi/scsi_cmnd.h>
 #include <linux/idr.h>
+#include <linux/blk-mq.h>
+#include <linux/wait.h>
 
 #define PART_BITS 4
 
@@ -16,19 +18,46 @@ static DEFINE_IDA(vd_index_ida);
 
 struct workqueue_struct *virtblk_wq;
 
-struct virtio_blk
-{
+/*
+ * Submit bios straight to the virtqueues, bypassing the request layer.
+ * Saves the request allocation and elevator for fast hosts, at the price
+ * of merging, io scheduling and SCSI passthrough.
+ */
+static bool use_bio;
+module_param(use_bio, bool, S_IRUGO);
+MODULE_PARM_DESC(use_bio, "Use bio based submission instead of requests");
+
+/* tags per hardware queue when the device has more than one virtqueue */
+static unsigned int queue_depth = 64;
+module_param(queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_depth, "Requests per virtqueue in multi-queue mode");
+
+/*
+ * One per virtqueue. Submission and completion on a virtqueue are
+ * serialised by its lock; for a single-queue device using the request
+ * layer, the lock of the only virtqueue doubles as the queue lock.
+ */
+struct virtio_blk_vq {
+	struct virtqueue *vq;
 	spinlock_t lock;
 
+	/* bio submitters waiting for room in the ring */
+	wait_queue_head_t wait;
+
+	char name[16];
+} ____cacheline_aligned_in_smp;
+
+struct virtio_blk
+{
 	struct virtio_device *vdev;
-	struct virtqueue *vq;
+
+	/* Virtqueues, num_queues of them if VIRTIO_BLK_F_MQ, else one. */
+	struct virtio_blk_vq *vqs;
+	unsigned int num_vqs;
 
 	/* The disk structure for the kernel. */
 	struct gendisk *disk;
 
-	/* Request tracking. */
-	struct list_head reqs;
-
 	mempool_t *pool;
 
 	/* Process context for config space updates */
@@ -44,36 +73,114 @@ struct virtio_blk
 	struct scatterlist sg[/*sg_elems*/];
 };
 
+/*
+ * Exactly one of req and bio is set for I/O; neither for the internal
+ * GET_ID command, whose issuer waits on done.
+ */
 struct virtblk_req
 {
-	struct list_head list;
 	struct request *req;
+	struct bio *bio;
+	struct completion *done;
 	struct virtio_blk_outhdr out_hdr;
 	struct virtio_scsi_inhdr in_hdr;
 	u8 status;
+
+	/* multi-queue and bio mode only, sized for sg_elems */
+	struct scatterlist sg[];
 };
 
-static void blk_done(struct virtqueue *vq)
+static inline int virtblk_result(struct virtblk_req *vbr)
 {
-	struct virtio_blk *vblk = vq->vdev->priv;
+	switch (vbr->status) {
+	case VIRTIO_BLK_S_OK:
+		return 0;
+	case VIRTIO_BLK_S_UNSUPP:
+		return -ENOTTY;
+	default:
+		return -EIO;
+	}
+}
+
+static struct virtio_blk_vq *virtblk_find_vq(struct virtio_blk *vblk,
+					     struct virtqueue *vq)
+{
+	unsigned int i;
+
+	for (i = 0; i < vblk->num_vqs; i++)
+		if (vblk->vqs[i].vq == vq)
+			return &vblk->vqs[i];
+	BUG();
+	return NULL;
+}
+
+/* the virtqueue a bio submitted from this cpu goes to, as blk-mq maps it */
+static inline struct virtio_blk_vq *virtblk_this_vq(struct virtio_blk *vblk)
+{
+	unsigned int cpu = raw_smp_processor_id();
+
+	return &vblk->vqs[cpu * vblk->num_vqs / nr_cpu_ids];
+}
+
+/*
+ * Queue vbr on bvq, sleeping until the host has made room. Called and
+ * returns with bvq->lock held and interrupts disabled.
+ */
+static void virtblk_add_buf_wait(struct virtio_blk_vq *bvq,
+				 struct scatterlist *sg, unsigned int out,
+				 unsigned int in, struct virtblk_req *vbr)
+{
+	DEFINE_WAIT(wait);
+
+	if (virtqueue_add_buf(bvq->vq, sg, out, in, vbr) >= 0)
+		return;
+
+	for (;;) {
+		prepare_to_wait(&bvq->wait, &wait, TASK_UNINTERRUPTIBLE);
+		if (virtqueue_add_buf(bvq->vq, sg, out, in, vbr) >= 0)
+			break;
+		spin_unlock_irq(&bvq->lock);
+		io_schedule();
+		spin_lock_irq(&bvq->lock);
+	}
+	finish_wait(&bvq->wait, &wait);
+}
+
+/* complete whatever the host has finished on bvq, returns how many */
+static int virtblk_reap(struct virtio_blk *vblk, struct virtio_blk_vq *bvq)
+{
+	struct request_queue *q = vblk->disk->queue;
 	struct virtblk_req *vbr;
 	unsigned int len;
 	unsigned long flags;
+	int done = 0;
 
-	spin_lock_irqsave(&vblk->lock, flags);
-	while ((vbr = virtqueue_get_buf(vblk->vq, &len)) != NULL) {
-		int error;
+	spin_lock_irqsave(&bvq->lock, flags);
+	while ((vbr = virtqueue_get_buf(bvq->vq, &len)) != NULL) {
+		int error = virtblk_result(vbr);
 
-		switch (vbr->status) {
-		case VIRTIO_BLK_S_OK:
-			error = 0;
-			break;
-		case VIRTIO_BLK_S_UNSUPP:
-			error = -ENOTTY;
-			break;
-		default:
-			error = -EIO;
-			break;
+		done++;
+
+		if (vbr->bio) {
+			bio_endio(vbr->bio, error);
+			mempool_free(vbr, vblk->pool);
+			continue;
+		}
+
+		if (!vbr->req) {
+			/* the issuer frees it */
+			complete(vbr->done);
+			continue;
+		}
+
+		if (q->mq_ops) {
+			/*
+			 * Finished in softirq by virtblk_mq_complete(), on the
+			 * submitting cpu (or its group) via rq->cpu.
+			 */
+			vbr->req->errors = error;
+			blk_complete_request(vbr->req);
+			continue;
 		}
 
 		if (vbr->req->cmd_type == REQ_TYPE_BLOCK_PC) {
@@ -81,16 +188,36 @@ static void blk_done(struct virtqueue *vq)
 			vbr->req->sense_len = vbr->in_hdr.sense_len;
 			vbr->req->errors = vbr->in_hdr.errors;
 		}
-		if (vbr->req->cmd_type == REQ_TYPE_SPECIAL)
-			vbr->req->errors = (error != 0);
 
 		__blk_end_request_all(vbr->req, error);
-		list_del(&vbr->list);
 		mempool_free(vbr, vblk->pool);
 	}
+
 	/* In case queue is stopped waiting for more buffers. */
-	blk_start_queue(vblk->disk->queue);
-	spin_unlock_irqrestore(&vblk->lock, flags);
+	if (q->mq_ops)
+		blk_mq_start_stopped_hw_queues(q, true);
+	else if (q->request_fn)
+		blk_start_queue(q);
+	if (waitqueue_active(&bvq->wait))
+		wake_up(&bvq->wait);
+	spin_unlock_irqrestore(&bvq->lock, flags);
+
+	return done;
+}
+
+static void blk_done(struct virtqueue *vq)
+{
+	struct virtio_blk *vblk = vq->vdev->priv;
+
+	virtblk_reap(vblk, virtblk_find_vq(vblk, vq));
+}
+
+/* blk_poll_fn: reap the virtqueue this cpu submits to */
+static int virtblk_poll(struct request_queue *q)
+{
+	struct virtio_blk *vblk = q->queuedata;
+
+	return virtblk_reap(vblk, virtblk_this_vq(vblk));
 }
 
 static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
@@ -105,6 +232,7 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		return false;
 
 	vbr->req = req;
+	vbr->bio = NULL;
 	if (req->cmd_flags & REQ_FLUSH) {
 		vbr->out_hdr.type = VIRTIO_BLK_T_FLUSH;
 		vbr->out_hdr.sector = 0;
@@ -121,11 +249,6 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 			vbr->out_hdr.sector = 0;
 			vbr->out_hdr.ioprio = req_get_ioprio(vbr->req);
 			break;
-		case REQ_TYPE_SPECIAL:
-			vbr->out_hdr.type = VIRTIO_BLK_T_GET_ID;
-			vbr->out_hdr.sector = 0;
-			vbr->out_hdr.ioprio = req_get_ioprio(vbr->req);
-			break;
 		default:
 			/* We don't put anything else in the queue. */
 			BUG();
@@ -164,12 +287,11 @@ static bool do_req(struct request_queue *q, struct virtio_blk *vblk,
 		}
 	}
 
-	if (virtqueue_add_buf(vblk->vq, vblk->sg, out, in, vbr) < 0) {
+	if (virtqueue_add_buf(vblk->vqs[0].vq, vblk->sg, out, in, vbr) < 0) {
 		mempool_free(vbr, vblk->pool);
 		return false;
 	}
 
-	list_add_tail(&vbr->list, &vblk->reqs);
 	return true;
 }
 
@@ -193,7 +315,125 @@ static void do_virtblk_request(struct request_queue *q)
 	}
 
 	if (issued)
-		virtqueue_kick(vblk->vq);
+		virtqueue_kick(vblk->vqs[0].vq);
+}
+
+static int virtblk_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *req)
+{
+	struct virtio_blk *vblk = hctx->driver_data;
+	struct virtio_blk_vq *bvq = &vblk->vqs[hctx->queue_num];
+	struct virtblk_req *vbr = blk_mq_rq_to_pdu(req);
+	unsigned int num, out = 0, in = 0;
+	unsigned long flags;
+
+	BUG_ON(req->nr_phys_segments + 2 > vblk->sg_elems);
+
+	vbr->req = req;
+	vbr->bio = NULL;
+	sg_init_table(vbr->sg, vblk->sg_elems);
+	if (req->cmd_flags & REQ_FLUSH) {
+		vbr->out_hdr.type = VIRTIO_BLK_T_FLUSH;
+		vbr->out_hdr.sector = 0;
+	} else {
+		vbr->out_hdr.type = 0;
+		vbr->out_hdr.sector = blk_rq_pos(req);
+	}
+	vbr->out_hdr.ioprio = req_get_ioprio(req);
+
+	sg_set_buf(&vbr->sg[out++], &vbr->out_hdr, sizeof(vbr->out_hdr));
+	num = blk_rq_map_sg(hctx->queue, req, vbr->sg + out);
+	sg_set_buf(&vbr->sg[num + out + in++], &vbr->status,
+		   sizeof(vbr->status));
+
+	if (num) {
+		if (rq_data_dir(req) == WRITE) {
+			vbr->out_hdr.type |= VIRTIO_BLK_T_OUT;
+			out += num;
+		} else {
+			vbr->out_hdr.type |= VIRTIO_BLK_T_IN;
+			in += num;
+		}
+	}
+
+	spin_lock_irqsave(&bvq->lock, flags);
+	if (virtqueue_add_buf(bvq->vq, vbr->sg, out, in, vbr) < 0) {
+		/* restarted from blk_done() once the host returns buffers */
+		blk_mq_stop_hw_queue(hctx);
+		spin_unlock_irqrestore(&bvq->lock, flags);
+		return BLK_MQ_RQ_QUEUE_BUSY;
+	}
+	virtqueue_kick(bvq->vq);
+	spin_unlock_irqrestore(&bvq->lock, flags);
+
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static void virtblk_mq_complete(struct request *req)
+{
+	blk_mq_end_io(req, req->errors);
+}
+
+static struct blk_mq_ops virtio_mq_ops = {
+	.queue_rq	= virtblk_queue_rq,
+	.complete	= virtblk_mq_complete,
+};
+
+static int virtblk_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct virtio_blk *vblk = q->queuedata;
+	struct virtio_blk_vq *bvq;
+	struct virtblk_req *vbr;
+	unsigned int num, out = 0, in = 0;
+
+	/* BIO_RW_BARRIER is deprecated */
+	if (WARN_ONCE(bio_rw_flagged(bio, BIO_RW_BARRIER),
+		"block: BARRIER is deprecated, use FLUSH/FUA instead\n")) {
+		bio_endio(bio, -EOPNOTSUPP);
+		return 0;
+	}
+
+	/* leaves at most an empty flush for us to send */
+	if (blk_flush_bio_seq(q, bio))
+		return 0;
+
+	BUG_ON(bio_phys_segments(q, bio) + 2 > vblk->sg_elems);
+
+	vbr = mempool_alloc(vblk->pool, GFP_NOIO);
+	vbr->req = NULL;
+	vbr->bio = bio;
+	sg_init_table(vbr->sg, vblk->sg_elems);
+
+	if (bio->bi_rw & BIO_FLUSH) {
+		vbr->out_hdr.type = VIRTIO_BLK_T_FLUSH;
+		vbr->out_hdr.sector = 0;
+	} else {
+		vbr->out_hdr.type = 0;
+		vbr->out_hdr.sector = bio->bi_sector;
+	}
+	vbr->out_hdr.ioprio = bio_prio(bio);
+
+	sg_set_buf(&vbr->sg[out++], &vbr->out_hdr, sizeof(vbr->out_hdr));
+	num = blk_bio_map_sg(q, bio, vbr->sg + out);
+	sg_set_buf(&vbr->sg[num + out + in++], &vbr->status,
+		   sizeof(vbr->status));
+
+	if (num) {
+		if (bio_data_dir(bio) == WRITE) {
+			vbr->out_hdr.type |= VIRTIO_BLK_T_OUT;
+			out += num;
+		} else {
+			vbr->out_hdr.type |= VIRTIO_BLK_T_IN;
+			in += num;
+		}
+	}
+
+	bvq = virtblk_this_vq(vblk);
+	spin_lock_irq(&bvq->lock);
+	virtblk_add_buf_wait(bvq, vbr->sg, out, in, vbr);
+	virtqueue_kick(bvq->vq);
+	spin_unlock_irq(&bvq->lock);
+
+	return 0;
 }
 
 /* return id (s/n) string for *disk to *id_str
@@ -201,24 +441,37 @@ static void do_virtblk_request(struct request_queue *q)
 static int virtblk_get_id(struct gendisk *disk, char *id_str)
 {
 	struct virtio_blk *vblk = disk->private_data;
-	struct request *req;
-	struct bio *bio;
+	struct virtio_blk_vq *bvq = &vblk->vqs[0];
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct virtblk_req *vbr;
+	struct scatterlist sg[3];
 	int err;
 
-	bio = bio_map_kern(vblk->disk->queue, id_str, VIRTIO_BLK_ID_BYTES,
-			   GFP_KERNEL);
-	if (IS_ERR(bio))
-		return PTR_ERR(bio);
-
-	req = blk_make_request(vblk->disk->queue, bio, GFP_KERNEL);
-	if (IS_ERR(req)) {
-		bio_put(bio);
-		return PTR_ERR(req);
-	}
-
-	req->cmd_type = REQ_TYPE_SPECIAL;
-	err = blk_execute_rq(vblk->disk->queue, vblk->disk, req, false);
-	blk_put_request(req);
+	/*
+	 * Sent straight down the first virtqueue, so it works the same
+	 * whichever way the disk's queue is driven.
+	 */
+	vbr = mempool_alloc(vblk->pool, GFP_KERNEL);
+	vbr->req = NULL;
+	vbr->bio = NULL;
+	vbr->done = &done;
+	vbr->out_hdr.type = VIRTIO_BLK_T_GET_ID | VIRTIO_BLK_T_IN;
+	vbr->out_hdr.sector = 0;
+	vbr->out_hdr.ioprio = 0;
+
+	sg_init_table(sg, ARRAY_SIZE(sg));
+	sg_set_buf(&sg[0], &vbr->out_hdr, sizeof(vbr->out_hdr));
+	sg_set_buf(&sg[1], id_str, VIRTIO_BLK_ID_BYTES);
+	sg_set_buf(&sg[2], &vbr->status, sizeof(vbr->status));
+
+	spin_lock_irq(&bvq->lock);
+	virtblk_add_buf_wait(bvq, sg, 1, 2, vbr);
+	virtqueue_kick(bvq->vq);
+	spin_unlock_irq(&bvq->lock);
+
+	wait_for_completion(&done);
+	err = virtblk_result(vbr);
+	mempool_free(vbr, vblk->pool);
 
 	return err;
 }
@@ -231,9 +484,12 @@ static int virtblk_ioctl(struct block_device *bdev, fmode_t mode,
 
 	/*
 	 * Only allow the generic SCSI ioctls if the host can support it.
+	 * Packet commands need the single-queue request path.
 	 */
 	if (!virtio_has_feature(vblk->vdev, VIRTIO_BLK_F_SCSI))
 		return -ENOTTY;
+	if (!disk->queue->request_fn)
+		return -ENOTTY;
 
 	return scsi_cmd_blk_ioctl(bdev, mode, cmd,
 				  (void __user *)data);
@@ -334,17 +590,94 @@ static ssize_t virtblk_serial_show(struct device *dev,
 	if (!err)
 		return strlen(buf);
 
-	if (err == -EIO) /* Unsupported? Make it empty. */
+	if (err == -EIO || err == -ENOTTY) /* Unsupported? Make it empty. */
 		return 0;
 
 	return err;
 }
 DEVICE_ATTR(serial, S_IRUGO, virtblk_serial_show, NULL);
 
+static int virtblk_init_vqs(struct virtio_blk *vblk)
+{
+	struct virtio_device *vdev = vblk->vdev;
+	vq_callback_t **callbacks;
+	struct virtqueue **vqs;
+	const char **names;
+	u16 num_vqs;
+	int i, err;
+
+	err = virtio_config_val(vdev, VIRTIO_BLK_F_MQ,
+				offsetof(struct virtio_blk_config, num_queues),
+				&num_vqs);
+	if (err || !num_vqs)
+		num_vqs = 1;
+
+	/* more queues than cpus buys nothing */
+	num_vqs = min_t(unsigned int, num_vqs, nr_cpu_ids);
+
+	vblk->vqs = kzalloc(sizeof(*vblk->vqs) * num_vqs, GFP_KERNEL);
+	callbacks = kmalloc(sizeof(*callbacks) * num_vqs, GFP_KERNEL);
+	vqs = kmalloc(sizeof(*vqs) * num_vqs, GFP_KERNEL);
+	names = kmalloc(sizeof(*names) * num_vqs, GFP_KERNEL);
+	if (!vblk->vqs || !callbacks || !vqs || !names) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < num_vqs; i++) {
+		spin_lock_init(&vblk->vqs[i].lock);
+		init_waitqueue_head(&vblk->vqs[i].wait);
+		if (num_vqs == 1)
+			strcpy(vblk->vqs[i].name, "requests");
+		else
+			snprintf(vblk->vqs[i].name, sizeof(vblk->vqs[i].name),
+				 "req.%d", i);
+		callbacks[i] = blk_done;
+		names[i] = vblk->vqs[i].name;
+	}
+
+	err = vdev->config->find_vqs(vdev, num_vqs, vqs, callbacks, names);
+	if (err)
+		goto out;
+
+	for (i = 0; i < num_vqs; i++)
+		vblk->vqs[i].vq = vqs[i];
+	vblk->num_vqs = num_vqs;
+
+out:
+	kfree(names);
+	kfree(vqs);
+	kfree(callbacks);
+	if (err) {
+		kfree(vblk->vqs);
+		vblk->vqs = NULL;
+	}
+	return err;
+}
+
+/*
+ * Steer each virtqueue's interrupt to the first cpu submitting on it, so
+ * completions run where the I/O was issued. Only a hint to the transport.
+ */
+static void virtblk_set_affinity(struct virtio_blk *vblk)
+{
+	unsigned int i, cpu;
+
+	if (vblk->num_vqs == 1)
+		return;
+
+	for (i = 0; i < vblk->num_vqs; i++) {
+		cpu = DIV_ROUND_UP(i * nr_cpu_ids, vblk->num_vqs);
+		if (cpu < nr_cpu_ids && cpu_online(cpu))
+			virtqueue_set_affinity(vblk->vqs[i].vq, cpu);
+	}
+}
+
 static int __devinit virtblk_probe(struct virtio_device *vdev)
 {
 	struct virtio_blk *vblk;
 	struct request_queue *q;
+	size_t pool_size;
 	int err, index;
 	u64 cap;
 	u32 v, blk_size, sg_elems, opt_io_size;
@@ -373,21 +706,20 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 		goto out_free_index;
 	}
 
-	INIT_LIST_HEAD(&vblk->reqs);
-	spin_lock_init(&vblk->lock);
 	vblk->vdev = vdev;
 	vblk->sg_elems = sg_elems;
 	sg_init_table(vblk->sg, vblk->sg_elems);
 	INIT_WORK(&vblk->config_work, virtblk_config_changed_work);
 
-	/* We expect one virtqueue, for output. */
-	vblk->vq = virtio_find_single_vq(vdev, blk_done, "requests");
-	if (IS_ERR(vblk->vq)) {
-		err = PTR_ERR(vblk->vq);
+	err = virtblk_init_vqs(vblk);
+	if (err)
 		goto out_free_vblk;
-	}
 
-	vblk->pool = mempool_create_kmalloc_pool(1,sizeof(struct virtblk_req));
+	/* bio mode maps straight into the request's own scatterlist */
+	pool_size = sizeof(struct virtblk_req);
+	if (use_bio)
+		pool_size += sizeof(struct scatterlist) * sg_elems;
+	vblk->pool = mempool_create_kmalloc_pool(1, pool_size);
 	if (!vblk->pool) {
 		err = -ENOMEM;
 		goto out_free_vq;
@@ -400,13 +732,33 @@ static int __devinit virtblk_probe(struct virtio_device *vdev)
 		goto out_mempool;
 	}
 
-	q = vblk->disk->queue = blk_init_queue(do_virtblk_request, &vblk->lock);
+	if (use_bio) {
+		q = blk_alloc_queue(GFP_KERNEL);
+		if (q)
+			blk_queue_make_request(q, virtblk_make_request);
+	} else if (vblk->num_vqs > 1) {
+		struct blk_mq_reg reg = {
+			.ops		= &virtio_mq_ops,
+			.nr_hw_queues	= vblk->num_vqs,
+			.queue_depth	= queue_depth,
+			.cmd_size	= sizeof(struct virtblk_req) +
+					  sizeof(struct scatterlist) * sg_elems,
+			.numa_node	= NUMA_NO_NODE,
+		};
+
+		q = blk_mq_init_queue(&reg, vblk);
+	} else {
+		q = blk_init_queue(do_virtblk_request, &vblk->vqs[0].lock);
+	}
 	if (!q) {
 		err = -ENOMEM;
 		goto out_put_disk;
 	}
 
+	vblk->disk->queue = q;
 	q->queuedata = vblk;
+	blk_queue_poll_fn(q, virtblk_poll);
+	virtblk_set_affinity(vblk);
 
 	if (index < 26) {
 		sprintf(vblk->disk->disk_name, "vd%c", 'a' + index % 26);
@@ -519,6 +871,7 @@ out_mempool:
 	mempool_destroy(vblk->pool);
 out_free_vq:
 	vdev->config->del_vqs(vdev);
+	kfree(vblk->vqs);
 out_free_vblk:
 	kfree(vblk);
 out_free_index:
@@ -534,9 +887,6 @@ static void __devexit virtblk_remove(struct virtio_device *vdev)
 
 	flush_work(&vblk->config_work);
 
-	/* Nothing should be pending. */
-	BUG_ON(!list_empty(&vblk->reqs));
-
 	/* Stop all the virtqueues. */
 	vdev->config->reset(vdev);
 
@@ -545,6 +895,7 @@ static void __devexit virtblk_remove(struct virtio_device *vdev)
 	put_disk(vblk->disk);
 	mempool_destroy(vblk->pool);
 	vdev->config->del_vqs(vdev);
+	kfree(vblk->vqs);
 	kfree(vblk);
 	ida_simple_remove(&vd_index_ida, index);
 }
@@ -557,7 +908,7 @@ static struct virtio_device_id id_table[] = {
 static unsigned int features[] = {
 	VIRTIO_BLK_F_SEG_MAX, VIRTIO_BLK_F_SIZE_MAX, VIRTIO_BLK_F_GEOMETRY,
 	VIRTIO_BLK_F_RO, VIRTIO_BLK_F_BLK_SIZE, VIRTIO_BLK_F_SCSI,
-	VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_TOPOLOGY
+	VIRTIO_BLK_F_FLUSH, VIRTIO_BLK_F_TOPOLOGY, VIRTIO_BLK_F_MQ
 };
 
 /*
@@ -94,6 +94,19 @@
 
 #define FLASHCACHE_FIFO		0
 #define FLASHCACHE_LRU		1
+#define FLASHCACHE_LRU2Q	2
+
+/*
+ * LRU2Q is a scan resistant (2Q like) variant of LRU. The set's LRU list is
+ * split in 2 segments, a cold (probationary) segment at the head and a hot
+ * (protected) segment at the tail starting at lru_hot_head. New blocks are 
+ * inserted at the tail of the cold segment and are promoted to the hot 
+ * segment when they are hit again. When the hot segment grows beyond 
+ * FLASHCACHE_LRU2Q_HOT_PCT of the set, its oldest block drops back into the
+ * cold segment. Replacement walks the list from the head, so a large scan
+ * only recycles cold blocks and doesn't flush the hot working set.
+ */
+#define FLASHCACHE_LRU2Q_HOT_PCT	75
 
 /*
  * The LRU pointers are maintained as set-relative offsets, instead of 
@@ -106,6 +119,7 @@
 #define FLASHCACHE_LRU_NULL	0xFFFF
 
 struct cacheblock;
+struct pending_job;
 
 struct cache_set {
 	u_int32_t		set_fifo_next;
@@ -114,18 +128,42 @@ struct cache_set {
 	u_int16_t		nr_dirty;
 	u_int16_t		lru_head, lru_tail;
 	u_int16_t		dirty_fallow;
+	u_int16_t		lru_hot_head, nr_hot;	/* LRU2Q hot segment */
 	unsigned long 		fallow_tstamp;
 	unsigned long 		fallow_next_cleaning;
+	struct pending_job	*pending_jobs;	/* IOs waiting on blocks in this set */
 };
 
+/*
+ * Set locks :
+ * Cache sets are protected by an array of hashed spinlocks. A set lock covers
+ * the cache_set, the state/dbn/lru/pending queue of every cacheblock in the
+ * set and the metadata block heads for the set (a metadata block never 
+ * straddles 2 sets, since assoc >= MD_SLOTS_PER_BLOCK).
+ * The cache_spin_lock is only used for whole-cache state (pid lists, the 
+ * sequential IO tracker, the sync index).
+ * Lock ordering : When 2 set locks are needed (a bio straddling 2 sets), they
+ * are taken in ascending order. The cache_spin_lock nests inside set locks.
+ */
+#define FLASHCACHE_NUM_SET_LOCKS	1024
+
+struct cache_set_lock {
+	spinlock_t		lock;
+} ____cacheline_aligned_in_smp;
+
 struct flashcache_errors {
-	int	disk_read_errors;
-	int	disk_write_errors;
-	int	ssd_read_errors;
-	int	ssd_write_errors;
-	int	memory_alloc_errors;
+	atomic_t	disk_read_errors;
+	atomic_t	disk_write_errors;
+	atomic_t	ssd_read_errors;
+	atomic_t	ssd_write_errors;
+	atomic_t	memory_alloc_errors;
 };
 
+/*
+ * Stats are bumped under different set locks, or none at all, and from
+ * interrupt context, so every cpu keeps its own copy. Only unsigned longs
+ * in here : flashcache_stats_sum() adds them up as an array.
+ */
 struct flashcache_stats {
 	unsigned long reads;		/* Number of reads */
 	unsigned long writes;		/* Number of writes */
@@ -150,6 +188,8 @@ struct flashcache_stats {
 	unsigned long md_write_clean;	/* Metadata sector writes cleaning block */
 	unsigned long md_write_batch;	/* How many md updates did we batch ? */
 	unsigned long md_ssd_writes;	/* How many md ssd writes did we do ? */
+	unsigned long md_group_commits;	/* md writes delayed for group commit */
+	unsigned long md_group_commit_batch; /* md updates folded into a group commit */
 	unsigned long pid_drops;
 	unsigned long pid_adds;
 	unsigned long pid_dels;
@@ -163,6 +203,10 @@ struct flashcache_stats {
 	unsigned long skipclean;
 	unsigned long trim_blocks;
 	unsigned long clean_set_ios;
+	unsigned long seq_stream_hits;	/* IOs continuing/repeating a tracked flow */
+	unsigned long seq_stream_misses; /* IOs starting a new flow */
+	unsigned long md_load_deferred;	/* IOs waiting on lazy metadata load */
+	unsigned long clean_throttled;	/* Cleanings held back for foreground disk IO */
 };
 
 /* 
@@ -174,13 +218,17 @@ struct sequential_io {
 	unsigned long		sequential_count;
 	/* We use LRU replacement when we need to record a new i/o 'flow' */
 	struct sequential_io 	*prev, *next;
+	/* Hashed on most_recent_sector, so a flow is found without a scan */
+	struct hlist_node	hash;
 };
 #define SKIP_SEQUENTIAL_THRESHOLD 0			/* 0 = cache all, >0 = dont cache sequential i/o more than this (kb) */
-#define SEQUENTIAL_TRACKER_QUEUE_DEPTH	32		/* How many io 'flows' to track (random i/o will hog many).
+#define SEQUENTIAL_TRACKER_QUEUE_DEPTH	128		/* How many io 'flows' to track (random i/o will hog many).
 							 * This should be large enough so that we don't quickly 
-							 * evict sequential i/o when we see some random,
-							 * but small enough that searching through it isn't slow
-							 * (currently we do linear search, we could consider hashed */
+							 * evict sequential i/o when we see some random.
+							 * Flows are looked up through a hash on the last 
+							 * sector seen, so the depth doesn't cost search time. */
+#define SEQUENTIAL_TRACKER_HASH_BITS	8
+#define SEQUENTIAL_TRACKER_HASH_SIZE	(1 << SEQUENTIAL_TRACKER_HASH_BITS)
 								
 	
 /*
@@ -198,6 +246,8 @@ struct cache_c {
 
 	struct cacheblock	*cache;	/* Hash table for cache blocks */
 	struct cache_set	*cache_sets;
+	struct cache_set_lock	*set_locks;
+	unsigned int		num_set_locks;
 	struct cache_md_block_head *md_blocks_buf;
 
 	unsigned int md_block_size;	/* Metadata block size in sectors */
@@ -224,15 +274,24 @@ struct cache_c {
 	int	dirty_thresh_set;	/* Per set dirty threshold to start cleaning */
 	int	max_clean_ios_set;	/* Max cleaning IOs per set */
 	int	max_clean_ios_total;	/* Total max cleaning IOs */
-	int	clean_inprog;
+	atomic_t	clean_inprog;
 	int	sync_index;
-	int	nr_dirty;
-	unsigned long cached_blocks;	/* Number of cached blocks */
-	unsigned long pending_jobs_count;
+	atomic_t	nr_dirty;
+	atomic_long_t	cached_blocks;	/* Number of cached blocks */
+	atomic_long_t	pending_jobs_count;
 	int	md_blocks;		/* Numbers of metadata blocks, including header */
 
-	/* Stats */
-	struct flashcache_stats flashcache_stats;
+	/* 
+	 * Foreground (read miss and uncached) disk IO tracking, used to pace 
+	 * cleaning, see flashcache_clean_limit(). Updated without locks.
+	 */
+	atomic_t	disk_fg_inflight;
+	unsigned long	disk_fg_latency;	/* EWMA in jiffies, scaled by 8 */
+	unsigned long	disk_fg_last;		/* Last completion */
+	int		clean_sweep_set;	/* Next set for flashcache_clean_all_sets() */
+
+	/* Stats, per cpu */
+	struct flashcache_stats *stats;
 
 	/* Errors */
 	struct flashcache_errors flashcache_errors;
@@ -250,6 +309,34 @@ struct cache_c {
 	struct delayed_work delayed_clean;
 #endif
 
+	/* 
+	 * md blocks waiting out the group commit window, protected by 
+	 * cache_spin_lock.
+	 */
+	struct cache_md_block_head *md_commit_head;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	struct work_struct md_commit_work;
+#else
+	struct delayed_work md_commit_work;
+#endif
+
+	/* 
+	 * Lazy metadata load. After a clean shutdown, the cache comes up 
+	 * right away and the metadata is read in the background, a few sets 
+	 * at a time. IOs to sets that are not loaded yet wait in md_load_bios,
+	 * and the loader does these sets first. md_loaded, md_sets_loaded, 
+	 * md_load_next and md_load_bios are protected by md_load_lock.
+	 */
+	int			md_load_pending;
+	spinlock_t		md_load_lock;
+	unsigned long		*md_loaded;	/* Bitmap of loaded sets */
+	unsigned int		md_sets_loaded;
+	unsigned int		md_load_next;	/* Next set in sequential order */
+	struct bio_list		md_load_bios;
+	struct flash_cacheblock	*md_load_buf;
+	struct work_struct	md_load_work;
+	struct completion	md_load_done;
+
 	unsigned long pid_expire_check;
 
 	struct flashcache_cachectl_pid *blacklist_head, *blacklist_tail;
@@ -257,9 +344,6 @@ struct cache_c {
 	int num_blacklist_pids, num_whitelist_pids;
 	unsigned long blacklist_expire_check, whitelist_expire_check;
 
-#define PENDING_JOB_HASH_SIZE		32
-	struct pending_job *pending_job_hashbuckets[PENDING_JOB_HASH_SIZE];
-	
 	struct cache_c	*next_cache;
 
 	void *sysctl_handle;
@@ -286,11 +370,15 @@ struct cache_c {
 	int sysctl_fallow_clean_speed;
 	int sysctl_fallow_delay;
 	int sysctl_skip_seq_thresh_kb;
+	int sysctl_md_commit_delay_ms;
+	int sysctl_clean_adaptive;
+	int sysctl_clean_disk_latency_ms;
 
 	/* Sequential I/O spotter */
 	struct sequential_io	seq_recent_ios[SEQUENTIAL_TRACKER_QUEUE_DEPTH];
 	struct sequential_io	*seq_io_head;
 	struct sequential_io 	*seq_io_tail;
+	struct hlist_head	seq_io_hash[SEQUENTIAL_TRACKER_HASH_SIZE];
 };
 
 /* kcached/pending job states */
@@ -321,6 +409,7 @@ struct kcached_job {
 	struct flash_cacheblock *md_block;
 	struct bio_vec md_io_bvec;
 	struct timeval io_start_time;
+	unsigned long disk_start;	/* jiffies, foreground disk IOs */
 	struct kcached_job *next;
 };
 
@@ -330,6 +419,25 @@ struct pending_job {
 	int	index;
 	struct pending_job *prev, *next;
 };
+
+/*
+ * Job lists. Jobs are queued on the lists of the CPU that pushes them and 
+ * processed by that CPU's work item, so job handling stays CPU local.
+ */
+enum {
+	FLASHCACHE_PENDING_JOBS,
+	FLASHCACHE_IO_JOBS,
+	FLASHCACHE_MD_IO_JOBS,
+	FLASHCACHE_MD_COMPLETE_JOBS,
+	FLASHCACHE_UNCACHED_IO_COMPLETE_JOBS,
+	FLASHCACHE_NR_JOB_LISTS
+};
+
+struct flashcache_job_queue {
+	spinlock_t		lock;
+	struct list_head	jobs[FLASHCACHE_NR_JOB_LISTS];
+	struct work_struct	work;
+};
 #endif /* __KERNEL__ */
 
 /* Cache Modes */
@@ -357,6 +465,8 @@ enum {
  */
 #define DIRTY_FALLOW_1		0x0080	
 #define DIRTY_FALLOW_2		0x0100
+/* In the hot segment of the set's LRU (LRU2Q). Not part of the block's IO state. */
+#define LRU_HOT			0x0200
 
 #define FALLOW_DOCLEAN		(DIRTY_FALLOW_1 | DIRTY_FALLOW_2)
 #define BLOCK_IO_INPROG	(DISKREADINPROG | DISKWRITEINPROG | CACHEREADINPROG | CACHEWRITEINPROG)
@@ -442,6 +552,40 @@ struct flash_cacheblock {
 
 #ifdef __KERNEL__
 
+static inline spinlock_t *
+flashcache_set_lock(struct cache_c *dmc, int set)
+{
+	return &dmc->set_locks[(unsigned int)set % dmc->num_set_locks].lock;
+}
+
+#define INDEX_TO_SET_LOCK(DMC, INDEX)	flashcache_set_lock((DMC), (INDEX) / (DMC)->assoc)
+
+#define FLASHCACHE_STATS_ADD(DMC, FIELD, N) do {			\
+	unsigned long __flags;						\
+									\
+	local_irq_save(__flags);					\
+	per_cpu_ptr((DMC)->stats, smp_processor_id())->FIELD += (N);	\
+	local_irq_restore(__flags);					\
+} while (0)
+#define FLASHCACHE_STATS_INC(DMC, FIELD)	FLASHCACHE_STATS_ADD(DMC, FIELD, 1)
+
+/*
+ * Consume an injected error. The test and the clear are one atomic step,
+ * so that an error armed through the sysctl fires exactly once.
+ */
+static inline int
+flashcache_inject_error(struct cache_c *dmc, int error)
+{
+	int old;
+
+	do {
+		old = ACCESS_ONCE(dmc->sysctl_error_inject);
+		if (likely((old & error) == 0))
+			return 0;
+	} while (cmpxchg(&dmc->sysctl_error_inject, old, old & ~error) != old);
+	return 1;
+}
+
 /* Cache persistence */
 #define CACHE_RELOAD		1
 #define CACHE_CREATE		2
@@ -456,6 +600,7 @@ struct flash_cacheblock {
 struct cache_md_block_head {
 	u_int32_t		nr_in_prog;
 	struct kcached_job	*queued_updates, *md_io_inprog;
+	struct cache_md_block_head *commit_next;	/* Group commit list */
 };
 
 #define MIN_JOBS 1024
@@ -473,6 +618,10 @@ struct cache_md_block_head {
 #define FALLOW_SPEED_MIN	1
 #define FALLOW_SPEED_MAX	100
 #define FALLOW_CLEAN_SPEED	2
+#define MD_COMMIT_DELAY_MS	0	/* Group commit of md updates off by default */
+#define MD_COMMIT_DELAY_MAX_MS	100
+#define CLEAN_DISK_LATENCY_MS	20	/* Foreground disk latency cleaning backs off at */
+#define CLEAN_DISK_IDLE_MS	100	/* No foreground disk IO for this long = idle */
 
 /* DM async IO mempool sizing */
 #define FLASHCACHE_ASYNC_SIZE 1024
@@ -534,13 +683,14 @@ void flashcache_store_checksum(struct kcached_job *job);
 int flashcache_validate_checksum(struct kcached_job *job);
 int flashcache_read_compute_checksum(struct cache_c *dmc, int index, void *block);
 #endif
-struct kcached_job *pop(struct list_head *jobs);
-void push(struct list_head *jobs, struct kcached_job *job);
+struct kcached_job *pop(struct flashcache_job_queue *queue, int list);
+void push(int list, struct kcached_job *job);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
-void do_work(void *unused);
+void do_work(void *data);
 #else
-void do_work(struct work_struct *unused);
+void do_work(struct work_struct *work);
 #endif
+void flashcache_job_queues_init(void);
 struct kcached_job *new_kcached_job(struct cache_c *dmc, struct bio* bio,
 				    int index);
 void push_pending(struct kcached_job *job);
@@ -556,11 +706,26 @@ void flashcache_md_write_done(struct kcached_job *job);
 void flashcache_do_pending(struct kcached_job *job);
 void flashcache_md_write(struct kcached_job *job);
 void flashcache_md_write_kickoff(struct kcached_job *job);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+void flashcache_md_group_commit(void *data);
+#else
+void flashcache_md_group_commit(struct work_struct *work);
+#endif
+int flashcache_md_load_check(struct cache_c *dmc, struct bio *bio);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+void flashcache_md_load(void *data);
+#else
+void flashcache_md_load(struct work_struct *work);
+#endif
 void flashcache_do_io(struct kcached_job *job);
 void flashcache_uncached_io_complete(struct kcached_job *job);
 void flashcache_clean_set(struct cache_c *dmc, int set);
+int flashcache_clean_limit(struct cache_c *dmc);
 void flashcache_sync_all(struct cache_c *dmc);
 void flashcache_reclaim_lru_movetail(struct cache_c *dmc, int index);
+void flashcache_stats_sum(struct cache_c *dmc, struct flashcache_stats *sum);
+void flashcache_reclaim_lru2q_insert(struct cache_c *dmc, int index);
+void flashcache_reclaim_lru2q_hit(struct cache_c *dmc, int index);
 void flashcache_merge_writes(struct cache_c *dmc, 
 			     struct dbn_index_pair *writes_list, 
 			     int *nr_writes, int set);
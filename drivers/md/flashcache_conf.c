@@ -60,7 +60,6 @@
 #include "flashcache_ioctl.h"
 
 struct cache_c *cache_list_head = NULL;
-struct work_struct _kcached_wq;
 u_int64_t size_hist[33];
 
 struct kmem_cache *_job_cache;
@@ -71,10 +70,23 @@ mempool_t *_pending_job_pool;
 atomic_t nr_cache_jobs;
 atomic_t nr_pending_jobs;
 
-extern struct list_head *_pending_jobs;
-extern struct list_head *_io_jobs;
-extern struct list_head *_md_io_jobs;
-extern struct list_head *_md_complete_jobs;
+/* 
+ * Reclaim policy new caches are created with (FIFO, LRU or LRU2Q). 
+ * Can be changed per cache afterwards with the reclaim_policy sysctl.
+ */
+static int reclaim_policy = FLASHCACHE_FIFO;
+module_param(reclaim_policy, int, 0644);
+MODULE_PARM_DESC(reclaim_policy, "Default reclaim policy, 0 = FIFO, 1 = LRU, 2 = LRU2Q");
+
+/* 
+ * After a clean shutdown, bring the cache up right away and load the 
+ * metadata in the background (see flashcache_md_load()).
+ */
+static int lazy_md_load = 1;
+module_param(lazy_md_load, int, 0644);
+MODULE_PARM_DESC(lazy_md_load, "Load cache metadata in the background after a clean shutdown");
+
+struct workqueue_struct *flashcache_md_load_wq;
 
 struct flashcache_control_s {
 	unsigned long synch_flags;
@@ -672,6 +684,25 @@ flashcache_writeback_load(struct cache_c *dmc)
 		DMERR("flashcache_writeback_load: Unable to allocate memory");
 		return 1;
 	}
+	if (header->cache_sb_state == CACHE_MD_STATE_CLEAN && lazy_md_load) {
+		/* 
+		 * No DIRTY blocks, so nothing is lost if the metadata turns out 
+		 * to be unreadable later. Come up with an empty cache and let 
+		 * flashcache_md_load() fill it in. The metadata buffer is handed 
+		 * off to the loader.
+		 */
+		for (i = 0 ; i < dmc->size ; i++) {
+			dmc->cache[i].nr_queued = 0;
+			dmc->cache[i].cache_state = INVALID;
+			dmc->cache[i].dbn = 0;
+#ifdef FLASHCACHE_DO_CHECKSUMS
+			dmc->cache[i].checksum = 0;
+#endif
+		}
+		dmc->md_load_buf = meta_data_cacheblock;
+		dmc->md_load_pending = 1;
+		goto write_superblock;
+	}
 	where.sector = MD_SECTORS_PER_BLOCK(dmc);
 	size = dmc->size;
 	i = 0;
@@ -754,6 +785,7 @@ flashcache_writeback_load(struct cache_c *dmc)
 		panic("flashcache_writeback_load: sector mismatch\n");
 	}
 	vfree((void *)meta_data_cacheblock);
+write_superblock:
 	/*
 	 * For writing the superblock out, use the preferred blocksize that 
 	 * we read from the superblock above.
@@ -762,6 +794,8 @@ flashcache_writeback_load(struct cache_c *dmc)
 		vfree((void *)header);
 		header = (struct flash_superblock *)vmalloc(MD_BLOCK_BYTES(dmc));
 		if (!header) {
+			vfree(dmc->cache);
+			vfree(dmc->md_load_buf);
 			DMERR("flashcache_writeback_load: Unable to allocate memory");
 			return 1;
 		}
@@ -784,16 +818,145 @@ flashcache_writeback_load(struct cache_c *dmc)
 	if (error) {
 		vfree((void *)header);
 		vfree(dmc->cache);
+		vfree(dmc->md_load_buf);
 		DMERR("flashcache_writeback_load: Could not write cache superblock %lu error %d !",
 		      where.sector, error);
 		return 1;		
 	}
 	vfree((void *)header);
-	DMINFO("flashcache_writeback_load: Cache metadata loaded from disk with %d valid %d DIRTY blocks", 
-	       num_valid, dirty_loaded);
+	if (dmc->md_load_pending)
+		DMINFO("flashcache_writeback_load: Cache metadata will be loaded in the background");
+	else
+		DMINFO("flashcache_writeback_load: Cache metadata loaded from disk with %d valid %d DIRTY blocks", 
+		       num_valid, dirty_loaded);
 	return 0;
 }
 
+/*
+ * Lazy metadata load. Reads in the metadata for a batch of sets that are 
+ * not loaded yet, sets that IOs are waiting on first, then lets those IOs 
+ * go and requeues itself until the whole cache is in. Sets are md block 
+ * aligned (assoc >= MD_SLOTS_PER_BLOCK), so a batch of sets is a single 
+ * metadata IO.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+void
+flashcache_md_load(void *data)
+{
+	struct cache_c *dmc = (struct cache_c *)data;
+#else
+void
+flashcache_md_load(struct work_struct *work)
+{
+	struct cache_c *dmc = container_of(work, struct cache_c, md_load_work);
+#endif
+	struct flash_cacheblock *next_ptr;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
+	struct io_region where;
+#else
+	struct dm_io_region where;
+#endif
+	struct bio_list bios;
+	struct bio *bio, *next;
+	spinlock_t *set_lock;
+	unsigned int set, nr_sets, max_sets, sectors_per_set;
+	int i, j, index;
+	int error, done;
+
+	sectors_per_set = (dmc->assoc / MD_SLOTS_PER_BLOCK(dmc)) * MD_SECTORS_PER_BLOCK(dmc);
+	max_sets = (METADATA_IO_BLOCKSIZE >> SECTOR_SHIFT) / sectors_per_set;
+
+	spin_lock_irq(&dmc->md_load_lock);
+	/* A bio deferred during the last pass may have queued us once more */
+	if (!dmc->md_load_pending) {
+		spin_unlock_irq(&dmc->md_load_lock);
+		return;
+	}
+	i = -1;
+	if (dmc->md_load_bios.head != NULL)
+		i = flashcache_md_load_check(dmc, dmc->md_load_bios.head);
+	if (i == -1) {
+		while (dmc->md_load_next < dmc->num_sets &&
+		       test_bit(dmc->md_load_next, dmc->md_loaded))
+			dmc->md_load_next++;
+		VERIFY(dmc->md_load_next < dmc->num_sets);
+		set = dmc->md_load_next;
+	} else
+		set = i;
+	nr_sets = 0;
+	while (set + nr_sets < dmc->num_sets && nr_sets < max_sets &&
+	       !test_bit(set + nr_sets, dmc->md_loaded))
+		nr_sets++;
+	spin_unlock_irq(&dmc->md_load_lock);
+
+	where.bdev = dmc->cache_dev->bdev;
+	where.sector = MD_SECTORS_PER_BLOCK(dmc) + (sector_t)set * sectors_per_set;
+	where.count = nr_sets * sectors_per_set;
+	error = flashcache_dm_io_sync_vm(dmc, &where, READ, dmc->md_load_buf);
+	if (error) {
+		/* The cache was clean, we only lose the cached copies */
+		DMERR("flashcache_md_load: Could not read cache metadata block %lu error %d, sets %u-%u left empty !",
+		      where.sector, error, set, set + nr_sets - 1);
+		atomic_inc(&dmc->flashcache_errors.ssd_read_errors);
+	} else {
+		next_ptr = dmc->md_load_buf;
+		for (i = 0 ; i < nr_sets ; i++) {
+			index = (set + i) * dmc->assoc;
+			set_lock = flashcache_set_lock(dmc, set + i);
+			spin_lock_irq(set_lock);
+			for (j = 0 ; j < dmc->assoc ; j++, index++, next_ptr++) {
+				if (!(next_ptr->cache_state & VALID))
+					continue;
+				VERIFY((next_ptr->cache_state & (VALID | INVALID)) 
+				       != (VALID | INVALID));
+				VERIFY((dmc->cache[index].cache_state & VALID) == 0);
+				dmc->cache[index].cache_state = next_ptr->cache_state;
+				dmc->cache[index].dbn = next_ptr->dbn;
+#ifdef FLASHCACHE_DO_CHECKSUMS
+				dmc->cache[index].checksum = next_ptr->checksum;
+#endif
+				atomic_long_inc(&dmc->cached_blocks);
+				if (next_ptr->cache_state & DIRTY) {
+					dmc->cache_sets[set + i].nr_dirty++;
+					atomic_inc(&dmc->nr_dirty);
+				}
+			}
+			spin_unlock_irq(set_lock);
+		}
+	}
+
+	bio_list_init(&bios);
+	spin_lock_irq(&dmc->md_load_lock);
+	for (i = 0 ; i < nr_sets ; i++)
+		set_bit(set + i, dmc->md_loaded);
+	dmc->md_sets_loaded += nr_sets;
+	done = (dmc->md_sets_loaded == dmc->num_sets);
+	if (done)
+		dmc->md_load_pending = 0;
+	bio = bio_list_get(&dmc->md_load_bios);
+	while (bio != NULL) {
+		next = bio->bi_next;
+		bio->bi_next = NULL;
+		if (done || flashcache_md_load_check(dmc, bio) == -1)
+			bio_list_add(&bios, bio);
+		else
+			bio_list_add(&dmc->md_load_bios, bio);
+		bio = next;
+	}
+	spin_unlock_irq(&dmc->md_load_lock);
+	while ((bio = bio_list_pop(&bios)) != NULL)
+		flashcache_map(dmc->tgt, bio, NULL);
+	if (!done) {
+		queue_work(flashcache_md_load_wq, &dmc->md_load_work);
+		return;
+	}
+	vfree((void *)dmc->md_load_buf);
+	dmc->md_load_buf = NULL;
+	DMINFO("flashcache_md_load: Cache metadata loaded from disk with %ld valid blocks",
+	       atomic_long_read(&dmc->cached_blocks));
+	complete_all(&dmc->md_load_done);
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 static void
 flashcache_clean_all_sets(void *data)
@@ -806,10 +969,27 @@ flashcache_clean_all_sets(struct work_struct *work)
 	struct cache_c *dmc = container_of(work, struct cache_c, 
 					   delayed_clean.work);
 #endif
-	int i;
+	int i, set;
 	
-	for (i = 0 ; i < dmc->num_sets ; i++)
-		flashcache_clean_set(dmc, i);
+	/* 
+	 * Sweep the sets in one direction, picking up where the last sweep ran 
+	 * out of cleaning budget, so the low sets don't always go first. Only 
+	 * the writebacks issued for one set are sorted by dbn (and merged), see 
+	 * flashcache_merge_writes(). hash_block() wraps the disk around the 
+	 * sets, so one set holds blocks from every wrap and the sweep as a whole
+	 * is not in ascending dbn order.
+	 */
+	set = dmc->clean_sweep_set;
+	for (i = 0 ; i < dmc->num_sets ; i++) {
+		if (atomic_read(&dmc->clean_inprog) >= flashcache_clean_limit(dmc)) {
+			schedule_delayed_work(&dmc->delayed_clean, 1*HZ);
+			break;
+		}
+		flashcache_clean_set(dmc, set);
+		if (++set == dmc->num_sets)
+			set = 0;
+	}
+	dmc->clean_sweep_set = set;
 }
 
 static int inline
@@ -867,6 +1047,13 @@ flashcache_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		r = ENOMEM;
 		goto bad;
 	}
+	dmc->stats = alloc_percpu(struct flashcache_stats);
+	if (dmc->stats == NULL) {
+		ti->error = "flashcache: Failed to allocate cache stats";
+		r = -ENOMEM;
+		kfree(dmc);
+		goto bad;
+	}
 
 	dmc->tgt = ti;
 	if ((r = flashcache_get_dev(ti, argv[0], &dmc->disk_dev, 
@@ -1045,6 +1232,7 @@ init:
 		ti->error = "Unable to allocate memory";
 		r = -ENOMEM;
 		vfree((void *)dmc->cache);
+		vfree((void *)dmc->md_load_buf);
 		goto bad3;
 	}				
 
@@ -1058,8 +1246,25 @@ init:
 		dmc->cache_sets[i].fallow_next_cleaning = jiffies;
 		dmc->cache_sets[i].lru_tail = FLASHCACHE_LRU_NULL;
 		dmc->cache_sets[i].lru_head = FLASHCACHE_LRU_NULL;
+		dmc->cache_sets[i].lru_hot_head = FLASHCACHE_LRU_NULL;
+		dmc->cache_sets[i].nr_hot = 0;
+		dmc->cache_sets[i].pending_jobs = NULL;
 	}
 
+	dmc->num_set_locks = min_t(unsigned long, dmc->num_sets, FLASHCACHE_NUM_SET_LOCKS);
+	order = dmc->num_set_locks * sizeof(struct cache_set_lock);
+	dmc->set_locks = (struct cache_set_lock *)vmalloc(order);
+	if (!dmc->set_locks) {
+		ti->error = "Unable to allocate memory";
+		r = -ENOMEM;
+		vfree((void *)dmc->cache);
+		vfree((void *)dmc->md_load_buf);
+		vfree((void *)dmc->cache_sets);
+		goto bad3;
+	}
+	for (i = 0 ; i < dmc->num_set_locks ; i++)
+		spin_lock_init(&dmc->set_locks[i].lock);
+
 	/* Push all blocks into the set specific LRUs */
 	for (i = 0 ; i < dmc->size ; i++) {
 		dmc->cache[i].lru_prev = FLASHCACHE_LRU_NULL;
@@ -1074,20 +1279,46 @@ init:
 			ti->error = "Unable to allocate memory";
 			r = -ENOMEM;
 			vfree((void *)dmc->cache);
+			vfree((void *)dmc->md_load_buf);
 			vfree((void *)dmc->cache_sets);
+			vfree((void *)dmc->set_locks);
 			goto bad3;
 		}		
 
 		for (i = 0 ; i < dmc->md_blocks - 1 ; i++) {
 			dmc->md_blocks_buf[i].nr_in_prog = 0;
 			dmc->md_blocks_buf[i].queued_updates = NULL;
+			dmc->md_blocks_buf[i].commit_next = NULL;
 		}
 	}
 
+	if (dmc->md_load_pending) {
+		order = BITS_TO_LONGS(dmc->num_sets) * sizeof(unsigned long);
+		dmc->md_loaded = (unsigned long *)vmalloc(order);
+		if (!dmc->md_loaded) {
+			ti->error = "Unable to allocate memory";
+			r = -ENOMEM;
+			vfree((void *)dmc->cache);
+			vfree((void *)dmc->md_load_buf);
+			vfree((void *)dmc->cache_sets);
+			vfree((void *)dmc->set_locks);
+			vfree((void *)dmc->md_blocks_buf);
+			goto bad3;
+		}
+		memset(dmc->md_loaded, 0, order);
+	}
+
 	spin_lock_init(&dmc->cache_spin_lock);
 
 	dmc->sync_index = 0;
-	dmc->clean_inprog = 0;
+	atomic_set(&dmc->clean_inprog, 0);
+	atomic_set(&dmc->nr_dirty, 0);
+	atomic_long_set(&dmc->cached_blocks, 0);
+	atomic_long_set(&dmc->pending_jobs_count, 0);
+	atomic_set(&dmc->disk_fg_inflight, 0);
+	dmc->disk_fg_latency = 0;
+	dmc->disk_fg_last = jiffies;
+	dmc->clean_sweep_set = 0;
 
 	ti->split_io = dmc->block_size;
 	ti->private = dmc;
@@ -1105,7 +1336,10 @@ init:
 	dmc->sysctl_pid_do_expiry = 0;
 	dmc->sysctl_max_pids = MAX_PIDS;
 	dmc->sysctl_pid_expiry_secs = PID_EXPIRY_SECS;
-	dmc->sysctl_reclaim_policy = FLASHCACHE_FIFO;
+	if (reclaim_policy >= FLASHCACHE_FIFO && reclaim_policy <= FLASHCACHE_LRU2Q)
+		dmc->sysctl_reclaim_policy = reclaim_policy;
+	else
+		dmc->sysctl_reclaim_policy = FLASHCACHE_FIFO;
 	dmc->sysctl_zerostats = 0;
 	dmc->sysctl_error_inject = 0;
 	dmc->sysctl_fast_remove = 0;
@@ -1113,13 +1347,19 @@ init:
 	dmc->sysctl_fallow_clean_speed = FALLOW_CLEAN_SPEED;
 	dmc->sysctl_fallow_delay = FALLOW_DELAY;
 	dmc->sysctl_skip_seq_thresh_kb = SKIP_SEQUENTIAL_THRESHOLD;
+	dmc->sysctl_md_commit_delay_ms = MD_COMMIT_DELAY_MS;
+	dmc->sysctl_clean_adaptive = 1;
+	dmc->sysctl_clean_disk_latency_ms = CLEAN_DISK_LATENCY_MS;
 
 	/* Sequential i/o spotting */	
+	for (i = 0; i < SEQUENTIAL_TRACKER_HASH_SIZE; i++)
+		INIT_HLIST_HEAD(&dmc->seq_io_hash[i]);
 	for (i = 0; i < SEQUENTIAL_TRACKER_QUEUE_DEPTH; i++) {
 		dmc->seq_recent_ios[i].most_recent_sector = 0;
 		dmc->seq_recent_ios[i].sequential_count = 0;
 		dmc->seq_recent_ios[i].prev = (struct sequential_io *)NULL;
 		dmc->seq_recent_ios[i].next = (struct sequential_io *)NULL;
+		INIT_HLIST_NODE(&dmc->seq_recent_ios[i].hash);
 		seq_io_move_to_lruhead(dmc, &dmc->seq_recent_ios[i]);
 	}
 	dmc->seq_io_tail = &dmc->seq_recent_ios[0];
@@ -1134,17 +1374,35 @@ init:
 
 	for (i = 0 ; i < dmc->size ; i++) {
 		if (dmc->cache[i].cache_state & VALID)
-			dmc->cached_blocks++;
+			atomic_long_inc(&dmc->cached_blocks);
 		if (dmc->cache[i].cache_state & DIRTY) {
 			dmc->cache_sets[i / dmc->assoc].nr_dirty++;
-			dmc->nr_dirty++;
+			atomic_inc(&dmc->nr_dirty);
 		}
 	}
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 	INIT_WORK(&dmc->delayed_clean, flashcache_clean_all_sets, dmc);
+	INIT_WORK(&dmc->md_commit_work, flashcache_md_group_commit, dmc);
 #else
 	INIT_DELAYED_WORK(&dmc->delayed_clean, flashcache_clean_all_sets);
+	INIT_DELAYED_WORK(&dmc->md_commit_work, flashcache_md_group_commit);
 #endif
+	dmc->md_commit_head = NULL;
+
+	spin_lock_init(&dmc->md_load_lock);
+	bio_list_init(&dmc->md_load_bios);
+	dmc->md_sets_loaded = 0;
+	dmc->md_load_next = 0;
+	init_completion(&dmc->md_load_done);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	INIT_WORK(&dmc->md_load_work, flashcache_md_load, dmc);
+#else
+	INIT_WORK(&dmc->md_load_work, flashcache_md_load);
+#endif
+	if (dmc->md_load_pending)
+		queue_work(flashcache_md_load_wq, &dmc->md_load_work);
+	else
+		complete_all(&dmc->md_load_done);
 
 	dmc->whitelist_head = NULL;
 	dmc->whitelist_tail = NULL;
@@ -1162,6 +1420,7 @@ bad3:
 bad2:
 	dm_put_device(ti, dmc->disk_dev);
 bad1:
+	free_percpu(dmc->stats);
 	kfree(dmc);
 bad:
 	return r;
@@ -1171,11 +1430,12 @@ static void
 flashcache_dtr_stats_print(struct cache_c *dmc)
 {
 	int read_hit_pct, write_hit_pct, dirty_write_hit_pct;
-	struct flashcache_stats *stats = &dmc->flashcache_stats;
+	struct flashcache_stats sum, *stats = &sum;
 	u_int64_t  cache_pct, dirty_pct;
 	char *cache_mode;
 	int i;
 	
+	flashcache_stats_sum(dmc, stats);
 	if (stats->reads > 0)
 		read_hit_pct = stats->read_hits * 100 / stats->reads;
 	else
@@ -1208,11 +1468,13 @@ flashcache_dtr_stats_print(struct cache_c *dmc)
 		DMINFO("\tpending enqueues(%lu), pending inval(%lu)\n"	\
 		       "\tmetadata dirties(%lu), metadata cleans(%lu)\n" \
 		       "\tmetadata batch(%lu) metadata ssd writes(%lu)\n" \
+		       "\tmetadata group commits(%lu) metadata group commit batch(%lu)\n" \
 		       "\tcleanings(%lu) fallow cleanings(%lu)\n"	\
 		       "\tno room(%lu) front merge(%lu) back merge(%lu)\n",
 		       stats->enqueues, stats->pending_inval,
 		       stats->md_write_dirty, stats->md_write_clean,
 		       stats->md_write_batch, stats->md_ssd_writes,
+		       stats->md_group_commits, stats->md_group_commit_batch,
 		       stats->cleanings, stats->fallow_cleanings, 
 		       stats->noroom, stats->front_merge, stats->back_merge);
 	} else if (dmc->cache_mode == FLASHCACHE_WRITE_THROUGH) {
@@ -1258,8 +1520,8 @@ flashcache_dtr_stats_print(struct cache_c *dmc)
 	       stats->uncached_sequential_reads, stats->uncached_sequential_writes,
                stats->pid_adds, stats->pid_dels, stats->pid_drops, stats->expiry);
 	if (dmc->size > 0) {
-		dirty_pct = ((u_int64_t)dmc->nr_dirty * 100) / dmc->size;
-		cache_pct = ((u_int64_t)dmc->cached_blocks * 100) / dmc->size;
+		dirty_pct = ((u_int64_t)atomic_read(&dmc->nr_dirty) * 100) / dmc->size;
+		cache_pct = ((u_int64_t)atomic_long_read(&dmc->cached_blocks) * 100) / dmc->size;
 	} else {
 		cache_pct = 0;
 		dirty_pct = 0;
@@ -1282,9 +1544,9 @@ flashcache_dtr_stats_print(struct cache_c *dmc)
 	       dmc->block_size>>(10-SECTOR_SHIFT), 
 	       dmc->md_block_size * 512, 
 	       dmc->sysctl_skip_seq_thresh_kb,
-	       dmc->size, dmc->cached_blocks, 
-	       (int)cache_pct, dmc->nr_dirty, (int)dirty_pct);
-	DMINFO("\tnr_queued(%lu)\n", dmc->pending_jobs_count);
+	       dmc->size, atomic_long_read(&dmc->cached_blocks), 
+	       (int)cache_pct, atomic_read(&dmc->nr_dirty), (int)dirty_pct);
+	DMINFO("\tnr_queued(%lu)\n", atomic_long_read(&dmc->pending_jobs_count));
 	DMINFO("Size Hist: ");
 	for (i = 1 ; i <= 32 ; i++) {
 		if (size_hist[i] > 0)
@@ -1305,13 +1567,24 @@ flashcache_dtr(struct dm_target *ti)
 
 	flashcache_dtr_procfs(dmc);
 
+	/* 
+	 * Let the lazy metadata load finish, and make sure no stray run of
+	 * the loader is left queued before the cache goes away.
+	 */
+	wait_for_completion(&dmc->md_load_done);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,22)
+	flush_workqueue(flashcache_md_load_wq);
+#else
+	cancel_work_sync(&dmc->md_load_work);
+#endif
+
 	if (dmc->cache_mode == FLASHCACHE_WRITE_BACK) {
 		flashcache_sync_for_remove(dmc);
 		flashcache_writeback_md_store(dmc);
 	}
-	if (!dmc->sysctl_fast_remove && dmc->nr_dirty > 0)
+	if (!dmc->sysctl_fast_remove && atomic_read(&dmc->nr_dirty) > 0)
 		DMERR("Could not sync %d blocks to disk, cache still dirty", 
-		      dmc->nr_dirty);
+		      atomic_read(&dmc->nr_dirty));
 	DMINFO("cache jobs %d, pending jobs %d", atomic_read(&nr_cache_jobs), 
 	       atomic_read(&nr_pending_jobs));
 	for (i = 0 ; i < dmc->size ; i++)
@@ -1321,8 +1594,10 @@ flashcache_dtr(struct dm_target *ti)
 
 	vfree((void *)dmc->cache);
 	vfree((void *)dmc->cache_sets);
+	vfree((void *)dmc->set_locks);
 	if (dmc->cache_mode == FLASHCACHE_WRITE_BACK)
 		vfree((void *)dmc->md_blocks_buf);
+	vfree((void *)dmc->md_loaded);
 	flashcache_del_all_pids(dmc, FLASHCACHE_WHITELIST, 1);
 	flashcache_del_all_pids(dmc, FLASHCACHE_BLACKLIST, 1);
 	VERIFY(dmc->num_whitelist_pids == 0);
@@ -1344,6 +1619,7 @@ flashcache_dtr(struct dm_target *ti)
 	clear_bit(FLASHCACHE_UPDATE_LIST, &flashcache_control->synch_flags);
 	smp_mb__after_clear_bit();
 	wake_up_bit(&flashcache_control->synch_flags, FLASHCACHE_UPDATE_LIST);
+	free_percpu(dmc->stats);
 	kfree(dmc);
 }
 
@@ -1353,9 +1629,9 @@ flashcache_status_info(struct cache_c *dmc, status_type_t type,
 {
 	int read_hit_pct, write_hit_pct, dirty_write_hit_pct;
 	int sz = 0; /* DMEMIT */
-	struct flashcache_stats *stats = &dmc->flashcache_stats;
+	struct flashcache_stats sum, *stats = &sum;
 
-	
+	flashcache_stats_sum(dmc, stats);
 	if (stats->reads > 0)
 		read_hit_pct = stats->read_hits * 100 / stats->reads;
 	else
@@ -1388,11 +1664,13 @@ flashcache_status_info(struct cache_c *dmc, status_type_t type,
 		DMEMIT("\tpending enqueues(%lu), pending inval(%lu)\n"	\
 		       "\tmetadata dirties(%lu), metadata cleans(%lu)\n" \
 		       "\tmetadata batch(%lu) metadata ssd writes(%lu)\n" \
+		       "\tmetadata group commits(%lu) metadata group commit batch(%lu)\n" \
 		       "\tcleanings(%lu) fallow cleanings(%lu)\n"	\
 		       "\tno room(%lu) front merge(%lu) back merge(%lu)\n",
 		       stats->enqueues, stats->pending_inval,
 		       stats->md_write_dirty, stats->md_write_clean,
 		       stats->md_write_batch, stats->md_ssd_writes,
+		       stats->md_group_commits, stats->md_group_commit_batch,
 		       stats->cleanings, stats->fallow_cleanings, 
 		       stats->noroom, stats->front_merge, stats->back_merge);
 	} else if (dmc->cache_mode == FLASHCACHE_WRITE_THROUGH) {
@@ -1459,8 +1737,8 @@ flashcache_status_table(struct cache_c *dmc, status_type_t type,
 	
 
 	if (dmc->size > 0) {
-		dirty_pct = ((u_int64_t)dmc->nr_dirty * 100) / dmc->size;
-		cache_pct = ((u_int64_t)dmc->cached_blocks * 100) / dmc->size;
+		dirty_pct = ((u_int64_t)atomic_read(&dmc->nr_dirty) * 100) / dmc->size;
+		cache_pct = ((u_int64_t)atomic_long_read(&dmc->cached_blocks) * 100) / dmc->size;
 	} else {
 		cache_pct = 0;
 		dirty_pct = 0;
@@ -1488,13 +1766,13 @@ flashcache_status_table(struct cache_c *dmc, status_type_t type,
 	DMEMIT("\tskip sequential thresh(%uK)\n",
 	       dmc->sysctl_skip_seq_thresh_kb);
 	DMEMIT("\ttotal blocks(%lu), cached blocks(%lu), cache percent(%d)\n",
-	       dmc->size, dmc->cached_blocks,
+	       dmc->size, atomic_long_read(&dmc->cached_blocks),
 	       (int)cache_pct);
 	if (dmc->cache_mode == FLASHCACHE_WRITE_BACK) {
 		DMEMIT("\tdirty blocks(%d), dirty percent(%d)\n",
-		       dmc->nr_dirty, (int)dirty_pct);
+		       atomic_read(&dmc->nr_dirty), (int)dirty_pct);
 	}
-	DMEMIT("\tnr_queued(%lu)\n", dmc->pending_jobs_count);
+	DMEMIT("\tnr_queued(%lu)\n", atomic_long_read(&dmc->pending_jobs_count));
 	DMEMIT("Size Hist: ");
 	for (i = 1 ; i <= 32 ; i++) {
 		if (size_hist[i] > 0)
@@ -1538,6 +1816,8 @@ static struct target_type flashcache_target = {
 static void
 flashcache_sync_for_remove(struct cache_c *dmc)
 {
+	/* All of the metadata has to be in core before it is written back out */
+	wait_for_completion(&dmc->md_load_done);
 	do {
 		atomic_set(&dmc->remove_in_prog, SLOW_REMOVE); /* Stop cleaning of sets */
 		if (!dmc->sysctl_fast_remove) {
@@ -1545,7 +1825,7 @@ flashcache_sync_for_remove(struct cache_c *dmc)
 			 * Kick off cache cleaning. client_destroy will wait for cleanings
 			 * to finish.
 			 */
-			printk(KERN_ALERT "Cleaning %d blocks please WAIT", dmc->nr_dirty);
+			printk(KERN_ALERT "Cleaning %d blocks please WAIT", atomic_read(&dmc->nr_dirty));
 			/* Tune up the cleaning parameters to clean very aggressively */
 			dmc->max_clean_ios_total = 20;
 			dmc->max_clean_ios_set = 10;
@@ -1554,7 +1834,7 @@ flashcache_sync_for_remove(struct cache_c *dmc)
 			/* Needed to abort any in-progress cleanings, leave blocks DIRTY */
 			atomic_set(&dmc->remove_in_prog, FAST_REMOVE);
 			printk(KERN_ALERT "Fast flashcache remove Skipping cleaning of %d blocks", 
-			       dmc->nr_dirty);
+			       atomic_read(&dmc->nr_dirty));
 		}
 		/* 
 		 * We've prevented new cleanings from starting (for the fast remove case)
@@ -1566,8 +1846,9 @@ flashcache_sync_for_remove(struct cache_c *dmc)
 		/* Wait for all the dirty blocks to get written out, and any other IOs */
 		wait_event(dmc->destroyq, !atomic_read(&dmc->nr_jobs));
 		cancel_delayed_work(&dmc->delayed_clean);
+		cancel_delayed_work(&dmc->md_commit_work);
 		flush_scheduled_work();
-	} while (!dmc->sysctl_fast_remove && dmc->nr_dirty > 0);
+	} while (!dmc->sysctl_fast_remove && atomic_read(&dmc->nr_dirty) > 0);
 }
 
 static int 
@@ -1630,6 +1911,11 @@ flashcache_init(void)
 	r = flashcache_jobs_init();
 	if (r)
 		return r;
+	flashcache_md_load_wq = create_singlethread_workqueue("flashcache_md");
+	if (!flashcache_md_load_wq) {
+		flashcache_jobs_exit();
+		return -ENOMEM;
+	}
 	atomic_set(&nr_cache_jobs, 0);
 	atomic_set(&nr_pending_jobs, 0);
 
@@ -1674,11 +1960,7 @@ flashcache_init(void)
 	}
 #endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,22) */
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
-	INIT_WORK(&_kcached_wq, do_work, NULL);
-#else
-	INIT_WORK(&_kcached_wq, do_work);
-#endif
+	flashcache_job_queues_init();
 	for (r = 0 ; r < 33 ; r++)
 		size_hist[r] = 0;
 	r = dm_register_target(&flashcache_target);
@@ -1721,6 +2003,7 @@ flashcache_exit(void)
 	dm_io_put(FLASHCACHE_ASYNC_SIZE);
 #endif
 	unregister_reboot_notifier(&flashcache_notifier);
+	destroy_workqueue(flashcache_md_load_wq);
 	flashcache_jobs_exit();
 	flashcache_module_procfs_releae();
 	kfree(flashcache_control);
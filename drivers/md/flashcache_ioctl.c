@@ -83,14 +83,14 @@ flashcache_drop_pids(struct cache_c *dmc, int which_list)
 			VERIFY(dmc->whitelist_head != NULL);
 			flashcache_del_pid_locked(dmc, dmc->whitelist_tail->pid,
 						  which_list);
-			dmc->flashcache_stats.pid_drops++;
+			FLASHCACHE_STATS_INC(dmc, pid_drops);
 		}
 	} else {
 		while (dmc->num_blacklist_pids >= dmc->sysctl_max_pids) {
 			VERIFY(dmc->blacklist_head != NULL);
 			flashcache_del_pid_locked(dmc, dmc->blacklist_tail->pid,
 						  which_list);
-			dmc->flashcache_stats.pid_drops++;
+			FLASHCACHE_STATS_INC(dmc, pid_drops);
 		}		
 	}
 }
@@ -137,7 +137,7 @@ flashcache_add_pid(struct cache_c *dmc, pid_t pid, int which_list)
 			dmc->num_whitelist_pids++;
 		else
 			dmc->num_blacklist_pids++;
-		dmc->flashcache_stats.pid_adds++;
+		FLASHCACHE_STATS_INC(dmc, pid_adds);
 		/* When adding the first entry to list, set expiry check timeout */
 		if (*head == new)
 			dmc->pid_expire_check = 
@@ -180,7 +180,7 @@ flashcache_del_pid_locked(struct cache_c *dmc, pid_t pid, int which_list)
 			} else
 				node->next->prev = node->prev;
 			kfree(node);
-			dmc->flashcache_stats.pid_dels++;
+			FLASHCACHE_STATS_INC(dmc, pid_dels);
 			if (which_list == FLASHCACHE_WHITELIST)
 				dmc->num_whitelist_pids--;
 			else
@@ -282,7 +282,7 @@ flashcache_pid_expiry_list_locked(struct cache_c *dmc, int which_list)
 			dmc->num_whitelist_pids--;
 		else
 			dmc->num_blacklist_pids--;
-		dmc->flashcache_stats.expiry++;
+		FLASHCACHE_STATS_INC(dmc, expiry);
 	}
 }
 
@@ -306,12 +306,21 @@ flashcache_pid_expiry_all_locked(struct cache_c *dmc)
  * 1) Check the pid (thread id) against the list. 
  * 2) Check the tgid against the list, then check for exceptions within the tgid.
  * 3) Possibly don't cache sequential i/o.
+ * The pid lists and the sequential tracker are protected by cache_spin_lock,
+ * which this takes itself (callers may hold set locks). In the common case of
+ * caching everything with no blacklist and no sequential skipping, the lock is
+ * not taken at all.
  */
 int
 flashcache_uncacheable(struct cache_c *dmc, struct bio *bio)
 {
 	int dontcache;
+	unsigned long flags;
 	
+	if (dmc->sysctl_cache_all && dmc->blacklist_head == NULL &&
+	    dmc->sysctl_skip_seq_thresh_kb == 0)
+		return 0;
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
 	if (dmc->sysctl_cache_all) {
 		/* If the tid has been blacklisted, we don't cache at all.
 		   This overrides everything else */
@@ -364,14 +373,46 @@ flashcache_uncacheable(struct cache_c *dmc, struct bio *bio)
   		 */
 	}
 out:
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
 	return dontcache;
 }
 
-/* Below 2 functions manage the LRU cache of recent IO 'flows'.  
+/* Below functions manage the LRU cache of recent IO 'flows'.  
  * A sequential IO will only take up one slot (we keep updating the 
  * last sector seen) but random IO will quickly fill multiple slots.  
  * We allocate the LRU cache from a small fixed sized buffer at startup. 
+ * Flows are also hashed on the last sector seen, so that finding the flow
+ * an IO continues is a single bucket walk rather than a scan of the LRU.
  */
+static inline struct hlist_head *
+seq_io_hash_bucket(struct cache_c *dmc, sector_t sector)
+{
+	return &dmc->seq_io_hash[hash_long((unsigned long)(sector >> dmc->block_shift), 
+					   SEQUENTIAL_TRACKER_HASH_BITS)];
+}
+
+static struct sequential_io *
+seq_io_lookup(struct cache_c *dmc, sector_t sector)
+{
+	struct sequential_io *seqio;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(seqio, node, seq_io_hash_bucket(dmc, sector), hash) {
+		if (seqio->most_recent_sector == sector)
+			return seqio;
+	}
+	return NULL;
+}
+
+/* Move the flow to the bucket for its (updated) most_recent_sector */
+static void
+seq_io_rehash(struct cache_c *dmc, struct sequential_io *seqio)
+{
+	if (!hlist_unhashed(&seqio->hash))
+		hlist_del(&seqio->hash);
+	hlist_add_head(&seqio->hash, seq_io_hash_bucket(dmc, seqio->most_recent_sector));
+}
+
 void
 seq_io_remove_from_lru(struct cache_c *dmc, struct sequential_io *seqio)
 {
@@ -431,47 +472,46 @@ skip_sequential_io(struct cache_c *dmc, struct bio *bio)
 		goto out;
 	}
 
-	/* locking : We are already within cache_spin_lock so we don't
-	 * need to explicitly lock our data structures.
+	/* locking : We are called from flashcache_uncacheable() under 
+	 * cache_spin_lock so we don't need to explicitly lock our data structures.
  	 */
 
 	/* Is it a continuation of recent i/o?  Try to find a match.  */
 	DPRINTK("skip_sequential_io: searching for %ld", bio->bi_sector);
-	/* search the list in LRU order so single sequential flow hits first slot */
-	for (seqio = dmc->seq_io_head; seqio != NULL && sequential == 0; seqio = seqio->next) { 
-
-		if (bio->bi_sector == seqio->most_recent_sector) {
-			/* Reread or write same sector again.  Ignore but move to head */
-			DPRINTK("skip_sequential_io: repeat");
-			sequential = 1;
-			if (dmc->seq_io_head != seqio)
-				seq_io_move_to_lruhead(dmc, seqio);
-		}
-		/* i/o to one block more than the previous i/o = sequential */	
-		else if (bio->bi_sector == seqio->most_recent_sector + dmc->block_size) {
-			DPRINTK("skip_sequential_io: sequential found");
-			/* Update stats.  */
-			seqio->most_recent_sector = bio->bi_sector;
-			seqio->sequential_count++;
-			sequential = 1;
-
-			/* And move to head, if not head already */
-			if (dmc->seq_io_head != seqio)
-				seq_io_move_to_lruhead(dmc, seqio);
-
-			/* Is it now sequential enough to be sure? (threshold expressed in kb) */
-			if (to_bytes(seqio->sequential_count * dmc->block_size) > dmc->sysctl_skip_seq_thresh_kb * 1024) {
-				DPRINTK("skip_sequential_io: Sequential i/o detected, seq count now %lu", 
-					seqio->sequential_count);
-				/* Sufficiently sequential */
-				skip = 1;
-			}
+	if ((seqio = seq_io_lookup(dmc, bio->bi_sector)) != NULL) {
+		/* Reread or write same sector again.  Ignore but move to head */
+		DPRINTK("skip_sequential_io: repeat");
+		sequential = 1;
+		if (dmc->seq_io_head != seqio)
+			seq_io_move_to_lruhead(dmc, seqio);
+	}
+	/* i/o to one block more than the previous i/o = sequential */	
+	else if (bio->bi_sector >= dmc->block_size &&
+		 (seqio = seq_io_lookup(dmc, bio->bi_sector - dmc->block_size)) != NULL) {
+		DPRINTK("skip_sequential_io: sequential found");
+		/* Update stats.  */
+		seqio->most_recent_sector = bio->bi_sector;
+		seq_io_rehash(dmc, seqio);
+		seqio->sequential_count++;
+		sequential = 1;
+
+		/* And move to head, if not head already */
+		if (dmc->seq_io_head != seqio)
+			seq_io_move_to_lruhead(dmc, seqio);
+
+		/* Is it now sequential enough to be sure? (threshold expressed in kb) */
+		if (to_bytes(seqio->sequential_count * dmc->block_size) > dmc->sysctl_skip_seq_thresh_kb * 1024) {
+			DPRINTK("skip_sequential_io: Sequential i/o detected, seq count now %lu", 
+				seqio->sequential_count);
+			/* Sufficiently sequential */
+			skip = 1;
 		}
 	}
 	if (!sequential) {
 		/* Record the start of some new i/o, maybe we'll spot it as 
 		 * sequential soon.  */
 		DPRINTK("skip_sequential_io: concluded that its random i/o");
+		FLASHCACHE_STATS_INC(dmc, seq_stream_misses);
 
 		seqio = dmc->seq_io_tail;
 		seq_io_move_to_lruhead(dmc, seqio);
@@ -481,14 +521,16 @@ skip_sequential_io(struct cache_c *dmc, struct bio *bio)
 		/* Fill in data */
 		seqio->most_recent_sector = bio->bi_sector;
 		seqio->sequential_count	  = 1;
-	}
+		seq_io_rehash(dmc, seqio);
+	} else
+		FLASHCACHE_STATS_INC(dmc, seq_stream_hits);
 	DPRINTK("skip_sequential_io: complete.");
 out:
 	if (skip) {
 		if (bio_data_dir(bio) == READ)
-	        	dmc->flashcache_stats.uncached_sequential_reads++;
+	        	FLASHCACHE_STATS_INC(dmc, uncached_sequential_reads);
 		else 
-	        	dmc->flashcache_stats.uncached_sequential_writes++;
+	        	FLASHCACHE_STATS_INC(dmc, uncached_sequential_writes);
 	}
 
 	return skip;
@@ -67,10 +67,8 @@
  * TODO List :
  * 1) Management of non cache pids : Needs improvement. Remove registration
  * on process exits (with  a pseudo filesstem'ish approach perhaps) ?
- * 2) Breaking up the cache spinlock : Right now contention on the spinlock
- * is not a problem. Might need change in future.
- * 3) Use the standard linked list manipulation macros instead rolling our own.
- * 4) Fix a security hole : A malicious process with 'ro' access to a file can 
+ * 2) Use the standard linked list manipulation macros instead rolling our own.
+ * 3) Fix a security hole : A malicious process with 'ro' access to a file can 
  * potentially corrupt file data. This can be fixed by copying the data on a
  * cache read miss.
  */
@@ -81,13 +79,16 @@ char *flashcache_sw_version = FLASHCACHE_SW_VERSION;
 static void flashcache_read_miss(struct cache_c *dmc, struct bio* bio,
 				 int index);
 static void flashcache_write(struct cache_c *dmc, struct bio* bio);
-static int flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio);
+static int flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio,
+				   int *writeback_index);
 static void flashcache_dirty_writeback(struct cache_c *dmc, int index);
 void flashcache_sync_blocks(struct cache_c *dmc);
 static void flashcache_start_uncached_io(struct cache_c *dmc, struct bio *bio);
+static void flashcache_lock_bio_sets(struct cache_c *dmc, struct bio *bio);
+static void flashcache_unlock_bio_sets(struct cache_c *dmc, struct bio *bio);
 
-extern struct work_struct _kcached_wq;
 extern u_int64_t size_hist[];
+extern struct workqueue_struct *flashcache_md_load_wq;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,26)
 extern struct dm_kcopyd_client *flashcache_kcp_client; /* Kcopyd client for writing back data */
@@ -171,6 +172,26 @@ flashcache_clear_fallow(struct cache_c *dmc, int index)
 	}
 }
 
+/* 
+ * Foreground disk IOs (read misses and uncached IOs) are tracked so that 
+ * cleaning can get out of their way, see flashcache_clean_limit().
+ */
+static inline void
+flashcache_disk_io_start(struct cache_c *dmc, struct kcached_job *job)
+{
+	job->disk_start = jiffies;
+	atomic_inc(&dmc->disk_fg_inflight);
+}
+
+static inline void
+flashcache_disk_io_done(struct cache_c *dmc, struct kcached_job *job)
+{
+	/* 1/8 weight EWMA, kept scaled by 8 */
+	dmc->disk_fg_latency += (jiffies - job->disk_start) - (dmc->disk_fg_latency >> 3);
+	dmc->disk_fg_last = jiffies;
+	atomic_dec(&dmc->disk_fg_inflight);
+}
+
 void 
 flashcache_io_callback(unsigned long error, void *context)
 {
@@ -180,6 +201,7 @@ flashcache_io_callback(unsigned long error, void *context)
 	unsigned long flags;
 	int index = job->index;
 	struct cacheblock *cacheblk = &dmc->cache[index];
+	spinlock_t *set_lock = INDEX_TO_SET_LOCK(dmc, index);
 
 	VERIFY(index != -1);		
 	bio = job->bio;
@@ -194,34 +216,32 @@ flashcache_io_callback(unsigned long error, void *context)
 	case READDISK:
 		DPRINTK("flashcache_io_callback: READDISK  %d",
 			index);
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-		if (unlikely(dmc->sysctl_error_inject & READDISK_ERROR)) {
+		flashcache_disk_io_done(dmc, job);
+		spin_lock_irqsave(set_lock, flags);
+		if (unlikely(flashcache_inject_error(dmc, READDISK_ERROR))) {
 			job->error = error = -EIO;
-			dmc->sysctl_error_inject &= ~READDISK_ERROR;
 		}
 		VERIFY(cacheblk->cache_state & DISKREADINPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		if (likely(error == 0)) {
 			/* Kick off the write to the cache */
 			job->action = READFILL;
 			push_io(job);
-			schedule_work(&_kcached_wq);
 			return;
 		} else
-			dmc->flashcache_errors.disk_read_errors++;			
+			atomic_inc(&dmc->flashcache_errors.disk_read_errors);			
 		break;
 	case READCACHE:
 		DPRINTK("flashcache_io_callback: READCACHE %d",
 			index);
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-		if (unlikely(dmc->sysctl_error_inject & READCACHE_ERROR)) {
+		spin_lock_irqsave(set_lock, flags);
+		if (unlikely(flashcache_inject_error(dmc, READCACHE_ERROR))) {
 			job->error = error = -EIO;
-			dmc->sysctl_error_inject &= ~READCACHE_ERROR;
 		}
 		VERIFY(cacheblk->cache_state & CACHEREADINPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		if (unlikely(error))
-			dmc->flashcache_errors.ssd_read_errors++;
+			atomic_inc(&dmc->flashcache_errors.ssd_read_errors);
 #ifdef FLASHCACHE_DO_CHECKSUMS
 		if (likely(error == 0)) {
 			if (flashcache_validate_checksum(job)) {
@@ -235,30 +255,28 @@ flashcache_io_callback(unsigned long error, void *context)
 	case READFILL:
 		DPRINTK("flashcache_io_callback: READFILL %d",
 			index);
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-		if (unlikely(dmc->sysctl_error_inject & READFILL_ERROR)) {
+		spin_lock_irqsave(set_lock, flags);
+		if (unlikely(flashcache_inject_error(dmc, READFILL_ERROR))) {
 			job->error = error = -EIO;
-			dmc->sysctl_error_inject &= ~READFILL_ERROR;
 		}
 		if (unlikely(error))
-			dmc->flashcache_errors.ssd_write_errors++;
+			atomic_inc(&dmc->flashcache_errors.ssd_write_errors);
 		VERIFY(cacheblk->cache_state & DISKREADINPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		break;
 	case WRITECACHE:
 		DPRINTK("flashcache_io_callback: WRITECACHE %d",
 			index);
-		if (unlikely(dmc->sysctl_error_inject & WRITECACHE_ERROR)) {
+		if (unlikely(flashcache_inject_error(dmc, WRITECACHE_ERROR))) {
 			job->error = error = -EIO;
-			dmc->sysctl_error_inject &= ~WRITECACHE_ERROR;
 		}
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(set_lock, flags);
 		VERIFY(cacheblk->cache_state & CACHEWRITEINPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		if (likely(error == 0)) {
 			if (dmc->cache_mode == FLASHCACHE_WRITE_BACK) {
 #ifdef FLASHCACHE_DO_CHECKSUMS
-				dmc->flashcache_stats.checksum_store++;
+				FLASHCACHE_STATS_INC(dmc, checksum_store);
 				flashcache_store_checksum(job);
 				/* 
 				 * We need to update the metadata on a DIRTY->DIRTY as well 
@@ -278,11 +296,11 @@ flashcache_io_callback(unsigned long error, void *context)
 				VERIFY(dmc->cache_mode == FLASHCACHE_WRITE_THROUGH);
 #ifdef FLASHCACHE_DO_CHECKSUMS
 				flashcache_store_checksum(job);
-				job->dmc->flashcache_stats.checksum_store++;
+				FLASHCACHE_STATS_INC(job->dmc, checksum_store);
 #endif
 			}
 		} else {
-			dmc->flashcache_errors.ssd_write_errors++;
+			atomic_inc(&dmc->flashcache_errors.ssd_write_errors);
 			if (dmc->cache_mode == FLASHCACHE_WRITE_THROUGH)
 				/* 
 				 * We don't know if the IO failed because of a ssd write
@@ -291,7 +309,7 @@ flashcache_io_callback(unsigned long error, void *context)
 				 * the IO to succeed as long as the disk write suceeded.
 				 * and invalidate the cache block.
 				 */
-				dmc->flashcache_errors.disk_write_errors++;
+				atomic_inc(&dmc->flashcache_errors.disk_write_errors);
 		}
 		break;
 	}
@@ -301,14 +319,13 @@ flashcache_io_callback(unsigned long error, void *context)
 	 * processed. We need to loop the pending requests back to a workqueue. We have the job,
 	 * add it to the pending req queue.
 	 */
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	if (unlikely(error || cacheblk->nr_queued > 0)) {
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		push_pending(job);
-		schedule_work(&_kcached_wq);
 	} else {
 		cacheblk->cache_state &= ~BLOCK_IO_INPROG;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		flashcache_free_cache_job(job);
 		if (atomic_dec_and_test(&dmc->nr_jobs))
 			wake_up(&dmc->destroyq);
@@ -321,7 +338,7 @@ flashcache_free_pending_jobs(struct cache_c *dmc, struct cacheblock *cacheblk,
 {
 	struct pending_job *pending_job, *freelist = NULL;
 
-	VERIFY(spin_is_locked(&dmc->cache_spin_lock));
+	VERIFY(spin_is_locked(INDEX_TO_SET_LOCK(dmc, cacheblk - &dmc->cache[0])));
 	freelist = flashcache_deq_pending(dmc, cacheblk - &dmc->cache[0]);
 	while (freelist != NULL) {
 		pending_job = freelist;
@@ -346,26 +363,26 @@ flashcache_do_pending_error(struct kcached_job *job)
 	struct cache_c *dmc = job->dmc;
 	unsigned long flags;
 	struct cacheblock *cacheblk = &dmc->cache[job->index];
+	spinlock_t *set_lock = INDEX_TO_SET_LOCK(dmc, job->index);
 
 	DMERR("flashcache_do_pending_error: error %d block %lu action %d", 
 	      job->error, job->job_io_regions.disk.sector, job->action);
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	VERIFY(cacheblk->cache_state & VALID);
 	/* Invalidate block if possible */
 	if ((cacheblk->cache_state & DIRTY) == 0) {
-		dmc->cached_blocks--;
-		dmc->flashcache_stats.pending_inval++;
+		atomic_long_dec(&dmc->cached_blocks);
+		FLASHCACHE_STATS_INC(dmc, pending_inval);
 		cacheblk->cache_state &= ~VALID;
 		cacheblk->cache_state |= INVALID;
 	}
 	flashcache_free_pending_jobs(dmc, cacheblk, job->error);
 	cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	spin_unlock_irqrestore(set_lock, flags);
 	flashcache_free_cache_job(job);
 	if (atomic_dec_and_test(&dmc->nr_jobs))
 		wake_up(&dmc->destroyq);
 }
-
 static void
 flashcache_do_pending_noerror(struct kcached_job *job)
 {
@@ -373,24 +390,25 @@ flashcache_do_pending_noerror(struct kcached_job *job)
 	int index = job->index;
 	unsigned long flags;
 	struct pending_job *pending_job, *freelist;
-	int queued;
+	int queued, writeback_index;
 	struct cacheblock *cacheblk = &dmc->cache[index];
+	spinlock_t *set_lock = INDEX_TO_SET_LOCK(dmc, index);
 
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	if (cacheblk->cache_state & DIRTY) {
 		VERIFY(dmc->cache_mode == FLASHCACHE_WRITE_BACK);
 		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
 		cacheblk->cache_state |= DISKWRITEINPROG;
 		flashcache_clear_fallow(dmc, index);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		flashcache_dirty_writeback(dmc, index);
 		goto out;
 	}
 	DPRINTK("flashcache_do_pending: Index %d %lx",
 		index, cacheblk->cache_state);
 	VERIFY(cacheblk->cache_state & VALID);
-	dmc->cached_blocks--;
-	dmc->flashcache_stats.pending_inval++;
+	atomic_long_dec(&dmc->cached_blocks);
+	FLASHCACHE_STATS_INC(dmc, pending_inval);
 	cacheblk->cache_state &= ~VALID;
 	cacheblk->cache_state |= INVALID;
 	while ((freelist = flashcache_deq_pending(dmc, index)) != NULL) {
@@ -400,11 +418,21 @@ flashcache_do_pending_noerror(struct kcached_job *job)
 			freelist = pending_job->next;
 			VERIFY(cacheblk->nr_queued > 0);
 			cacheblk->nr_queued--;
+			spin_unlock_irqrestore(set_lock, flags);
 			if (pending_job->action == INVALIDATE) {
 				DPRINTK("flashcache_do_pending: INVALIDATE  %llu",
 					pending_job->bio->bi_sector);
 				VERIFY(pending_job->bio != NULL);
-				queued = flashcache_inval_blocks(dmc, pending_job->bio);
+				/* 
+				 * The bio may straddle into the neighbouring set, 
+				 * so retake the set lock(s) covering the bio.
+				 */
+				flashcache_lock_bio_sets(dmc, pending_job->bio);
+				queued = flashcache_inval_blocks(dmc, pending_job->bio, 
+								 &writeback_index);
+				flashcache_unlock_bio_sets(dmc, pending_job->bio);
+				if (writeback_index != -1)
+					flashcache_dirty_writeback(dmc, writeback_index);
 				if (queued) {
 					if (unlikely(queued < 0)) {
 						/*
@@ -414,21 +442,21 @@ flashcache_do_pending_noerror(struct kcached_job *job)
 						flashcache_bio_endio(pending_job->bio, -EIO, dmc, NULL);
 					}
 					flashcache_free_pending_job(pending_job);
+					spin_lock_irqsave(set_lock, flags);
 					continue;
 				}
 			}
-			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
 			DPRINTK("flashcache_do_pending: Sending down IO %llu",
 				pending_job->bio->bi_sector);
 			/* Start uncached IO */
 			flashcache_start_uncached_io(dmc, pending_job->bio);
 			flashcache_free_pending_job(pending_job);
-			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+			spin_lock_irqsave(set_lock, flags);
 		}
 	}
 	VERIFY(cacheblk->nr_queued == 0);
 	cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	spin_unlock_irqrestore(set_lock, flags);
 out:
 	flashcache_free_cache_job(job);
 	if (atomic_dec_and_test(&dmc->nr_jobs))
@@ -454,10 +482,10 @@ flashcache_do_io(struct kcached_job *job)
 	VERIFY(job->action == READFILL);
 #ifdef FLASHCACHE_DO_CHECKSUMS
 	flashcache_store_checksum(job);
-	job->dmc->flashcache_stats.checksum_store++;
+	FLASHCACHE_STATS_INC(job->dmc, checksum_store);
 #endif
 	/* Write to cache device */
-	job->dmc->flashcache_stats.ssd_writes++;
+	FLASHCACHE_STATS_INC(job->dmc, ssd_writes);
 	r = dm_io_async_bvec(1, &job->job_io_regions.cache, WRITE, bio->bi_io_vec + bio->bi_idx,
 			     flashcache_io_callback, job);
 	VERIFY(r == 0);
@@ -479,6 +507,95 @@ hash_block(struct cache_c *dmc, sector_t dbn)
 	return set_number;
 }
 
+/*
+ * A bio can straddle 2 cache sets (see flashcache_inval_blocks()), so 
+ * the set locks covering both the start and the end of the bio are 
+ * taken, in ascending order. Only called from process context.
+ */
+static void
+flashcache_bio_set_locks(struct cache_c *dmc, struct bio *bio,
+			 spinlock_t **first, spinlock_t **second)
+{
+	spinlock_t *start_lock, *end_lock;
+
+	start_lock = flashcache_set_lock(dmc, hash_block(dmc, bio->bi_sector));
+	end_lock = flashcache_set_lock(dmc, 
+				       hash_block(dmc, bio->bi_sector + 
+						  (to_sector(bio->bi_size) - 1)));
+	if (start_lock == end_lock) {
+		*first = start_lock;
+		*second = NULL;
+	} else if (start_lock < end_lock) {
+		*first = start_lock;
+		*second = end_lock;
+	} else {
+		*first = end_lock;
+		*second = start_lock;
+	}
+}
+
+/*
+ * Lazy metadata load : returns the first set the bio touches whose metadata
+ * isn't loaded yet, -1 if it can go ahead. Called with md_load_lock held.
+ */
+int
+flashcache_md_load_check(struct cache_c *dmc, struct bio *bio)
+{
+	unsigned long start_set, end_set;
+
+	start_set = hash_block(dmc, bio->bi_sector);
+	if (!test_bit(start_set, dmc->md_loaded))
+		return start_set;
+	end_set = hash_block(dmc, bio->bi_sector + (to_sector(bio->bi_size) - 1));
+	if (!test_bit(end_set, dmc->md_loaded))
+		return end_set;
+	return -1;
+}
+
+/* 
+ * Park a bio that touches a set that isn't loaded yet, and kick the loader 
+ * so it does that set next. flashcache_md_load() reissues the bio.
+ */
+static int
+flashcache_md_load_defer(struct cache_c *dmc, struct bio *bio)
+{
+	unsigned long flags;
+	int deferred = 0;
+
+	spin_lock_irqsave(&dmc->md_load_lock, flags);
+	if (dmc->md_load_pending && flashcache_md_load_check(dmc, bio) != -1) {
+		bio_list_add(&dmc->md_load_bios, bio);
+		FLASHCACHE_STATS_INC(dmc, md_load_deferred);
+		/* Queued under the lock, so never once the load is done */
+		queue_work(flashcache_md_load_wq, &dmc->md_load_work);
+		deferred = 1;
+	}
+	spin_unlock_irqrestore(&dmc->md_load_lock, flags);
+	return deferred;
+}
+
+static void
+flashcache_lock_bio_sets(struct cache_c *dmc, struct bio *bio)
+{
+	spinlock_t *first, *second;
+
+	flashcache_bio_set_locks(dmc, bio, &first, &second);
+	spin_lock_irq(first);
+	if (second != NULL)
+		spin_lock_nested(second, SINGLE_DEPTH_NESTING);
+}
+
+static void
+flashcache_unlock_bio_sets(struct cache_c *dmc, struct bio *bio)
+{
+	spinlock_t *first, *second;
+
+	flashcache_bio_set_locks(dmc, bio, &first, &second);
+	if (second != NULL)
+		spin_unlock(second);
+	spin_unlock_irq(first);
+}
+
 static void
 find_valid_dbn(struct cache_c *dmc, sector_t dbn, 
 	       int start_index, int *valid, int *invalid)
@@ -491,9 +608,12 @@ find_valid_dbn(struct cache_c *dmc, sector_t dbn,
 		if (dbn == dmc->cache[i].dbn &&
 		    (dmc->cache[i].cache_state & VALID)) {
 			*valid = i;
-			if (dmc->sysctl_reclaim_policy == FLASHCACHE_LRU &&
-			    ((dmc->cache[i].cache_state & BLOCK_IO_INPROG) == 0))
-				flashcache_reclaim_lru_movetail(dmc, i);
+			if ((dmc->cache[i].cache_state & BLOCK_IO_INPROG) == 0) {
+				if (dmc->sysctl_reclaim_policy == FLASHCACHE_LRU)
+					flashcache_reclaim_lru_movetail(dmc, i);
+				else if (dmc->sysctl_reclaim_policy == FLASHCACHE_LRU2Q)
+					flashcache_reclaim_lru2q_hit(dmc, i);
+			}
 			/* 
 			 * If the block was DIRTY and earmarked for cleaning because it was old, make 
 			 * the block young again.
@@ -501,14 +621,18 @@ find_valid_dbn(struct cache_c *dmc, sector_t dbn,
 			flashcache_clear_fallow(dmc, i);
 			return;
 		}
-		if (*invalid == -1 && dmc->cache[i].cache_state == INVALID) {
+		if (*invalid == -1 && 
+		    (dmc->cache[i].cache_state & ~LRU_HOT) == INVALID) {
 			VERIFY((dmc->cache[i].cache_state & FALLOW_DOCLEAN) == 0);
 			*invalid = i;
 		}
 	}
-	if (*valid == -1 && *invalid != -1)
+	if (*valid == -1 && *invalid != -1) {
 		if (dmc->sysctl_reclaim_policy == FLASHCACHE_LRU)
 			flashcache_reclaim_lru_movetail(dmc, *invalid);
+		else if (dmc->sysctl_reclaim_policy == FLASHCACHE_LRU2Q)
+			flashcache_reclaim_lru2q_insert(dmc, *invalid);
+	}
 }
 
 /* Search for a slot that we can reclaim */
@@ -528,7 +652,7 @@ find_reclaim_dbn(struct cache_c *dmc, int start_index, int *index)
 		while (slots_searched < dmc->assoc) {
 			VERIFY(i >= start_index);
 			VERIFY(i < end_index);
-			if (dmc->cache[i].cache_state == VALID) {
+			if ((dmc->cache[i].cache_state & ~LRU_HOT) == VALID) {
 				*index = i;
 				VERIFY((dmc->cache[*index].cache_state & FALLOW_DOCLEAN) == 0);
 				break;
@@ -542,18 +666,22 @@ find_reclaim_dbn(struct cache_c *dmc, int start_index, int *index)
 		if (i == end_index)
 			i = start_index;
 		cache_set->set_fifo_next = i;
-	} else { /* reclaim_policy == FLASHCACHE_LRU */
+	} else { /* reclaim_policy == FLASHCACHE_LRU or FLASHCACHE_LRU2Q */
 		int lru_rel_index;
 
+		/* For LRU2Q, the head of the list is the cold segment */
 		lru_rel_index = cache_set->lru_head;
 		while (lru_rel_index != FLASHCACHE_LRU_NULL) {
 			cacheblk = &dmc->cache[lru_rel_index + start_index];
-			if (cacheblk->cache_state == VALID) {
+			if ((cacheblk->cache_state & ~LRU_HOT) == VALID) {
 				VERIFY((cacheblk - &dmc->cache[0]) == 
 				       (lru_rel_index + start_index));
 				*index = cacheblk - &dmc->cache[0];
 				VERIFY((dmc->cache[*index].cache_state & FALLOW_DOCLEAN) == 0);
-				flashcache_reclaim_lru_movetail(dmc, *index);
+				if (dmc->sysctl_reclaim_policy == FLASHCACHE_LRU2Q)
+					flashcache_reclaim_lru2q_insert(dmc, *index);
+				else
+					flashcache_reclaim_lru_movetail(dmc, *index);
 				break;
 			}
 			lru_rel_index = cacheblk->lru_next;
@@ -610,7 +738,7 @@ flashcache_lookup(struct cache_c *dmc, struct bio *bio, int *index)
 	if (*index < (start_index + dmc->assoc))
 		return INVALID;
 	else {
-		dmc->flashcache_stats.noroom++;
+		FLASHCACHE_STATS_INC(dmc, noroom);
 		return -1;
 	}
 }
@@ -628,7 +756,6 @@ flashcache_md_write_callback(unsigned long error, void *context)
 	else
 		job->error = 0;
 	push_md_complete(job);
-	schedule_work(&_kcached_wq);
 }
 
 static int
@@ -637,18 +764,17 @@ flashcache_alloc_md_sector(struct kcached_job *job)
 	struct page *page = NULL;
 	struct cache_c *dmc = job->dmc;	
 	
-	if (likely((dmc->sysctl_error_inject & MD_ALLOC_SECTOR_ERROR) == 0)) {
+	if (likely(!flashcache_inject_error(dmc, MD_ALLOC_SECTOR_ERROR))) {
 		unsigned long addr;
 
 		/* Get physically consecutive pages */
 		addr = __get_free_pages(GFP_NOIO, get_order(MD_BLOCK_BYTES(job->dmc)));
 		if (addr)
 			page = virt_to_page(addr);
-	} else
-		dmc->sysctl_error_inject &= ~MD_ALLOC_SECTOR_ERROR;
+	}
 	job->md_io_bvec.bv_page = page;
 	if (unlikely(page == NULL)) {
-		job->dmc->flashcache_errors.memory_alloc_errors++;
+		atomic_inc(&job->dmc->flashcache_errors.memory_alloc_errors);
 		return -ENOMEM;
 	}
 	job->md_io_bvec.bv_len = MD_BLOCK_BYTES(job->dmc);
@@ -679,6 +805,7 @@ flashcache_md_write_kickoff(struct kcached_job *job)
 	struct cache_md_block_head *md_block_head;
 	struct kcached_job *orig_job = job;
 	unsigned long flags;
+	spinlock_t *set_lock = INDEX_TO_SET_LOCK(dmc, job->index);
 
 	if (flashcache_alloc_md_sector(job)) {
 		DMERR("flashcache: %d: Cache metadata write failed, cannot alloc page ! block %lu", 
@@ -686,7 +813,7 @@ flashcache_md_write_kickoff(struct kcached_job *job)
 		flashcache_md_write_callback(-EIO, job);
 		return;
 	}
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	/*
 	 * Transfer whatever is on the pending queue to the md_io_inprog queue.
 	 */
@@ -719,7 +846,7 @@ flashcache_md_write_kickoff(struct kcached_job *job)
 	for (job = md_block_head->md_io_inprog ; 
 	     job != NULL ;
 	     job = job->next) {
-		dmc->flashcache_stats.md_write_batch++;
+		FLASHCACHE_STATS_INC(dmc, md_write_batch);
 		if (job->action == WRITECACHE) {
 			/* DIRTY the cache block */
 			md_block[INDEX_TO_MD_BLOCK_OFFSET(dmc, job->index)].cache_state = 
@@ -729,12 +856,12 @@ flashcache_md_write_kickoff(struct kcached_job *job)
 			md_block[INDEX_TO_MD_BLOCK_OFFSET(dmc, job->index)].cache_state = VALID;
 		}
 	}
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	spin_unlock_irqrestore(set_lock, flags);
 	where.bdev = dmc->cache_dev->bdev;
 	where.count = MD_SECTORS_PER_BLOCK(dmc);
 	where.sector = (1 + INDEX_TO_MD_BLOCK(dmc, orig_job->index)) * MD_SECTORS_PER_BLOCK(dmc);
-	dmc->flashcache_stats.ssd_writes++;
-	dmc->flashcache_stats.md_ssd_writes++;
+	FLASHCACHE_STATS_INC(dmc, ssd_writes);
+	FLASHCACHE_STATS_INC(dmc, md_ssd_writes);
 	dm_io_async_bvec(1, &where, WRITE,
 			 &orig_job->md_io_bvec,
 			 flashcache_md_write_callback, orig_job);
@@ -751,6 +878,7 @@ flashcache_md_write_done(struct kcached_job *job)
 	int error = job->error;
 	struct kcached_job *next;
 	struct cacheblock *cacheblk;
+	spinlock_t *set_lock = INDEX_TO_SET_LOCK(dmc, job->index);
 		
 	VERIFY(!in_interrupt());
 	VERIFY(job->action == WRITEDISK || job->action == WRITECACHE || 
@@ -766,32 +894,31 @@ flashcache_md_write_done(struct kcached_job *job)
 		job->error = error;
 		index = job->index;
 		cacheblk = &dmc->cache[index];
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(set_lock, flags);
 		if (job->action == WRITECACHE) {
-			if (unlikely(dmc->sysctl_error_inject & WRITECACHE_MD_ERROR)) {
+			if (unlikely(flashcache_inject_error(dmc, WRITECACHE_MD_ERROR))) {
 				job->error = -EIO;
-				dmc->sysctl_error_inject &= ~WRITECACHE_MD_ERROR;
 			}
 			if (likely(job->error == 0)) {
 				if ((cacheblk->cache_state & DIRTY) == 0) {
 					dmc->cache_sets[index / dmc->assoc].nr_dirty++;
-					dmc->nr_dirty++;
+					atomic_inc(&dmc->nr_dirty);
 				}
-				dmc->flashcache_stats.md_write_dirty++;
+				FLASHCACHE_STATS_INC(dmc, md_write_dirty);
 				cacheblk->cache_state |= DIRTY;
 			} else
-				dmc->flashcache_errors.ssd_write_errors++;
+				atomic_inc(&dmc->flashcache_errors.ssd_write_errors);
 			flashcache_bio_endio(job->bio, job->error, dmc, &job->io_start_time);
 			if (job->error || cacheblk->nr_queued > 0) {
 				if (job->error) {
 					DMERR("flashcache: WRITE: Cache metadata write failed ! error %d block %lu", 
 					      job->error, cacheblk->dbn);
 				}
-				spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+				spin_unlock_irqrestore(set_lock, flags);
 				flashcache_do_pending(job);
 			} else {
 				cacheblk->cache_state &= ~BLOCK_IO_INPROG;
-				spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+				spin_unlock_irqrestore(set_lock, flags);
 				flashcache_free_cache_job(job);
 				if (atomic_dec_and_test(&dmc->nr_jobs))
 					wake_up(&dmc->destroyq);
@@ -799,9 +926,8 @@ flashcache_md_write_done(struct kcached_job *job)
 		} else {
 			int action = job->action;
 
-			if (unlikely(dmc->sysctl_error_inject & WRITEDISK_MD_ERROR)) {
+			if (unlikely(flashcache_inject_error(dmc, WRITEDISK_MD_ERROR))) {
 				job->error = -EIO;
-				dmc->sysctl_error_inject &= ~WRITEDISK_MD_ERROR;
 			}
 			/*
 			 * If we have an error on a WRITEDISK*, no choice but to preserve the 
@@ -809,28 +935,28 @@ flashcache_md_write_done(struct kcached_job *job)
 			 * the block was being cleaned.
 			 */
 			if (likely(job->error == 0)) {
-				dmc->flashcache_stats.md_write_clean++;
+				FLASHCACHE_STATS_INC(dmc, md_write_clean);
 				cacheblk->cache_state &= ~DIRTY;
 				VERIFY(dmc->cache_sets[index / dmc->assoc].nr_dirty > 0);
-				VERIFY(dmc->nr_dirty > 0);
+				VERIFY(atomic_read(&dmc->nr_dirty) > 0);
 				dmc->cache_sets[index / dmc->assoc].nr_dirty--;
-				dmc->nr_dirty--;
+				atomic_dec(&dmc->nr_dirty);
 			} else 
-				dmc->flashcache_errors.ssd_write_errors++;
+				atomic_inc(&dmc->flashcache_errors.ssd_write_errors);
 			VERIFY(dmc->cache_sets[index / dmc->assoc].clean_inprog > 0);
-			VERIFY(dmc->clean_inprog > 0);
+			VERIFY(atomic_read(&dmc->clean_inprog) > 0);
 			dmc->cache_sets[index / dmc->assoc].clean_inprog--;
-			dmc->clean_inprog--;
+			atomic_dec(&dmc->clean_inprog);
 			if (job->error || cacheblk->nr_queued > 0) {
 				if (job->error) {
 					DMERR("flashcache: CLEAN: Cache metadata write failed ! error %d block %lu", 
 					      job->error, cacheblk->dbn);
 				}
-				spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+				spin_unlock_irqrestore(set_lock, flags);
 				flashcache_do_pending(job);
 			} else {
 				cacheblk->cache_state &= ~BLOCK_IO_INPROG;
-				spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+				spin_unlock_irqrestore(set_lock, flags);
 				flashcache_free_cache_job(job);
 				if (atomic_dec_and_test(&dmc->nr_jobs))
 					wake_up(&dmc->destroyq);
@@ -840,27 +966,26 @@ flashcache_md_write_done(struct kcached_job *job)
 				flashcache_clean_set(dmc, index / dmc->assoc);
 			else
 				flashcache_sync_blocks(dmc);
-			dmc->flashcache_stats.cleanings++;
+			FLASHCACHE_STATS_INC(dmc, cleanings);
 			if (action == WRITEDISK_SYNC)
 				flashcache_update_sync_progress(dmc);
 		}
 	}
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	if (md_block_head->queued_updates != NULL) {
 		/* peel off the first job from the pending queue and kick that off */
 		job = md_block_head->queued_updates;
 		md_block_head->queued_updates = job->next;
 		job->next = NULL;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		VERIFY(job->action == WRITEDISK || job->action == WRITECACHE ||
 		       job->action == WRITEDISK_SYNC);
 		flashcache_md_write_kickoff(job);
 	} else {
 		md_block_head->nr_in_prog = 0;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 	}
 }
-
 /* 
  * Kick off a cache metadata update (called from workqueue).
  * Cache metadata update IOs to a given metadata sector are serialized using the 
@@ -870,6 +995,9 @@ flashcache_md_write_done(struct kcached_job *job)
  * cluster all these pending updates and do all of them as 1 flash write (that 
  * logic is in md_write_kickoff), where it switches out the entire pending_jobs
  * list and does all of those updates as 1 ssd write.
+ * With group commit (md_commit_delay_ms > 0), an update to an idle md sector
+ * is also held back for up to md_commit_delay_ms, so that updates to other 
+ * blocks in the same md sector arriving in that window share the write.
  */
 void
 flashcache_md_write(struct kcached_job *job)
@@ -877,11 +1005,13 @@ flashcache_md_write(struct kcached_job *job)
 	struct cache_c *dmc = job->dmc;
 	struct cache_md_block_head *md_block_head;
 	unsigned long flags;
+	spinlock_t *set_lock = INDEX_TO_SET_LOCK(dmc, job->index);
+	int commit_delay_ms = dmc->sysctl_md_commit_delay_ms;
 	
 	VERIFY(job->action == WRITEDISK || job->action == WRITECACHE || 
 	       job->action == WRITEDISK_SYNC);
 	md_block_head = &dmc->md_blocks_buf[INDEX_TO_MD_BLOCK(dmc, job->index)];
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	/* If a write is in progress for this metadata sector, queue this update up */
 	if (md_block_head->nr_in_prog != 0) {
 		struct kcached_job **nodepp;
@@ -892,10 +1022,31 @@ flashcache_md_write(struct kcached_job *job)
 			nodepp = &((*nodepp)->next);
 		job->next = NULL;
 		*nodepp = job;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
+	} else if (commit_delay_ms > 0) {
+		int schedule;
+
+		/* 
+		 * Group commit : Claim the md sector, park this update on its 
+		 * queue and let flashcache_md_group_commit() kick off the write
+		 * when the commit window closes. 
+		 */
+		md_block_head->nr_in_prog = 1;
+		job->next = NULL;
+		md_block_head->queued_updates = job;
+		spin_lock(&dmc->cache_spin_lock);
+		schedule = (dmc->md_commit_head == NULL);
+		md_block_head->commit_next = dmc->md_commit_head;
+		dmc->md_commit_head = md_block_head;
+		FLASHCACHE_STATS_INC(dmc, md_group_commits);
+		spin_unlock(&dmc->cache_spin_lock);
+		spin_unlock_irqrestore(set_lock, flags);
+		if (schedule)
+			schedule_delayed_work(&dmc->md_commit_work, 
+					      msecs_to_jiffies(commit_delay_ms));
 	} else {
 		md_block_head->nr_in_prog = 1;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		/*
 		 * Always push to a worker thread. If the driver has
 		 * a completion thread, we could end up deadlocking even
@@ -907,7 +1058,53 @@ flashcache_md_write(struct kcached_job *job)
 		 * deadlock.
 		 */
 		push_md_io(job);
-		schedule_work(&_kcached_wq);
+	}
+}
+
+/*
+ * The group commit window has closed. Kick off the metadata writes for all
+ * the md sectors that were waiting, each covering every update that was 
+ * queued up on the md sector during the window.
+ */
+void
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+flashcache_md_group_commit(void *data)
+{
+	struct cache_c *dmc = (struct cache_c *)data;
+#else
+flashcache_md_group_commit(struct work_struct *work)
+{
+	struct cache_c *dmc = container_of(work, struct cache_c, 
+					   md_commit_work.work);
+#endif
+	struct cache_md_block_head *md_block_head, *next;
+	struct kcached_job *job, *node;
+	spinlock_t *set_lock;
+	unsigned long flags;
+	int md_block_ix;
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	md_block_head = dmc->md_commit_head;
+	dmc->md_commit_head = NULL;
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	for ( ; md_block_head != NULL ; md_block_head = next) {
+		next = md_block_head->commit_next;
+		md_block_ix = md_block_head - dmc->md_blocks_buf;
+		set_lock = INDEX_TO_SET_LOCK(dmc, md_block_ix * MD_SLOTS_PER_BLOCK(dmc));
+		spin_lock_irqsave(set_lock, flags);
+		md_block_head->commit_next = NULL;
+		VERIFY(md_block_head->nr_in_prog == 1);
+		/* peel off the first job from the pending queue and kick that off */
+		job = md_block_head->queued_updates;
+		VERIFY(job != NULL);
+		md_block_head->queued_updates = job->next;
+		job->next = NULL;
+		for (node = md_block_head->queued_updates ; node != NULL ; node = node->next)
+			FLASHCACHE_STATS_INC(dmc, md_group_commit_batch);
+		spin_unlock_irqrestore(set_lock, flags);
+		VERIFY(job->action == WRITEDISK || job->action == WRITECACHE ||
+		       job->action == WRITEDISK_SYNC);
+		push_md_io(job);
 	}
 }
 
@@ -918,18 +1115,18 @@ flashcache_kcopyd_callback(int read_err, unsigned int write_err, void *context)
 	struct cache_c *dmc = job->dmc;
 	int index = job->index;
 	unsigned long flags;
+	spinlock_t *set_lock = INDEX_TO_SET_LOCK(dmc, index);
 
 	VERIFY(!in_interrupt());
 	DPRINTK("kcopyd_callback: Index %d", index);
 	VERIFY(job->bio == NULL);
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	VERIFY(dmc->cache[index].cache_state & (DISKWRITEINPROG | VALID | DIRTY));
-	if (unlikely(dmc->sysctl_error_inject & KCOPYD_CALLBACK_ERROR)) {
+	if (unlikely(flashcache_inject_error(dmc, KCOPYD_CALLBACK_ERROR))) {
 		read_err = -EIO;
-		dmc->sysctl_error_inject &= ~KCOPYD_CALLBACK_ERROR;
 	}
 	if (likely(read_err == 0 && write_err == 0)) {
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		flashcache_md_write(job);
 	} else {
 		if (read_err)
@@ -940,21 +1137,21 @@ flashcache_kcopyd_callback(int read_err, unsigned int write_err, void *context)
 		DMERR("flashcache: Disk writeback failed ! read error %d write error %d block %lu", 
 		      -read_err, -write_err, job->job_io_regions.disk.sector);
 		VERIFY(dmc->cache_sets[index / dmc->assoc].clean_inprog > 0);
-		VERIFY(dmc->clean_inprog > 0);
+		VERIFY(atomic_read(&dmc->clean_inprog) > 0);
 		dmc->cache_sets[index / dmc->assoc].clean_inprog--;
-		dmc->clean_inprog--;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		atomic_dec(&dmc->clean_inprog);
+		spin_unlock_irqrestore(set_lock, flags);
 		/* Set the error in the job and let do_pending() handle the error */
 		if (read_err) {
-			dmc->flashcache_errors.ssd_read_errors++;
+			atomic_inc(&dmc->flashcache_errors.ssd_read_errors);
 			job->error = read_err;
 		} else {
-			dmc->flashcache_errors.disk_write_errors++;
+			atomic_inc(&dmc->flashcache_errors.disk_write_errors);
 			job->error = write_err;
 		}
 		flashcache_do_pending(job);
 		flashcache_clean_set(dmc, index / dmc->assoc); /* Kick off more cleanings */
-		dmc->flashcache_stats.cleanings++;
+		FLASHCACHE_STATS_INC(dmc, cleanings);
 	}
 }
 
@@ -965,20 +1162,20 @@ flashcache_dirty_writeback(struct cache_c *dmc, int index)
 	unsigned long flags;
 	struct cacheblock *cacheblk = &dmc->cache[index];
 	int device_removal = 0;
+	spinlock_t *set_lock = INDEX_TO_SET_LOCK(dmc, index);
 	
 	DPRINTK("flashcache_dirty_writeback: Index %d", index);
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	VERIFY((cacheblk->cache_state & BLOCK_IO_INPROG) == DISKWRITEINPROG);
 	VERIFY(cacheblk->cache_state & DIRTY);
 	dmc->cache_sets[index / dmc->assoc].clean_inprog++;
-	dmc->clean_inprog++;
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	atomic_inc(&dmc->clean_inprog);
+	spin_unlock_irqrestore(set_lock, flags);
 	job = new_kcached_job(dmc, NULL, index);
-	if (unlikely(dmc->sysctl_error_inject & DIRTY_WRITEBACK_JOB_ALLOC_FAIL)) {
+	if (unlikely(flashcache_inject_error(dmc, DIRTY_WRITEBACK_JOB_ALLOC_FAIL))) {
 		if (job)
 			flashcache_free_cache_job(job);
 		job = NULL;
-		dmc->sysctl_error_inject &= ~DIRTY_WRITEBACK_JOB_ALLOC_FAIL;
 	}
 	/*
 	 * If the device is being removed, do not kick off any more cleanings.
@@ -992,12 +1189,12 @@ flashcache_dirty_writeback(struct cache_c *dmc, int index)
 		device_removal = 1;
 	}
 	if (unlikely(job == NULL)) {
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(set_lock, flags);
 		dmc->cache_sets[index / dmc->assoc].clean_inprog--;
-		dmc->clean_inprog--;
+		atomic_dec(&dmc->clean_inprog);
 		flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		if (device_removal == 0)
 			DMERR("flashcache: Dirty Writeback (for set cleaning) failed ! Can't allocate memory, block %lu", 
 			      cacheblk->dbn);
@@ -1005,8 +1202,8 @@ flashcache_dirty_writeback(struct cache_c *dmc, int index)
 		job->bio = NULL;
 		job->action = WRITEDISK;
 		atomic_inc(&dmc->nr_jobs);
-		dmc->flashcache_stats.ssd_reads++;
-		dmc->flashcache_stats.disk_writes++;
+		FLASHCACHE_STATS_INC(dmc, ssd_reads);
+		FLASHCACHE_STATS_INC(dmc, disk_writes);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 		kcopyd_copy(flashcache_kcp_client, &job->job_io_regions.cache, 1, &job->job_io_regions.disk, 0, 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
@@ -1044,14 +1241,53 @@ flashcache_dirty_writeback(struct cache_c *dmc, int index)
  *    free.
  */
 
-/* Are we under the limits for disk cleaning ? */
+/*
+ * How many cleanings can be in flight across the cache right now. With 
+ * adaptive cleaning on, the disk is shared with the foreground IOs in 
+ * flight, and cleaning backs off further when the foreground disk latency 
+ * is over target. When the disk has been idle for a while, or the device is 
+ * being removed, cleaning goes full speed. Never less than 1 so cleaning 
+ * always makes progress.
+ */
+int
+flashcache_clean_limit(struct cache_c *dmc)
+{
+	int limit = dmc->max_clean_ios_total;
+	int busy;
+
+	if (!dmc->sysctl_clean_adaptive || atomic_read(&dmc->remove_in_prog))
+		return limit;
+	busy = atomic_read(&dmc->disk_fg_inflight);
+	if (busy == 0 && 
+	    time_after(jiffies, dmc->disk_fg_last + msecs_to_jiffies(CLEAN_DISK_IDLE_MS)))
+		return limit;
+	limit /= (busy + 1);
+	if (dmc->sysctl_clean_disk_latency_ms &&
+	    (dmc->disk_fg_latency >> 3) > msecs_to_jiffies(dmc->sysctl_clean_disk_latency_ms))
+		limit /= 2;
+	return max(limit, 1);
+}
+
+/* 
+ * Are we under the limits for disk cleaning ? A set that is more than half 
+ * way from its dirty threshold to full isn't held back for foreground IO.
+ */
 static inline int
 flashcache_can_clean(struct cache_c *dmc, 
 		     struct cache_set *cache_set,
 		     int nr_writes)
 {
-	return ((cache_set->clean_inprog + nr_writes) < dmc->max_clean_ios_set &&
-		(nr_writes + dmc->clean_inprog) < dmc->max_clean_ios_total);
+	int limit = dmc->max_clean_ios_total;
+
+	if ((cache_set->clean_inprog + nr_writes) >= dmc->max_clean_ios_set)
+		return 0;
+	if (cache_set->nr_dirty < dmc->dirty_thresh_set + (dmc->assoc - dmc->dirty_thresh_set) / 2)
+		limit = flashcache_clean_limit(dmc);
+	if ((nr_writes + atomic_read(&dmc->clean_inprog)) < limit)
+		return 1;
+	if (limit < dmc->max_clean_ios_total)
+		FLASHCACHE_STATS_INC(dmc, clean_throttled);
+	return 0;
 }
 
 void
@@ -1066,6 +1302,7 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 	struct cache_set *cache_set = &dmc->cache_sets[set];
 	struct cacheblock *cacheblk;
 	int do_delayed_clean = 0;
+	spinlock_t *set_lock = flashcache_set_lock(dmc, set);
 
 	if (dmc->cache_mode != FLASHCACHE_WRITE_BACK)
 		return;
@@ -1078,17 +1315,16 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 	if (atomic_read(&dmc->remove_in_prog))
 		return;
 	writes_list = kmalloc(dmc->assoc * sizeof(struct dbn_index_pair), GFP_NOIO);
-	if (unlikely(dmc->sysctl_error_inject & WRITES_LIST_ALLOC_FAIL)) {
+	if (unlikely(flashcache_inject_error(dmc, WRITES_LIST_ALLOC_FAIL))) {
 		if (writes_list)
 			kfree(writes_list);
 		writes_list = NULL;
-		dmc->sysctl_error_inject &= ~WRITES_LIST_ALLOC_FAIL;
 	}
 	if (writes_list == NULL) {
-		dmc->flashcache_errors.memory_alloc_errors++;
+		atomic_inc(&dmc->flashcache_errors.memory_alloc_errors);
 		return;
 	}
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	/* 
 	 * Before we try to clean any blocks, check the last time the fallow block
 	 * detection was done. If it has been more than "fallow_delay" seconds, make 
@@ -1124,7 +1360,7 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 		flashcache_clear_fallow(dmc, i);
 		writes_list[nr_writes].dbn = cacheblk->dbn;
 		writes_list[nr_writes].index = i;
-		dmc->flashcache_stats.fallow_cleanings++;
+		FLASHCACHE_STATS_INC(dmc, fallow_cleanings);
 		nr_writes++;
 	}
 	if (nr_writes > 0)
@@ -1160,7 +1396,7 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 				i = start_index;
 		}
 		cache_set->set_clean_next = i;
-	} else { /* reclaim_policy == FLASHCACHE_LRU */
+	} else { /* reclaim_policy == FLASHCACHE_LRU or FLASHCACHE_LRU2Q */
 		int lru_rel_index;
 
 		lru_rel_index = cache_set->lru_head;
@@ -1170,9 +1406,9 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 			cacheblk = &dmc->cache[lru_rel_index + start_index];
 			if ((cacheblk->cache_state & (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
 				cacheblk->cache_state |= DISKWRITEINPROG;
-				flashcache_clear_fallow(dmc, i);
 				writes_list[nr_writes].dbn = cacheblk->dbn;
 				writes_list[nr_writes].index = cacheblk - &dmc->cache[0];
+				flashcache_clear_fallow(dmc, writes_list[nr_writes].index);
 				nr_writes++;
 			}
 			lru_rel_index = cacheblk->lru_next;
@@ -1181,14 +1417,14 @@ flashcache_clean_set(struct cache_c *dmc, int set)
 out:
 	if (nr_writes > 0) {
 		flashcache_merge_writes(dmc, writes_list, &nr_writes, set);
-		dmc->flashcache_stats.clean_set_ios += nr_writes;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		FLASHCACHE_STATS_ADD(dmc, clean_set_ios, nr_writes);
+		spin_unlock_irqrestore(set_lock, flags);
 		for (i = 0 ; i < nr_writes ; i++)
 			flashcache_dirty_writeback(dmc, writes_list[i].index);
 	} else {
 		if (cache_set->nr_dirty > dmc->dirty_thresh_set)
 			do_delayed_clean = 1;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		if (do_delayed_clean)
 			schedule_delayed_work(&dmc->delayed_clean, 1*HZ);
 	}
@@ -1207,16 +1443,15 @@ flashcache_read_hit(struct cache_c *dmc, struct bio* bio, int index)
 		struct kcached_job *job;
 			
 		cacheblk->cache_state |= CACHEREADINPROG;
-		dmc->flashcache_stats.read_hits++;
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		FLASHCACHE_STATS_INC(dmc, read_hits);
+		flashcache_unlock_bio_sets(dmc, bio);
 		DPRINTK("Cache read: Block %llu(%lu), index = %d:%s",
 			bio->bi_sector, bio->bi_size, index, "CACHE HIT");
 		job = new_kcached_job(dmc, bio, index);
-		if (unlikely(dmc->sysctl_error_inject & READ_HIT_JOB_ALLOC_FAIL)) {
+		if (unlikely(flashcache_inject_error(dmc, READ_HIT_JOB_ALLOC_FAIL))) {
 			if (job)
 				flashcache_free_cache_job(job);
 			job = NULL;
-			dmc->sysctl_error_inject &= ~READ_HIT_JOB_ALLOC_FAIL;
 		}
 		if (unlikely(job == NULL)) {
 			/* 
@@ -1227,32 +1462,33 @@ flashcache_read_hit(struct cache_c *dmc, struct bio* bio, int index)
 			DMERR("flashcache: Read (hit) failed ! Can't allocate memory for cache IO, block %lu", 
 			      cacheblk->dbn);
 			flashcache_bio_endio(bio, -EIO, dmc, NULL);
-			spin_lock_irq(&dmc->cache_spin_lock);
+			spin_lock_irq(INDEX_TO_SET_LOCK(dmc, index));
 			flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 			cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-			spin_unlock_irq(&dmc->cache_spin_lock);
+			spin_unlock_irq(INDEX_TO_SET_LOCK(dmc, index));
 		} else {
 			job->action = READCACHE; /* Fetch data from cache */
 			atomic_inc(&dmc->nr_jobs);
-			dmc->flashcache_stats.ssd_reads++;
+			FLASHCACHE_STATS_INC(dmc, ssd_reads);
 			dm_io_async_bvec(1, &job->job_io_regions.cache, READ,
 					 bio->bi_io_vec + bio->bi_idx,
 					 flashcache_io_callback, job);
 		}
 	} else {
 		pjob = flashcache_alloc_pending_job(dmc);
-		if (unlikely(dmc->sysctl_error_inject & READ_HIT_PENDING_JOB_ALLOC_FAIL)) {
+		if (unlikely(flashcache_inject_error(dmc, READ_HIT_PENDING_JOB_ALLOC_FAIL))) {
 			if (pjob) {
 				flashcache_free_pending_job(pjob);
 				pjob = NULL;
 			}
-			dmc->sysctl_error_inject &= ~READ_HIT_PENDING_JOB_ALLOC_FAIL;
 		}
-		if (pjob == NULL)
+		if (pjob == NULL) {
+			flashcache_unlock_bio_sets(dmc, bio);
 			flashcache_bio_endio(bio, -EIO, dmc, NULL);
-		else
+		} else {
 			flashcache_enq_pending(dmc, bio, index, READCACHE, pjob);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+			flashcache_unlock_bio_sets(dmc, bio);
+		}
 	}
 }
 
@@ -1264,11 +1500,10 @@ flashcache_read_miss(struct cache_c *dmc, struct bio* bio,
 	struct cacheblock *cacheblk = &dmc->cache[index];
 
 	job = new_kcached_job(dmc, bio, index);
-	if (unlikely(dmc->sysctl_error_inject & READ_MISS_JOB_ALLOC_FAIL)) {
+	if (unlikely(flashcache_inject_error(dmc, READ_MISS_JOB_ALLOC_FAIL))) {
 		if (job)
 			flashcache_free_cache_job(job);
 		job = NULL;
-		dmc->sysctl_error_inject &= ~READ_MISS_JOB_ALLOC_FAIL;
 	}
 	if (unlikely(job == NULL)) {
 		/* 
@@ -1279,17 +1514,18 @@ flashcache_read_miss(struct cache_c *dmc, struct bio* bio,
 		DMERR("flashcache: Read (miss) failed ! Can't allocate memory for cache IO, block %lu", 
 		      cacheblk->dbn);
 		flashcache_bio_endio(bio, -EIO, dmc, NULL);
-		spin_lock_irq(&dmc->cache_spin_lock);
-		dmc->cached_blocks--;
+		spin_lock_irq(INDEX_TO_SET_LOCK(dmc, index));
+		atomic_long_dec(&dmc->cached_blocks);
 		cacheblk->cache_state &= ~VALID;
 		cacheblk->cache_state |= INVALID;
 		flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		spin_unlock_irq(INDEX_TO_SET_LOCK(dmc, index));
 	} else {
 		job->action = READDISK; /* Fetch data from the source device */
 		atomic_inc(&dmc->nr_jobs);
-		dmc->flashcache_stats.disk_reads++;
+		FLASHCACHE_STATS_INC(dmc, disk_reads);
+		flashcache_disk_io_start(dmc, job);
 		dm_io_async_bvec(1, &job->job_io_regions.disk, READ,
 				 bio->bi_io_vec + bio->bi_idx,
 				 flashcache_io_callback, job);
@@ -1303,13 +1539,13 @@ flashcache_read(struct cache_c *dmc, struct bio *bio)
 	int index;
 	int res;
 	struct cacheblock *cacheblk;
-	int queued;
+	int queued, writeback_index;
 	
 	DPRINTK("Got a %s for %llu (%u bytes)",
 	        (bio_rw(bio) == READ ? "READ":"READA"), 
 		bio->bi_sector, bio->bi_size);
 
-	spin_lock_irq(&dmc->cache_spin_lock);
+	flashcache_lock_bio_sets(dmc, bio);
 	res = flashcache_lookup(dmc, bio, &index);
 	/* Cache Read Hit case */
 	if (res > 0) {
@@ -1324,17 +1560,19 @@ flashcache_read(struct cache_c *dmc, struct bio *bio)
 	 * In all cases except for a cache hit (and VALID), test for potential 
 	 * invalidations that we need to do.
 	 */
-	queued = flashcache_inval_blocks(dmc, bio);
+	queued = flashcache_inval_blocks(dmc, bio, &writeback_index);
 	if (queued) {
+		flashcache_unlock_bio_sets(dmc, bio);
 		if (unlikely(queued < 0))
 			flashcache_bio_endio(bio, -EIO, dmc, NULL);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		if (writeback_index != -1)
+			flashcache_dirty_writeback(dmc, writeback_index);
 		return;
 	}
 
 	if (res == -1 || flashcache_uncacheable(dmc, bio)) {
 		/* No room , non-cacheable or sequential i/o means not wanted in cache */
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		flashcache_unlock_bio_sets(dmc, bio);
 		DPRINTK("Cache read: Block %llu(%lu):%s",
 			bio->bi_sector, bio->bi_size, "CACHE MISS & NO ROOM");
 		if (res == -1)
@@ -1349,12 +1587,14 @@ flashcache_read(struct cache_c *dmc, struct bio *bio)
 	 * Claim the cache blocks before giving up the spinlock
 	 */
 	if (dmc->cache[index].cache_state & VALID)
-		dmc->flashcache_stats.replace++;
+		FLASHCACHE_STATS_INC(dmc, replace);
 	else
-		dmc->cached_blocks++;
-	dmc->cache[index].cache_state = VALID | DISKREADINPROG;
+		atomic_long_inc(&dmc->cached_blocks);
+	/* LRU_HOT is only cleared by flashcache_reclaim_lru_remove() */
+	dmc->cache[index].cache_state = VALID | DISKREADINPROG |
+		(dmc->cache[index].cache_state & LRU_HOT);
 	dmc->cache[index].dbn = bio->bi_sector;
-	spin_unlock_irq(&dmc->cache_spin_lock);
+	flashcache_unlock_bio_sets(dmc, bio);
 
 	DPRINTK("Cache read: Block %llu(%lu), index = %d:%s",
 		bio->bi_sector, bio->bi_size, index, "CACHE MISS & REPLACE");
@@ -1368,7 +1608,7 @@ flashcache_read(struct cache_c *dmc, struct bio *bio)
  */
 static int
 flashcache_inval_block_set(struct cache_c *dmc, int set, struct bio *bio, int rw,
-			   struct pending_job *pjob)
+			   struct pending_job *pjob, int *writeback_index)
 {
 	sector_t io_start = bio->bi_sector;
 	sector_t io_end = bio->bi_sector + (to_sector(bio->bi_size) - 1);
@@ -1388,15 +1628,16 @@ flashcache_inval_block_set(struct cache_c *dmc, int set, struct bio *bio, int rw
 		    (io_end >= start_dbn && io_end < end_dbn)) {
 			/* We have a match */
 			if (rw == WRITE)
-				dmc->flashcache_stats.wr_invalidates++;
+				FLASHCACHE_STATS_INC(dmc, wr_invalidates);
 			else
-				dmc->flashcache_stats.rd_invalidates++;
+				FLASHCACHE_STATS_INC(dmc, rd_invalidates);
 			if (!(cacheblk->cache_state & (BLOCK_IO_INPROG | DIRTY)) &&
 			    (cacheblk->nr_queued == 0)) {
-				dmc->cached_blocks--;			
+				atomic_long_dec(&dmc->cached_blocks);
 				DPRINTK("Cache invalidate (!BUSY): Block %llu %lx",
 					start_dbn, cacheblk->cache_state);
-				cacheblk->cache_state = INVALID;
+				cacheblk->cache_state = INVALID | 
+					(cacheblk->cache_state & LRU_HOT);
 				continue;
 			}
 			/*
@@ -1412,21 +1653,15 @@ flashcache_inval_block_set(struct cache_c *dmc, int set, struct bio *bio, int rw
 			if ((cacheblk->cache_state & (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
 				/* 
 				 * Kick off block write.
-				 * We can't kick off the write under the spinlock.
-				 * Instead, we mark the slot DISKWRITEINPROG, drop 
-				 * the spinlock and kick off the write. A block marked
-				 * DISKWRITEINPROG cannot change underneath us. 
-				 * to enqueue ourselves onto it's pending queue.
-				 *
-				 * XXX - The dropping of the lock here can be avoided if
-				 * we punt the cleaning of the block to the worker thread,
-				 * at the cost of a context switch.
+				 * We can't kick off the write under the set lock.
+				 * Instead, we mark the slot DISKWRITEINPROG and hand
+				 * the index back to the caller, which kicks off the 
+				 * write once it has dropped the set lock(s). A block 
+				 * marked DISKWRITEINPROG cannot change underneath us.
 				 */
 				cacheblk->cache_state |= DISKWRITEINPROG;
 				flashcache_clear_fallow(dmc, i);
-				spin_unlock_irq(&dmc->cache_spin_lock);
-				flashcache_dirty_writeback(dmc, i); /* Must inc nr_jobs */
-				spin_lock_irq(&dmc->cache_spin_lock);
+				*writeback_index = i; /* Caller must kick off the writeback */
 			}
 			return 1;
 		}
@@ -1437,9 +1672,12 @@ flashcache_inval_block_set(struct cache_c *dmc, int set, struct bio *bio, int rw
 /* 
  * Since md will break up IO into blocksize pieces, we only really need to check 
  * the start set and the end set for overlaps.
+ * Called with the set lock(s) covering the bio held. If a dirty block has to
+ * be cleaned, its index is returned in *writeback_index (-1 otherwise) and the
+ * caller kicks off flashcache_dirty_writeback() after dropping the set lock(s).
  */
 static int
-flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio)
+flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio, int *writeback_index)
 {	
 	sector_t io_start = bio->bi_sector;
 	sector_t io_end = bio->bi_sector + (to_sector(bio->bi_size) - 1);
@@ -1447,13 +1685,14 @@ flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio)
 	int queued;
 	struct pending_job *pjob1, *pjob2;
 
+	*writeback_index = -1;
+
 	pjob1 = flashcache_alloc_pending_job(dmc);
-	if (unlikely(dmc->sysctl_error_inject & INVAL_PENDING_JOB_ALLOC_FAIL)) {
+	if (unlikely(flashcache_inject_error(dmc, INVAL_PENDING_JOB_ALLOC_FAIL))) {
 		if (pjob1) {
 			flashcache_free_pending_job(pjob1);
 			pjob1 = NULL;
 		}
-		dmc->sysctl_error_inject &= ~INVAL_PENDING_JOB_ALLOC_FAIL;
 	}
 	if (pjob1 == NULL) {
 		queued = -ENOMEM;
@@ -1468,7 +1707,7 @@ flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio)
 	start_set = hash_block(dmc, io_start);
 	end_set = hash_block(dmc, io_end);
 	queued = flashcache_inval_block_set(dmc, start_set, bio, 
-					    bio_data_dir(bio), pjob1);
+					    bio_data_dir(bio), pjob1, writeback_index);
 	if (queued) {
 		flashcache_free_pending_job(pjob2);
 		goto out;
@@ -1476,7 +1715,8 @@ flashcache_inval_blocks(struct cache_c *dmc, struct bio *bio)
 		flashcache_free_pending_job(pjob1);		
 	if (start_set != end_set) {
 		queued = flashcache_inval_block_set(dmc, end_set, 
-						    bio, bio_data_dir(bio), pjob2);
+						    bio, bio_data_dir(bio), pjob2, 
+						    writeback_index);
 		if (!queued)
 			flashcache_free_pending_job(pjob2);
 	} else
@@ -1490,29 +1730,31 @@ flashcache_write_miss(struct cache_c *dmc, struct bio *bio, int index)
 {
 	struct cacheblock *cacheblk;
 	struct kcached_job *job;
-	int queued;
+	int queued, writeback_index;
 
 	cacheblk = &dmc->cache[index];
-	queued = flashcache_inval_blocks(dmc, bio);
+	queued = flashcache_inval_blocks(dmc, bio, &writeback_index);
 	if (queued) {
+		flashcache_unlock_bio_sets(dmc, bio);
 		if (unlikely(queued < 0))
 			flashcache_bio_endio(bio, -EIO, dmc, NULL);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		if (writeback_index != -1)
+			flashcache_dirty_writeback(dmc, writeback_index);
 		return;
 	}
 	if (cacheblk->cache_state & VALID)
-		dmc->flashcache_stats.wr_replace++;
+		FLASHCACHE_STATS_INC(dmc, wr_replace);
 	else
-		dmc->cached_blocks++;
-	cacheblk->cache_state = VALID | CACHEWRITEINPROG;
+		atomic_long_inc(&dmc->cached_blocks);
+	cacheblk->cache_state = VALID | CACHEWRITEINPROG |
+		(cacheblk->cache_state & LRU_HOT);
 	cacheblk->dbn = bio->bi_sector;
-	spin_unlock_irq(&dmc->cache_spin_lock);
+	flashcache_unlock_bio_sets(dmc, bio);
 	job = new_kcached_job(dmc, bio, index);
-	if (unlikely(dmc->sysctl_error_inject & WRITE_MISS_JOB_ALLOC_FAIL)) {
+	if (unlikely(flashcache_inject_error(dmc, WRITE_MISS_JOB_ALLOC_FAIL))) {
 		if (job)
 			flashcache_free_cache_job(job);
 		job = NULL;
-		dmc->sysctl_error_inject &= ~WRITE_MISS_JOB_ALLOC_FAIL;
 	}
 	if (unlikely(job == NULL)) {
 		/* 
@@ -1523,16 +1765,16 @@ flashcache_write_miss(struct cache_c *dmc, struct bio *bio, int index)
 		DMERR("flashcache: Write (miss) failed ! Can't allocate memory for cache IO, block %lu", 
 		      cacheblk->dbn);
 		flashcache_bio_endio(bio, -EIO, dmc, NULL);
-		spin_lock_irq(&dmc->cache_spin_lock);
-		dmc->cached_blocks--;
+		spin_lock_irq(INDEX_TO_SET_LOCK(dmc, index));
+		atomic_long_dec(&dmc->cached_blocks);
 		cacheblk->cache_state &= ~VALID;
 		cacheblk->cache_state |= INVALID;
 		flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		spin_unlock_irq(INDEX_TO_SET_LOCK(dmc, index));
 	} else {
 		atomic_inc(&dmc->nr_jobs);
-		dmc->flashcache_stats.ssd_writes++;
+		FLASHCACHE_STATS_INC(dmc, ssd_writes);
 		job->action = WRITECACHE; 
 		if (dmc->cache_mode == FLASHCACHE_WRITE_BACK) {
 			/* Write data to the cache */		
@@ -1566,16 +1808,15 @@ flashcache_write_hit(struct cache_c *dmc, struct bio *bio, int index)
 	cacheblk = &dmc->cache[index];
 	if (!(cacheblk->cache_state & BLOCK_IO_INPROG) && (cacheblk->nr_queued == 0)) {
 		if (cacheblk->cache_state & DIRTY)
-			dmc->flashcache_stats.dirty_write_hits++;
-		dmc->flashcache_stats.write_hits++;
+			FLASHCACHE_STATS_INC(dmc, dirty_write_hits);
+		FLASHCACHE_STATS_INC(dmc, write_hits);
 		cacheblk->cache_state |= CACHEWRITEINPROG;
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		flashcache_unlock_bio_sets(dmc, bio);
 		job = new_kcached_job(dmc, bio, index);
-		if (unlikely(dmc->sysctl_error_inject & WRITE_HIT_JOB_ALLOC_FAIL)) {
+		if (unlikely(flashcache_inject_error(dmc, WRITE_HIT_JOB_ALLOC_FAIL))) {
 			if (job)
 				flashcache_free_cache_job(job);
 			job = NULL;
-			dmc->sysctl_error_inject &= ~WRITE_HIT_JOB_ALLOC_FAIL;
 		}
 		if (unlikely(job == NULL)) {
 			/* 
@@ -1586,14 +1827,14 @@ flashcache_write_hit(struct cache_c *dmc, struct bio *bio, int index)
 			DMERR("flashcache: Write (hit) failed ! Can't allocate memory for cache IO, block %lu", 
 			      cacheblk->dbn);
 			flashcache_bio_endio(bio, -EIO, dmc, NULL);
-			spin_lock_irq(&dmc->cache_spin_lock);
+			spin_lock_irq(INDEX_TO_SET_LOCK(dmc, index));
 			flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 			cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-			spin_unlock_irq(&dmc->cache_spin_lock);
+			spin_unlock_irq(INDEX_TO_SET_LOCK(dmc, index));
 		} else {
 			DPRINTK("Queue job for %llu", bio->bi_sector);
 			atomic_inc(&dmc->nr_jobs);
-			dmc->flashcache_stats.ssd_writes++;
+			FLASHCACHE_STATS_INC(dmc, ssd_writes);
 			job->action = WRITECACHE;
 			if (dmc->cache_mode == FLASHCACHE_WRITE_BACK) {
 				/* Write data to the cache */
@@ -1604,7 +1845,7 @@ flashcache_write_hit(struct cache_c *dmc, struct bio *bio, int index)
 			} else {
 				VERIFY(dmc->cache_mode == FLASHCACHE_WRITE_THROUGH);
 				/* Write data to both disk and cache */
-				dmc->flashcache_stats.disk_writes++;
+				FLASHCACHE_STATS_INC(dmc, disk_writes);
 				dm_io_async_bvec(2, 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 						 (struct io_region *)&job->job_io_regions, 
@@ -1618,18 +1859,19 @@ flashcache_write_hit(struct cache_c *dmc, struct bio *bio, int index)
 		}
 	} else {
 		pjob = flashcache_alloc_pending_job(dmc);
-		if (unlikely(dmc->sysctl_error_inject & WRITE_HIT_PENDING_JOB_ALLOC_FAIL)) {
+		if (unlikely(flashcache_inject_error(dmc, WRITE_HIT_PENDING_JOB_ALLOC_FAIL))) {
 			if (pjob) {
 				flashcache_free_pending_job(pjob);
 				pjob = NULL;
 			}
-			dmc->sysctl_error_inject &= ~WRITE_HIT_PENDING_JOB_ALLOC_FAIL;
 		}
-		if (unlikely(pjob == NULL))
+		if (unlikely(pjob == NULL)) {
+			flashcache_unlock_bio_sets(dmc, bio);
 			flashcache_bio_endio(bio, -EIO, dmc, NULL);
-		else
+		} else {
 			flashcache_enq_pending(dmc, bio, index, WRITECACHE, pjob);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+			flashcache_unlock_bio_sets(dmc, bio);
+		}
 	}
 }
 
@@ -1639,9 +1881,9 @@ flashcache_write(struct cache_c *dmc, struct bio *bio)
 	int index;
 	int res;
 	struct cacheblock *cacheblk;
-	int queued;
+	int queued, writeback_index;
 	
-	spin_lock_irq(&dmc->cache_spin_lock);
+	flashcache_lock_bio_sets(dmc, bio);
 	res = flashcache_lookup(dmc, bio, &index);
 	if (res != -1) {
 		/* Cache Hit */
@@ -1661,11 +1903,13 @@ flashcache_write(struct cache_c *dmc, struct bio *bio)
 	 * send the request to disk. Before we do that, we must check 
 	 * for potential invalidations !
 	 */
-	queued = flashcache_inval_blocks(dmc, bio);
-	spin_unlock_irq(&dmc->cache_spin_lock);
+	queued = flashcache_inval_blocks(dmc, bio, &writeback_index);
+	flashcache_unlock_bio_sets(dmc, bio);
 	if (queued) {
 		if (unlikely(queued < 0))
 			flashcache_bio_endio(bio, -EIO, dmc, NULL);
+		if (writeback_index != -1)
+			flashcache_dirty_writeback(dmc, writeback_index);
 		return;
 	}
 	/* Start uncached IO */
@@ -1694,39 +1938,46 @@ flashcache_map(struct dm_target *ti, struct bio *bio,
 {
 	struct cache_c *dmc = (struct cache_c *) ti->private;
 	int sectors = to_sector(bio->bi_size);
-	int queued;
+	int queued, writeback_index;
 	
-	if (sectors <= 32)
-		size_hist[sectors]++;
-
 	if (bio_barrier(bio))
 		return -EOPNOTSUPP;
 
+	if (unlikely(dmc->md_load_pending) && flashcache_md_load_defer(dmc, bio))
+		return DM_MAPIO_SUBMITTED;
+
+	if (sectors <= 32)
+		size_hist[sectors]++;
+
 	VERIFY(to_sector(bio->bi_size) <= dmc->block_size);
 
 	if (bio_data_dir(bio) == READ)
-		dmc->flashcache_stats.reads++;
+		FLASHCACHE_STATS_INC(dmc, reads);
 	else
-		dmc->flashcache_stats.writes++;
+		FLASHCACHE_STATS_INC(dmc, writes);
 
-	spin_lock_irq(&dmc->cache_spin_lock);
 	if (unlikely(dmc->sysctl_pid_do_expiry && 
-		     (dmc->whitelist_head || dmc->blacklist_head)))
+		     (dmc->whitelist_head || dmc->blacklist_head))) {
+		spin_lock_irq(&dmc->cache_spin_lock);
 		flashcache_pid_expiry_all_locked(dmc);
+		spin_unlock_irq(&dmc->cache_spin_lock);
+	}
 	if ((to_sector(bio->bi_size) != dmc->block_size) ||
 	    (bio_data_dir(bio) == WRITE && 
 	     (dmc->cache_mode == FLASHCACHE_WRITE_AROUND || flashcache_uncacheable(dmc, bio)))) {
-		queued = flashcache_inval_blocks(dmc, bio);
-		spin_unlock_irq(&dmc->cache_spin_lock);
+		flashcache_lock_bio_sets(dmc, bio);
+		queued = flashcache_inval_blocks(dmc, bio, &writeback_index);
+		flashcache_unlock_bio_sets(dmc, bio);
 		if (queued) {
 			if (unlikely(queued < 0))
 				flashcache_bio_endio(bio, -EIO, dmc, NULL);
+			if (writeback_index != -1)
+				flashcache_dirty_writeback(dmc, writeback_index);
 		} else {
 			/* Start uncached IO */
 			flashcache_start_uncached_io(dmc, bio);
 		}
 	} else {
-		spin_unlock_irq(&dmc->cache_spin_lock);		
 		if (bio_data_dir(bio) == READ)
 			flashcache_read(dmc, bio);
 		else
@@ -1743,14 +1994,15 @@ flashcache_kcopyd_callback_sync(int read_err, unsigned int write_err, void *cont
 	struct cache_c *dmc = job->dmc;
 	int index = job->index;
 	unsigned long flags;
+	spinlock_t *set_lock = INDEX_TO_SET_LOCK(dmc, index);
 
 	VERIFY(!in_interrupt());
 	DPRINTK("kcopyd_callback_sync: Index %d", index);
 	VERIFY(job->bio == NULL);
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	VERIFY(dmc->cache[index].cache_state & (DISKWRITEINPROG | VALID | DIRTY));
 	if (likely(read_err == 0 && write_err == 0)) {
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		flashcache_md_write(job);
 	} else {
 		if (read_err)
@@ -1761,21 +2013,21 @@ flashcache_kcopyd_callback_sync(int read_err, unsigned int write_err, void *cont
 		DMERR("flashcache: Disk writeback failed ! read error %d write error %d block %lu", 
 		      -read_err, -write_err, job->job_io_regions.disk.sector);
 		VERIFY(dmc->cache_sets[index / dmc->assoc].clean_inprog > 0);
-		VERIFY(dmc->clean_inprog > 0);
+		VERIFY(atomic_read(&dmc->clean_inprog) > 0);
 		dmc->cache_sets[index / dmc->assoc].clean_inprog--;
-		dmc->clean_inprog--;
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		atomic_dec(&dmc->clean_inprog);
+		spin_unlock_irqrestore(set_lock, flags);
 		/* Set the error in the job and let do_pending() handle the error */
 		if (read_err) {
-			dmc->flashcache_errors.ssd_read_errors++;
+			atomic_inc(&dmc->flashcache_errors.ssd_read_errors);
 			job->error = read_err;
 		} else {
-			dmc->flashcache_errors.disk_write_errors++;			
+			atomic_inc(&dmc->flashcache_errors.disk_write_errors);			
 			job->error = write_err;
 		}
 		flashcache_do_pending(job);
 		flashcache_sync_blocks(dmc);  /* Kick off more cleanings */
-		dmc->flashcache_stats.cleanings++;
+		FLASHCACHE_STATS_INC(dmc, cleanings);
 	}
 }
 
@@ -1786,15 +2038,16 @@ flashcache_dirty_writeback_sync(struct cache_c *dmc, int index)
 	unsigned long flags;
 	struct cacheblock *cacheblk = &dmc->cache[index];
 	int device_removal = 0;
+	spinlock_t *set_lock = INDEX_TO_SET_LOCK(dmc, index);
 	
 	VERIFY((cacheblk->cache_state & FALLOW_DOCLEAN) == 0);
 	DPRINTK("flashcache_dirty_writeback_sync: Index %d", index);
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(set_lock, flags);
 	VERIFY((cacheblk->cache_state & BLOCK_IO_INPROG) == DISKWRITEINPROG);
 	VERIFY(cacheblk->cache_state & DIRTY);
 	dmc->cache_sets[index / dmc->assoc].clean_inprog++;
-	dmc->clean_inprog++;
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	atomic_inc(&dmc->clean_inprog);
+	spin_unlock_irqrestore(set_lock, flags);
 	job = new_kcached_job(dmc, NULL, index);
 	/*
 	 * If the device is being (fast) removed, do not kick off any more cleanings.
@@ -1808,12 +2061,12 @@ flashcache_dirty_writeback_sync(struct cache_c *dmc, int index)
 		device_removal = 1;
 	}
 	if (unlikely(job == NULL)) {
-		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		spin_lock_irqsave(set_lock, flags);
 		dmc->cache_sets[index / dmc->assoc].clean_inprog--;
-		dmc->clean_inprog--;
+		atomic_dec(&dmc->clean_inprog);
 		flashcache_free_pending_jobs(dmc, cacheblk, -EIO);
 		cacheblk->cache_state &= ~(BLOCK_IO_INPROG);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		spin_unlock_irqrestore(set_lock, flags);
 		if (device_removal == 0)
 			DMERR("flashcache: Dirty Writeback (for sync) failed ! Can't allocate memory, block %lu", 
 			      cacheblk->dbn);
@@ -1821,8 +2074,8 @@ flashcache_dirty_writeback_sync(struct cache_c *dmc, int index)
 		job->bio = NULL;
 		job->action = WRITEDISK_SYNC;
 		atomic_inc(&dmc->nr_jobs);
-		dmc->flashcache_stats.ssd_reads++;
-		dmc->flashcache_stats.disk_writes++;
+		FLASHCACHE_STATS_INC(dmc, ssd_reads);
+		FLASHCACHE_STATS_INC(dmc, disk_writes);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,26)
 		kcopyd_copy(flashcache_kcp_client, &job->job_io_regions.cache, 1, &job->job_io_regions.disk, 0, 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
@@ -1838,20 +2091,21 @@ flashcache_dirty_writeback_sync(struct cache_c *dmc, int index)
 #endif
 	}
 }
-
 /* 
  * Sync all dirty blocks. We pick off dirty blocks, sort them, merge them with 
  * any contigous blocks we can within the set and fire off the writes.
+ * The dirty blocks are picked off one set at a time, under that set's lock.
  */
 void
 flashcache_sync_blocks(struct cache_c *dmc)
 {
 	unsigned long flags;
-	int index;
+	int index, end_index;
 	struct dbn_index_pair *writes_list;
 	int nr_writes;
 	int i, set;
 	struct cacheblock *cacheblk;
+	spinlock_t *set_lock;
 
 	/* 
 	 * If a (fast) removal of this device is in progress, don't kick off 
@@ -1864,50 +2118,41 @@ flashcache_sync_blocks(struct cache_c *dmc)
 		return;
 	writes_list = kmalloc(dmc->assoc * sizeof(struct dbn_index_pair), GFP_NOIO);
 	if (writes_list == NULL) {
-		dmc->flashcache_errors.memory_alloc_errors++;
+		atomic_inc(&dmc->flashcache_errors.memory_alloc_errors);
 		return;
 	}
-	nr_writes = 0;
-	set = -1;
 	spin_lock_irqsave(&dmc->cache_spin_lock, flags);	
 	index = dmc->sync_index;
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);	
 	while (index < dmc->size && 
-	       (nr_writes + dmc->clean_inprog) < dmc->max_clean_ios_total) {
-		VERIFY(nr_writes <= dmc->assoc);
-		if (((index % dmc->assoc) == 0) && (nr_writes > 0)) {
-			/*
-			 * Crossing a set, sort/merge all the IOs collected so
-			 * far and issue the writes.
-			 */
-			VERIFY(set != -1);
-			flashcache_merge_writes(dmc, writes_list, &nr_writes, set);
-			spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-			for (i = 0 ; i < nr_writes ; i++)
-				flashcache_dirty_writeback_sync(dmc, writes_list[i].index);
-			nr_writes = 0;
-			set = -1;
-			spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-		}
-		cacheblk = &dmc->cache[index];
-		if ((cacheblk->cache_state & (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
-			cacheblk->cache_state |= DISKWRITEINPROG;
-			flashcache_clear_fallow(dmc, index);
-			writes_list[nr_writes].dbn = cacheblk->dbn;
-			writes_list[nr_writes].index = index;
-			set = index / dmc->assoc;
-			nr_writes++;
+	       atomic_read(&dmc->clean_inprog) < dmc->max_clean_ios_total) {
+		nr_writes = 0;
+		set = index / dmc->assoc;
+		end_index = (set + 1) * dmc->assoc;
+		set_lock = flashcache_set_lock(dmc, set);
+		spin_lock_irqsave(set_lock, flags);
+		while (index < end_index && 
+		       (nr_writes + atomic_read(&dmc->clean_inprog)) < dmc->max_clean_ios_total) {
+			VERIFY(nr_writes <= dmc->assoc);
+			cacheblk = &dmc->cache[index];
+			if ((cacheblk->cache_state & (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
+				cacheblk->cache_state |= DISKWRITEINPROG;
+				flashcache_clear_fallow(dmc, index);
+				writes_list[nr_writes].dbn = cacheblk->dbn;
+				writes_list[nr_writes].index = index;
+				nr_writes++;
+			}
+			index++;
 		}
-		index++;
-	}
-	dmc->sync_index = index;
-	if (nr_writes > 0) {
-		VERIFY(set != -1);
-		flashcache_merge_writes(dmc, writes_list, &nr_writes, set);
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		if (nr_writes > 0)
+			flashcache_merge_writes(dmc, writes_list, &nr_writes, set);
+		spin_unlock_irqrestore(set_lock, flags);
 		for (i = 0 ; i < nr_writes ; i++)
 			flashcache_dirty_writeback_sync(dmc, writes_list[i].index);
-	} else
-		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);	
+	dmc->sync_index = index;
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);	
 	kfree(writes_list);
 }
 
@@ -1953,8 +2198,7 @@ void
 flashcache_uncached_io_complete(struct kcached_job *job)
 {
 	struct cache_c *dmc = job->dmc;
-	unsigned long flags;
-	int queued;
+	int queued, writeback_index;
 	int error = job->error;
 
 	if (unlikely(error)) {
@@ -1962,23 +2206,25 @@ flashcache_uncached_io_complete(struct kcached_job *job)
 		      error, job->job_io_regions.disk.sector, 
 		      (bio_data_dir(job->bio) == WRITE) ? "WRITE" : "READ");
 		if (bio_data_dir(job->bio) == WRITE)
-			dmc->flashcache_errors.disk_write_errors++;
+			atomic_inc(&dmc->flashcache_errors.disk_write_errors);
 		else
-			dmc->flashcache_errors.disk_read_errors++;
+			atomic_inc(&dmc->flashcache_errors.disk_read_errors);
 	}
-	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-	queued = flashcache_inval_blocks(dmc, job->bio);
-	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	flashcache_lock_bio_sets(dmc, job->bio);
+	queued = flashcache_inval_blocks(dmc, job->bio, &writeback_index);
+	flashcache_unlock_bio_sets(dmc, job->bio);
 	if (queued) {
 		if (unlikely(queued < 0))
 			flashcache_bio_endio(job->bio, -EIO, dmc, NULL);
+		if (writeback_index != -1)
+			flashcache_dirty_writeback(dmc, writeback_index);
 		/* 
 		 * The IO will be re-executed.
 		 * The do_pending logic will re-launch the 
 		 * disk IO post-invalidation calling start_uncached_io.
 		 * This should be a rare occurrence.
 		 */
-		dmc->flashcache_stats.uncached_io_requeue++;
+		FLASHCACHE_STATS_INC(dmc, uncached_io_requeue);
 	} else {
 		flashcache_bio_endio(job->bio, error, dmc, &job->io_start_time);
 	}
@@ -1993,12 +2239,12 @@ flashcache_uncached_io_callback(unsigned long error, void *context)
 	struct kcached_job *job = (struct kcached_job *) context;
 
 	VERIFY(job->index == -1);
+	flashcache_disk_io_done(job->dmc, job);
 	if (unlikely(error))
 		job->error = -EIO;
 	else
 		job->error = 0;
 	push_uncached_io_complete(job);
-	schedule_work(&_kcached_wq);
 }
 
 static void
@@ -2008,11 +2254,11 @@ flashcache_start_uncached_io(struct cache_c *dmc, struct bio *bio)
 	struct kcached_job *job;
 	
 	if (is_write) {
-		dmc->flashcache_stats.uncached_writes++;
-		dmc->flashcache_stats.disk_writes++;
+		FLASHCACHE_STATS_INC(dmc, uncached_writes);
+		FLASHCACHE_STATS_INC(dmc, disk_writes);
 	} else {
-		dmc->flashcache_stats.uncached_reads++;
-		dmc->flashcache_stats.disk_reads++;
+		FLASHCACHE_STATS_INC(dmc, uncached_reads);
+		FLASHCACHE_STATS_INC(dmc, disk_reads);
 	}
 	job = new_kcached_job(dmc, bio, -1);
 	if (unlikely(job == NULL)) {
@@ -2020,6 +2266,7 @@ flashcache_start_uncached_io(struct cache_c *dmc, struct bio *bio)
 		return;
 	}
 	atomic_inc(&dmc->nr_jobs);
+	flashcache_disk_io_start(dmc, job);
 	dm_io_async_bvec(1, &job->job_io_regions.disk,
 			 ((is_write) ? WRITE : READ), 
 			 bio->bi_io_vec + bio->bi_idx,
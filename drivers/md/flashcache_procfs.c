@@ -61,6 +61,9 @@
 
 static int fallow_clean_speed_min = FALLOW_SPEED_MIN;
 static int fallow_clean_speed_max = FALLOW_SPEED_MAX;
+static int md_commit_delay_ms_max = MD_COMMIT_DELAY_MAX_MS;
+static int zero;
+static int one = 1;
 
 extern u_int64_t size_hist[];
 
@@ -139,9 +142,11 @@ flashcache_zerostats_sysctl(ctl_table *table, int write,
 #endif
 	if (write) {
 		if (dmc->sysctl_zerostats) {
-			int i;
+			int i, cpu;
 
-			memset(&dmc->flashcache_stats, 0, sizeof(struct flashcache_stats));
+			for_each_possible_cpu(cpu)
+				memset(per_cpu_ptr(dmc->stats, cpu), 0,
+				       sizeof(struct flashcache_stats));
 			for (i = 0 ; i < IO_LATENCY_BUCKETS ; i++)
 				dmc->latency_hist[i] = 0;
 			dmc->latency_hist_10ms = 0;
@@ -175,6 +180,54 @@ flashcache_fallow_clean_speed_sysctl(ctl_table *table, int write,
 	return 0;
 }
 
+static int
+flashcache_md_commit_delay_sysctl(ctl_table *table, int write,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+				  struct file *file, 
+#endif
+				  void __user *buffer, 
+				  size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+	proc_dointvec(table, write, file, buffer, length, ppos);
+#else
+	proc_dointvec(table, write, buffer, length, ppos);
+#endif
+	if (write) {
+		if (dmc->sysctl_md_commit_delay_ms < 0)
+			dmc->sysctl_md_commit_delay_ms = 0;
+
+		if (dmc->sysctl_md_commit_delay_ms > md_commit_delay_ms_max)
+			dmc->sysctl_md_commit_delay_ms = md_commit_delay_ms_max;
+	}
+	return 0;
+}
+
+static int
+flashcache_reclaim_policy_sysctl(ctl_table *table, int write,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+				 struct file *file, 
+#endif
+				 void __user *buffer, 
+				 size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+	proc_dointvec(table, write, file, buffer, length, ppos);
+#else
+	proc_dointvec(table, write, buffer, length, ppos);
+#endif
+	if (write) {
+		if (dmc->sysctl_reclaim_policy < FLASHCACHE_FIFO ||
+		    dmc->sysctl_reclaim_policy > FLASHCACHE_LRU2Q)
+			dmc->sysctl_reclaim_policy = FLASHCACHE_FIFO;
+	}
+	return 0;
+}
+
 static int
 flashcache_dirty_thresh_sysctl(ctl_table *table, int write,
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
@@ -212,7 +265,7 @@ flashcache_dirty_thresh_sysctl(ctl_table *table, int write,
  * entries - zero padded at the end ! Therefore the NUM_*_SYSCTLS
  * is 1 more than then number of sysctls.
  */
-#define FLASHCACHE_NUM_WRITEBACK_SYSCTLS	17
+#define FLASHCACHE_NUM_WRITEBACK_SYSCTLS	20
 
 static struct flashcache_writeback_sysctl_table {
 	struct ctl_table_header *sysctl_header;
@@ -319,7 +372,10 @@ static struct flashcache_writeback_sysctl_table {
 			.procname	= "reclaim_policy",
 			.maxlen		= sizeof(int),
 			.mode		= 0644,
-			.proc_handler	= &proc_dointvec,
+			.proc_handler	= &flashcache_reclaim_policy_sysctl,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.strategy	= &sysctl_intvec,
+#endif
 		},
 		{
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
@@ -397,6 +453,45 @@ static struct flashcache_writeback_sysctl_table {
 			.mode		= 0644,
 			.proc_handler	= &proc_dointvec,
 		},
+		{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name	= CTL_UNNUMBERED,
+#endif
+			.procname	= "md_commit_delay_ms",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &flashcache_md_commit_delay_sysctl,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.strategy	= &sysctl_intvec,
+#endif
+		},
+		{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name	= CTL_UNNUMBERED,
+#endif
+			.procname	= "clean_adaptive",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &proc_dointvec_minmax,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.strategy	= &sysctl_intvec,
+#endif
+			.extra1		= &zero,
+			.extra2		= &one,
+		},
+		{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name	= CTL_UNNUMBERED,
+#endif
+			.procname	= "clean_disk_latency_ms",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &proc_dointvec_minmax,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.strategy	= &sysctl_intvec,
+#endif
+			.extra1		= &zero,
+		},
 	},
 	.dev = {
 		{
@@ -494,7 +589,10 @@ static struct flashcache_writethrough_sysctl_table {
 			.procname	= "reclaim_policy",
 			.maxlen		= sizeof(int),
 			.mode		= 0644,
-			.proc_handler	= &proc_dointvec,
+			.proc_handler	= &flashcache_reclaim_policy_sysctl,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.strategy	= &sysctl_intvec,
+#endif
 		},
 		{
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
@@ -615,6 +713,12 @@ flashcache_find_sysctl_data(struct cache_c *dmc, ctl_table *vars)
 		return &dmc->sysctl_fallow_delay;
 	else if (strcmp(vars->procname, "skip_seq_thresh_kb") == 0) 
 		return &dmc->sysctl_skip_seq_thresh_kb;
+	else if (strcmp(vars->procname, "md_commit_delay_ms") == 0) 
+		return &dmc->sysctl_md_commit_delay_ms;
+	else if (strcmp(vars->procname, "clean_adaptive") == 0) 
+		return &dmc->sysctl_clean_adaptive;
+	else if (strcmp(vars->procname, "clean_disk_latency_ms") == 0) 
+		return &dmc->sysctl_clean_disk_latency_ms;
 	VERIFY(0);
 	return NULL;
 }
@@ -633,7 +737,9 @@ flashcache_writeback_sysctl_register(struct cache_c *dmc)
 		t->vars[i].de = NULL;
 #endif
 		t->vars[i].data = flashcache_find_sysctl_data(dmc, &t->vars[i]);
-		t->vars[i].extra1 = dmc;
+		/* extra1/extra2 hold the bounds of the minmax entries */
+		if (t->vars[i].proc_handler != &proc_dointvec_minmax)
+			t->vars[i].extra1 = dmc;
 	}
 	
 	t->dev[0].procname = flashcache_cons_sysctl_devname(dmc);
@@ -746,10 +852,15 @@ static int
 flashcache_stats_show(struct seq_file *seq, void *v)
 {
 	struct cache_c *dmc = seq->private;
-	struct flashcache_stats *stats;
-	int read_hit_pct, write_hit_pct, dirty_write_hit_pct;
+	struct flashcache_stats sum, *stats = &sum;
+	int read_hit_pct, write_hit_pct, dirty_write_hit_pct, seq_stream_hit_pct;
 
-	stats = &dmc->flashcache_stats;
+	flashcache_stats_sum(dmc, stats);
+	if (stats->seq_stream_hits + stats->seq_stream_misses > 0)
+		seq_stream_hit_pct = stats->seq_stream_hits * 100 / 
+			(stats->seq_stream_hits + stats->seq_stream_misses);
+	else
+		seq_stream_hit_pct = 0;
 	if (stats->reads > 0)
 		read_hit_pct = stats->read_hits * 100 / stats->reads;
 	else
@@ -796,8 +907,14 @@ flashcache_stats_show(struct seq_file *seq, void *v)
 			   stats->md_write_dirty, stats->md_write_clean);
 		seq_printf(seq, "metadata_batch=%lu metadata_ssd_writes=%lu ",
 			   stats->md_write_batch, stats->md_ssd_writes);
+		seq_printf(seq, "metadata_group_commits=%lu metadata_group_commit_batch=%lu ",
+			   stats->md_group_commits, stats->md_group_commit_batch);
+		seq_printf(seq, "metadata_load_deferred=%lu ",
+			   stats->md_load_deferred);
 		seq_printf(seq, "cleanings=%lu fallow_cleanings=%lu ",
 			   stats->cleanings, stats->fallow_cleanings);
+		seq_printf(seq, "clean_throttled=%lu ",
+			   stats->clean_throttled);
 	}
 	seq_printf(seq, "no_room=%lu ",
 		   stats->noroom);
@@ -812,6 +929,8 @@ flashcache_stats_show(struct seq_file *seq, void *v)
 		   stats->uncached_reads, stats->uncached_writes, stats->uncached_io_requeue);
 	seq_printf(seq,  "uncached_sequential_reads=%lu uncached_sequential_writes=%lu ",
 		   stats->uncached_sequential_reads, stats->uncached_sequential_writes);
+	seq_printf(seq,  "seq_stream_hits=%lu seq_stream_misses=%lu seq_stream_hit_percent=%d ",
+		   stats->seq_stream_hits, stats->seq_stream_misses, seq_stream_hit_pct);
 	seq_printf(seq, "pid_adds=%lu pid_dels=%lu pid_drops=%lu pid_expiry=%lu\n",
 		   stats->pid_adds, stats->pid_dels, stats->pid_drops, stats->expiry);
 	return 0;
@@ -836,13 +955,13 @@ flashcache_errors_show(struct seq_file *seq, void *v)
 	struct cache_c *dmc = seq->private;
 
 	seq_printf(seq, "disk_read_errors=%d disk_write_errors=%d ",
-		   dmc->flashcache_errors.disk_read_errors, 
-		   dmc->flashcache_errors.disk_write_errors);
+		   atomic_read(&dmc->flashcache_errors.disk_read_errors), 
+		   atomic_read(&dmc->flashcache_errors.disk_write_errors));
 	seq_printf(seq, "ssd_read_errors=%d ssd_write_errors=%d ",
-		   dmc->flashcache_errors.ssd_read_errors, 
-		   dmc->flashcache_errors.ssd_write_errors);
+		   atomic_read(&dmc->flashcache_errors.ssd_read_errors), 
+		   atomic_read(&dmc->flashcache_errors.ssd_write_errors));
 	seq_printf(seq, "memory_alloc_errors=%d\n", 
-		   dmc->flashcache_errors.memory_alloc_errors);
+		   atomic_read(&dmc->flashcache_errors.memory_alloc_errors));
 	return 0;
 }
 
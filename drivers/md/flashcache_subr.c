@@ -56,48 +56,72 @@
 #endif
 #include "flashcache.h"
 
-static DEFINE_SPINLOCK(_job_lock);
-
 extern mempool_t *_job_pool;
 extern mempool_t *_pending_job_pool;
 
 extern atomic_t nr_cache_jobs;
 extern atomic_t nr_pending_jobs;
 
-LIST_HEAD(_pending_jobs);
-LIST_HEAD(_io_jobs);
-LIST_HEAD(_md_io_jobs);
-LIST_HEAD(_md_complete_jobs);
-LIST_HEAD(_uncached_io_complete_jobs);
+static DEFINE_PER_CPU(struct flashcache_job_queue, flashcache_job_queues);
+
+void
+flashcache_job_queues_init(void)
+{
+	struct flashcache_job_queue *queue;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		queue = &per_cpu(flashcache_job_queues, cpu);
+		spin_lock_init(&queue->lock);
+		for (i = 0 ; i < FLASHCACHE_NR_JOB_LISTS ; i++)
+			INIT_LIST_HEAD(&queue->jobs[i]);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+		INIT_WORK(&queue->work, do_work, queue);
+#else
+		INIT_WORK(&queue->work, do_work);
+#endif
+	}
+}
+
+static int
+flashcache_jobs_empty(int list)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		if (!list_empty(&per_cpu(flashcache_job_queues, cpu).jobs[list]))
+			return 0;
+	return 1;
+}
 
 int
 flashcache_pending_empty(void)
 {
-	return list_empty(&_pending_jobs);
+	return flashcache_jobs_empty(FLASHCACHE_PENDING_JOBS);
 }
 
 int
 flashcache_io_empty(void)
 {
-	return list_empty(&_io_jobs);
+	return flashcache_jobs_empty(FLASHCACHE_IO_JOBS);
 }
 
 int
 flashcache_md_io_empty(void)
 {
-	return list_empty(&_md_io_jobs);
+	return flashcache_jobs_empty(FLASHCACHE_MD_IO_JOBS);
 }
 
 int
 flashcache_md_complete_empty(void)
 {
-	return list_empty(&_md_complete_jobs);
+	return flashcache_jobs_empty(FLASHCACHE_MD_COMPLETE_JOBS);
 }
 
 int
 flashcache_uncached_io_complete_empty(void)
 {
-	return list_empty(&_uncached_io_complete_jobs);
+	return flashcache_jobs_empty(FLASHCACHE_UNCACHED_IO_COMPLETE_JOBS);
 }
 
 struct kcached_job *
@@ -127,7 +151,7 @@ flashcache_alloc_pending_job(struct cache_c *dmc)
 	if (likely(job))
 		atomic_inc(&nr_pending_jobs);
 	else
-		dmc->flashcache_errors.memory_alloc_errors++;
+		atomic_inc(&dmc->flashcache_errors.memory_alloc_errors);
 	return job;
 }
 
@@ -138,15 +162,18 @@ flashcache_free_pending_job(struct pending_job *job)
 	atomic_dec(&nr_pending_jobs);
 }
 
-#define FLASHCACHE_PENDING_JOB_HASH(INDEX)		((INDEX) % PENDING_JOB_HASH_SIZE)
-
+/*
+ * Pending jobs are queued on the set of the cacheblock they are waiting on,
+ * so they are protected by the set lock.
+ */
 void 
 flashcache_enq_pending(struct cache_c *dmc, struct bio* bio,
 		       int index, int action, struct pending_job *job)
 {
 	struct pending_job **head;
 	
-	head = &dmc->pending_job_hashbuckets[FLASHCACHE_PENDING_JOB_HASH(index)];
+	VERIFY(spin_is_locked(INDEX_TO_SET_LOCK(dmc, index)));
+	head = &dmc->cache_sets[index / dmc->assoc].pending_jobs;
 	DPRINTK("flashcache_enq_pending: Queue to pending Q Index %d %llu",
 		index, bio->bi_sector);
 	VERIFY(job != NULL);
@@ -159,8 +186,8 @@ flashcache_enq_pending(struct cache_c *dmc, struct bio* bio,
 		(*head)->prev = job;
 	*head = job;
 	dmc->cache[index].nr_queued++;
-	dmc->flashcache_stats.enqueues++;
-	dmc->pending_jobs_count++;
+	FLASHCACHE_STATS_INC(dmc, enqueues);
+	atomic_long_inc(&dmc->pending_jobs_count);
 }
 
 /*
@@ -173,13 +200,13 @@ flashcache_deq_pending(struct cache_c *dmc, int index)
 	int moved = 0;
 	struct pending_job **head;
 	
-	VERIFY(spin_is_locked(&dmc->cache_spin_lock));
-	head = &dmc->pending_job_hashbuckets[FLASHCACHE_PENDING_JOB_HASH(index)];
+	VERIFY(spin_is_locked(INDEX_TO_SET_LOCK(dmc, index)));
+	head = &dmc->cache_sets[index / dmc->assoc].pending_jobs;
 	for (node = *head ; node != NULL ; node = next) {
 		next = node->next;
 		if (node->index == index) {
 			/* 
-			 * Remove pending job from the global list of 
+			 * Remove pending job from the set's list of 
 			 * jobs and move it to the private list for freeing 
 			 */
 			if (node->prev == NULL) {
@@ -199,8 +226,8 @@ flashcache_deq_pending(struct cache_c *dmc, int index)
 			moved++;
 		}
 	}
-	VERIFY(dmc->pending_jobs_count >= moved);
-	dmc->pending_jobs_count -= moved;
+	VERIFY(atomic_long_read(&dmc->pending_jobs_count) >= moved);
+	atomic_long_sub(moved, &dmc->pending_jobs_count);
 	return movelist;
 }
 
@@ -267,9 +294,9 @@ flashcache_store_checksum(struct kcached_job *job)
 	unsigned long flags;
 	
 	sum = flashcache_compute_checksum(job->bio);
-	spin_lock_irqsave(&job->dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(INDEX_TO_SET_LOCK(job->dmc, job->index), flags);
 	job->dmc->cache[job->index].checksum = sum;
-	spin_unlock_irqrestore(&job->dmc->cache_spin_lock, flags);
+	spin_unlock_irqrestore(INDEX_TO_SET_LOCK(job->dmc, job->index), flags);
 }
 
 int
@@ -280,99 +307,116 @@ flashcache_validate_checksum(struct kcached_job *job)
 	unsigned long flags;
 	
 	sum = flashcache_compute_checksum(job->bio);
-	spin_lock_irqsave(&job->dmc->cache_spin_lock, flags);
+	spin_lock_irqsave(INDEX_TO_SET_LOCK(job->dmc, job->index), flags);
 	if (likely(job->dmc->cache[job->index].checksum == sum)) {
-		job->dmc->flashcache_stats.checksum_valid++;		
+		FLASHCACHE_STATS_INC(job->dmc, checksum_valid);		
 		retval = 0;
 	} else {
-		job->dmc->flashcache_stats.checksum_invalid++;
+		FLASHCACHE_STATS_INC(job->dmc, checksum_invalid);
 		retval = 1;
 	}
-	spin_unlock_irqrestore(&job->dmc->cache_spin_lock, flags);
+	spin_unlock_irqrestore(INDEX_TO_SET_LOCK(job->dmc, job->index), flags);
 	return retval;
 }
 #endif
 
 /*
  * Functions to push and pop a job onto the head of a given job list.
+ * A job is pushed onto the list of the local CPU, and that CPU's work item
+ * is kicked to process it. The queue lock is only contended if the work 
+ * item ends up running elsewhere (CPU hotplug).
  */
 struct kcached_job *
-pop(struct list_head *jobs)
+pop(struct flashcache_job_queue *queue, int list)
 {
 	struct kcached_job *job = NULL;
+	struct list_head *jobs = &queue->jobs[list];
 	unsigned long flags;
 
-	spin_lock_irqsave(&_job_lock, flags);
+	spin_lock_irqsave(&queue->lock, flags);
 	if (!list_empty(jobs)) {
 		job = list_entry(jobs->next, struct kcached_job, list);
 		list_del(&job->list);
 	}
-	spin_unlock_irqrestore(&_job_lock, flags);
+	spin_unlock_irqrestore(&queue->lock, flags);
 	return job;
 }
 
 void 
-push(struct list_head *jobs, struct kcached_job *job)
+push(int list, struct kcached_job *job)
 {
+	struct flashcache_job_queue *queue;
 	unsigned long flags;
 
-	spin_lock_irqsave(&_job_lock, flags);
-	list_add_tail(&job->list, jobs);
-	spin_unlock_irqrestore(&_job_lock, flags);
+	local_irq_save(flags);
+	queue = &__get_cpu_var(flashcache_job_queues);
+	spin_lock(&queue->lock);
+	list_add_tail(&job->list, &queue->jobs[list]);
+	spin_unlock(&queue->lock);
+	schedule_work_on(smp_processor_id(), &queue->work);
+	local_irq_restore(flags);
 }
 
 void
 push_pending(struct kcached_job *job)
 {
-	push(&_pending_jobs, job);	
+	push(FLASHCACHE_PENDING_JOBS, job);	
 }
 
 void
 push_io(struct kcached_job *job)
 {
-	push(&_io_jobs, job);	
+	push(FLASHCACHE_IO_JOBS, job);	
 }
 
 void
 push_uncached_io_complete(struct kcached_job *job)
 {
-	push(&_uncached_io_complete_jobs, job);	
+	push(FLASHCACHE_UNCACHED_IO_COMPLETE_JOBS, job);	
 }
 
 void
 push_md_io(struct kcached_job *job)
 {
-	push(&_md_io_jobs, job);	
+	push(FLASHCACHE_MD_IO_JOBS, job);	
 }
 
 void
 push_md_complete(struct kcached_job *job)
 {
-	push(&_md_complete_jobs, job);	
+	push(FLASHCACHE_MD_COMPLETE_JOBS, job);	
 }
 
 static void
-process_jobs(struct list_head *jobs,
+process_jobs(struct flashcache_job_queue *queue, int list,
 	     void (*fn) (struct kcached_job *))
 {
 	struct kcached_job *job;
 
-	while ((job = pop(jobs)))
+	while ((job = pop(queue, list)))
 		(void)fn(job);
 }
 
 void 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
-do_work(void *unused)
+do_work(void *data)
 #else
-do_work(struct work_struct *unused)
+do_work(struct work_struct *work)
 #endif
 {
-	process_jobs(&_md_complete_jobs, flashcache_md_write_done);
-	process_jobs(&_pending_jobs, flashcache_do_pending);
-	process_jobs(&_md_io_jobs, flashcache_md_write_kickoff);
-	process_jobs(&_io_jobs, flashcache_do_io);
-	process_jobs(&_uncached_io_complete_jobs, flashcache_uncached_io_complete);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	struct flashcache_job_queue *queue = data;
+#else
+	struct flashcache_job_queue *queue = 
+		container_of(work, struct flashcache_job_queue, work);
+#endif
+
+	process_jobs(queue, FLASHCACHE_MD_COMPLETE_JOBS, flashcache_md_write_done);
+	process_jobs(queue, FLASHCACHE_PENDING_JOBS, flashcache_do_pending);
+	process_jobs(queue, FLASHCACHE_MD_IO_JOBS, flashcache_md_write_kickoff);
+	process_jobs(queue, FLASHCACHE_IO_JOBS, flashcache_do_io);
+	process_jobs(queue, FLASHCACHE_UNCACHED_IO_COMPLETE_JOBS, 
+		     flashcache_uncached_io_complete);
 }
 
 struct kcached_job *
@@ -382,7 +426,7 @@ new_kcached_job(struct cache_c *dmc, struct bio* bio, int index)
 
 	job = flashcache_alloc_cache_job();
 	if (unlikely(job == NULL)) {
-		dmc->flashcache_errors.memory_alloc_errors++;
+		atomic_inc(&dmc->flashcache_errors.memory_alloc_errors);
 		return NULL;
 	}
 	job->dmc = dmc;
@@ -447,37 +491,111 @@ flashcache_bio_endio(struct bio *bio, int error,
 #endif	
 }
 
-void
-flashcache_reclaim_lru_movetail(struct cache_c *dmc, int index)
+/* 
+ * Remove a block from its set's LRU. This also keeps the LRU2Q hot segment 
+ * consistent, whatever the reclaim policy, so the policy can be switched 
+ * at any time.
+ */
+static void
+flashcache_reclaim_lru_remove(struct cache_c *dmc, int index)
 {
 	int set = index / dmc->assoc;
 	int start_index = set * dmc->assoc;
 	int my_index = index - start_index;
 	struct cacheblock *cacheblk = &dmc->cache[index];
-
-	/* Remove from LRU */
+	struct cache_set *cache_set = &dmc->cache_sets[set];
+
+	if (cache_set->lru_hot_head == my_index)
+		cache_set->lru_hot_head = cacheblk->lru_next;
+	if (cacheblk->cache_state & LRU_HOT) {
+		cacheblk->cache_state &= ~LRU_HOT;
+		VERIFY(cache_set->nr_hot > 0);
+		if (--cache_set->nr_hot == 0)
+			cache_set->lru_hot_head = FLASHCACHE_LRU_NULL;
+	}
 	if (likely((cacheblk->lru_prev != FLASHCACHE_LRU_NULL) ||
 		   (cacheblk->lru_next != FLASHCACHE_LRU_NULL))) {
 		if (cacheblk->lru_prev != FLASHCACHE_LRU_NULL)
 			dmc->cache[cacheblk->lru_prev + start_index].lru_next = 
 				cacheblk->lru_next;
 		else
-			dmc->cache_sets[set].lru_head = cacheblk->lru_next;
+			cache_set->lru_head = cacheblk->lru_next;
 		if (cacheblk->lru_next != FLASHCACHE_LRU_NULL)
 			dmc->cache[cacheblk->lru_next + start_index].lru_prev = 
 				cacheblk->lru_prev;
 		else
-			dmc->cache_sets[set].lru_tail = cacheblk->lru_prev;
+			cache_set->lru_tail = cacheblk->lru_prev;
+	}
+}
+
+/* Insert a block in its set's LRU, in front of next (at the tail if NULL) */
+static void
+flashcache_reclaim_lru_insert(struct cache_c *dmc, int index, u_int16_t next)
+{
+	int set = index / dmc->assoc;
+	int start_index = set * dmc->assoc;
+	int my_index = index - start_index;
+	struct cacheblock *cacheblk = &dmc->cache[index];
+	struct cache_set *cache_set = &dmc->cache_sets[set];
+
+	cacheblk->lru_next = next;
+	if (next == FLASHCACHE_LRU_NULL) {
+		cacheblk->lru_prev = cache_set->lru_tail;
+		cache_set->lru_tail = my_index;
+	} else {
+		cacheblk->lru_prev = dmc->cache[next + start_index].lru_prev;
+		dmc->cache[next + start_index].lru_prev = my_index;
 	}
-	/* And add it to LRU Tail */
-	cacheblk->lru_next = FLASHCACHE_LRU_NULL;
-	cacheblk->lru_prev = dmc->cache_sets[set].lru_tail;
-	if (dmc->cache_sets[set].lru_tail == FLASHCACHE_LRU_NULL)
-		dmc->cache_sets[set].lru_head = my_index;
+	if (cacheblk->lru_prev == FLASHCACHE_LRU_NULL)
+		cache_set->lru_head = my_index;
 	else
-		dmc->cache[dmc->cache_sets[set].lru_tail + start_index].lru_next = 
-			my_index;
-	dmc->cache_sets[set].lru_tail = my_index;
+		dmc->cache[cacheblk->lru_prev + start_index].lru_next = my_index;
+}
+
+void
+flashcache_reclaim_lru_movetail(struct cache_c *dmc, int index)
+{
+	flashcache_reclaim_lru_remove(dmc, index);
+	flashcache_reclaim_lru_insert(dmc, index, FLASHCACHE_LRU_NULL);
+}
+
+/* LRU2Q : A new block goes to the tail of the cold segment */
+void
+flashcache_reclaim_lru2q_insert(struct cache_c *dmc, int index)
+{
+	struct cache_set *cache_set = &dmc->cache_sets[index / dmc->assoc];
+
+	flashcache_reclaim_lru_remove(dmc, index);
+	flashcache_reclaim_lru_insert(dmc, index, cache_set->lru_hot_head);
+}
+
+/* 
+ * LRU2Q : A hit moves the block to the tail of the hot segment. If that 
+ * grows the hot segment over its limit, the oldest hot block(s) become the 
+ * youngest cold ones, which only needs the hot head to move up.
+ */
+void
+flashcache_reclaim_lru2q_hit(struct cache_c *dmc, int index)
+{
+	int start_index = (index / dmc->assoc) * dmc->assoc;
+	struct cache_set *cache_set = &dmc->cache_sets[index / dmc->assoc];
+	struct cacheblock *cacheblk;
+	int max_hot = (dmc->assoc * FLASHCACHE_LRU2Q_HOT_PCT) / 100;
+
+	flashcache_reclaim_lru_remove(dmc, index);
+	flashcache_reclaim_lru_insert(dmc, index, FLASHCACHE_LRU_NULL);
+	dmc->cache[index].cache_state |= LRU_HOT;
+	if (cache_set->nr_hot++ == 0)
+		cache_set->lru_hot_head = index - start_index;
+	while (cache_set->nr_hot > max_hot) {
+		VERIFY(cache_set->lru_hot_head != FLASHCACHE_LRU_NULL);
+		cacheblk = &dmc->cache[cache_set->lru_hot_head + start_index];
+		if (cacheblk->cache_state & LRU_HOT) {
+			cacheblk->cache_state &= ~LRU_HOT;
+			cache_set->nr_hot--;
+		}
+		cache_set->lru_hot_head = cacheblk->lru_next;
+	}
 }
 
 static int 
@@ -505,7 +623,7 @@ swap_dbn_index_pair(void *a, void *b, int size)
  * 2) (sysctl'able) See if there are any other blocks in the same set
  * that are contig to any of the blocks in step 1. If so, include them
  * in our "to write" set, maintaining sorted order.
- * Has to be called under the cache spinlock !
+ * Has to be called under the set lock !
  */
 void
 flashcache_merge_writes(struct cache_c *dmc, struct dbn_index_pair *writes_list, 
@@ -526,7 +644,7 @@ flashcache_merge_writes(struct cache_c *dmc, struct dbn_index_pair *writes_list,
 
 	set_dirty_list = kmalloc(dmc->assoc * sizeof(struct dbn_index_pair), GFP_ATOMIC);
 	if (set_dirty_list == NULL) {
-		dmc->flashcache_errors.memory_alloc_errors++;
+		atomic_inc(&dmc->flashcache_errors.memory_alloc_errors);
 		goto out;
 	}
 	nr_set_dirty = 0;
@@ -585,9 +703,9 @@ flashcache_merge_writes(struct cache_c *dmc, struct dbn_index_pair *writes_list,
 				VERIFY(*nr_writes <= dmc->assoc);
 				new_inserts++;
 				if (back_merge == -1)
-					dmc->flashcache_stats.front_merge++;
+					FLASHCACHE_STATS_INC(dmc, front_merge);
 				else
-					dmc->flashcache_stats.back_merge++;
+					FLASHCACHE_STATS_INC(dmc, back_merge);
 				VERIFY(*nr_writes <= dmc->assoc);
 				break;
 			}
@@ -614,7 +732,7 @@ flashcache_merge_writes(struct cache_c *dmc, struct dbn_index_pair *writes_list,
 				(*nr_writes)++;
 				VERIFY(*nr_writes <= dmc->assoc);
 				new_inserts++;
-				dmc->flashcache_stats.back_merge++;
+				FLASHCACHE_STATS_INC(dmc, back_merge);
 				VERIFY(*nr_writes <= dmc->assoc);				
 			}
 		}
@@ -748,18 +866,37 @@ flashcache_dm_io_sync_vm(struct cache_c *dmc, struct dm_io_region *where, int rw
 }
 #endif
 
+void
+flashcache_stats_sum(struct cache_c *dmc, struct flashcache_stats *sum)
+{
+	unsigned long *total = (unsigned long *)sum;
+	unsigned long *stats;
+	int cpu, i;
+
+	BUILD_BUG_ON(sizeof(*sum) % sizeof(unsigned long));
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		stats = (unsigned long *)per_cpu_ptr(dmc->stats, cpu);
+		for (i = 0 ; i < sizeof(*sum) / sizeof(unsigned long) ; i++)
+			total[i] += stats[i];
+	}
+}
+
 void
 flashcache_update_sync_progress(struct cache_c *dmc)
 {
 	u_int64_t dirty_pct;
+	int nr_dirty;
 	
-	if (dmc->flashcache_stats.cleanings % 1000)
+	/* Going by this cpu's cleanings is good enough for a progress report */
+	if (per_cpu_ptr(dmc->stats, raw_smp_processor_id())->cleanings % 1000)
 		return;
-	if (!dmc->nr_dirty || !dmc->size || !printk_ratelimit())
+	nr_dirty = atomic_read(&dmc->nr_dirty);
+	if (!nr_dirty || !dmc->size || !printk_ratelimit())
 		return;
-	dirty_pct = ((u_int64_t)dmc->nr_dirty * 100) / dmc->size;
+	dirty_pct = ((u_int64_t)nr_dirty * 100) / dmc->size;
 	printk(KERN_INFO "Flashcache: Cleaning %d Dirty blocks, Dirty Blocks pct %llu%%", 
-	       dmc->nr_dirty, dirty_pct);
+	       nr_dirty, dirty_pct);
 	printk(KERN_INFO "\r");
 }
 
@@ -781,5 +918,7 @@ EXPORT_SYMBOL(flashcache_dm_io_sync_vm_callback);
 #endif
 EXPORT_SYMBOL(flashcache_dm_io_sync_vm);
 EXPORT_SYMBOL(flashcache_reclaim_lru_movetail);
+EXPORT_SYMBOL(flashcache_reclaim_lru2q_insert);
+EXPORT_SYMBOL(flashcache_reclaim_lru2q_hit);
 EXPORT_SYMBOL(flashcache_merge_writes);
 EXPORT_SYMBOL(flashcache_enq_pending);
@@ -469,9 +469,12 @@ static void vp_del_vqs(struct virtio_device *vdev)
 	list_for_each_entry_safe(vq, n, &vdev->vqs, list) {
 		info = vq->priv;
 		if (vp_dev->per_vq_vectors &&
-			info->msix_vector != VIRTIO_MSI_NO_VECTOR)
-			free_irq(vp_dev->msix_entries[info->msix_vector].vector,
-				 vq);
+			info->msix_vector != VIRTIO_MSI_NO_VECTOR) {
+			int irq = vp_dev->msix_entries[info->msix_vector].vector;
+
+			irq_set_affinity_hint(irq, NULL);
+			free_irq(irq, vq);
+		}
 		vp_del_vq(vq);
 	}
 	vp_dev->per_vq_vectors = false;
@@ -575,6 +578,24 @@ static int vp_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 				  false, false);
 }
 
+/* the config->set_vq_affinity() implementation */
+static int vp_set_vq_affinity(struct virtqueue *vq, int cpu)
+{
+	struct virtio_pci_device *vp_dev = to_vp_device(vq->vdev);
+	struct virtio_pci_vq_info *info = vq->priv;
+	int irq;
+
+	/* only a vq with a vector of its own can be steered */
+	if (!vp_dev->per_vq_vectors ||
+	    info->msix_vector == VIRTIO_MSI_NO_VECTOR)
+		return 0;
+
+	irq = vp_dev->msix_entries[info->msix_vector].vector;
+	if (cpu == -1)
+		return irq_set_affinity_hint(irq, NULL);
+	return irq_set_affinity_hint(irq, cpumask_of(cpu));
+}
+
 static struct virtio_config_ops virtio_pci_config_ops = {
 	.get		= vp_get,
 	.set		= vp_set,
@@ -585,6 +606,7 @@ static struct virtio_config_ops virtio_pci_config_ops = {
 	.del_vqs	= vp_del_vqs,
 	.get_features	= vp_get_features,
 	.finalize_features = vp_finalize_features,
+	.set_vq_affinity = vp_set_vq_affinity,
 };
 
 static void virtio_pci_release_dev(struct device *_d)
@@ -38,6 +38,7 @@
 
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
+#include <linux/seq_file.h>
 
 #include "acridafs.h"
 #include "kuafu_info.h"
@@ -47,8 +48,6 @@
 #define MAX_NOFILE     32768
 #define printk(...)
 
-struct semaphore inode_mutex = __SEMAPHORE_INITIALIZER(inode_mutex, 1);
-
 static struct super_operations acridafs_ops;
 static struct address_space_operations acridafs_aops;
 static struct inode_operations acridafs_file_inode_operations;
@@ -66,8 +65,15 @@ static struct backing_dev_info acridafs_backing_dev_info = {
 const struct file_operations acridafs_file_operations;
 
 struct dentry *g_root_dentry;
-static int g_in_flush;
 
+/*
+ * Each message channel (regular file) has an acrida_bdev hanging off
+ * inode->i_bdev. There is no filesystem wide lock: the pointer and nr_open
+ * are protected by the inode's i_lock, the lock word in the shared page by
+ * ab->spin, and unlinks are serialized by the parent's i_mutex like any
+ * other filesystem. Notifications (poll, COULD_READ/COULD_WRITE) are
+ * lockless.
+ */
 struct acrida_bdev {
 	struct list_head        list;
 	wait_queue_head_t       rwait;
@@ -84,8 +90,6 @@ struct acrida_center_dev {
 	wait_queue_head_t       wait;
 };
 
-static DEFINE_RWLOCK(g_alive_lock);
-
 static struct acrida_center_dev ac_dev;
 static struct miscdevice ka_dev;
 static int g_file_count;
@@ -96,8 +100,21 @@ static long acrida_center_ioctl(struct file *file, unsigned int cmd,
 static int acrida_center_open(struct inode *inode, struct file *file);
 static int acrida_center_release(struct inode *inode, struct file *file);
 
-static ssize_t kuafu_alive_read(struct file *file, char __user *user,
-		size_t count, loff_t *off);
+/* wake up the readers and writers of a channel, if it is still open */
+static void acrida_bdev_wake(struct inode *inode)
+{
+	struct acrida_bdev *ab;
+
+	spin_lock(&inode->i_lock);
+	ab = (struct acrida_bdev *)(inode->i_bdev);
+	if (ab) {
+		wake_up_interruptible(&ab->rwait);
+		wake_up_interruptible(&ab->wwait);
+	}
+	spin_unlock(&inode->i_lock);
+}
+
+static int kuafu_alive_open(struct inode *inode, struct file *file);
 static ssize_t kuafu_alive_write(struct file *file, const char __user *user,
 		size_t count, loff_t *off);
 static int kuafu_alive_flush(struct file *file, fl_owner_t id);
@@ -210,10 +227,40 @@ static int acridafs_symlink(struct inode *dir, struct dentry *dentry,
 	return error;
 }
 
+/*
+ * ring channel readiness, see acridafs.h. Flag the side that is going to
+ * sleep before rechecking the indices, so a producer or consumer moving
+ * them concurrently either sees the flag and does ARING_WAKE, or we see
+ * its update here.
+ */
+static unsigned int acrida_ring_poll(unsigned long *hdr)
+{
+	unsigned long size = ACCESS_ONCE(hdr[AHDR_RING_SIZE]);
+	unsigned long head, tail;
+	unsigned int mask = 0;
+
+	head = ACCESS_ONCE(hdr[AHDR_RING_HEAD]);
+	tail = ACCESS_ONCE(hdr[AHDR_RING_TAIL]);
+	if (head == tail)
+		set_bit(ARING_READER_WAITING, &hdr[AHDR_RING_WAITERS]);
+	if (head - tail >= size)
+		set_bit(ARING_WRITER_WAITING, &hdr[AHDR_RING_WAITERS]);
+	smp_mb();
+	head = ACCESS_ONCE(hdr[AHDR_RING_HEAD]);
+	tail = ACCESS_ONCE(hdr[AHDR_RING_TAIL]);
+
+	if (head != tail)
+		mask |= POLLIN | POLLRDNORM;
+	if (head - tail < size)
+		mask |= POLLOUT | POLLWRNORM;
+	return mask;
+}
+
 /* check the queue in the share memory */
 unsigned int acridafs_file_poll(struct file *file, poll_table *wait)
 {
 	struct acrida_bdev *ab = NULL;
+	unsigned long *hdr = NULL;
 	unsigned int mask = 0;
 	unsigned long begin = 0;
 	unsigned long kfc_live = 0;
@@ -237,8 +284,9 @@ unsigned int acridafs_file_poll(struct file *file, poll_table *wait)
 			}
 
 			if (ab->buff) {
-				begin = ((unsigned long *)(ab->buff))[0];
-				kfc_live = ((unsigned long *)(ab->buff))[5];
+				hdr = (unsigned long *)(ab->buff);
+				begin = hdr[AHDR_BEGIN];
+				kfc_live = hdr[AHDR_KFC_LIVE];
 				ret = 0;
 			}
 		}
@@ -247,7 +295,9 @@ unsigned int acridafs_file_poll(struct file *file, poll_table *wait)
 	printk(KERN_ERR "begin %lu, ret %d, kfc_live:%d\n",
 				begin, ret, kfc_live);
 
-	if (begin)
+	if (hdr && hdr[AHDR_RING_SIZE])
+		mask |= acrida_ring_poll(hdr);
+	else if (begin)
 		mask |= POLLIN;
 	else
 		mask |= POLLOUT;
@@ -293,7 +343,22 @@ long acridafs_file_ioctl(struct file *file, unsigned int cmd,
 				ab->buff = page_address(page);
 	}
 	if (ab->buff)
-		lock = (size_t *)(ab->buff) + 6;
+		lock = (size_t *)(ab->buff) + AHDR_LOCK;
+
+	/* one wakeup for a batch of ring messages, only for sleepers */
+	if (cmd == ARING_WAKE) {
+		unsigned long *hdr = (unsigned long *)(ab->buff);
+
+		if (!hdr)
+			goto out;
+		if (test_and_clear_bit(ARING_READER_WAITING,
+					&hdr[AHDR_RING_WAITERS]))
+			wake_up_interruptible(&ab->rwait);
+		if (test_and_clear_bit(ARING_WRITER_WAITING,
+					&hdr[AHDR_RING_WAITERS]))
+			wake_up_interruptible(&ab->wwait);
+		goto out;
+	}
 
 	if (cmd == ALOCK) {
 retry:
@@ -362,8 +427,6 @@ int acridafs_file_flush(struct file *file, fl_owner_t id)
 	size_t *lock = NULL;
 	int should_wake = 0;
 
-	down(&inode_mutex);
-
 	if (!file)
 		goto out;
 
@@ -381,49 +444,55 @@ int acridafs_file_flush(struct file *file, fl_owner_t id)
 		atomic_inc(&node->i_count);
 
 		printk(KERN_ERR "mapping:%x\n", file->f_mapping);
-		if (file->f_mapping && file->f_mapping->page_tree.rnode) {
-			spin_lock(&file->f_mapping->tree_lock);
-			page = radix_tree_lookup(&file->f_mapping->page_tree,
-					0);
-			if (!page)
-				goto page_out;
-			printk(KERN_ERR "page:%x\n", page);
-			buff = page_address(page);
-			if (!buff)
-				goto page_out;
-			printk(KERN_ERR "buff:%x\n", buff);
-			pid = buff[4];
-			lock = buff + 6;
-
-			ab = (struct acrida_bdev *)(node->i_bdev);
-			if (!ab)
-				goto page_out;
-			printk(KERN_ERR "ab ok %d, %d\n", *lock, current->tgid);
-			spin_lock(&ab->spin);
-			if (*lock == current->tgid) {
-				printk(KERN_ERR "flush lock %d\n", *lock);
-				*lock = 0;
-				should_wake = 1;
-			}
-			spin_unlock(&ab->spin);
-
-			if (should_wake)
-				wake_up_interruptible(&ab->lockq);
-page_out:
-			spin_unlock(&file->f_mapping->tree_lock);
+		/* lockless pagecache lookup, no tree_lock */
+		page = NULL;
+		if (file->f_mapping)
+			page = find_get_page(file->f_mapping, 0);
+		if (!page)
+			goto page_out;
+		printk(KERN_ERR "page:%x\n", page);
+		buff = page_address(page);
+		if (!buff)
+			goto page_release;
+		printk(KERN_ERR "buff:%x\n", buff);
+		pid = buff[AHDR_OWNER];
+		lock = buff + AHDR_LOCK;
+
+		/* our own open file pins the acrida_bdev */
+		ab = (struct acrida_bdev *)(node->i_bdev);
+		if (!ab)
+			goto page_release;
+		printk(KERN_ERR "ab ok %d, %d\n", *lock, current->tgid);
+		spin_lock(&ab->spin);
+		if (*lock == current->tgid) {
+			printk(KERN_ERR "flush lock %d\n", *lock);
+			*lock = 0;
+			should_wake = 1;
 		}
+		spin_unlock(&ab->spin);
 
+		if (should_wake)
+			wake_up_interruptible(&ab->lockq);
+page_release:
+		page_cache_release(page);
+page_out:
 		printk(KERN_ERR "current:%u, owner:%lu, i_nlink:%lu\n",
 				current->tgid, pid, node->i_nlink);
 
-		if (current->tgid == pid && node->i_nlink &&
-				!IS_ERR(file->f_dentry)) {
-			parent = file->f_dentry->d_parent;
+		if (current->tgid == pid && node->i_nlink) {
+			parent = dget_parent(file->f_dentry);
 			if (parent->d_inode) {
-				g_in_flush = 1;
-				vfs_unlink(parent->d_inode, file->f_dentry);
-				g_in_flush = 0;
+				mutex_lock_nested(&parent->d_inode->i_mutex,
+						I_MUTEX_PARENT);
+				/* somebody may have unlinked it meanwhile */
+				if (node->i_nlink &&
+						file->f_dentry->d_parent == parent &&
+						!d_unhashed(file->f_dentry))
+					vfs_unlink(parent->d_inode,
+							file->f_dentry);
+				mutex_unlock(&parent->d_inode->i_mutex);
 			}
+			dput(parent);
 		}
 		iput(node);
 	}
@@ -431,11 +500,7 @@ page_out:
 	dput(file->f_dentry);
 	atomic_long_dec(&file->f_count);
 out:
-	up(&inode_mutex);
-
-	write_lock(&g_alive_lock);
 	kuafu_info_clear_pid_app(current->tgid);
-	write_unlock(&g_alive_lock);
 
 	return 0;
 }
@@ -445,9 +510,13 @@ int acridafs_file_open(struct inode *inode, struct file* file)
 	struct acrida_bdev *ab;
 	struct page *page;
 
-	if (inode->i_bdev) {
-		ab = (struct acrida_bdev *)(inode->i_bdev);
+	spin_lock(&inode->i_lock);
+	ab = (struct acrida_bdev *)(inode->i_bdev);
+	if (ab)
 		ab->nr_open++;
+	spin_unlock(&inode->i_lock);
+
+	if (ab) {
 		if (!ab->buff) {
 			page = find_get_page(file->f_mapping, 0);
 			if (page)
@@ -462,45 +531,40 @@ int acridafs_file_release(struct inode *inode, struct file *file)
 {
 	struct acrida_bdev *ab;
 
-	if (inode->i_bdev) {
+	spin_lock(&inode->i_lock);
+	ab = (struct acrida_bdev *)(inode->i_bdev);
+	if (ab) {
 		printk(KERN_ERR "release in file: kfree bdev\n");
-		ab = (struct acrida_bdev *)(inode->i_bdev);
 		wake_up_interruptible(&ab->rwait);
 		wake_up_interruptible(&ab->wwait);
 		ab->nr_open--;
 		printk(KERN_ERR "release:%d\n", ab->nr_open);
 
-		if (!(ab->nr_open)) {
-			kfree(ab);
+		if (!(ab->nr_open))
 			inode->i_bdev = NULL;
-		}
+		else
+			ab = NULL;
 	}
+	spin_unlock(&inode->i_lock);
+
+	kfree(ab);
 	return 0;
 }
 
+/* called with dir->i_mutex held, from the VFS or from acridafs_file_flush */
 int acridafs_unlink(struct inode *dir, struct dentry *dentry)
 {
-	struct acrida_bdev *ab = NULL;
 	int res = 0;
 
-	if (!g_in_flush)
-		down(&inode_mutex);
-
-	if (dentry && dentry->d_inode &&
-				dentry->d_inode->i_bdev) {
-		printk(KERN_ERR "release in unlink: kfree bdev\n");
-		ab = (struct acrida_bdev *)(dentry->d_inode->i_bdev);
-		wake_up_interruptible(&ab->rwait);
-		wake_up_interruptible(&ab->wwait);
+	if (dentry && dentry->d_inode) {
+		printk(KERN_ERR "release in unlink: wake bdev\n");
+		acrida_bdev_wake(dentry->d_inode);
 	}
 
 	if (dentry && dentry->d_inode &&
 				dentry->d_inode->i_nlink)
 		res = simple_unlink(dir, dentry);
 
-	if (!g_in_flush)
-		up(&inode_mutex);
-
 	return res;
 }
 
@@ -667,9 +731,12 @@ long acrida_center_ioctl(struct file *file, unsigned int cmd,
 
 const struct file_operations kuafu_alive_fops = {
 	.owner  = THIS_MODULE,
-	.read   = kuafu_alive_read,
+	.open   = kuafu_alive_open,
+	.read   = seq_read,
+	.llseek = seq_lseek,
 	.write  = kuafu_alive_write,
 	.flush  = kuafu_alive_flush,
+	.release = seq_release,
 };
 
 /* user will write information like:
@@ -695,8 +762,6 @@ ssize_t kuafu_alive_write(struct file *file, const char __user *user,
 
 	res = copy_from_user(buff, user, count);
 
-	write_lock(&g_alive_lock);
-
 	/* clear the current kfc information */
 	if (count == 5 && !strncmp(buff, "clear", 5)) {
 		kuafu_info_clear_group(current->tgid);
@@ -743,41 +808,14 @@ ssize_t kuafu_alive_write(struct file *file, const char __user *user,
 				!strncmp(buff, "clearapp", 8))
 		kuafu_info_remove_app(current->tgid, pos+1, count-9);
 err:
-	write_unlock(&g_alive_lock);
 	kfree(buff);
 	return count;
 }
 
-ssize_t kuafu_alive_read(struct file *file, char __user *user,
-		size_t count, loff_t *off)
+/* the dump is produced incrementally by kuafu_info_seq_ops */
+int kuafu_alive_open(struct inode *inode, struct file *file)
 {
-	int len;
-	int min;
-	int res;
-	char *buff = vmalloc(BUFFER_SIZE);
-	if (!buff)
-		return 0;
-
-	read_lock(&g_alive_lock);
-	kuafu_info_traverse(buff, &len);
-	read_unlock(&g_alive_lock);
-
-	if (*off >= len) {
-		min = 0;
-		goto ret;
-	}
-
-	if (count + *off > len)
-		min = len - *off;
-	else
-		min = count;
-
-	res = copy_to_user(user, buff + *off, min);
-
-	*off += min;
-ret:
-	vfree(buff);
-	return min;
+	return seq_open(file, &kuafu_info_seq_ops);
 }
 
 /* when kuafu daemon exit (include coredump), this will set flag
@@ -788,7 +826,6 @@ int kuafu_alive_flush(struct file *file, fl_owner_t id)
 	struct dentry *dentry;
 	struct page *page;
 	unsigned long *buff;
-	struct acrida_bdev *ab;
 	const unsigned char *pos = NULL;
 	const unsigned char *begin = NULL;
 	const unsigned char *end = NULL;
@@ -796,16 +833,13 @@ int kuafu_alive_flush(struct file *file, fl_owner_t id)
 	int res = 0;
 	int i = 0;
 
-	read_lock(&g_alive_lock);
 	res = kuafu_info_exists_pid(current->tgid);
-	read_unlock(&g_alive_lock);
 
 	printk(KERN_ERR "res:%d,%d\n", res, current->tgid);
 
 	if (!res)
 		return 0;
 
-	down(&inode_mutex);
 	spin_lock(&dcache_lock);
 
 	next = g_root_dentry->d_subdirs.next;
@@ -824,14 +858,12 @@ int kuafu_alive_flush(struct file *file, fl_owner_t id)
 				break;
 		}
 		if (end <= begin || i != 3)
-			continue;
+			goto page_out;
 
 		pos = end;
 		len = pos - begin;
 
-		read_lock(&g_alive_lock);
 		res = kuafu_info_exists_group(current->tgid, begin, len);
-		read_unlock(&g_alive_lock);
 
 		if (dentry->d_inode && dentry->d_inode->i_nlink &&
 				dentry->d_inode->i_mapping && pos && res) {
@@ -840,15 +872,13 @@ int kuafu_alive_flush(struct file *file, fl_owner_t id)
 			if (!page)
 				goto page_out;
 			buff = page_address(page);
-			if (!buff)
-				goto page_out;
-			buff[5] = KFC_FAIL;
-			ab = (struct acrida_bdev *)(dentry->d_inode->i_bdev);
-			if (ab) {
-				wake_up_interruptible(&ab->rwait);
-				wake_up_interruptible(&ab->wwait);
+			if (buff) {
+				buff[AHDR_KFC_LIVE] = KFC_FAIL;
+				acrida_bdev_wake(dentry->d_inode);
+				printk(KERN_ERR "center flush:%d\n",
+						buff[AHDR_OWNER]);
 			}
-			printk(KERN_ERR "center flush:%d\n", buff[4]);
+			page_cache_release(page);
 		}
 page_out:
 		next = next->next;
@@ -856,11 +886,7 @@ page_out:
 
 	spin_unlock(&dcache_lock);
 
-	up(&inode_mutex);
-
-	write_lock(&g_alive_lock);
 	kuafu_info_remove_pid(current->tgid);
-	write_unlock(&g_alive_lock);
 
 	return 0;
 }
@@ -3,8 +3,39 @@
 #define ALOCK          0x12
 #define AUNLOCK                0x13
 #define AUNLOCK_WAKE   0x14
+#define ARING_WAKE     0x15
 
 #define ADD_FILE       0x20
 #define DEL_FILE       0x21
 
 #define KFC_FAIL       0x20100521
+
+/*
+ * Header words (unsigned long) at the start of page 0 of a channel file,
+ * which apps share through mmap.
+ */
+#define AHDR_BEGIN     0       /* legacy: non zero when a message is queued */
+#define AHDR_OWNER     4       /* tgid of the creator, unlinks it on exit */
+#define AHDR_KFC_LIVE  5       /* KFC_FAIL once the kuafu daemon died */
+#define AHDR_LOCK      6       /* tgid holding ALOCK */
+/*
+ * Optional ring: when AHDR_RING_SIZE is non zero, the channel is a
+ * single producer/single consumer ring of AHDR_RING_SIZE bytes living in
+ * the mmap'd file after page 0. AHDR_RING_HEAD and AHDR_RING_TAIL are free
+ * running byte counts written by the producer and the consumer, so the
+ * ring is empty when they are equal and full when they differ by the size.
+ *
+ * Messages go through the ring without syscalls. Before poll() sleeps it
+ * sets ARING_READER_WAITING (ring empty) or ARING_WRITER_WAITING (ring
+ * full) in AHDR_RING_WAITERS and rechecks the indices. After moving
+ * head/tail, and after a full memory barrier, a producer or consumer that
+ * finds the other side's bit set calls ioctl(ARING_WAKE) once for the
+ * whole batch.
+ */
+#define AHDR_RING_HEAD         7
+#define AHDR_RING_TAIL         8
+#define AHDR_RING_SIZE         9
+#define AHDR_RING_WAITERS      10
+
+#define ARING_READER_WAITING   0       /* bit numbers in AHDR_RING_WAITERS */
+#define ARING_WRITER_WAITING   1
@@ -1,322 +1,427 @@
-#ifdef __KERNEL__
+/*
+ * Registry of the kuafu agents (pid -> group), their message sizes and
+ * the apps they serve.
+ *
+ * Entries are allocated on demand and hashed by pid (groups also by name,
+ * for the one-agent-per-group-and-role check). Lookups only take
+ * rcu_read_lock(); updates serialize on kuafu_info_lock and free entries
+ * after a grace period. The /dev/kuafu_alive dump walks the tables one
+ * bucket at a time through seq_file.
+ */
 #include <linux/kernel.h>
 #include <linux/string.h>
 #include <linux/module.h>
-#define MALLOC(size)   kzalloc(size, GFP_KERNEL)
-#define FREE(p)                 kfree(p)
-#else
-#include <string.h>
-#include <stdio.h>
-#include <stdlib.h>
-#define MALLOC(size)   malloc(size)
-#define FREE(p)                 free(p)
-#endif
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/rculist.h>
+#include <linux/spinlock.h>
+#include <linux/seq_file.h>
 
 #include "kuafu_info.h"
 
-static struct pid_group g_groups[DEFAULT_GROUPS];
-static struct pid_msgsize g_msgsizes[DEFAULT_TASKS];
-static struct app_bucket *g_apps[BUCKETS_NUM];
+#define KUAFU_HASH_BITS        10
+#define KUAFU_HASH_SIZE        (1 << KUAFU_HASH_BITS)
+
+struct pid_group {
+	struct hlist_node       pid_node;
+	struct hlist_node       name_node;
+	struct rcu_head         rcu;
+	pid_t   pid;
+	char    groupname[8];
+	char    role;   /* 'c', 's' or 'b' */
+	int     groupname_len;
+};
+
+struct pid_msgsize {
+	struct hlist_node       node;
+	struct rcu_head         rcu;
+	pid_t   pid;
+	int     msgsize;
+};
+
+struct pid_app {
+	struct hlist_node       node;
+	struct rcu_head         rcu;
+	pid_t   pid;
+	char    appname[64];
+	int     appname_len;
+};
+
+static struct hlist_head g_groups[KUAFU_HASH_SIZE];        /* by pid */
+static struct hlist_head g_group_names[KUAFU_HASH_SIZE];   /* by name */
+static struct hlist_head g_msgsizes[KUAFU_HASH_SIZE];
+static struct hlist_head g_apps[KUAFU_HASH_SIZE];
+
+static DEFINE_SPINLOCK(kuafu_info_lock);
+
+static inline struct hlist_head *pid_bucket(struct hlist_head *table,
+		pid_t pid)
+{
+	return table + hash_32((u32)pid, KUAFU_HASH_BITS);
+}
 
-int init_kuafu_info(void)
+static inline struct hlist_head *name_bucket(const char *name, int len)
 {
-	int ino;
-	int i;
-	struct app_bucket *bk = NULL;
-
-	for (ino = 0; ino < BUCKETS_NUM; ino++) {
-		bk = MALLOC(sizeof(struct app_bucket));
-		if (bk) {
-				g_apps[ino] = bk;
-				g_apps[ino]->entrys_num = 0;
-		} else
-				goto rollback;
-	}
-	return 0;
+	return g_group_names + (jhash(name, len, 0) & (KUAFU_HASH_SIZE - 1));
+}
 
-rollback:
-	for (i = ino-1; i >= 0; i--)
-		FREE(g_apps[i]);
-	return -1;
+static void pid_group_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct pid_group, rcu));
 }
 
-int exit_kuafu_info(void)
+static void pid_msgsize_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct pid_msgsize, rcu));
+}
+
+static void pid_app_free(struct rcu_head *head)
+{
+	kfree(container_of(head, struct pid_app, rcu));
+}
+
+int init_kuafu_info(void)
 {
-	int ino;
-	for (ino = 0; ino < BUCKETS_NUM; ino++)
-		FREE(g_apps[ino]);
 	return 0;
 }
 
 int kuafu_info_exists_pid(pid_t pid)
 {
-	int i = 0;
 	struct pid_group *pg = NULL;
-
-	for (; i < DEFAULT_GROUPS; i++) {
-		pg = g_groups + i;
-		if (pg->pid == pid)
-				return 1;
+	struct hlist_node *node;
+	int found = 0;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(pg, node, pid_bucket(g_groups, pid), pid_node) {
+		if (pg->pid == pid) {
+			found = 1;
+			break;
+		}
 	}
-	return 0;
+	rcu_read_unlock();
+	return found;
 }
 
 int kuafu_info_exists_group(pid_t pid, const char *name, int len)
 {
-	int i = 0;
 	struct pid_group *pg = NULL;
+	struct hlist_node *node;
+	int found = 0;
 
-	for (; i < DEFAULT_GROUPS; i++) {
-		pg = g_groups + i;
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(pg, node, pid_bucket(g_groups, pid), pid_node) {
 		if (pg->pid == pid &&
 				pg->groupname_len == len &&
-				!strncmp(pg->groupname, name, len))
-				return 1;
+				!strncmp(pg->groupname, name, len)) {
+			found = 1;
+			break;
+		}
 	}
-	return 0;
+	rcu_read_unlock();
+	return found;
 }
 
+int kuafu_info_exists_agent(const char *name, int len, char role)
+{
+	struct pid_group *pg = NULL;
+	struct hlist_node *node;
+	int found = 0;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(pg, node, name_bucket(name, len), name_node) {
+		if (pg->groupname_len == len &&
+			!strncmp(pg->groupname, name, len) &&
+			(role == 'b' || pg->role == 'b' || pg->role == role)) {
+			found = 1;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return found;
+}
+
+/* name is "<groupname>:<role>" */
 int kuafu_info_store_group(pid_t pid, const char *name, int len)
 {
-	int i = 0;
 	struct pid_group *pg = NULL;
+	int glen = len - 2;
 
-	if (kuafu_info_exists_agent(name, len - 2, name[len - 1]))
+	if (glen < 0 || glen > sizeof(pg->groupname))
 		return -1;
 
-	for (; i < DEFAULT_GROUPS; i++) {
-		pg = g_groups + i;
-		if (!pg->pid) {
-				pg->pid = pid;
-				strncpy(pg->groupname, name, len-2);
-				pg->groupname_len = len-2;
-				pg->role = name[len - 1];
-				return 0;
-		}
+	pg = kzalloc(sizeof(struct pid_group), GFP_KERNEL);
+	if (!pg)
+		return -2;
+	pg->pid = pid;
+	strncpy(pg->groupname, name, glen);
+	pg->groupname_len = glen;
+	pg->role = name[len - 1];
+
+	spin_lock(&kuafu_info_lock);
+	if (kuafu_info_exists_agent(name, glen, pg->role)) {
+		spin_unlock(&kuafu_info_lock);
+		kfree(pg);
+		return -1;
 	}
-	return -2;
+	hlist_add_head_rcu(&pg->pid_node, pid_bucket(g_groups, pid));
+	hlist_add_head_rcu(&pg->name_node, name_bucket(name, glen));
+	spin_unlock(&kuafu_info_lock);
+	return 0;
 }
 
-int kuafu_info_clear_group(pid_t pid)
+/* called with kuafu_info_lock held */
+static void kuafu_info_remove_pid_bucket_match(struct hlist_head *head,
+		pid_t pid, int any)
 {
-	int i = 0;
 	struct pid_group *pg = NULL;
+	struct hlist_node *node, *n;
 
-	for (; i < DEFAULT_GROUPS; i++) {
-		pg = g_groups + i;
-		if (pg->pid == pid)
-				pg->pid = 0;
+	hlist_for_each_entry_safe(pg, node, n, head, pid_node) {
+		if (any || pg->pid == pid) {
+			hlist_del_rcu(&pg->pid_node);
+			hlist_del_rcu(&pg->name_node);
+			call_rcu(&pg->rcu, pid_group_free);
+		}
 	}
+}
+
+int kuafu_info_clear_group(pid_t pid)
+{
+	spin_lock(&kuafu_info_lock);
+	kuafu_info_remove_pid_bucket_match(pid_bucket(g_groups, pid), pid, 0);
+	spin_unlock(&kuafu_info_lock);
 	return 0;
 }
 
 int kuafu_info_fetch_msgsize(pid_t pid)
 {
-	int i = 0;
 	struct pid_msgsize *pm = NULL;
-
-	for (; i < DEFAULT_TASKS; i++) {
-		pm = g_msgsizes + i;
-		if (pm->pid == pid)
-				return pm->msgsize;
+	struct hlist_node *node;
+	int msgsize = 0;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(pm, node, pid_bucket(g_msgsizes, pid), node) {
+		if (pm->pid == pid) {
+			msgsize = pm->msgsize;
+			break;
+		}
 	}
-	return 0;
+	rcu_read_unlock();
+	return msgsize;
 }
 
 int kuafu_info_store_msgsize(pid_t pid, int msgsize)
 {
-	int i = 0;
-	struct pid_msgsize *pm = NULL;
-
-	for (; i < DEFAULT_TASKS; i++) {
-		pm = g_msgsizes + i;
-		if (!pm->pid) {
-				pm->pid = pid;
-				pm->msgsize = msgsize;
-				break;
+	struct pid_msgsize *pm = NULL, *new;
+	struct hlist_node *node;
+
+	new = kzalloc(sizeof(struct pid_msgsize), GFP_KERNEL);
+	if (!new)
+		return 0;
+	new->pid = pid;
+	new->msgsize = msgsize;
+
+	spin_lock(&kuafu_info_lock);
+	hlist_for_each_entry(pm, node, pid_bucket(g_msgsizes, pid), node) {
+		if (pm->pid == pid) {
+			pm->msgsize = msgsize;
+			spin_unlock(&kuafu_info_lock);
+			kfree(new);
+			return 0;
 		}
 	}
+	hlist_add_head_rcu(&new->node, pid_bucket(g_msgsizes, pid));
+	spin_unlock(&kuafu_info_lock);
 	return 0;
 }
 
 int kuafu_info_clear_msgsize(pid_t pid)
 {
-	int i = 0;
 	struct pid_msgsize *pm = NULL;
+	struct hlist_node *node, *n;
 
-	for (; i < DEFAULT_TASKS; i++) {
-		pm = g_msgsizes + i;
-		if (pm->pid == pid)
-				pm->pid = 0;
+	spin_lock(&kuafu_info_lock);
+	hlist_for_each_entry_safe(pm, node, n, pid_bucket(g_msgsizes, pid), node) {
+		if (pm->pid == pid) {
+			hlist_del_rcu(&pm->node);
+			call_rcu(&pm->rcu, pid_msgsize_free);
+		}
 	}
+	spin_unlock(&kuafu_info_lock);
 	return 0;
 }
 
-int kuafu_info_exists_in_buckets_app(struct app_bucket *bk, pid_t pid,
-		const char *name, int len)
+static int kuafu_info_exists_app(pid_t pid, const char *name, int len)
 {
-	int i = 0;
 	struct pid_app *pa = NULL;
+	struct hlist_node *node;
+	int found = 0;
 
-	for (; i < bk->entrys_num; i++) {
-		pa = bk->entrys + i;
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(pa, node, pid_bucket(g_apps, pid), node) {
 		if (pa->pid == pid &&
-					 pa->appname_len == len &&
-					 !strncmp(pa->appname, name, len))
-				return 1;
+				pa->appname_len == len &&
+				!strncmp(pa->appname, name, len)) {
+			found = 1;
+			break;
+		}
 	}
-
-	return 0;
+	rcu_read_unlock();
+	return found;
 }
 
 int kuafu_info_store_app(pid_t pid, const char *name, int len)
 {
-	int no = pid % BUCKETS_NUM;
-	struct app_bucket *bk = g_apps[no];
 	struct pid_app *pa = NULL;
 
-	if (bk->entrys_num >= DEFAULT_APPS)
+	if (len < 0 || len > sizeof(pa->appname))
 		return -1;
 
-	if (kuafu_info_exists_in_buckets_app(bk, pid, name, len))
+	pa = kzalloc(sizeof(struct pid_app), GFP_KERNEL);
+	if (!pa)
 		return -1;
-
-	pa = bk->entrys + bk->entrys_num;
 	pa->pid = pid;
 	strncpy(pa->appname, name, len);
 	pa->appname_len = len;
-	bk->entrys_num++;
+
+	spin_lock(&kuafu_info_lock);
+	if (kuafu_info_exists_app(pid, name, len)) {
+		spin_unlock(&kuafu_info_lock);
+		kfree(pa);
+		return -1;
+	}
+	hlist_add_head_rcu(&pa->node, pid_bucket(g_apps, pid));
+	spin_unlock(&kuafu_info_lock);
 	return 0;
 }
 
 int kuafu_info_remove_app(pid_t pid, const char *name, int len)
 {
-	int i = 0;
-	int no = pid % BUCKETS_NUM;
 	struct pid_app *pa = NULL;
-	struct app_bucket *bk = g_apps[no];
+	struct hlist_node *node;
+	int res = -1;
 
-	for (; i < bk->entrys_num; i++) {
-		pa = bk->entrys + i;
+	spin_lock(&kuafu_info_lock);
+	hlist_for_each_entry(pa, node, pid_bucket(g_apps, pid), node) {
 		if (pa->pid == pid &&
 			pa->appname_len == len &&
 			!strncmp(pa->appname, name, len)) {
-			memmove(pa, pa + 1,
-				((bk->entrys + bk->entrys_num - 1) - pa) *
-				sizeof(struct pid_app));
-			bk->entrys_num--;
-			return 0;
+			hlist_del_rcu(&pa->node);
+			call_rcu(&pa->rcu, pid_app_free);
+			res = 0;
+			break;
 		}
 	}
-	return -1;
+	spin_unlock(&kuafu_info_lock);
+	return res;
 }
 
 int kuafu_info_clear_pid_app(pid_t pid)
 {
-	int i = 0;
-	int no = pid % BUCKETS_NUM;
 	struct pid_app *pa = NULL;
-	struct app_bucket *bk = g_apps[no];
-	int num = bk->entrys_num;
+	struct hlist_node *node, *n;
 
-	while (i < num) {
-		pa = bk->entrys + i;
+	spin_lock(&kuafu_info_lock);
+	hlist_for_each_entry_safe(pa, node, n, pid_bucket(g_apps, pid), node) {
 		if (pa->pid == pid) {
-			memmove(pa, pa + 1, ((bk->entrys + num - 1) - pa) *
-				sizeof(struct pid_app));
-			num--;
-			continue;
+			hlist_del_rcu(&pa->node);
+			call_rcu(&pa->rcu, pid_app_free);
 		}
-		i++;
 	}
-	bk->entrys_num = num;
+	spin_unlock(&kuafu_info_lock);
 	return 0;
 }
 
 int kuafu_info_remove_pid(pid_t pid)
 {
-	int i = 0;
-	struct pid_group *pg = NULL;
-	struct pid_msgsize *pm = NULL;
-
-	for (; i < DEFAULT_GROUPS; i++) {
-		pg = g_groups + i;
-		if (pg->pid == pid)
-			pg->pid = 0;
-	}
-
-	for (i = 0; i < DEFAULT_TASKS; i++) {
-		pm = g_msgsizes + i;
-		if (pm->pid == pid)
-			pm->pid = 0;
-	}
+	kuafu_info_clear_group(pid);
+	kuafu_info_clear_msgsize(pid);
 	return 0;
 }
 
-char *kuafu_info_traverse(char *buffer, int *slen)
+int exit_kuafu_info(void)
 {
-	int i = 0, j = 0;
-	int len = 0;
-	struct pid_group *pg = NULL;
+	int i;
 	struct pid_msgsize *pm = NULL;
 	struct pid_app *pa = NULL;
-	char *begin = buffer;
-	struct app_bucket *bk = NULL;
-
-	len = sprintf(begin, "[group]\n");
-	begin += len;
-
-	for (; i < DEFAULT_GROUPS; i++) {
-		pg = g_groups + i;
-		if (pg->pid) {
-			len = sprintf(begin, "%d:%.*s:%c\n", pg->pid,
-				pg->groupname_len, pg->groupname, pg->role);
-			begin += len;
+	struct hlist_node *node, *n;
+
+	spin_lock(&kuafu_info_lock);
+	for (i = 0; i < KUAFU_HASH_SIZE; i++) {
+		kuafu_info_remove_pid_bucket_match(g_groups + i, 0, 1);
+		hlist_for_each_entry_safe(pm, node, n, g_msgsizes + i, node) {
+			hlist_del_rcu(&pm->node);
+			call_rcu(&pm->rcu, pid_msgsize_free);
+		}
+		hlist_for_each_entry_safe(pa, node, n, g_apps + i, node) {
+			hlist_del_rcu(&pa->node);
+			call_rcu(&pa->rcu, pid_app_free);
 		}
 	}
+	spin_unlock(&kuafu_info_lock);
+	/* the frees must run before the module text goes away */
+	rcu_barrier();
+	return 0;
+}
 
-	len = sprintf(begin, "\n[msgsize]\n");
-	begin += len;
+/*
+ * /dev/kuafu_alive dump: one seq_file record per hash bucket, groups first,
+ * then msgsizes, then apps, each section with its header.
+ */
+static void *kuafu_info_seq_start(struct seq_file *m, loff_t *pos)
+{
+	rcu_read_lock();
+	return (*pos < 3 * KUAFU_HASH_SIZE) ? pos : NULL;
+}
 
-	for (i = 0; i < DEFAULT_TASKS; i++) {
-		pm = g_msgsizes + i;
-		if (pm->pid) {
-			len = sprintf(begin, "%d:%d\n", pm->pid, pm->msgsize);
-			begin += len;
-		}
-	}
+static void *kuafu_info_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return (*pos < 3 * KUAFU_HASH_SIZE) ? pos : NULL;
+}
 
-	len = sprintf(begin, "\n[apps]\n");
-	begin += len;
-	for (j = 0; j < BUCKETS_NUM; j++) {
-		bk = g_apps[j];
-		for (i = 0; i < bk->entrys_num; i++) {
-			pa = bk->entrys + i;
-			if (pa->pid) {
-				len = sprintf(begin, "%.*s\n",
-				pa->appname_len, pa->appname);
-				begin += len;
-			}
-		}
-	}
-	*slen = begin - buffer;
-	return buffer;
+static void kuafu_info_seq_stop(struct seq_file *m, void *v)
+{
+	rcu_read_unlock();
 }
 
-int kuafu_info_exists_agent(const char *name, int len, char role)
+static int kuafu_info_seq_show(struct seq_file *m, void *v)
 {
-	int i = 0;
+	loff_t n = *(loff_t *)v;
+	int bucket = n & (KUAFU_HASH_SIZE - 1);
 	struct pid_group *pg = NULL;
-
-	for (; i < DEFAULT_GROUPS; i++) {
-		pg = g_groups + i;
-		if (pg->pid &&
-			pg->groupname_len == len &&
-			!strncmp(pg->groupname, name, len)) {
-			if (role == 'b' || pg->role == 'b' || pg->role == role)
-				return 1;
-		}
+	struct pid_msgsize *pm = NULL;
+	struct pid_app *pa = NULL;
+	struct hlist_node *node;
+
+	switch (n >> KUAFU_HASH_BITS) {
+	case 0:
+		if (!bucket)
+			seq_puts(m, "[group]\n");
+		hlist_for_each_entry_rcu(pg, node, g_groups + bucket, pid_node)
+			seq_printf(m, "%d:%.*s:%c\n", pg->pid,
+				pg->groupname_len, pg->groupname, pg->role);
+		break;
+	case 1:
+		if (!bucket)
+			seq_puts(m, "\n[msgsize]\n");
+		hlist_for_each_entry_rcu(pm, node, g_msgsizes + bucket, node)
+			seq_printf(m, "%d:%d\n", pm->pid, pm->msgsize);
+		break;
+	default:
+		if (!bucket)
+			seq_puts(m, "\n[apps]\n");
+		hlist_for_each_entry_rcu(pa, node, g_apps + bucket, node)
+			seq_printf(m, "%.*s\n", pa->appname_len, pa->appname);
+		break;
 	}
 	return 0;
 }
 
+const struct seq_operations kuafu_info_seq_ops = {
+	.start  = kuafu_info_seq_start,
+	.next   = kuafu_info_seq_next,
+	.stop   = kuafu_info_seq_stop,
+	.show   = kuafu_info_seq_show,
+};
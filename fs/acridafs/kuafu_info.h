@@ -4,34 +4,7 @@
 #include <sys/types.h>
 #endif
 
-#define DEFAULT_GROUPS 1024
-#define DEFAULT_TASKS  256
-#define DEFAULT_APPS   256
-#define BUFFER_SIZE    (512*1024)
-#define BUCKETS_NUM    503
-
-struct pid_group {
-	pid_t   pid;
-	char    groupname[8];
-	char    role;   /* 'c', 's' or 'b' */
-	int     groupname_len;
-};
-
-struct pid_msgsize {
-	pid_t   pid;
-	int     msgsize;
-};
-
-struct pid_app {
-	pid_t   pid;
-	char    appname[64];
-	int     appname_len;
-};
-
-struct app_bucket {
-	int             entrys_num;
-	struct pid_app  entrys[DEFAULT_APPS];
-};
+struct seq_operations;
 
 int init_kuafu_info(void);
 int exit_kuafu_info(void);
@@ -48,11 +21,10 @@ int kuafu_info_fetch_msgsize(pid_t pid);
 int kuafu_info_clear_msgsize(pid_t pid);
 
 int kuafu_info_store_app(pid_t pid, const char *name, int len);
-int kuafu_info_exists_in_buckets_app(struct app_bucket *bk, pid_t pid,
-		const char *name, int len);
 int kuafu_info_remove_app(pid_t pid, const char *name, int len);
 int kuafu_info_clear_pid_app(pid_t pid);
 
 int kuafu_info_remove_pid(pid_t pid);
 
-char *kuafu_info_traverse(char *buff, int *slen);
+/* dump of all groups, msgsizes and apps, for /dev/kuafu_alive */
+extern const struct seq_operations kuafu_info_seq_ops;
@@ -445,11 +445,16 @@ static struct inode *bdev_alloc_inode(struct super_block *sb)
 	return &ei->vfs_inode;
 }
 
-static void bdev_destroy_inode(struct inode *inode)
+static void bdev_i_callback(struct rcu_head *head)
 {
-	struct bdev_inode *bdi = BDEV_I(inode);
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+	INIT_LIST_HEAD(&inode->i_dentry);
+	kmem_cache_free(bdev_cachep, BDEV_I(inode));
+}
 
-	kmem_cache_free(bdev_cachep, bdi);
+static void bdev_destroy_inode(struct inode *inode)
+{
+	call_rcu(&inode->i_rcu, bdev_i_callback);
 }
 
 static void init_once(void *foo)
@@ -336,11 +336,19 @@ cifs_alloc_inode(struct super_block *sb)
 }
 
 static void
-cifs_destroy_inode(struct inode *inode)
+cifs_i_callback(struct rcu_head *head)
 {
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+	INIT_LIST_HEAD(&inode->i_dentry);
 	kmem_cache_free(cifs_inode_cachep, CIFS_I(inode));
 }
 
+static void
+cifs_destroy_inode(struct inode *inode)
+{
+	call_rcu(&inode->i_rcu, cifs_i_callback);
+}
+
 static void
 cifs_clear_inode(struct inode *inode)
 {
@@ -33,6 +33,7 @@
 #include <linux/bootmem.h>
 #include <linux/fs_struct.h>
 #include <linux/hardirq.h>
+#include <linux/percpu_counter.h>
 #include "internal.h"
 
 int sysctl_vfs_cache_pressure __read_mostly = 100;
@@ -62,11 +63,53 @@ static unsigned int d_hash_mask __read_mostly;
 static unsigned int d_hash_shift __read_mostly;
 static struct hlist_head *dentry_hashtable __read_mostly;
 
+/*
+ * Lookups walk the hash chains under RCU.  Adding a dentry to a chain or
+ * taking it off needs that chain's lock (and the dentry's d_lock); each
+ * bucket maps onto one lock of this table, as in the route cache.  The
+ * anonymous dentries on sb->s_anon are still covered by dcache_lock.
+ */
+#if NR_CPUS >= 32
+# define D_HASH_LOCK_SZ	4096
+#elif NR_CPUS >= 16
+# define D_HASH_LOCK_SZ	2048
+#elif NR_CPUS >= 8
+# define D_HASH_LOCK_SZ	1024
+#elif NR_CPUS >= 4
+# define D_HASH_LOCK_SZ	512
+#else
+# define D_HASH_LOCK_SZ	256
+#endif
+
+static spinlock_t *d_hash_locks __read_mostly;
+
 /* Statistics gathering. */
 struct dentry_stat_t dentry_stat = {
 	.age_limit = 45,
 };
 
+static struct percpu_counter nr_dentry_unused __cacheline_aligned_in_smp;
+
+static int get_nr_dentry_unused(void)
+{
+	return percpu_counter_read_positive(&nr_dentry_unused);
+}
+
+#if defined(CONFIG_SYSCTL) && defined(CONFIG_PROC_FS)
+int proc_nr_dentry(ctl_table *table, int write,
+		   void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	dentry_stat.nr_unused = get_nr_dentry_unused();
+	return proc_dointvec(table, write, buffer, lenp, ppos);
+}
+#else
+int proc_nr_dentry(ctl_table *table, int write,
+		   void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	return -ENOSYS;
+}
+#endif
+
 static void __d_free(struct dentry *dentry)
 {
 	WARN_ON(!list_empty(&dentry->d_alias));
@@ -106,7 +149,10 @@ static void dentry_iput(struct dentry * dentry)
 {
 	struct inode *inode = dentry->d_inode;
 	if (inode) {
+		/* store-free walkers may still be sampling the inode */
+		write_seqcount_begin(&dentry->d_seq);
 		dentry->d_inode = NULL;
+		write_seqcount_end(&dentry->d_seq);
 		list_del_init(&dentry->d_alias);
 		spin_unlock(&dentry->d_lock);
 		spin_unlock(&dcache_lock);
@@ -123,37 +169,56 @@ static void dentry_iput(struct dentry * dentry)
 }
 
 /*
- * dentry_lru_(add|add_tail|del|del_init) must be called with dcache_lock held.
+ * The dentry LRU of a superblock is protected by its s_dentry_lru_lock,
+ * which nests inside d_lock.  Since dput() lets go of an LRU dentry under
+ * d_lock alone, anyone taking a dentry off the LRU must also hold d_lock,
+ * or recheck d_count under it afterwards.
  */
 static void dentry_lru_add(struct dentry *dentry)
 {
-	list_add(&dentry->d_lru, &dentry->d_sb->s_dentry_lru);
-	dentry->d_sb->s_nr_dentry_unused++;
-	dentry_stat.nr_unused++;
+	struct super_block *sb = dentry->d_sb;
+
+	spin_lock(&sb->s_dentry_lru_lock);
+	if (list_empty(&dentry->d_lru)) {
+		list_add(&dentry->d_lru, &sb->s_dentry_lru);
+		sb->s_nr_dentry_unused++;
+		percpu_counter_inc(&nr_dentry_unused);
+	}
+	spin_unlock(&sb->s_dentry_lru_lock);
 }
 
-static void dentry_lru_add_tail(struct dentry *dentry)
+static void dentry_lru_move_tail(struct dentry *dentry)
 {
-	list_add_tail(&dentry->d_lru, &dentry->d_sb->s_dentry_lru);
-	dentry->d_sb->s_nr_dentry_unused++;
-	dentry_stat.nr_unused++;
+	struct super_block *sb = dentry->d_sb;
+
+	spin_lock(&sb->s_dentry_lru_lock);
+	if (list_empty(&dentry->d_lru)) {
+		list_add_tail(&dentry->d_lru, &sb->s_dentry_lru);
+		sb->s_nr_dentry_unused++;
+		percpu_counter_inc(&nr_dentry_unused);
+	} else {
+		list_move_tail(&dentry->d_lru, &sb->s_dentry_lru);
+	}
+	spin_unlock(&sb->s_dentry_lru_lock);
 }
 
-static void dentry_lru_del(struct dentry *dentry)
+/* the caller must hold s_dentry_lru_lock */
+static void __dentry_lru_del_init(struct dentry *dentry)
 {
-	if (!list_empty(&dentry->d_lru)) {
-		list_del(&dentry->d_lru);
-		dentry->d_sb->s_nr_dentry_unused--;
-		dentry_stat.nr_unused--;
-	}
+	list_del_init(&dentry->d_lru);
+	dentry->d_sb->s_nr_dentry_unused--;
+	percpu_counter_dec(&nr_dentry_unused);
 }
 
 static void dentry_lru_del_init(struct dentry *dentry)
 {
+	struct super_block *sb = dentry->d_sb;
+
 	if (likely(!list_empty(&dentry->d_lru))) {
-		list_del_init(&dentry->d_lru);
-		dentry->d_sb->s_nr_dentry_unused--;
-		dentry_stat.nr_unused--;
+		spin_lock(&sb->s_dentry_lru_lock);
+		if (!list_empty(&dentry->d_lru))
+			__dentry_lru_del_init(dentry);
+		spin_unlock(&sb->s_dentry_lru_lock);
 	}
 }
 
@@ -220,6 +285,27 @@ void dput(struct dentry *dentry)
 repeat:
 	if (atomic_read(&dentry->d_count) == 1)
 		might_sleep();
+	if (atomic_add_unless(&dentry->d_count, -1, 1))
+		return;
+
+	/*
+	 * This looks like the last reference.  A hashed dentry just stays
+	 * cached on its superblock's LRU, which d_lock and the LRU lock are
+	 * enough for: nobody may unhash it or take it off the LRU without
+	 * looking at d_count under d_lock.
+	 */
+	spin_lock(&dentry->d_lock);
+	if (!d_unhashed(dentry) && !(dentry->d_op && dentry->d_op->d_delete)) {
+		if (list_empty(&dentry->d_lru)) {
+			dentry->d_flags |= DCACHE_REFERENCED;
+			dentry_lru_add(dentry);
+		}
+		atomic_dec(&dentry->d_count);
+		spin_unlock(&dentry->d_lock);
+		return;
+	}
+	spin_unlock(&dentry->d_lock);
+
 	if (!atomic_dec_and_lock(&dentry->d_count, &dcache_lock))
 		return;
 
@@ -252,7 +338,7 @@ unhash_it:
 	__d_drop(dentry);
 kill_it:
 	/* if dentry was on the d_lru list delete it from there */
-	dentry_lru_del(dentry);
+	dentry_lru_del_init(dentry);
 	dentry = d_kill(dentry);
 	if (dentry)
 		goto repeat;
@@ -459,11 +545,11 @@ static void __shrink_dcache_sb(struct super_block *sb, int *count, int flags)
 
 	BUG_ON(!sb);
 	BUG_ON((flags & DCACHE_REFERENCED) && count == NULL);
-	spin_lock(&dcache_lock);
 	if (count != NULL)
 		/* called from prune_dcache() and shrink_dcache_parent() */
 		cnt = *count;
 restart:
+	spin_lock(&sb->s_dentry_lru_lock);
 	if (count == NULL)
 		list_splice_init(&sb->s_dentry_lru, &tmp);
 	else {
@@ -472,7 +558,13 @@ restart:
 					struct dentry, d_lru);
 			BUG_ON(dentry->d_sb != sb);
 
-			spin_lock(&dentry->d_lock);
+			/* d_lock nests outside the LRU lock */
+			if (!spin_trylock(&dentry->d_lock)) {
+				spin_unlock(&sb->s_dentry_lru_lock);
+				cpu_relax();
+				spin_lock(&sb->s_dentry_lru_lock);
+				continue;
+			}
 			/*
 			 * If we are honouring the DCACHE_REFERENCED flag and
 			 * the dentry has this flag set, don't free it. Clear
@@ -490,12 +582,26 @@ restart:
 				if (!cnt)
 					break;
 			}
-			cond_resched_lock(&dcache_lock);
+			cond_resched_lock(&sb->s_dentry_lru_lock);
 		}
 	}
-	while (!list_empty(&tmp)) {
+	spin_unlock(&sb->s_dentry_lru_lock);
+
+	/*
+	 * The dentries on tmp are still accounted to the LRU, so others may
+	 * take them off it: only look at tmp under the LRU lock.  Once a
+	 * dentry is off, dcache_lock keeps anybody else from freeing it.
+	 */
+	spin_lock(&dcache_lock);
+	for (;;) {
+		spin_lock(&sb->s_dentry_lru_lock);
+		if (list_empty(&tmp)) {
+			spin_unlock(&sb->s_dentry_lru_lock);
+			break;
+		}
 		dentry = list_entry(tmp.prev, struct dentry, d_lru);
-		dentry_lru_del_init(dentry);
+		__dentry_lru_del_init(dentry);
+		spin_unlock(&sb->s_dentry_lru_lock);
 		spin_lock(&dentry->d_lock);
 		/*
 		 * We found an inuse dentry which was not removed from
@@ -510,13 +616,15 @@ restart:
 		/* dentry->d_lock was dropped in prune_one_dentry() */
 		cond_resched_lock(&dcache_lock);
 	}
+	spin_unlock(&dcache_lock);
 	if (count == NULL && !list_empty(&sb->s_dentry_lru))
 		goto restart;
 	if (count != NULL)
 		*count = cnt;
+	spin_lock(&sb->s_dentry_lru_lock);
 	if (!list_empty(&referenced))
 		list_splice(&referenced, &sb->s_dentry_lru);
-	spin_unlock(&dcache_lock);
+	spin_unlock(&sb->s_dentry_lru_lock);
 }
 
 /**
@@ -532,13 +640,12 @@ static void prune_dcache(int count)
 {
 	struct super_block *sb;
 	int w_count;
-	int unused = dentry_stat.nr_unused;
+	int unused = get_nr_dentry_unused();
 	int prune_ratio;
 	int pruned;
 
 	if (unused == 0 || count == 0)
 		return;
-	spin_lock(&dcache_lock);
 restart:
 	if (count >= unused)
 		prune_ratio = 1;
@@ -574,11 +681,9 @@ restart:
 		if (down_read_trylock(&sb->s_umount)) {
 			if ((sb->s_root != NULL) &&
 			    (!list_empty(&sb->s_dentry_lru))) {
-				spin_unlock(&dcache_lock);
 				__shrink_dcache_sb(sb, &w_count,
 						DCACHE_REFERENCED);
 				pruned -= w_count;
-				spin_lock(&dcache_lock);
 			}
 			up_read(&sb->s_umount);
 		}
@@ -594,7 +699,6 @@ restart:
 		}
 	}
 	spin_unlock(&sb_lock);
-	spin_unlock(&dcache_lock);
 }
 
 /**
@@ -821,15 +925,17 @@ resume:
 		struct dentry *dentry = list_entry(tmp, struct dentry, d_u.d_child);
 		next = tmp->next;
 
-		dentry_lru_del_init(dentry);
+		spin_lock(&dentry->d_lock);
 		/* 
 		 * move only zero ref count dentries to the end 
 		 * of the unused list for prune_dcache
 		 */
 		if (!atomic_read(&dentry->d_count)) {
-			dentry_lru_add_tail(dentry);
+			dentry_lru_move_tail(dentry);
 			found++;
-		}
+		} else
+			dentry_lru_del_init(dentry);
+		spin_unlock(&dentry->d_lock);
 
 		/*
 		 * We can return to the caller if we have found some (this
@@ -895,7 +1001,7 @@ static int shrink_dcache_memory(struct shrinker *shrink, int nr, gfp_t gfp_mask)
 			return -1;
 		prune_dcache(nr);
 	}
-	return (dentry_stat.nr_unused / 100) * sysctl_vfs_cache_pressure;
+	return (get_nr_dentry_unused() / 100) * sysctl_vfs_cache_pressure;
 }
 
 static struct shrinker dcache_shrinker = {
@@ -941,6 +1047,7 @@ struct dentry *d_alloc(struct dentry * parent, const struct qstr *name)
 	atomic_set(&dentry->d_count, 1);
 	dentry->d_flags = DCACHE_UNHASHED;
 	spin_lock_init(&dentry->d_lock);
+	seqcount_init(&dentry->d_seq);
 	dentry->d_inode = NULL;
 	dentry->d_parent = NULL;
 	dentry->d_sb = NULL;
@@ -1109,14 +1216,54 @@ struct dentry * d_alloc_root(struct inode * root_inode)
 	return res;
 }
 
-static inline struct hlist_head *d_hash(struct dentry *parent,
+static inline unsigned long d_hash_slot(struct dentry *parent,
 					unsigned long hash)
 {
 	hash += ((unsigned long) parent ^ GOLDEN_RATIO_PRIME) / L1_CACHE_BYTES;
 	hash = hash ^ ((hash ^ GOLDEN_RATIO_PRIME) >> D_HASHBITS);
-	return dentry_hashtable + (hash & D_HASHMASK);
+	return hash & D_HASHMASK;
+}
+
+static inline struct hlist_head *d_hash(struct dentry *parent,
+					unsigned long hash)
+{
+	return dentry_hashtable + d_hash_slot(parent, hash);
 }
 
+static inline spinlock_t *d_hash_lock(struct dentry *parent,
+				      unsigned long hash)
+{
+	return &d_hash_locks[d_hash_slot(parent, hash) & (D_HASH_LOCK_SZ - 1)];
+}
+
+/*
+ * Take a hashed dentry off its chain.  The caller holds dcache_lock and
+ * dentry->d_lock, which keeps d_parent and d_name.hash, and so the chain,
+ * stable.  Anonymous dentries are on sb->s_anon, under dcache_lock.
+ */
+static void __d_unhash(struct dentry *dentry)
+{
+	spinlock_t *lock;
+
+	if (unlikely(IS_ROOT(dentry))) {
+		hlist_del_rcu(&dentry->d_hash);
+		return;
+	}
+	lock = d_hash_lock(dentry->d_parent, dentry->d_name.hash);
+	spin_lock(lock);
+	hlist_del_rcu(&dentry->d_hash);
+	spin_unlock(lock);
+}
+
+void __d_drop(struct dentry *dentry)
+{
+	if (!(dentry->d_flags & DCACHE_UNHASHED)) {
+		dentry->d_flags |= DCACHE_UNHASHED;
+		__d_unhash(dentry);
+	}
+}
+EXPORT_SYMBOL(__d_drop);
+
 static struct dentry * __d_find_any_alias(struct inode *inode)
 {
 	struct dentry *alias;
@@ -1444,6 +1591,65 @@ next:
  	return found;
 }
 
+/**
+ * __d_lookup_rcu - search for a dentry without touching it
+ * @parent: parent dentry
+ * @name: qstr of name we wish to find
+ * @seq: returns the d_seq of the found dentry
+ *
+ * Store-free variant of __d_lookup() for the RCU path walk: neither d_lock
+ * nor the reference count of the dentry is touched.  Must be called under
+ * rcu_read_lock(), and the result is only a hint - the caller has to
+ * validate it with read_seqcount_retry(&dentry->d_seq, *seq) after it is
+ * done looking at the dentry, and pin it under d_lock if it wants to keep
+ * it.  A %NULL return does not mean the name is not cached; a concurrent
+ * d_move() can make us miss it, so callers must fall back to __d_lookup().
+ *
+ * Parents with ->d_compare() are not supported.
+ */
+struct dentry * __d_lookup_rcu(struct dentry * parent, struct qstr * name,
+			       unsigned *seq)
+{
+	unsigned int len = name->len;
+	unsigned int hash = name->hash;
+	const unsigned char *str = name->name;
+	struct hlist_head *head = d_hash(parent,hash);
+	struct hlist_node *node;
+	struct dentry *dentry;
+
+	hlist_for_each_entry_rcu(dentry, node, head, d_hash) {
+		const unsigned char *tname;
+		unsigned int tlen;
+
+		if (dentry->d_name.hash != hash)
+			continue;
+seqretry:
+		*seq = read_seqcount_begin(&dentry->d_seq);
+		if (dentry->d_parent != parent)
+			continue;
+		if (d_unhashed(dentry))
+			continue;
+		/*
+		 * Sample the name length and pointer as a pair before
+		 * comparing, so memcmp() never overruns a name d_move() is
+		 * swapping.  The contents themselves are checked by the
+		 * caller's final d_seq validation.
+		 */
+		tlen = dentry->d_name.len;
+		tname = dentry->d_name.name;
+		if (read_seqcount_retry(&dentry->d_seq, *seq)) {
+			cpu_relax();
+			goto seqretry;
+		}
+		if (tlen != len)
+			continue;
+		if (memcmp(tname, str, len))
+			continue;
+		return dentry;
+	}
+	return NULL;
+}
+
 /**
  * d_hash_and_lookup - hash the qstr then search for a dentry
  * @dir: Directory to search in
@@ -1484,6 +1690,7 @@ int d_validate(struct dentry *dentry, struct dentry *dparent)
 {
 	struct hlist_head *base;
 	struct hlist_node *lhp;
+	spinlock_t *lock;
 
 	/* Check whether the ptr might be valid at all.. */
 	if (!kmem_ptr_validate(dentry_cache, dentry))
@@ -1494,16 +1701,20 @@ int d_validate(struct dentry *dentry, struct dentry *dparent)
 
 	spin_lock(&dcache_lock);
 	base = d_hash(dparent, dentry->d_name.hash);
+	lock = d_hash_lock(dparent, dentry->d_name.hash);
+	spin_lock(lock);
 	hlist_for_each(lhp,base) { 
 		/* hlist_for_each_entry_rcu() not required for d_hash list
-		 * as it is parsed under dcache_lock
+		 * as it is parsed under the chain lock
 		 */
 		if (dentry == hlist_entry(lhp, struct dentry, d_hash)) {
+			spin_unlock(lock);
 			__dget_locked(dentry);
 			spin_unlock(&dcache_lock);
 			return 1;
 		}
 	}
+	spin_unlock(lock);
 	spin_unlock(&dcache_lock);
 out:
 	return 0;
@@ -1554,16 +1765,21 @@ void d_delete(struct dentry * dentry)
 	fsnotify_nameremove(dentry, isdir);
 }
 
-static void __d_rehash(struct dentry * entry, struct hlist_head *list)
+/* the caller must hold entry->d_lock */
+static void __d_rehash(struct dentry * entry, struct dentry *parent,
+		       unsigned long hash)
 {
+	spinlock_t *lock = d_hash_lock(parent, hash);
 
  	entry->d_flags &= ~DCACHE_UNHASHED;
- 	hlist_add_head_rcu(&entry->d_hash, list);
+	spin_lock(lock);
+ 	hlist_add_head_rcu(&entry->d_hash, d_hash(parent, hash));
+	spin_unlock(lock);
 }
 
 static void _d_rehash(struct dentry * entry)
 {
-	__d_rehash(entry, d_hash(entry->d_parent, entry->d_name.hash));
+	__d_rehash(entry, entry->d_parent, entry->d_name.hash);
 }
 
 /**
@@ -1575,11 +1791,9 @@ static void _d_rehash(struct dentry * entry)
  
 void d_rehash(struct dentry * entry)
 {
-	spin_lock(&dcache_lock);
 	spin_lock(&entry->d_lock);
 	_d_rehash(entry);
 	spin_unlock(&entry->d_lock);
-	spin_unlock(&dcache_lock);
 }
 
 /*
@@ -1656,8 +1870,6 @@ static void switch_names(struct dentry *dentry, struct dentry *target)
  */
 static void d_move_locked(struct dentry * dentry, struct dentry * target)
 {
-	struct hlist_head *list;
-
 	if (!dentry->d_inode)
 		printk(KERN_WARNING "VFS: moving negative dcache entry\n");
 
@@ -1673,15 +1885,17 @@ static void d_move_locked(struct dentry * dentry, struct dentry * target)
 		spin_lock_nested(&target->d_lock, DENTRY_D_LOCK_NESTED);
 	}
 
+	write_seqcount_begin(&dentry->d_seq);
+	write_seqcount_begin(&target->d_seq);
+
 	/* Move the dentry to the target hash queue, if on different bucket */
 	if (d_unhashed(dentry))
 		goto already_unhashed;
 
-	hlist_del_rcu(&dentry->d_hash);
+	__d_unhash(dentry);
 
 already_unhashed:
-	list = d_hash(target->d_parent, target->d_name.hash);
-	__d_rehash(dentry, list);
+	__d_rehash(dentry, target->d_parent, target->d_name.hash);
 
 	/* Unhash the target: dput() will then get rid of it */
 	__d_drop(target);
@@ -1706,6 +1920,8 @@ already_unhashed:
 	}
 
 	list_add(&dentry->d_u.d_child, &dentry->d_parent->d_subdirs);
+	write_seqcount_end(&target->d_seq);
+	write_seqcount_end(&dentry->d_seq);
 	spin_unlock(&target->d_lock);
 	fsnotify_d_move(dentry);
 	spin_unlock(&dentry->d_lock);
@@ -1799,6 +2015,7 @@ static void __d_materialise_dentry(struct dentry *dentry, struct dentry *anon)
 {
 	struct dentry *dparent, *aparent;
 
+	write_seqcount_begin(&anon->d_seq);
 	switch_names(dentry, anon);
 	swap(dentry->d_name.hash, anon->d_name.hash);
 
@@ -1818,6 +2035,7 @@ static void __d_materialise_dentry(struct dentry *dentry, struct dentry *anon)
 		list_add(&anon->d_u.d_child, &anon->d_parent->d_subdirs);
 	else
 		INIT_LIST_HEAD(&anon->d_u.d_child);
+	write_seqcount_end(&anon->d_seq);
 
 	anon->d_flags &= ~DCACHE_DISCONNECTED;
 }
@@ -1855,8 +2073,9 @@ struct dentry *d_materialise_unique(struct dentry *dentry, struct inode *inode)
 			 * into our tree? */
 			if (IS_ROOT(alias)) {
 				spin_lock(&alias->d_lock);
-				__d_materialise_dentry(dentry, alias);
+				/* off s_anon while it is still IS_ROOT() */
 				__d_drop(alias);
+				__d_materialise_dentry(dentry, alias);
 				goto found;
 			}
 			/* Nope, but we must(!) avoid directory aliasing */
@@ -1935,7 +2154,7 @@ char *__d_path(const struct path *path, struct path *root,
 	char *end = buffer + buflen;
 	char *retval;
 
-	spin_lock(&vfsmount_lock);
+	br_read_lock(vfsmount_lock);
 	prepend(&end, &buflen, "\0", 1);
 	if (d_unlinked(dentry) &&
 		(prepend(&end, &buflen, " (deleted)", 10) != 0))
@@ -1971,7 +2190,7 @@ char *__d_path(const struct path *path, struct path *root,
 	}
 
 out:
-	spin_unlock(&vfsmount_lock);
+	br_read_unlock(vfsmount_lock);
 	return retval;
 
 global_root:
@@ -2299,6 +2518,15 @@ static void __init dcache_init(void)
 	 */
 	dentry_cache = KMEM_CACHE(dentry,
 		SLAB_RECLAIM_ACCOUNT|SLAB_PANIC|SLAB_MEM_SPREAD);
+
+	percpu_counter_init(&nr_dentry_unused, 0);
+
+	d_hash_locks = kmalloc(sizeof(spinlock_t) * D_HASH_LOCK_SZ,
+			       GFP_KERNEL);
+	if (!d_hash_locks)
+		panic("Failed to allocate dentry hash locks\n");
+	for (loop = 0; loop < D_HASH_LOCK_SZ; loop++)
+		spin_lock_init(&d_hash_locks[loop]);
 	
 	register_shrinker(&dcache_shrinker);
 
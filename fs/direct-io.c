@@ -105,6 +105,7 @@ struct dio {
 	unsigned long refcount;		/* direct_io_worker() and bios */
 	struct bio *bio_list;		/* singly linked via bi_private */
 	struct task_struct *waiter;	/* waiting task (NULL if none) */
+	struct block_device *poll_bdev;	/* where the last bio went */
 
 	/* AIO related stuff */
 	struct kiocb *iocb;		/* kiocb */
@@ -366,6 +367,8 @@ static void dio_bio_submit(struct dio *dio)
 	if (dio->is_async && dio->rw == READ)
 		bio_set_pages_dirty(bio);
 
+	dio->poll_bdev = bio->bi_bdev;
+
 	if (dio->submit_io)
 		dio->submit_io(dio->rw, bio, dio->inode,
 			       dio->logical_offset_in_bio);
@@ -386,6 +389,25 @@ static void dio_cleanup(struct dio *dio)
 		page_cache_release(dio_get_page(dio));
 }
 
+/*
+ * On a queue that polls, spin for the completion rather than sleeping
+ * until its interrupt. See blk_poll() for the calling convention.
+ */
+static bool dio_poll(struct dio *dio, u64 *wait_start)
+{
+	struct request_queue *q;
+
+	if (!dio->poll_bdev)
+		return false;
+	q = bdev_get_queue(dio->poll_bdev);
+	if (!blk_queue_poll(q))
+		return false;
+
+	if (!*wait_start)
+		*wait_start = ktime_to_ns(ktime_get());
+	return blk_poll(q, *wait_start);
+}
+
 /*
  * Wait for the next BIO to complete.  Remove it and return it.  NULL is
  * returned once all BIOs have been completed.  This must only be called once
@@ -396,6 +418,7 @@ static struct bio *dio_await_one(struct dio *dio)
 {
 	unsigned long flags;
 	struct bio *bio = NULL;
+	u64 wait_start = 0;
 
 	spin_lock_irqsave(&dio->bio_lock, flags);
 
@@ -409,7 +432,8 @@ static struct bio *dio_await_one(struct dio *dio)
 		__set_current_state(TASK_UNINTERRUPTIBLE);
 		dio->waiter = current;
 		spin_unlock_irqrestore(&dio->bio_lock, flags);
-		io_schedule();
+		if (!dio_poll(dio, &wait_start))
+			io_schedule();
 		/* wake up sets us TASK_RUNNING */
 		spin_lock_irqsave(&dio->bio_lock, flags);
 		dio->waiter = NULL;
@@ -991,6 +1015,7 @@ direct_io_worker(int rw, struct kiocb *iocb, struct inode *inode,
 	ssize_t ret = 0;
 	ssize_t ret2;
 	size_t bytes;
+	struct blk_plug plug;
 
 	dio->inode = inode;
 	dio->rw = rw;
@@ -1024,6 +1049,8 @@ direct_io_worker(int rw, struct kiocb *iocb, struct inode *inode,
 				- user_addr/PAGE_SIZE);
 	}
 
+	blk_start_plug(&plug);
+
 	for (seg = 0; seg < nr_segs; seg++) {
 		user_addr = (unsigned long)iov[seg].iov_base;
 		dio->size += bytes = iov[seg].iov_len;
@@ -1080,6 +1107,8 @@ direct_io_worker(int rw, struct kiocb *iocb, struct inode *inode,
 	if (dio->bio)
 		dio_bio_submit(dio);
 
+	blk_finish_plug(&plug);
+
 	/*
 	 * It is possible that, we return short IO due to end of file.
 	 * In that case, we need to release all the pages we got hold on.
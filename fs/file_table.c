@@ -32,8 +32,13 @@ struct files_stat_struct files_stat = {
 	.max_files = NR_FILE
 };
 
-/* public. Not pretty! */
-__cacheline_aligned_in_smp DEFINE_SPINLOCK(files_lock);
+/*
+ * Open files sit on per-cpu lists of their super block, each CPU's lists
+ * protected by that CPU's files_cpu_lock.  Open and close only touch one
+ * CPU's lock; the rare walkers of all of a super block's files take them
+ * one after another.
+ */
+static DEFINE_PER_CPU(spinlock_t, files_cpu_lock);
 
 /* SLAB cache for file structures */
 static struct kmem_cache *filp_cachep __read_mostly;
@@ -258,7 +263,7 @@ void __fput(struct file *file)
 		cdev_put(inode->i_cdev);
 	fops_put(file->f_op);
 	put_pid(file->f_owner.pid);
-	file_kill(file);
+	file_sb_list_del(file);
 	if (file->f_mode & FMODE_WRITE)
 		drop_file_write_access(file);
 	file->f_path.dentry = NULL;
@@ -337,50 +342,72 @@ void put_filp(struct file *file)
 {
 	if (atomic_long_dec_and_test(&file->f_count)) {
 		security_file_free(file);
-		file_kill(file);
+		file_sb_list_del(file);
 		file_free(file);
 	}
 }
 
-void file_move(struct file *file, struct list_head *list)
+/**
+ *	file_sb_list_add - add a file to the sb's list of open files
+ *	@file: file to add
+ *	@sb: super block to add it to
+ *
+ *	The file goes on the list of the CPU we are running on.
+ */
+void file_sb_list_add(struct file *file, struct super_block *sb)
 {
-	if (!list)
-		return;
-	file_list_lock();
-	list_move(&file->f_u.fu_list, list);
-	file_list_unlock();
+	int cpu = get_cpu();
+
+	file->f_sb_list_cpu = cpu;
+	spin_lock(&per_cpu(files_cpu_lock, cpu));
+	list_add(&file->f_u.fu_list, per_cpu_ptr(sb->s_files_pcpu, cpu));
+	spin_unlock(&per_cpu(files_cpu_lock, cpu));
+	put_cpu();
 }
 
-void file_kill(struct file *file)
+/**
+ *	file_sb_list_del - remove a file from the sb's list of open files
+ *	@file: file to remove
+ */
+void file_sb_list_del(struct file *file)
 {
 	if (!list_empty(&file->f_u.fu_list)) {
-		file_list_lock();
+		spinlock_t *lock = &per_cpu(files_cpu_lock,
+					    file->f_sb_list_cpu);
+
+		spin_lock(lock);
 		list_del_init(&file->f_u.fu_list);
-		file_list_unlock();
+		spin_unlock(lock);
 	}
 }
 
 int fs_may_remount_ro(struct super_block *sb)
 {
 	struct file *file;
+	int cpu;
 
 	/* Check that no files are currently opened for writing. */
-	file_list_lock();
-	list_for_each_entry(file, &sb->s_files, f_u.fu_list) {
-		struct inode *inode = file->f_path.dentry->d_inode;
+	for_each_possible_cpu(cpu) {
+		struct list_head *list = per_cpu_ptr(sb->s_files_pcpu, cpu);
 
-		/* File with pending delete? */
-		if (inode->i_nlink == 0)
-			goto too_bad;
+		spin_lock(&per_cpu(files_cpu_lock, cpu));
+		list_for_each_entry(file, list, f_u.fu_list) {
+			struct inode *inode = file->f_path.dentry->d_inode;
 
-		/* Writeable file? */
-		if (S_ISREG(inode->i_mode) && (file->f_mode & FMODE_WRITE))
-			goto too_bad;
+			/* File with pending delete? */
+			if (inode->i_nlink == 0)
+				goto too_bad;
+
+			/* Writeable file? */
+			if (S_ISREG(inode->i_mode) &&
+			    (file->f_mode & FMODE_WRITE))
+				goto too_bad;
+		}
+		spin_unlock(&per_cpu(files_cpu_lock, cpu));
 	}
-	file_list_unlock();
 	return 1; /* Tis' cool bro. */
 too_bad:
-	file_list_unlock();
+	spin_unlock(&per_cpu(files_cpu_lock, cpu));
 	return 0;
 }
 
@@ -394,34 +421,39 @@ too_bad:
 void mark_files_ro(struct super_block *sb)
 {
 	struct file *f;
+	int cpu;
 
 retry:
-	file_list_lock();
-	list_for_each_entry(f, &sb->s_files, f_u.fu_list) {
-		struct vfsmount *mnt;
-		if (!S_ISREG(f->f_path.dentry->d_inode->i_mode))
-		       continue;
-		if (!file_count(f))
-			continue;
-		if (!(f->f_mode & FMODE_WRITE))
-			continue;
-		spin_lock(&f->f_lock);
-		f->f_mode &= ~FMODE_WRITE;
-		spin_unlock(&f->f_lock);
-		if (file_check_writeable(f) != 0)
-			continue;
-		file_release_write(f);
-		mnt = mntget(f->f_path.mnt);
-		file_list_unlock();
-		/*
-		 * This can sleep, so we can't hold
-		 * the file_list_lock() spinlock.
-		 */
-		mnt_drop_write(mnt);
-		mntput(mnt);
-		goto retry;
+	for_each_possible_cpu(cpu) {
+		struct list_head *list = per_cpu_ptr(sb->s_files_pcpu, cpu);
+
+		spin_lock(&per_cpu(files_cpu_lock, cpu));
+		list_for_each_entry(f, list, f_u.fu_list) {
+			struct vfsmount *mnt;
+			if (!S_ISREG(f->f_path.dentry->d_inode->i_mode))
+			       continue;
+			if (!file_count(f))
+				continue;
+			if (!(f->f_mode & FMODE_WRITE))
+				continue;
+			spin_lock(&f->f_lock);
+			f->f_mode &= ~FMODE_WRITE;
+			spin_unlock(&f->f_lock);
+			if (file_check_writeable(f) != 0)
+				continue;
+			file_release_write(f);
+			mnt = mntget(f->f_path.mnt);
+			spin_unlock(&per_cpu(files_cpu_lock, cpu));
+			/*
+			 * This can sleep, so we can't hold
+			 * the files_cpu_lock spinlock.
+			 */
+			mnt_drop_write(mnt);
+			mntput(mnt);
+			goto retry;
+		}
+		spin_unlock(&per_cpu(files_cpu_lock, cpu));
 	}
-	file_list_unlock();
 }
 
 void __init files_init(unsigned long mempages)
@@ -431,6 +463,9 @@ void __init files_init(unsigned long mempages)
 	filp_cachep = kmem_cache_create("filp", sizeof(struct file), 0,
 			SLAB_HWCACHE_ALIGN | SLAB_PANIC, NULL);
 
+	for_each_possible_cpu(n)
+		spin_lock_init(&per_cpu(files_cpu_lock, n));
+
 	/*
 	 * One file with associated inode and dcache is very roughly 1K.
 	 * Per default don't use more than 10% of our memory for files. 
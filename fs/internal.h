@@ -43,6 +43,16 @@ static inline int __sync_blockdev(struct block_device *bdev, int wait)
 }
 #endif
 
+/*
+ * inode.c
+ */
+extern int get_nr_dirty_inodes(void);
+
+/*
+ * fs-writeback.c
+ */
+extern void inode_wb_list_del(struct inode *inode);
+
 /*
  * char_dev.c
  */
@@ -564,8 +564,11 @@ int simple_pin_fs(struct file_system_type *type, struct vfsmount **mount, int *c
 		if (IS_ERR(mnt))
 			return PTR_ERR(mnt);
 		spin_lock(&pin_fs_lock);
-		if (!*mount)
+		if (!*mount) {
+			/* long term while pinned, like a kern_mount() */
+			mnt_make_longterm(mnt);
 			*mount = mnt;
+		}
 	}
 	mntget(*mount);
 	++*count;
@@ -577,11 +580,15 @@ int simple_pin_fs(struct file_system_type *type, struct vfsmount **mount, int *c
 void simple_release_fs(struct vfsmount **mount, int *count)
 {
 	struct vfsmount *mnt;
+	int last;
 	spin_lock(&pin_fs_lock);
 	mnt = *mount;
-	if (!--*count)
+	last = !--*count;
+	if (last)
 		*mount = NULL;
 	spin_unlock(&pin_fs_lock);
+	if (last)
+		mnt_make_shortterm(mnt);
 	mntput(mnt);
 }
 
@@ -652,15 +652,15 @@ int follow_up(struct path *path)
 {
 	struct vfsmount *parent;
 	struct dentry *mountpoint;
-	spin_lock(&vfsmount_lock);
+	br_read_lock(vfsmount_lock);
 	parent = path->mnt->mnt_parent;
 	if (parent == path->mnt) {
-		spin_unlock(&vfsmount_lock);
+		br_read_unlock(vfsmount_lock);
 		return 0;
 	}
 	mntget(parent);
 	mountpoint = dget(path->mnt->mnt_mountpoint);
-	spin_unlock(&vfsmount_lock);
+	br_read_unlock(vfsmount_lock);
 	dput(path->dentry);
 	path->dentry = mountpoint;
 	mntput(path->mnt);
@@ -929,15 +929,15 @@ static __always_inline void follow_dotdot(struct nameidata *nd)
 			break;
 		}
 		spin_unlock(&dcache_lock);
-		spin_lock(&vfsmount_lock);
+		br_read_lock(vfsmount_lock);
 		parent = nd->path.mnt->mnt_parent;
 		if (parent == nd->path.mnt) {
-			spin_unlock(&vfsmount_lock);
+			br_read_unlock(vfsmount_lock);
 			break;
 		}
 		mntget(parent);
 		nd->path.dentry = dget(nd->path.mnt->mnt_mountpoint);
-		spin_unlock(&vfsmount_lock);
+		br_read_unlock(vfsmount_lock);
 		dput(old);
 		mntput(nd->path.mnt);
 		nd->path.mnt = parent;
@@ -1046,6 +1046,170 @@ static inline int follow_on_final(struct inode *inode, unsigned lookup_flags)
 		((lookup_flags & LOOKUP_FOLLOW) || S_ISDIR(inode->i_mode));
 }
 
+/*
+ * MAY_EXEC check for the store-free walk, on inode fields sampled under
+ * d_seq.  Succeeds only when the mode bits alone grant search permission;
+ * ACLs and capability overrides are left to exec_permission_lite().
+ */
+static inline int exec_permission_rcu(umode_t mode, uid_t uid, gid_t gid,
+				      int acl)
+{
+	if (current_fsuid() == uid)
+		mode >>= 6;
+	else {
+		if (acl)
+			return -ECHILD;
+		if (in_group_p(gid))
+			mode >>= 3;
+	}
+	return (mode & MAY_EXEC) ? 0 : -ECHILD;
+}
+
+/*
+ * Store-free walk over the leading components of a pathname.
+ *
+ * Intermediate directories are looked up under rcu_read_lock() without
+ * taking their d_lock or a reference; every step is validated against
+ * d_seq instead, which d_move() and dentry_iput() bump.  Inodes are not
+ * RCU-freed, so nothing sampled from one is dereferenced before the
+ * dentry pointing at it has been revalidated.  Only the directory we stop
+ * at gets pinned, and __link_path_walk() carries on from there.
+ *
+ * Anything this cannot handle ends the walk early: "..", mountpoints,
+ * symlinks, ->d_revalidate(), ->d_hash()/->d_compare(), ->permission(),
+ * ACLs and security modules.  The last component is always left to the
+ * ref-walk, so the result is never different from what the ref-walk
+ * alone would have produced.
+ */
+static void link_path_walk_rcu(const char **namep, struct nameidata *nd)
+{
+	struct super_block *sb = nd->path.mnt->mnt_sb;
+	struct dentry *parent = nd->path.dentry;
+	const char *name = *namep;
+	const char *done = name;
+	unsigned seq;
+
+	if ((nd->flags & LOOKUP_REVAL) || !security_inode_permission_trivial())
+		return;
+
+	rcu_read_lock();
+	seq = read_seqcount_begin(&parent->d_seq);
+	for (;;) {
+		const struct inode_operations *iop;
+		struct inode *inode;
+		struct dentry *dentry;
+		struct qstr this;
+		const char *next;
+		unsigned long hash;
+		unsigned int c;
+		unsigned dseq;
+		umode_t mode;
+		uid_t uid;
+		gid_t gid;
+		int acl;
+
+		inode = ACCESS_ONCE(parent->d_inode);
+		if (!inode)
+			break;
+		iop = inode->i_op;
+		mode = inode->i_mode;
+		uid = inode->i_uid;
+		gid = inode->i_gid;
+#ifdef CONFIG_FS_POSIX_ACL
+		acl = ACCESS_ONCE(inode->i_acl) != NULL;
+#else
+		acl = 1;
+#endif
+		if (read_seqcount_retry(&parent->d_seq, seq))
+			break;
+		/* the inode is known to have been live; i_op is static */
+		if (iop->permission || iop->follow_link || !iop->lookup)
+			break;
+		acl = acl && (sb->s_flags & MS_POSIXACL) && iop->check_acl &&
+		      (mode & S_IRWXG);
+		if (exec_permission_rcu(mode, uid, gid, acl))
+			break;
+
+		this.name = name;
+		c = *(const unsigned char *)name;
+		hash = init_name_hash();
+		do {
+			name++;
+			hash = partial_name_hash(c, hash);
+			c = *(const unsigned char *)name;
+		} while (c && (c != '/'));
+		this.len = name - (const char *) this.name;
+		this.hash = end_name_hash(hash);
+
+		/* the last component is left to the ref-walk */
+		next = name;
+		while (*next == '/')
+			next++;
+		if (!*next)
+			break;
+
+		if (this.name[0] == '.' && this.len <= 2) {
+			if (this.len == 2 && this.name[1] == '.')
+				break;
+			if (this.len == 1) {
+				name = next;
+				continue;
+			}
+		}
+
+		if (parent->d_op &&
+		    (parent->d_op->d_hash || parent->d_op->d_compare))
+			break;
+		dentry = __d_lookup_rcu(parent, &this, &dseq);
+		if (!dentry)
+			break;
+		if (read_seqcount_retry(&parent->d_seq, seq))
+			break;
+		if (dentry->d_op && dentry->d_op->d_revalidate)
+			break;
+		if (dentry->d_flags & DCACHE_MANAGED_DENTRY)
+			break;
+		/*
+		 * Never move onto anything but a positive directory the
+		 * ref-walk can carry on from: negative dentries, symlinks
+		 * and files stay with the ref-walk, from the parent.
+		 */
+		inode = ACCESS_ONCE(dentry->d_inode);
+		if (!inode)
+			break;
+		iop = inode->i_op;
+		if (read_seqcount_retry(&dentry->d_seq, dseq))
+			break;
+		if (iop->permission || iop->follow_link || !iop->lookup)
+			break;
+
+		parent = dentry;
+		seq = dseq;
+		name = next;
+		done = next;
+	}
+
+	if (parent == nd->path.dentry) {
+		rcu_read_unlock();
+		return;
+	}
+
+	/* pin where we stopped, or have the ref-walk redo it all */
+	spin_lock(&parent->d_lock);
+	if (d_unhashed(parent) || read_seqcount_retry(&parent->d_seq, seq)) {
+		spin_unlock(&parent->d_lock);
+		rcu_read_unlock();
+		return;
+	}
+	atomic_inc(&parent->d_count);
+	spin_unlock(&parent->d_lock);
+	rcu_read_unlock();
+
+	dput(nd->path.dentry);
+	nd->path.dentry = parent;
+	*namep = done;
+}
+
 /*
  * Name resolution.
  * This is the basic name resolution function, turning a pathname into
@@ -1066,6 +1230,8 @@ static int __link_path_walk(const char *name, struct nameidata *nd)
 	if (!*name)
 		goto return_reval;
 
+	link_path_walk_rcu(&name, nd);
+
 	inode = nd->path.dentry->d_inode;
 	if (nd->depth)
 		lookup_flags = LOOKUP_FOLLOW | (nd->flags & LOOKUP_CONTINUE);
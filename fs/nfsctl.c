@@ -20,32 +20,56 @@
  * open a file on nfsd fs
  */
 
-static struct file *do_open(char *name, int flags)
+/*
+ * The do_kern_mount reference is kept long term, and so the mntput()s of
+ * everything else on the fast path, until the caller has put the file and
+ * drops it with nfsctl_put_mount().
+ */
+static struct file *do_open(char *name, int flags, struct vfsmount **mntp)
 {
 	struct nameidata nd;
 	struct vfsmount *mnt;
+	struct file *file;
 	int error;
 
 	mnt = do_kern_mount("nfsd", 0, "nfsd", NULL);
 	if (IS_ERR(mnt))
 		return (struct file *)mnt;
+	mnt_make_longterm(mnt);
 
 	error = vfs_path_lookup(mnt->mnt_root, mnt, name, 0, &nd);
-	mntput(mnt);	/* drop do_kern_mount reference */
-	if (error)
-		return ERR_PTR(error);
+	if (error) {
+		file = ERR_PTR(error);
+		goto out;
+	}
 
 	if (flags == O_RDWR)
 		error = may_open(&nd.path, MAY_READ|MAY_WRITE, flags);
 	else
 		error = may_open(&nd.path, MAY_WRITE, flags);
 
-	if (!error)
-		return dentry_open(nd.path.dentry, nd.path.mnt, flags,
+	if (!error) {
+		file = dentry_open(nd.path.dentry, nd.path.mnt, flags,
 				   current_cred());
+		if (!IS_ERR(file)) {
+			*mntp = mnt;
+			return file;
+		}
+		goto out;
+	}
 
 	path_put(&nd.path);
-	return ERR_PTR(error);
+	file = ERR_PTR(error);
+out:
+	mnt_make_shortterm(mnt);
+	mntput(mnt);
+	return file;
+}
+
+static void nfsctl_put_mount(struct vfsmount *mnt)
+{
+	mnt_make_shortterm(mnt);
+	mntput(mnt);
 }
 
 static struct {
@@ -86,6 +110,7 @@ static struct {
 SYSCALL_DEFINE3(nfsservctl, int, cmd, struct nfsctl_arg __user *, arg,
 		void __user *, res)
 {
+	struct vfsmount *mnt;
 	struct file *file;
 	void __user *p = &arg->u;
 	int version;
@@ -100,7 +125,7 @@ SYSCALL_DEFINE3(nfsservctl, int, cmd, struct nfsctl_arg __user *, arg,
 	if (cmd < 0 || cmd >= ARRAY_SIZE(map) || !map[cmd].name)
 		return -EINVAL;
 
-	file = do_open(map[cmd].name, map[cmd].rsize ? O_RDWR : O_WRONLY);	
+	file = do_open(map[cmd].name, map[cmd].rsize ? O_RDWR : O_WRONLY, &mnt);
 	if (IS_ERR(file))
 		return PTR_ERR(file);
 	err = file->f_op->write(file, p, map[cmd].wsize, &file->f_pos);
@@ -109,5 +134,6 @@ SYSCALL_DEFINE3(nfsservctl, int, cmd, struct nfsctl_arg __user *, arg,
 	if (err >= 0)
 		err = 0;
 	fput(file);
+	nfsctl_put_mount(mnt);
 	return err;
 }
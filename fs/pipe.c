@@ -1147,7 +1147,7 @@ static int __init init_pipe_fs(void)
 static void __exit exit_pipe_fs(void)
 {
 	unregister_filesystem(&pipe_fs_type);
-	mntput(pipe_mnt);
+	kern_unmount(pipe_mnt);
 }
 
 fs_initcall(init_pipe_fs);
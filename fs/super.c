@@ -57,16 +57,29 @@ static struct super_block *alloc_super(struct file_system_type *type)
 	static const struct super_operations default_op;
 
 	if (s) {
+		int i;
+
 		if (security_sb_alloc(s)) {
 			kfree(s);
 			s = NULL;
 			goto out;
 		}
+		s->s_files_pcpu = alloc_percpu(struct list_head);
+		if (!s->s_files_pcpu) {
+			security_sb_free(s);
+			kfree(s);
+			s = NULL;
+			goto out;
+		}
+		for_each_possible_cpu(i)
+			INIT_LIST_HEAD(per_cpu_ptr(s->s_files_pcpu, i));
 		INIT_LIST_HEAD(&s->s_files);
 		INIT_LIST_HEAD(&s->s_instances);
 		INIT_HLIST_HEAD(&s->s_anon);
 		INIT_LIST_HEAD(&s->s_inodes);
+		spin_lock_init(&s->s_inodes_lock);
 		INIT_LIST_HEAD(&s->s_dentry_lru);
+		spin_lock_init(&s->s_dentry_lru_lock);
 		init_rwsem(&s->s_umount);
 		mutex_init(&s->s_lock);
 		lockdep_set_class(&s->s_umount, &type->s_umount_key);
@@ -117,6 +130,7 @@ out:
  */
 static inline void destroy_super(struct super_block *s)
 {
+	free_percpu(s->s_files_pcpu);
 	security_sb_free(s);
 	kfree(s->s_subtype);
 	kfree(s->s_options);
@@ -220,6 +234,11 @@ void deactivate_locked_super(struct super_block *s)
 		spin_unlock(&sb_lock);
 		vfs_dq_off(s, 0);
 		fs->kill_sb(s);
+		/*
+		 * Inodes are freed through call_rcu(); flush the callbacks
+		 * before the module that owns the inode cache can go away.
+		 */
+		rcu_barrier();
 		put_filesystem(fs);
 		put_super(s);
 	} else {
@@ -1001,7 +1020,28 @@ EXPORT_SYMBOL_GPL(do_kern_mount);
 
 struct vfsmount *kern_mount_data(struct file_system_type *type, void *data)
 {
-	return vfs_kern_mount(type, MS_KERNMOUNT, type->name, data);
+	struct vfsmount *mnt;
+
+	mnt = vfs_kern_mount(type, MS_KERNMOUNT, type->name, data);
+	if (!IS_ERR(mnt)) {
+		/*
+		 * it is a longterm mount, don't release mnt until
+		 * we unmount before file sys is unregistered
+		*/
+		mnt_make_longterm(mnt);
+	}
+	return mnt;
 }
 
 EXPORT_SYMBOL_GPL(kern_mount_data);
+
+void kern_unmount(struct vfsmount *mnt)
+{
+	/* release long term mount so mount point can be released */
+	if (!IS_ERR_OR_NULL(mnt)) {
+		mnt_make_shortterm(mnt);
+		mntput(mnt);
+	}
+}
+
+EXPORT_SYMBOL(kern_unmount);
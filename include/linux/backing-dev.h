@@ -55,6 +55,9 @@ struct bdi_writeback {
 	struct list_head	b_dirty;	/* dirty inodes */
 	struct list_head	b_io;		/* parked for writeback */
 	struct list_head	b_more_io;	/* parked for more writeback */
+#ifndef __GENKSYMS__
+	spinlock_t		list_lock;	/* protects the b_* lists */
+#endif
 };
 
 struct backing_dev_info {
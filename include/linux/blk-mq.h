@@ -0,0 +1,97 @@
+#ifndef BLK_MQ_H
+#define BLK_MQ_H
+
+#include <linux/blkdev.h>
+
+struct blk_mq_tags;
+struct blk_mq_ctx;
+
+/*
+ * One hardware dispatch queue. Several per-cpu software queues feed it;
+ * requests bounced by the driver wait on ->dispatch until the next run.
+ */
+struct blk_mq_hw_ctx {
+	spinlock_t		lock;
+	struct list_head	dispatch;
+
+	unsigned long		state;		/* BLK_MQ_S_* flags */
+	struct delayed_work	run_work;
+
+	unsigned long		*ctx_map;	/* software queues with work */
+	struct blk_mq_ctx	**ctxs;
+	unsigned int		nr_ctx;
+
+	struct blk_mq_tags	*tags;
+	struct request_queue	*queue;
+	void			*driver_data;
+	unsigned int		queue_num;
+	int			numa_node;
+};
+
+typedef int (queue_rq_fn)(struct blk_mq_hw_ctx *, struct request *);
+typedef int (init_hctx_fn)(struct blk_mq_hw_ctx *, void *, unsigned int);
+typedef void (exit_hctx_fn)(struct blk_mq_hw_ctx *, unsigned int);
+
+struct blk_mq_ops {
+	/*
+	 * Start one request. May be called concurrently for the same
+	 * hardware queue from several cpus, the driver does its own locking.
+	 * Return BLK_MQ_RQ_QUEUE_BUSY (after blk_mq_stop_hw_queue()) when the
+	 * hardware is full, the request is retried once the queue is
+	 * restarted.
+	 */
+	queue_rq_fn		*queue_rq;
+
+	/* optional, called for each hardware queue at init/teardown */
+	init_hctx_fn		*init_hctx;
+	exit_hctx_fn		*exit_hctx;
+
+	/* optional, installed as the queue's softirq_done_fn */
+	softirq_done_fn		*complete;
+};
+
+struct blk_mq_reg {
+	struct blk_mq_ops	*ops;
+	unsigned int		nr_hw_queues;
+	unsigned int		queue_depth;	/* tags per hardware queue */
+	unsigned int		cmd_size;	/* per-request driver data */
+	int			numa_node;
+};
+
+enum {
+	BLK_MQ_RQ_QUEUE_OK	= 0,	/* queued fine */
+	BLK_MQ_RQ_QUEUE_BUSY	= 1,	/* requeue IO for later */
+	BLK_MQ_RQ_QUEUE_ERROR	= 2,	/* end IO with error */
+
+	BLK_MQ_S_STOPPED	= 0,
+
+	BLK_MQ_MAX_DEPTH	= 2048,
+};
+
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *, void *);
+
+struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *, const int cpu);
+
+void blk_mq_end_io(struct request *rq, int error);
+
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async);
+void blk_mq_run_queues(struct request_queue *q, bool async);
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx);
+void blk_mq_start_stopped_hw_queues(struct request_queue *q, bool async);
+
+#define queue_for_each_hw_ctx(q, hctx, i)				\
+	for ((i) = 0; (i) < (q)->nr_hw_queues &&			\
+	     ({ hctx = (q)->queue_hw_ctx[i]; 1; }); (i)++)
+
+/* the driver's cmd_size bytes live right behind the request */
+static inline void *blk_mq_rq_to_pdu(struct request *rq)
+{
+	return (void *) rq + sizeof(*rq);
+}
+
+static inline struct request *blk_mq_rq_from_pdu(void *pdu)
+{
+	return pdu - sizeof(struct request);
+}
+
+#endif
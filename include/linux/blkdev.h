@@ -30,6 +30,11 @@ struct request_pm_state;
 struct blk_trace;
 struct request;
 struct sg_io_hdr;
+struct blk_mq_ops;
+struct blk_mq_ctx;
+struct blk_mq_hw_ctx;
+struct iolat_grp;
+struct iolat_data;
 
 #define BLKDEV_MIN_RQ	4
 #define BLKDEV_MAX_RQ	128	/* Default maximum */
@@ -144,10 +149,8 @@ struct request {
 
 	struct gendisk *rq_disk;
 	unsigned long start_time;
-#ifdef CONFIG_BLK_CGROUP
 	unsigned long long start_time_ns;
 	unsigned long long io_start_time_ns;    /* when passed to hardware */
-#endif
 	/* Number of scatter-gather DMA addr+len pairs after
 	 * physical address coalescing is performed.
 	 */
@@ -190,6 +193,15 @@ struct request {
 	struct request *next_rq;
 	/* For future extensions */
 	void *pad;
+
+#ifndef __GENKSYMS__
+	/* software queue of a multi-queue device, see blk-mq */
+	struct blk_mq_ctx *mq_ctx;
+#ifdef CONFIG_BLK_DEV_IOLATENCY
+	/* cgroup group this request is charged to by the latency controller */
+	struct iolat_grp *iolat;
+#endif
+#endif
 };
 
 static inline unsigned short req_get_ioprio(struct request *req)
@@ -231,6 +243,7 @@ typedef void (prepare_flush_fn) (struct request_queue *, struct request *);
 typedef void (softirq_done_fn)(struct request *);
 typedef int (dma_drain_needed_fn)(struct request *);
 typedef int (lld_busy_fn) (struct request_queue *q);
+typedef int (blk_poll_fn) (struct request_queue *q);
 
 enum blk_eh_timer_return {
 	BLK_EH_NOT_HANDLED,
@@ -425,11 +438,40 @@ struct request_queue
 #ifdef CONFIG_BLK_DEV_THROTTLING
 	/* Throttle data */
 	struct throtl_data *td;
+#endif
+#ifdef CONFIG_BLK_DEV_IOLATENCY
+	/* Latency target controller data */
+	struct iolat_data *iolat;
 #endif
 	/*
 	 * Delayed queue handling
 	 */
 	struct delayed_work	delay_work;
+
+	/*
+	 * Multi-queue devices (blk-mq): per-cpu software queues mapped onto
+	 * nr_hw_queues hardware contexts, no elevator and no queue_lock on
+	 * the submission path.
+	 */
+	struct blk_mq_ops	*mq_ops;
+	struct blk_mq_ctx __percpu *queue_ctx;
+	struct blk_mq_hw_ctx	**queue_hw_ctx;
+	unsigned int		nr_hw_queues;
+	unsigned int		*mq_map;
+
+	/*
+	 * Synchronous completion polling, see blk_poll(). The counters are
+	 * updated without locking and only meant for tuning.
+	 */
+	blk_poll_fn		*poll_fn;
+	int			poll_delay;	/* -1 spin, 0 hybrid, else usecs */
+	u64			poll_nsec;	/* mean time to completion */
+	struct {
+		unsigned long	invoked;
+		unsigned long	hits;
+		unsigned long	misses;
+		unsigned long	sleeps;
+	} poll_stat;
 #endif /* __GENKSYMS__ */
 };
 
@@ -454,6 +496,7 @@ struct request_queue
 #define QUEUE_FLAG_DISCARD     17	/* supports DISCARD */
 #define QUEUE_FLAG_ADD_RANDOM  18	/* Contributes to random pool */
 #define QUEUE_FLAG_SAME_FORCE  19	/* force complete on same CPU */
+#define QUEUE_FLAG_POLL	       20	/* poll for completions */
 
 #define QUEUE_FLAG_DEFAULT	((1 << QUEUE_FLAG_IO_STAT) |		\
 				 (1 << QUEUE_FLAG_CLUSTER) |		\
@@ -587,6 +630,7 @@ enum {
 #define blk_queue_nonrot(q)	test_bit(QUEUE_FLAG_NONROT, &(q)->queue_flags)
 #define blk_queue_io_stat(q)	test_bit(QUEUE_FLAG_IO_STAT, &(q)->queue_flags)
 #define blk_queue_add_random(q)	test_bit(QUEUE_FLAG_ADD_RANDOM, &(q)->queue_flags)
+#define blk_queue_poll(q)	test_bit(QUEUE_FLAG_POLL, &(q)->queue_flags)
 #define blk_queue_flushing(q)	((q)->ordseq)
 #define blk_queue_stackable(q)	\
 	test_bit(QUEUE_FLAG_STACKABLE, &(q)->queue_flags)
@@ -810,6 +854,49 @@ extern void blk_execute_rq_nowait(struct request_queue *, struct gendisk *,
 				  struct request *, int, rq_end_io_fn *);
 extern void blk_unplug(struct request_queue *q);
 
+/*
+ * blk_plug lets a task collect the requests of a batch of submissions on
+ * its stack, merging them without the queue lock, and hand them to the
+ * queues in one go from blk_finish_plug(). Anything still plugged when the
+ * task sleeps is flushed from schedule().
+ */
+#define PLUG_MAGIC		0x91827364
+#define BLK_MAX_REQUEST_COUNT	16
+
+struct blk_plug {
+	unsigned long magic;
+	struct list_head list;
+	unsigned int should_sort;
+	unsigned int count;
+};
+
+extern void blk_start_plug(struct blk_plug *);
+extern void blk_finish_plug(struct blk_plug *);
+extern void blk_flush_plug_list(struct blk_plug *, bool);
+
+static inline void blk_flush_plug(struct task_struct *tsk)
+{
+	struct blk_plug *plug = tsk->plug;
+
+	if (plug)
+		blk_flush_plug_list(plug, false);
+}
+
+static inline void blk_schedule_flush_plug(struct task_struct *tsk)
+{
+	struct blk_plug *plug = tsk->plug;
+
+	if (plug)
+		blk_flush_plug_list(plug, true);
+}
+
+static inline bool blk_needs_flush_plug(struct task_struct *tsk)
+{
+	struct blk_plug *plug = tsk->plug;
+
+	return plug && !list_empty(&plug->list);
+}
+
 static inline struct request_queue *bdev_get_queue(struct block_device *bdev)
 {
 	return bdev->bd_disk->queue;
@@ -904,6 +991,7 @@ extern bool __blk_end_request_err(struct request *rq, int error);
 
 extern void blk_complete_request(struct request *);
 extern void __blk_complete_request(struct request *);
+extern bool blk_poll(struct request_queue *, u64);
 extern void blk_abort_request(struct request *);
 extern void blk_abort_queue(struct request_queue *);
 extern void blk_unprep_request(struct request *);
@@ -957,6 +1045,7 @@ extern void blk_queue_merge_bvec(struct request_queue *, merge_bvec_fn *);
 extern void blk_queue_dma_alignment(struct request_queue *, int);
 extern void blk_queue_update_dma_alignment(struct request_queue *, int);
 extern void blk_queue_softirq_done(struct request_queue *, softirq_done_fn *);
+extern void blk_queue_poll_fn(struct request_queue *, blk_poll_fn *);
 extern void blk_queue_rq_timed_out(struct request_queue *, rq_timed_out_fn *);
 extern void blk_queue_rq_timeout(struct request_queue *, unsigned int);
 extern void blk_queue_flush(struct request_queue *q, unsigned int flush);
@@ -966,6 +1055,7 @@ extern int blk_queue_ordered(struct request_queue *q, unsigned ordered, prepare_
 extern struct backing_dev_info *blk_get_backing_dev_info(struct block_device *bdev);
 
 extern int blk_rq_map_sg(struct request_queue *, struct request *, struct scatterlist *);
+extern int blk_bio_map_sg(struct request_queue *, struct bio *, struct scatterlist *);
 extern void blk_dump_rq_flags(struct request *, char *);
 extern void generic_unplug_device(struct request_queue *);
 extern long nr_blockdev_pages(void);
@@ -999,6 +1089,7 @@ static inline struct request *blk_map_queue_find_tag(struct blk_queue_tag *bqt,
 
 extern int __blkdev_issue_flush(struct block_device *, gfp_t, sector_t *);
 extern int blkdev_issue_flush(struct block_device *, sector_t *);
+extern bool blk_flush_bio_seq(struct request_queue *, struct bio *);
 /* DEPRECATED preserving DISCARD_FL_* purely for compatibility */
 #define DISCARD_FL_WAIT		0x01	/* wait for completion */
 #define DISCARD_FL_BARRIER	0x02	/* issue DISCARD_BARRIER request */
@@ -1216,8 +1307,9 @@ static inline void put_dev_sector(Sector p)
 
 struct work_struct;
 int kblockd_schedule_work(struct request_queue *q, struct work_struct *work);
+int kblockd_schedule_delayed_work(struct request_queue *q,
+				  struct delayed_work *dwork, unsigned long delay);
 
-#ifdef CONFIG_BLK_CGROUP
 static inline void set_start_time_ns(struct request *req)
 {
 	req->start_time_ns = sched_clock();
@@ -1237,33 +1329,49 @@ static inline uint64_t rq_io_start_time_ns(struct request *req)
 {
         return req->io_start_time_ns;
 }
-#else
-static inline void set_start_time_ns(struct request *req) {}
-static inline void set_io_start_time_ns(struct request *req) {}
-static inline uint64_t rq_start_time_ns(struct request *req)
-{
-	return 0;
-}
-static inline uint64_t rq_io_start_time_ns(struct request *req)
-{
-	return 0;
-}
-#endif
+
+extern void blk_lat_hist_add(struct blk_lat_hist *hist, struct request *rq,
+			     u64 now);
 
 #ifdef CONFIG_BLK_DEV_THROTTLING
 extern int blk_throtl_init(struct request_queue *q);
 extern void blk_throtl_exit(struct request_queue *q);
 extern int blk_throtl_bio(struct request_queue *q, struct bio **bio);
+extern void blk_throtl_rq_done(struct request *rq);
 #else /* CONFIG_BLK_DEV_THROTTLING */
 static inline int blk_throtl_bio(struct request_queue *q, struct bio **bio)
 {
 	return 0;
 }
 
+static inline void blk_throtl_rq_done(struct request *rq) { }
+
 static inline int blk_throtl_init(struct request_queue *q) { return 0; }
 static inline int blk_throtl_exit(struct request_queue *q) { return 0; }
 #endif /* CONFIG_BLK_DEV_THROTTLING */
 
+#ifdef CONFIG_BLK_DEV_IOLATENCY
+extern int blk_iolatency_init(struct request_queue *q);
+extern void blk_iolatency_exit(struct request_queue *q);
+extern struct iolat_grp *blk_iolatency_throttle(struct request_queue *q);
+extern void blk_iolatency_done(struct request *rq);
+
+static inline void blk_rq_set_iolat(struct request *rq, struct iolat_grp *grp)
+{
+	rq->iolat = grp;
+}
+#else /* CONFIG_BLK_DEV_IOLATENCY */
+static inline int blk_iolatency_init(struct request_queue *q) { return 0; }
+static inline void blk_iolatency_exit(struct request_queue *q) { }
+static inline struct iolat_grp *blk_iolatency_throttle(struct request_queue *q)
+{
+	return NULL;
+}
+static inline void blk_iolatency_done(struct request *rq) { }
+static inline void blk_rq_set_iolat(struct request *rq,
+				    struct iolat_grp *grp) { }
+#endif /* CONFIG_BLK_DEV_IOLATENCY */
+
 #define MODULE_ALIAS_BLOCKDEV(major,minor) \
 	MODULE_ALIAS("block-major-" __stringify(major) "-" __stringify(minor))
 #define MODULE_ALIAS_BLOCKDEV_MAJOR(major) \
@@ -1375,6 +1483,30 @@ static inline long nr_blockdev_pages(void)
 	return 0;
 }
 
+struct blk_plug {
+};
+
+static inline void blk_start_plug(struct blk_plug *plug)
+{
+}
+
+static inline void blk_finish_plug(struct blk_plug *plug)
+{
+}
+
+static inline void blk_flush_plug(struct task_struct *task)
+{
+}
+
+static inline void blk_schedule_flush_plug(struct task_struct *task)
+{
+}
+
+static inline bool blk_needs_flush_plug(struct task_struct *tsk)
+{
+	return false;
+}
+
 #endif /* CONFIG_BLOCK */
 
 #endif
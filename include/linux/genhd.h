@@ -91,6 +91,28 @@ struct disk_stats {
 	unsigned long page_cache_missed[2];
 #endif
 };
+
+/*
+ * log2 latency histograms of completed requests.  Bucket 0 counts requests
+ * which took less than 1us, bucket i those which took less than 2^i us and
+ * the last bucket all slower ones.
+ */
+#define BLK_LAT_HIST_BUCKETS	24
+
+enum {
+	BLK_LAT_QUEUE,		/* allocation until dispatch to the driver */
+	BLK_LAT_SERVICE,	/* dispatch until completion */
+	BLK_LAT_TOTAL,		/* allocation until completion */
+	BLK_LAT_NR_TYPES,
+};
+
+struct blk_lat_hist {
+	/* indexed by type, READ/WRITE, async/sync and bucket */
+	unsigned long count[BLK_LAT_NR_TYPES][2][2][BLK_LAT_HIST_BUCKETS];
+};
+
+extern int blk_lat_hist_print(struct blk_lat_hist *hist, const char *prefix,
+			      char *buf, int size);
 	
 struct hd_struct {
 	sector_t start_sect;
@@ -104,7 +126,11 @@ struct hd_struct {
 	int make_it_fail;
 #endif
 	unsigned long stamp;
+#ifndef __GENKSYMS__
+	atomic_t in_flight[2];	/* blk-mq accounts without the queue lock */
+#else
 	int in_flight[2];
+#endif
 #ifdef	CONFIG_SMP
 	struct disk_stats *dkstats;
 #else
@@ -174,6 +200,9 @@ struct gendisk {
 	struct blk_integrity *integrity;
 #endif
 	int node_id;
+#ifndef __GENKSYMS__
+	struct blk_lat_hist __percpu *lat_hist;
+#endif
 };
 
 static inline struct gendisk *part_to_disk(struct hd_struct *part)
@@ -333,21 +362,22 @@ static inline void free_part_stats(struct hd_struct *part)
 
 static inline void part_inc_in_flight(struct hd_struct *part, int rw)
 {
-	part->in_flight[rw]++;
+	atomic_inc(&part->in_flight[rw]);
 	if (part->partno)
-		part_to_disk(part)->part0.in_flight[rw]++;
+		atomic_inc(&part_to_disk(part)->part0.in_flight[rw]);
 }
 
 static inline void part_dec_in_flight(struct hd_struct *part, int rw)
 {
-	part->in_flight[rw]--;
+	atomic_dec(&part->in_flight[rw]);
 	if (part->partno)
-		part_to_disk(part)->part0.in_flight[rw]--;
+		atomic_dec(&part_to_disk(part)->part0.in_flight[rw]);
 }
 
 static inline int part_in_flight(struct hd_struct *part)
 {
-	return part->in_flight[0] + part->in_flight[1];
+	return atomic_read(&part->in_flight[0]) +
+		atomic_read(&part->in_flight[1]);
 }
 
 /* block/blk-core.c */
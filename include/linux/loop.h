@@ -28,6 +28,16 @@ enum {
 
 struct loop_func_table;
 
+/* Upper bound for the worker threads of one device */
+#define LOOP_MAX_WORKERS	16
+
+/* Contiguous run of the backing file on its block device, in sectors */
+struct loop_extent {
+	sector_t	lstart;		/* offset in the backing file */
+	sector_t	pstart;		/* sector on the block device */
+	sector_t	nr_sects;
+};
+
 struct loop_device {
 	int		lo_number;
 	int		lo_refcnt;
@@ -65,6 +75,21 @@ struct loop_device {
 	struct request_queue	*lo_queue;
 	struct gendisk		*lo_disk;
 	struct list_head	lo_list;
+
+#ifndef __GENKSYMS__
+	/* Worker threads, lo_thread is the first one */
+	struct task_struct	*lo_threads[LOOP_MAX_WORKERS];
+	int			lo_nr_threads;
+	int			lo_active;	/* bios handled by workers */
+	int			lo_barrier;	/* switch waiting for workers */
+
+	/* LO_FLAGS_DIRECT_IO: bios are remapped onto lo_dio_bdev */
+	struct block_device	*lo_dio_bdev;
+	struct loop_extent	*lo_dio_map;
+	unsigned int		lo_dio_nr_extents;
+	atomic_t		lo_dio_pending;
+	wait_queue_head_t	lo_dio_wait;
+#endif
 };
 
 #endif /* __KERNEL__ */
@@ -76,6 +101,7 @@ enum {
 	LO_FLAGS_READ_ONLY	= 1,
 	LO_FLAGS_USE_AOPS	= 2,
 	LO_FLAGS_AUTOCLEAR	= 4,
+	LO_FLAGS_DIRECT_IO	= 16,
 };
 
 #include <asm/posix_types.h>	/* for __kernel_old_dev_t */
@@ -160,5 +186,6 @@ int loop_unregister_transfer(int number);
 #define LOOP_GET_STATUS64	0x4C05
 #define LOOP_CHANGE_FD		0x4C06
 #define LOOP_SET_CAPACITY	0x4C07
+#define LOOP_SET_DIRECT_IO	0x4C08
 
 #endif
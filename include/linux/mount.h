@@ -13,6 +13,8 @@
 #include <linux/list.h>
 #include <linux/nodemask.h>
 #include <linux/spinlock.h>
+#include <linux/lglock.h>
+#include <linux/percpu.h>
 #include <asm/atomic.h>
 
 struct super_block;
@@ -71,6 +73,18 @@ struct vfsmount {
 #else
 	int mnt_writers;
 #endif
+#ifndef __GENKSYMS__
+#ifdef CONFIG_SMP
+	/*
+	 * On SMP mnt_count is unused: references are counted per-cpu in
+	 * mnt_pcp_count and only summed up under the vfsmount_lock write
+	 * lock.  mnt_longterm counts the references (namespace attachment,
+	 * kern_mount) that keep the mount alive without such a sum.
+	 */
+	int *mnt_pcp_count;
+	atomic_t mnt_longterm;
+#endif
+#endif
 };
 
 static inline int *get_mnt_writers_ptr(struct vfsmount *mnt)
@@ -84,8 +98,15 @@ static inline int *get_mnt_writers_ptr(struct vfsmount *mnt)
 
 static inline struct vfsmount *mntget(struct vfsmount *mnt)
 {
-	if (mnt)
+	if (mnt) {
+#ifdef CONFIG_SMP
+		preempt_disable();
+		(*per_cpu_ptr(mnt->mnt_pcp_count, smp_processor_id()))++;
+		preempt_enable();
+#else
 		atomic_inc(&mnt->mnt_count);
+#endif
+	}
 	return mnt;
 }
 
@@ -98,6 +119,8 @@ extern void mnt_drop_write(struct vfsmount *mnt);
 extern void mntput_no_expire(struct vfsmount *mnt);
 extern void mnt_pin(struct vfsmount *mnt);
 extern void mnt_unpin(struct vfsmount *mnt);
+extern void mnt_make_longterm(struct vfsmount *mnt);
+extern void mnt_make_shortterm(struct vfsmount *mnt);
 extern int __mnt_is_readonly(struct vfsmount *mnt);
 
 static inline void mntput(struct vfsmount *mnt)
@@ -128,7 +151,7 @@ extern int do_add_mount(struct vfsmount *newmnt, struct path *path,
 extern void mnt_set_expiry(struct vfsmount *mnt, struct list_head *expiry_list);
 extern void mark_mounts_for_expiry(struct list_head *mounts);
 
-extern spinlock_t vfsmount_lock;
+DECLARE_BRLOCK(vfsmount_lock);
 extern dev_t name_to_dev_t(char *name);
 
 #endif /* _LINUX_MOUNT_H */
@@ -98,6 +98,7 @@ struct exec_domain;
 struct futex_pi_state;
 struct robust_list_head;
 struct bio;
+struct blk_plug;
 struct fs_struct;
 struct perf_event_context;
 
@@ -1663,6 +1664,11 @@ struct task_struct {
 
 	u64 rx_bytes;
 	u64 tx_bytes;
+
+#ifdef CONFIG_BLOCK
+/* stack plugging */
+	struct blk_plug *plug;
+#endif
 };
 
 /* Future-safe accessor for struct task_struct's cpus_allowed. */
@@ -77,6 +77,10 @@
  *	vdev: the virtio_device
  *	This gives the final feature bits for the device: it can change
  *	the dev->feature bits if it wants.
+ * @set_vq_affinity: set the affinity for a virtqueue (optional).
+ *	vq: the virtqueue
+ *	cpu: the cpu its interrupt should be delivered to, -1 to clear
+ *	Returns 0 on success or error status; this is only a hint.
  */
 typedef void vq_callback_t(struct virtqueue *);
 struct virtio_config_ops {
@@ -94,6 +98,9 @@ struct virtio_config_ops {
 	void (*del_vqs)(struct virtio_device *);
 	u32 (*get_features)(struct virtio_device *vdev);
 	void (*finalize_features)(struct virtio_device *vdev);
+#ifndef __GENKSYMS__
+	int (*set_vq_affinity)(struct virtqueue *vq, int cpu);
+#endif
 };
 
 /* If driver didn't advertise the feature, it will never appear. */
@@ -153,5 +160,21 @@ struct virtqueue *virtio_find_single_vq(struct virtio_device *vdev,
 		return ERR_PTR(err);
 	return vq;
 }
+
+/**
+ * virtqueue_set_affinity - steer a virtqueue's interrupt to a cpu
+ * @vq: the virtqueue
+ * @cpu: the cpu, or -1 to clear the hint
+ *
+ * Transports without per-queue interrupts simply ignore this.
+ */
+static inline int virtqueue_set_affinity(struct virtqueue *vq, int cpu)
+{
+	struct virtio_device *vdev = vq->vdev;
+
+	if (vdev->config->set_vq_affinity)
+		return vdev->config->set_vq_affinity(vq, cpu);
+	return 0;
+}
 #endif /* __KERNEL__ */
 #endif /* _LINUX_VIRTIO_CONFIG_H */
@@ -67,21 +67,23 @@ static int bdi_debug_stats_show(struct seq_file *m, void *v)
 	struct inode *inode;
 
 	/*
-	 * inode lock is enough here, the bdi->wb_list is protected by
-	 * RCU on the reader side
+	 * the bdi->wb_list is protected by RCU on the reader side, each
+	 * wb's inode lists by its list_lock
 	 */
 	nr_wb = nr_dirty = nr_io = nr_more_io = 0;
-	spin_lock(&inode_lock);
-	list_for_each_entry(wb, &bdi->wb_list, list) {
+	rcu_read_lock();
+	list_for_each_entry_rcu(wb, &bdi->wb_list, list) {
 		nr_wb++;
-		list_for_each_entry(inode, &wb->b_dirty, i_list)
+		spin_lock(&wb->list_lock);
+		list_for_each_entry(inode, &wb->b_dirty, i_wb_list)
 			nr_dirty++;
-		list_for_each_entry(inode, &wb->b_io, i_list)
+		list_for_each_entry(inode, &wb->b_io, i_wb_list)
 			nr_io++;
-		list_for_each_entry(inode, &wb->b_more_io, i_list)
+		list_for_each_entry(inode, &wb->b_more_io, i_wb_list)
 			nr_more_io++;
+		spin_unlock(&wb->list_lock);
 	}
-	spin_unlock(&inode_lock);
+	rcu_read_unlock();
 
 	get_dirty_limits(&background_thresh, &dirty_thresh, &bdi_thresh, bdi);
 
@@ -259,6 +261,7 @@ static void bdi_wb_init(struct bdi_writeback *wb, struct backing_dev_info *bdi)
 	INIT_LIST_HEAD(&wb->b_dirty);
 	INIT_LIST_HEAD(&wb->b_io);
 	INIT_LIST_HEAD(&wb->b_more_io);
+	spin_lock_init(&wb->list_lock);
 }
 
 static void bdi_task_init(struct backing_dev_info *bdi,
@@ -694,12 +697,22 @@ void bdi_destroy(struct backing_dev_info *bdi)
 	 */
 	if (bdi_has_dirty_io(bdi)) {
 		struct bdi_writeback *dst = &default_backing_dev_info.wb;
-
-		spin_lock(&inode_lock);
+		struct inode *inode;
+
+		/* the only place that nests two list_locks */
+		spin_lock(&bdi->wb.list_lock);
+		spin_lock_nested(&dst->list_lock, SINGLE_DEPTH_NESTING);
+		list_for_each_entry(inode, &bdi->wb.b_dirty, i_wb_list)
+			inode->i_wb = dst;
+		list_for_each_entry(inode, &bdi->wb.b_io, i_wb_list)
+			inode->i_wb = dst;
+		list_for_each_entry(inode, &bdi->wb.b_more_io, i_wb_list)
+			inode->i_wb = dst;
 		list_splice(&bdi->wb.b_dirty, &dst->b_dirty);
 		list_splice(&bdi->wb.b_io, &dst->b_io);
 		list_splice(&bdi->wb.b_more_io, &dst->b_more_io);
-		spin_unlock(&inode_lock);
+		spin_unlock(&dst->list_lock);
+		spin_unlock(&bdi->wb.list_lock);
 	}
 
 	bdi_unregister(bdi);
@@ -540,6 +540,16 @@ int security_inode_permission(struct inode *inode, int mask)
 	return security_ops->inode_permission(inode, mask);
 }
 
+/*
+ * True while no LSM is registered on top of the capability defaults, so
+ * ->inode_permission() cannot deny anything.  The store-free path walk
+ * cannot call into an LSM and relies on this to skip the hook.
+ */
+int security_inode_permission_trivial(void)
+{
+	return security_ops == &default_security_ops;
+}
+
 int security_inode_setattr(struct dentry *dentry, struct iattr *attr)
 {
 	if (unlikely(IS_PRIVATE(dentry->d_inode)))